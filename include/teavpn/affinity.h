@@ -0,0 +1,67 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__affinity_h
+#define __teavpn__affinity_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * CPU placement of the server threads.
+ *
+ *   main          the event loop (also does every tun read and write).
+ *   workers       teavpn-wrk-N, worker N gets the N-th CPU of the
+ *                 list (round robin), one CPU each.
+ *   housekeeping  every other thread (accept-worker, logger,
+ *                 watchdog, user space iface).
+ *
+ * Lists use the kernel cpulist format ("0-3,8,10-11"). In auto
+ * mode the lists which are not set are derived from the CPUs of
+ * the NUMA node of the NIC that carries bind_addr: main gets the
+ * first CPU, housekeeping the second and workers the rest.
+ */
+
+enum teavpn_affinity_mode {
+	TEAVPN_AFFINITY_OFF = 0,
+	TEAVPN_AFFINITY_ON = 1,
+	TEAVPN_AFFINITY_AUTO = 2
+};
+
+#define TEAVPN_MAX_CPUS 256
+
+// Thread name prefix of the workers, the name is cut at 15 chars.
+#define TEAVPN_WORKER_COMM "teavpn-wrk-"
+
+struct teavpn_cpulist {
+	uint16_t nr;
+	uint16_t cpus[TEAVPN_MAX_CPUS];
+};
+
+struct teavpn_affinity {
+	uint8_t mode;
+	int nic_node;				// -1 = unknown.
+	char nic[16];
+	struct teavpn_cpulist main;
+	struct teavpn_cpulist workers;
+	struct teavpn_cpulist housekeeping;
+};
+
+uint8_t teavpn_affinity_mode(const char *value);
+bool teavpn_cpulist_parse(const char *str, struct teavpn_cpulist *list);
+void teavpn_cpulist_str(const struct teavpn_cpulist *list, char *buf, size_t len);
+
+bool teavpn_affinity_init(struct teavpn_affinity *aff, uint8_t mode, const char *bind_addr,
+	const char *main, const char *workers, const char *housekeeping);
+bool teavpn_affinity_pin_self(const struct teavpn_cpulist *list);
+bool teavpn_affinity_pin_worker(const struct teavpn_affinity *aff, pthread_t thread, uint8_t num);
+void teavpn_affinity_pin_housekeeping(const struct teavpn_affinity *aff);
+void teavpn_affinity_dump(const struct teavpn_affinity *aff, FILE *fp);
+
+#endif
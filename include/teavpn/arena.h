@@ -0,0 +1,67 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__arena_h
+#define __teavpn__arena_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * Packet memory arena.
+ *
+ * One region per online NUMA node, reserved at startup, bound to
+ * its node with mbind(2) and faulted in before the event loop
+ * starts. Regions are backed by 2 MB huge pages (MAP_HUGETLB)
+ * when the pool has enough of them, otherwise by transparent huge
+ * pages (MADV_HUGEPAGE) or plain pages, see the hugepages key.
+ *
+ * Allocation is a bump pointer, memory is never given back until
+ * teavpn_arena_destroy(). Allocate from the node of the thread
+ * which writes the memory (teavpn_arena_local()).
+ */
+
+#define TEAVPN_ARENA_MAX_NODES 8
+#define TEAVPN_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+enum teavpn_hugepages_mode {
+	TEAVPN_HUGEPAGES_OFF = 0,		// Plain pages.
+	TEAVPN_HUGEPAGES_AUTO = 1,		// hugetlbfs, then THP, then plain pages.
+	TEAVPN_HUGEPAGES_ON = 2			// hugetlbfs or fail.
+};
+
+enum teavpn_arena_backing {
+	TEAVPN_ARENA_PAGES = 0,
+	TEAVPN_ARENA_THP = 1,
+	TEAVPN_ARENA_HUGETLB = 2
+};
+
+struct teavpn_arena {
+	char *base;
+	size_t size;
+	size_t used;
+	int node;
+	uint8_t backing;
+	bool bound;					// mbind(2) succeeded.
+};
+
+struct teavpn_arena_set {
+	uint8_t nr_nodes;
+	struct teavpn_arena nodes[TEAVPN_ARENA_MAX_NODES];
+};
+
+uint8_t teavpn_hugepages_mode(const char *value);
+bool teavpn_arena_init(struct teavpn_arena_set *set, size_t size, uint8_t mode);
+void teavpn_arena_destroy(struct teavpn_arena_set *set);
+struct teavpn_arena *teavpn_arena_node(struct teavpn_arena_set *set, int node);
+struct teavpn_arena *teavpn_arena_local(struct teavpn_arena_set *set);
+void *teavpn_arena_alloc(struct teavpn_arena *arena, size_t size, size_t align);
+void teavpn_arena_stats(struct teavpn_arena_set *set, FILE *fp);
+
+#endif
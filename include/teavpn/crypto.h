@@ -0,0 +1,115 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__crypto_h
+#define __teavpn__crypto_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Data channel encryption.
+ *
+ * The client puts the ciphers it can run fast and an ephemeral
+ * X25519 public key in the auth packet, the server answers with
+ * the chosen cipher and its own public key in the conf packet.
+ * Both sides then derive one key and one nonce prefix per
+ * direction with HKDF-SHA256 over the shared secret, salted with
+ * the user password and bound to both public keys.
+ *
+ * Only DATA frames are encrypted. The frame header stays in the
+ * clear and is authenticated, the body is the ciphertext followed
+ * by a TEAVPN_AEAD_TAG_SIZE tag. The nonce is the 4 byte prefix
+ * and the 64 bit info.seq of the frame, every direction counts
+ * its own seq (the sender passes it to teavpn_crypto_seal() and
+ * must send the frames in seq order) and the receiver drops
+ * anything not above the last accepted one (replay).
+ *
+ * AES-256-GCM is offered only if the CPU has AES instructions,
+ * OpenSSL then runs AES-NI, or VAES + VPCLMULQDQ on CPUs which
+ * have them. Without them ChaCha20-Poly1305 is faster.
+ *
+ * Built without libcrypto (make CRYPTO=0) nothing is offered and
+ * every connection stays in plaintext.
+ */
+
+#define TEAVPN_AEAD_KEY_SIZE 32
+#define TEAVPN_AEAD_TAG_SIZE 16
+#define TEAVPN_AEAD_PREFIX_SIZE 4
+#define TEAVPN_KEX_SIZE 32
+
+enum teavpn_cipher {
+	TEAVPN_CIPHER_NONE = 0,
+	TEAVPN_CIPHER_CHACHA20_POLY1305 = (1 << 0),
+	TEAVPN_CIPHER_AES_256_GCM = (1 << 1)
+};
+
+enum teavpn_encryption_mode {
+	TEAVPN_ENCRYPTION_OFF = 0,
+	TEAVPN_ENCRYPTION_ON = 1,			// If the peer can.
+	TEAVPN_ENCRYPTION_REQUIRED = 2		// Refuse plaintext peers.
+};
+
+/**
+ * Session keys, plain data so an upgrade can hand them over.
+ */
+struct teavpn_crypto_state {
+	uint8_t cipher;
+	uint64_t tx_seq;
+	uint64_t rx_seq;
+	uint8_t tx_key[TEAVPN_AEAD_KEY_SIZE];
+	uint8_t rx_key[TEAVPN_AEAD_KEY_SIZE];
+	uint8_t tx_prefix[TEAVPN_AEAD_PREFIX_SIZE];
+	uint8_t rx_prefix[TEAVPN_AEAD_PREFIX_SIZE];
+};
+
+/**
+ * Cipher contexts are allocated once and keep their key schedule,
+ * a frame only sets a new nonce. Up to TEAVPN_CRYPTO_TX_LANES
+ * threads can seal frames of one session at the same time, every
+ * one takes a free tx context.
+ */
+#define TEAVPN_CRYPTO_TX_LANES 4
+
+struct teavpn_crypto {
+	struct teavpn_crypto_state st;
+	void *tx_ctx[TEAVPN_CRYPTO_TX_LANES];
+	uint8_t tx_busy[TEAVPN_CRYPTO_TX_LANES];
+	void *rx_ctx;
+	uint64_t rx_fail;
+};
+
+struct _teavpn_packet;
+
+struct teavpn_kex {
+	void *pkey;
+	uint8_t pub[TEAVPN_KEX_SIZE];
+};
+
+uint8_t teavpn_encryption_mode(const char *value);
+const char *teavpn_cipher_name(uint8_t cipher);
+uint8_t teavpn_crypto_offer();
+uint8_t teavpn_crypto_pick(uint8_t offer, uint8_t peer_offer);
+
+bool teavpn_kex_init(struct teavpn_kex *kex);
+void teavpn_kex_destroy(struct teavpn_kex *kex);
+bool teavpn_crypto_derive(struct teavpn_crypto_state *st, uint8_t cipher, struct teavpn_kex *kex,
+	const uint8_t *peer_pub, const char *password, bool server);
+
+bool teavpn_crypto_alloc(struct teavpn_crypto *c);
+void teavpn_crypto_free(struct teavpn_crypto *c);
+bool teavpn_crypto_set(struct teavpn_crypto *c, const struct teavpn_crypto_state *st);
+void teavpn_crypto_clear(struct teavpn_crypto *c);
+uint16_t teavpn_crypto_seal(struct teavpn_crypto *c, struct _teavpn_packet *dst, const struct _teavpn_packet *src,
+	uint64_t seq);
+ssize_t teavpn_crypto_open(struct teavpn_crypto *c, struct _teavpn_packet *pkt);
+void teavpn_crypto_dump(FILE *fp, uint16_t conn, const struct teavpn_crypto *c);
+void teavpn_crypto_log_cpu();
+
+#endif
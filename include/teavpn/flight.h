@@ -0,0 +1,144 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__flight_h
+#define __teavpn__flight_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <teavpn/tsc.h>
+
+/**
+ * Flight recorder.
+ *
+ * Every thread owns a fixed-size ring of compact binary
+ * events which is always on. The rings are written to
+ * a file on SIGUSR2, on fatal signals and when the
+ * watchdog detects a stalled event loop. Decode the
+ * file with `teavpn-flightdec` (make tools).
+ *
+ * The ring of an exited thread is dumped until a new
+ * thread takes it over.
+ */
+
+#define TEAVPN_FR_MAGIC 0x52465654u	// "TVFR"
+#define TEAVPN_FR_VERSION 1
+#define TEAVPN_FR_RING_SIZE 4096
+
+// Threads besides the workers: event loop, accept worker, logger, watchdog, iface.
+#define TEAVPN_FR_FIXED_THREADS 8
+
+// A full worker pool (WORKER_ALLOC) and the fixed threads.
+#define TEAVPN_FR_MAX_THREADS (255 + TEAVPN_FR_FIXED_THREADS)
+
+enum teavpn_fr_type {
+	TEAVPN_FR_ENQUEUE = 1,			// a=conn_index, b=bufchan_index, c=queue_index
+	TEAVPN_FR_DEQUEUE = 2,			// a=worker_num, b=queue_index, c=conn_index
+	TEAVPN_FR_BUF_ALLOC = 3,		// a=bufchan_index
+	TEAVPN_FR_BUF_FREE = 4,			// a=bufchan_index, b=ref_count after release
+	TEAVPN_FR_BUF_EXHAUSTED = 5,	// a=buf_chan_wait, b=sleep_state
+	TEAVPN_FR_QUEUE_FULL = 6,		// a=conn_index, b=bufchan_index
+	TEAVPN_FR_CONN_OPEN = 7,		// a=conn_index, b=fd
+	TEAVPN_FR_CONN_CLOSE = 8,		// a=conn_index, b=fd, c=enum teavpn_conn_close_reason
+	TEAVPN_FR_ERROR = 9,			// a=enum teavpn_fr_err_site, b=errno, c=conn_index
+	TEAVPN_FR_WATCHDOG = 10,		// a=stalled seconds
+	TEAVPN_FR_TYPE_NUM = 11
+};
+
+enum teavpn_fr_err_site {
+	TEAVPN_FR_ERR_TAP_READ = 1,
+	TEAVPN_FR_ERR_TAP_WRITE = 2,
+	TEAVPN_FR_ERR_SOCK_READ = 3,
+	TEAVPN_FR_ERR_SOCK_WRITE = 4,
+	TEAVPN_FR_ERR_ACCEPT = 5,
+	TEAVPN_FR_ERR_SELECT = 6,
+	TEAVPN_FR_ERR_DECRYPT = 7
+};
+
+enum teavpn_fr_reason {
+	TEAVPN_FR_DUMP_SIGNAL = 1,
+	TEAVPN_FR_DUMP_FATAL = 2,
+	TEAVPN_FR_DUMP_WATCHDOG = 3
+};
+
+struct teavpn_fr_event {
+	uint64_t tsc;
+	uint16_t type;
+	uint16_t a;
+	uint16_t b;
+	uint16_t c;
+};
+
+/**
+ * On-disk layout:
+ *
+ *   struct teavpn_fr_file_hdr
+ *   nr_rings x (struct teavpn_fr_ring_hdr + ring_size x struct teavpn_fr_event)
+ */
+struct teavpn_fr_file_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t reason;
+	int32_t signo;
+	uint32_t nr_rings;
+	uint32_t ring_size;
+	uint32_t pid;
+	uint64_t tsc_hz;
+	uint64_t dump_tsc;
+	int64_t dump_unix_ns;
+};
+
+struct teavpn_fr_ring_hdr {
+	uint32_t tid;
+	uint32_t head;
+	char name[16];
+};
+
+struct teavpn_fr_ring {
+	struct teavpn_fr_ring_hdr hdr;
+	struct teavpn_fr_event events[TEAVPN_FR_RING_SIZE];
+};
+
+extern __thread struct teavpn_fr_ring *teavpn_fr_tls;
+
+struct teavpn_fr_ring *teavpn_fr_register();
+void teavpn_fr_init(const char *dump_file);
+void teavpn_fr_dump(uint16_t reason, int signo);
+bool teavpn_fr_watchdog_start(volatile uint64_t *busy_since, uint32_t timeout_sec);
+
+/**
+ * Record one event into the ring of the calling thread.
+ *
+ * @param uint16_t type
+ * @param uint16_t a
+ * @param uint16_t b
+ * @param uint16_t c
+ * @return void
+ */
+static inline void teavpn_fr_record(uint16_t type, uint16_t a, uint16_t b, uint16_t c)
+{
+	register struct teavpn_fr_ring *ring = teavpn_fr_tls;
+	register struct teavpn_fr_event *ev;
+
+	if (__builtin_expect(ring == NULL, 0)) {
+		ring = teavpn_fr_register();
+		if (ring == NULL) {
+			return;
+		}
+	}
+
+	ev = &(ring->events[ring->hdr.head & (TEAVPN_FR_RING_SIZE - 1)]);
+	ev->tsc = teavpn_tsc();
+	ev->type = type;
+	ev->a = a;
+	ev->b = b;
+	ev->c = c;
+	__atomic_store_n(&(ring->hdr.head), ring->hdr.head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
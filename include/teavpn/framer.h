@@ -0,0 +1,63 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__framer_h
+#define __teavpn__framer_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <teavpn/teavpn.h>
+
+/**
+ * Splits the byte stream of a connection into frames.
+ *
+ * A receive may end anywhere, in a header or in a payload, and
+ * hold the start of the next frame. Bytes are taken as they come:
+ * once the header of a frame is complete alloc() gives the buffer
+ * it is assembled in, once the whole frame is there it goes to
+ * frame(). Nothing blocks, a frame may span any number of calls.
+ */
+
+typedef teavpn_packet *(*teavpn_framer_alloc_t)(void *arg, uint16_t len, intptr_t *ctx);
+typedef void (*teavpn_framer_frame_t)(void *arg, teavpn_packet *pkt, uint16_t len, intptr_t ctx);
+typedef void (*teavpn_framer_drop_t)(void *arg, intptr_t ctx);
+
+struct teavpn_framer_ops {
+	teavpn_framer_alloc_t alloc;		// Buffer for len bytes, NULL drops the frame.
+	teavpn_framer_frame_t frame;		// The buffer belongs to frame() from here on.
+	teavpn_framer_drop_t drop;			// A buffer the frame never completed.
+};
+
+struct teavpn_framer {
+	struct packet_info hdr;				// Header of the next frame, while it is incomplete.
+	uint16_t hdr_have;
+	uint16_t have;						// Bytes of the frame in dst.
+	uint16_t len;						// Frame length, 0 between frames.
+	teavpn_packet *dst;					// NULL: the frame is skipped.
+	intptr_t ctx;						// Of alloc(), handed to frame() or drop().
+};
+
+void teavpn_framer_init(struct teavpn_framer *fr);
+bool teavpn_framer_feed(struct teavpn_framer *fr, const uint8_t *data, size_t len,
+	const struct teavpn_framer_ops *ops, void *arg);
+void teavpn_framer_reset(struct teavpn_framer *fr, const struct teavpn_framer_ops *ops, void *arg);
+
+/**
+ * @param struct teavpn_framer *fr
+ * @return size_t	Bytes still missing of the frame in progress, 0 between frames.
+ */
+static inline size_t teavpn_framer_missing(struct teavpn_framer *fr)
+{
+	if (fr->len > 0) {
+		return fr->len - fr->have;
+	}
+	return (fr->hdr_have > 0) ? (sizeof(fr->hdr) - fr->hdr_have) : 0;
+}
+
+#endif
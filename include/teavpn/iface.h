@@ -0,0 +1,79 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__iface_h
+#define __teavpn__iface_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Virtual network device backends.
+ *
+ * Every backend hands the event loop a file descriptor with
+ * packet semantics (one read(2) = one IP packet, one write(2)
+ * = one IP packet) which can be put into select(2), so the
+ * data path does not change between backends.
+ *
+ * Backend spec (iface_backend config key):
+ *
+ *   tun                        kernel TUN device (default).
+ *   mem                        socketpair, packets written by TeaVPN
+ *                              are counted and dropped.
+ *   mem:echo                   socketpair, packets written by TeaVPN
+ *                              come back with swapped IPv4 addresses.
+ *   pcap:<file>[,pps=N][,loop=N]
+ *                              socketpair, replays the IP packets of
+ *                              a pcap file at N packets per second
+ *                              (0 = as fast as possible), N times.
+ *
+ * Only the tun backend needs root and /sbin/ip setup.
+ */
+
+struct teavpn_iface;
+
+struct teavpn_iface_ops {
+	const char *name;
+	bool kernel;				// Needs address/route setup.
+	int (*open)(struct teavpn_iface *iface, char *dev, const char *arg);
+	void (*close)(struct teavpn_iface *iface);
+	void (*stats)(struct teavpn_iface *iface, FILE *fp);
+};
+
+struct teavpn_iface {
+	int fd;
+	int peer_fd;				// -1 for the tun backend.
+	char dev[16];				// IFNAMSIZ
+	const struct teavpn_iface_ops *ops;
+	void *priv;
+
+	/**
+	 * Counted by the peer side of the user space backends.
+	 */
+	uint64_t to_peer_pkts;		// Written by TeaVPN.
+	uint64_t to_peer_bytes;
+	uint64_t from_peer_pkts;	// Injected into TeaVPN.
+	uint64_t from_peer_bytes;
+};
+
+extern const struct teavpn_iface_ops teavpn_iface_tun_ops;
+extern const struct teavpn_iface_ops teavpn_iface_mem_ops;
+extern const struct teavpn_iface_ops teavpn_iface_pcap_ops;
+
+int teavpn_iface_open(struct teavpn_iface *iface, const char *spec, char *dev);
+int teavpn_iface_adopt(struct teavpn_iface *iface, int fd, const char *dev);
+void teavpn_iface_close(struct teavpn_iface *iface);
+void teavpn_iface_stats(struct teavpn_iface *iface, FILE *fp);
+
+/* Shared by the user space backends (iface/mem.c). */
+int teavpn_iface_socketpair(struct teavpn_iface *iface);
+bool teavpn_iface_peer_thread(struct teavpn_iface *iface, void *(*fn)(struct teavpn_iface *), const char *name);
+void teavpn_iface_peer_close(struct teavpn_iface *iface);
+void teavpn_iface_peer_stats(struct teavpn_iface *iface, FILE *fp);
+
+#endif
@@ -0,0 +1,52 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__latency_h
+#define __teavpn__latency_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <teavpn/tsc.h>
+
+/**
+ * Stages of the packet path which have their own histogram.
+ */
+enum teavpn_lat_stage {
+	TEAVPN_LAT_TUN_TO_ENQUEUE = 0,	// read(tap_fd) -> enqueue_packet()
+	TEAVPN_LAT_QUEUE_WAIT = 1,		// enqueue_packet() -> worker_job_pull()
+	TEAVPN_LAT_SOCK_WRITE = 2,		// write(client fd) syscall
+	TEAVPN_LAT_SOCK_TO_TUN = 3,		// read(client fd) -> write(tap_fd)
+	TEAVPN_LAT_STAGE_NUM = 4
+};
+
+/**
+ * Log-linear (HDR style) bucketing.
+ *
+ * Values below 2^TEAVPN_LAT_SUB_BITS ticks are exact, everything
+ * above is split into 2^TEAVPN_LAT_SUB_BITS sub-buckets per power
+ * of two, so the relative error is bounded by 1/16 (6.25%).
+ */
+#define TEAVPN_LAT_SUB_BITS 4
+#define TEAVPN_LAT_SUB_COUNT (1 << TEAVPN_LAT_SUB_BITS)
+#define TEAVPN_LAT_BUCKETS (TEAVPN_LAT_SUB_COUNT + ((64 - TEAVPN_LAT_SUB_BITS) * TEAVPN_LAT_SUB_COUNT))
+
+struct teavpn_lat_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[TEAVPN_LAT_BUCKETS];
+};
+
+void teavpn_lat_init();
+void teavpn_lat_reset();
+void teavpn_lat_dump(FILE *fp);
+uint64_t teavpn_lat_percentile(enum teavpn_lat_stage stage, double p);
+void teavpn_lat_record(enum teavpn_lat_stage stage, uint64_t start_tsc, uint64_t end_tsc);
+
+#endif
@@ -0,0 +1,183 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__lockstat_h
+#define __teavpn__lockstat_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <teavpn/tsc.h>
+
+/**
+ * Lock contention profiling.
+ *
+ * struct teavpn_mutex wraps pthread_mutex_t and, when enabled
+ * at runtime (lock_stats = 1 in the server config), counts
+ * acquisitions, contended acquisitions, the time spent
+ * waiting for and holding the lock and the time spent in
+ * teavpn_cond_wait() on it. The counters are dumped
+ * together with the server statistics (SIGUSR1).
+ *
+ * Build with LOCKSTAT=0 to compile the instrumentation out.
+ */
+
+struct teavpn_mutex {
+	pthread_mutex_t mutex;
+	const char *name;
+	int16_t index;				// -1 for singleton locks.
+	uint64_t locked_at;			// TSC, only touched by the owner.
+	uint64_t acquired;
+	uint64_t contended;
+	uint64_t wait_tsc;
+	uint64_t max_wait_tsc;
+	uint64_t hold_tsc;
+	uint64_t max_hold_tsc;
+	uint64_t cond_waits;
+	uint64_t cond_wait_tsc;		// Asleep on the condition plus the reacquire.
+	struct teavpn_mutex *next;
+};
+
+extern bool teavpn_lockstat_enabled;
+
+void teavpn_mutex_init(struct teavpn_mutex *lock, const char *name, int16_t index);
+void teavpn_lockstat_enable(bool enable);
+void teavpn_lockstat_reset();
+void teavpn_lockstat_dump(FILE *fp);
+
+/**
+ * Store v to *p if it is bigger than *p.
+ *
+ * @param uint64_t *p
+ * @param uint64_t v
+ * @return void
+ */
+static inline void teavpn_lockstat_max(uint64_t *p, uint64_t v)
+{
+	if (v > __atomic_load_n(p, __ATOMIC_RELAXED)) {
+		__atomic_store_n(p, v, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * @param struct teavpn_mutex *lock
+ * @return void
+ */
+static inline void teavpn_mutex_lock(struct teavpn_mutex *lock)
+{
+#ifndef TEAVPN_NO_LOCKSTAT
+	register uint64_t start, wait;
+
+	if (__builtin_expect(teavpn_lockstat_enabled, 0)) {
+
+		/**
+		 * Uncontended path, no clock read for the wait.
+		 */
+		if (pthread_mutex_trylock(&(lock->mutex)) == 0) {
+			lock->locked_at = teavpn_tsc();
+			__atomic_fetch_add(&(lock->acquired), 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		start = teavpn_tsc();
+		pthread_mutex_lock(&(lock->mutex));
+		lock->locked_at = teavpn_tsc();
+		wait = lock->locked_at - start;
+
+		/**
+		 * We own the lock now, the only other writer is
+		 * teavpn_lockstat_reset().
+		 */
+		__atomic_fetch_add(&(lock->acquired), 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&(lock->contended), 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&(lock->wait_tsc), wait, __ATOMIC_RELAXED);
+		teavpn_lockstat_max(&(lock->max_wait_tsc), wait);
+		return;
+	}
+#endif
+	pthread_mutex_lock(&(lock->mutex));
+}
+
+/**
+ * Account the hold time of the current owner.
+ *
+ * @param struct teavpn_mutex *lock
+ * @return void
+ */
+static inline void teavpn_mutex_release_stat(struct teavpn_mutex *lock)
+{
+#ifndef TEAVPN_NO_LOCKSTAT
+	register uint64_t hold;
+
+	/**
+	 * locked_at is 0 if the lock has been taken
+	 * before the profiling was enabled.
+	 */
+	if (__builtin_expect(teavpn_lockstat_enabled, 0) && (lock->locked_at != 0)) {
+		hold = teavpn_tsc() - lock->locked_at;
+		lock->locked_at = 0;
+		__atomic_fetch_add(&(lock->hold_tsc), hold, __ATOMIC_RELAXED);
+		teavpn_lockstat_max(&(lock->max_hold_tsc), hold);
+	}
+#else
+	(void)lock;
+#endif
+}
+
+/**
+ * @param struct teavpn_mutex *lock
+ * @return void
+ */
+static inline void teavpn_mutex_unlock(struct teavpn_mutex *lock)
+{
+	teavpn_mutex_release_stat(lock);
+	pthread_mutex_unlock(&(lock->mutex));
+}
+
+/**
+ * pthread_cond_wait(3) on an instrumented mutex.
+ *
+ * Time spent sleeping on the condition is neither hold time
+ * nor lock wait time, and reacquiring the mutex on wake up is
+ * not a new acquisition. The wait is counted in cond_waits and
+ * cond_wait_tsc instead, the hold time restarts on wake up.
+ *
+ * @param pthread_cond_t		*cond
+ * @param struct teavpn_mutex	*lock
+ * @return void
+ */
+static inline void teavpn_cond_wait(pthread_cond_t *cond, struct teavpn_mutex *lock)
+{
+#ifndef TEAVPN_NO_LOCKSTAT
+	register uint64_t start = 0;
+
+	teavpn_mutex_release_stat(lock);
+	if (__builtin_expect(teavpn_lockstat_enabled, 0)) {
+		start = teavpn_tsc();
+	}
+
+	pthread_cond_wait(cond, &(lock->mutex));
+
+	/**
+	 * start is 0 if the profiling was enabled while we slept,
+	 * that wait is not accounted.
+	 */
+	if (__builtin_expect(teavpn_lockstat_enabled, 0)) {
+		lock->locked_at = teavpn_tsc();
+		if (start != 0) {
+			__atomic_fetch_add(&(lock->cond_waits), 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&(lock->cond_wait_tsc), lock->locked_at - start, __ATOMIC_RELAXED);
+		}
+	}
+#else
+	pthread_cond_wait(cond, &(lock->mutex));
+#endif
+}
+
+#endif
@@ -0,0 +1,58 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__log_h
+#define __teavpn__log_h
+
+#include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * Highest verbose level compiled in.
+ *
+ * debug_log() calls above this level are removed by the
+ * compiler, e.g. `make LOG_LEVEL=1` keeps only levels 0 and 1.
+ */
+#ifndef TEAVPN_LOG_MAX_LEVEL
+#define TEAVPN_LOG_MAX_LEVEL 255
+#endif
+
+/**
+ * Per-thread ring geometry.
+ *
+ * A slot keeps the format string pointer and the raw
+ * arguments, formatting happens in the logger thread.
+ */
+#define TEAVPN_LOG_RING_SIZE 1024
+#define TEAVPN_LOG_SLOT_SIZE 256
+#define TEAVPN_LOG_ARGS_SIZE (TEAVPN_LOG_SLOT_SIZE - sizeof(const char *) - sizeof(time_t) - 8)
+
+struct teavpn_log_slot {
+	const char *fmt;
+	time_t sec;
+	uint16_t len;
+	bool truncated;
+	char args[TEAVPN_LOG_ARGS_SIZE];
+};
+
+struct teavpn_log_ring {
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	uint64_t dropped;
+	uint64_t reported_dropped;
+	char name[16];						// Thread name, read by the thread itself.
+	bool exited;						// Freed by the logger once drained.
+	struct teavpn_log_ring *next;
+	struct teavpn_log_slot slots[TEAVPN_LOG_RING_SIZE];
+};
+
+void teavpn_log_init();
+void teavpn_log_flush();
+
+#endif
@@ -0,0 +1,67 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__netlink_h
+#define __teavpn__netlink_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Interface and route configuration over rtnetlink.
+ *
+ * Requests are queued into one buffer and sent with a single
+ * sendmsg(2) by teavpn_nl_commit(), which then collects one ack
+ * per request. Routes queued with track = true are remembered
+ * once the kernel acked them and removed by teavpn_nl_cleanup().
+ *
+ * Addresses are IPv4 in network byte order.
+ */
+
+#define TEAVPN_NL_BUF_SIZE 4096
+#define TEAVPN_NL_MAX_REQS 16
+#define TEAVPN_NL_MAX_ROUTES 8
+
+struct teavpn_nl_route {
+	uint32_t dst;
+	uint8_t prefix;
+	uint32_t gateway;			// 0 = directly connected.
+	int ifindex;
+};
+
+struct teavpn_nl_req {
+	uint32_t seq;
+	bool fatal;					// Fail the commit on error.
+	bool track;					// Route to remove on cleanup.
+	const char *what;
+	struct teavpn_nl_route route;
+};
+
+struct teavpn_nl {
+	int fd;
+	uint32_t seq;
+	uint32_t len;
+	uint8_t nr_reqs;
+	uint8_t nr_routes;
+	struct teavpn_nl_req reqs[TEAVPN_NL_MAX_REQS];
+	struct teavpn_nl_route routes[TEAVPN_NL_MAX_ROUTES];
+	char buf[TEAVPN_NL_BUF_SIZE] __attribute__((aligned(4)));
+};
+
+bool teavpn_nl_open(struct teavpn_nl *nl);
+void teavpn_nl_close(struct teavpn_nl *nl);
+int teavpn_nl_ifindex(const char *dev);
+
+bool teavpn_nl_link_up(struct teavpn_nl *nl, int ifindex, uint16_t mtu);
+bool teavpn_nl_addr_add(struct teavpn_nl *nl, int ifindex, const char *inet4, const char *broadcast);
+bool teavpn_nl_route_add(struct teavpn_nl *nl, struct teavpn_nl_route *route, bool track);
+bool teavpn_nl_commit(struct teavpn_nl *nl);
+
+bool teavpn_nl_route_get(struct teavpn_nl *nl, uint32_t dst, uint32_t *gateway, int *ifindex);
+void teavpn_nl_cleanup(struct teavpn_nl *nl);
+
+#endif
@@ -0,0 +1,219 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__pktbuf_h
+#define __teavpn__pktbuf_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <teavpn/teavpn.h>
+
+/**
+ * Packet buffer with head and tail room (like a kernel skb).
+ *
+ * The frame is the len bytes from data on. Reading from tun puts
+ * the payload at TEAVPN_PB_HEADROOM and every stage then grows or
+ * shrinks the frame where it is: the frame header is pushed in
+ * front of the payload, a cipher tag is put behind it, receiving
+ * pulls the header off and trims the tag. The payload is never
+ * moved between read(2) and write(2).
+ *
+ * The room reserved on each side can be raised at build time
+ * (-DTEAVPN_PB_HEADROOM=N) for longer encapsulations. The frame
+ * always looks like a teavpn_packet from data on.
+ *
+ * The storage (head) is separate from the descriptor and comes
+ * in size classes: most tunnel traffic is ACKs and DNS, a pool
+ * of full frame buffers would mostly hold empty bytes. Each
+ * class has room for TEAVPN_PB_*_CAP payload bytes plus the
+ * head and tail room.
+ */
+
+#ifndef TEAVPN_PB_HEADROOM
+#define TEAVPN_PB_HEADROOM 64
+#endif
+
+#ifndef TEAVPN_PB_TAILROOM
+#define TEAVPN_PB_TAILROOM 32
+#endif
+
+#if TEAVPN_PB_HEADROOM < 16
+#error "TEAVPN_PB_HEADROOM must hold the frame header"
+#endif
+
+#if TEAVPN_PB_TAILROOM < TEAVPN_AEAD_TAG_SIZE
+#error "TEAVPN_PB_TAILROOM must hold the cipher tag"
+#endif
+
+enum teavpn_pb_class {
+	TEAVPN_PB_SMALL = 0,
+	TEAVPN_PB_MEDIUM = 1,
+	TEAVPN_PB_LARGE = 2,
+	TEAVPN_PB_CLASSES = 3
+};
+
+#define TEAVPN_PB_SMALL_CAP 256
+#define TEAVPN_PB_MEDIUM_CAP 2048
+#define TEAVPN_PB_LARGE_CAP sizeof(teavpn_packet)
+
+// Storage bytes for CAP payload bytes, whole cache lines.
+#define TEAVPN_PB_ROOM(CAP) ((TEAVPN_PB_HEADROOM + (CAP) + TEAVPN_PB_TAILROOM + 63) & ~((size_t)63))
+
+#define TEAVPN_PB_SMALL_ROOM TEAVPN_PB_ROOM(TEAVPN_PB_SMALL_CAP)
+#define TEAVPN_PB_MEDIUM_ROOM TEAVPN_PB_ROOM(TEAVPN_PB_MEDIUM_CAP)
+#define TEAVPN_PB_LARGE_ROOM TEAVPN_PB_ROOM(TEAVPN_PB_LARGE_CAP)
+
+// Holds any frame.
+#define TEAVPN_PB_SIZE TEAVPN_PB_LARGE_ROOM
+
+struct teavpn_pktbuf {
+	uint16_t data;					// Offset of the frame in head.
+	uint16_t len;					// Frame length.
+	uint16_t size;					// Bytes at head.
+	uint8_t *head;					// 64-byte aligned.
+};
+
+/**
+ * @param uint8_t class	enum teavpn_pb_class
+ * @return size_t	Storage bytes of the class.
+ */
+static inline size_t teavpn_pb_class_room(uint8_t class)
+{
+	switch (class) {
+		case TEAVPN_PB_SMALL: return TEAVPN_PB_SMALL_ROOM;
+		case TEAVPN_PB_MEDIUM: return TEAVPN_PB_MEDIUM_ROOM;
+		default: return TEAVPN_PB_LARGE_ROOM;
+	}
+}
+
+/**
+ * Attach storage to a descriptor.
+ *
+ * @param struct teavpn_pktbuf	*pb
+ * @param void					*head
+ * @param size_t				size
+ * @return void
+ */
+static inline void teavpn_pb_init(struct teavpn_pktbuf *pb, void *head, size_t size)
+{
+	pb->head = (uint8_t *)head;
+	pb->size = (uint16_t)size;
+	pb->data = 0;
+	pb->len = 0;
+}
+
+/**
+ * Empty frame starting at headroom.
+ *
+ * @param struct teavpn_pktbuf	*pb
+ * @param uint16_t				headroom
+ * @return void
+ */
+static inline void teavpn_pb_reset(struct teavpn_pktbuf *pb, uint16_t headroom)
+{
+	pb->data = headroom;
+	pb->len = 0;
+}
+
+/**
+ * @param struct teavpn_pktbuf *pb
+ * @return void *	First byte of the frame.
+ */
+static inline void *teavpn_pb_data(struct teavpn_pktbuf *pb)
+{
+	return &(pb->head[pb->data]);
+}
+
+/**
+ * @param struct teavpn_pktbuf *pb
+ * @return void *	First byte after the frame.
+ */
+static inline void *teavpn_pb_tail(struct teavpn_pktbuf *pb)
+{
+	return &(pb->head[pb->data + pb->len]);
+}
+
+/**
+ * @param struct teavpn_pktbuf *pb
+ * @return size_t
+ */
+static inline size_t teavpn_pb_tailroom(struct teavpn_pktbuf *pb)
+{
+	return pb->size - (pb->data + pb->len);
+}
+
+/**
+ * Prepend n bytes.
+ *
+ * @param struct teavpn_pktbuf	*pb
+ * @param uint16_t				n
+ * @return void *	New first byte, NULL if the headroom is too small.
+ */
+static inline void *teavpn_pb_push(struct teavpn_pktbuf *pb, uint16_t n)
+{
+	if (__builtin_expect(n > pb->data, 0)) {
+		return NULL;
+	}
+
+	pb->data -= n;
+	pb->len += n;
+	return &(pb->head[pb->data]);
+}
+
+/**
+ * Strip n bytes from the front.
+ *
+ * @param struct teavpn_pktbuf	*pb
+ * @param uint16_t				n
+ * @return void *	New first byte, NULL if the frame is shorter.
+ */
+static inline void *teavpn_pb_pull(struct teavpn_pktbuf *pb, uint16_t n)
+{
+	if (__builtin_expect(n > pb->len, 0)) {
+		return NULL;
+	}
+
+	pb->data += n;
+	pb->len -= n;
+	return &(pb->head[pb->data]);
+}
+
+/**
+ * Append n bytes.
+ *
+ * @param struct teavpn_pktbuf	*pb
+ * @param uint16_t				n
+ * @return void *	Where the n bytes go, NULL if the tailroom is too small.
+ */
+static inline void *teavpn_pb_put(struct teavpn_pktbuf *pb, uint16_t n)
+{
+	void *tail = teavpn_pb_tail(pb);
+
+	if (__builtin_expect(n > teavpn_pb_tailroom(pb), 0)) {
+		return NULL;
+	}
+
+	pb->len += n;
+	return tail;
+}
+
+/**
+ * Cut the frame down to len bytes.
+ *
+ * @param struct teavpn_pktbuf	*pb
+ * @param uint16_t				len
+ * @return void
+ */
+static inline void teavpn_pb_trim(struct teavpn_pktbuf *pb, uint16_t len)
+{
+	if (len < pb->len) {
+		pb->len = len;
+	}
+}
+
+#endif
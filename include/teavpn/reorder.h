@@ -0,0 +1,68 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__reorder_h
+#define __teavpn__reorder_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <teavpn/lockstat.h>
+
+/**
+ * Order-preserving pipeline stage (one per connection).
+ *
+ * The producer takes a ticket for every job in arrival order
+ * (teavpn_reorder_ticket(), single producer). Any worker may run
+ * the stage work of any job, several jobs of one connection run
+ * in parallel and finish in any order. teavpn_reorder_done()
+ * parks a finished job in the slot of its ticket, jobs leave
+ * through emit strictly in ticket order.
+ *
+ * Whoever finishes the job at the head becomes the emitter and
+ * emits every consecutive finished job, the others only park
+ * theirs and go back to work. So emit runs on one thread at a
+ * time per connection and needs no lock of its own.
+ *
+ * At most TEAVPN_REORDER_SLOTS jobs may be in flight, the caller
+ * bounds that (QUEUE_AMOUNT for the server).
+ */
+
+#define TEAVPN_REORDER_SLOTS 64
+#define TEAVPN_REORDER_MASK (TEAVPN_REORDER_SLOTS - 1)
+
+typedef void (*teavpn_reorder_emit_t)(uint64_t seq, void *item);
+
+struct teavpn_reorder {
+	struct teavpn_mutex lock;
+	uint64_t next_ticket;
+	uint64_t head;					// Next ticket to emit.
+	bool emitting;
+	void *items[TEAVPN_REORDER_SLOTS];
+
+	// Stats.
+	uint64_t emitted;
+	uint64_t parked;				// Finished before their predecessors.
+	uint32_t max_depth;				// Largest ticket - head seen at done.
+};
+
+void teavpn_reorder_init(struct teavpn_reorder *ro, int16_t index);
+void teavpn_reorder_reset(struct teavpn_reorder *ro, uint64_t last);
+void teavpn_reorder_done(struct teavpn_reorder *ro, uint64_t seq, void *item, teavpn_reorder_emit_t emit);
+void teavpn_reorder_dump(FILE *fp, uint16_t conn, struct teavpn_reorder *ro);
+
+/**
+ * @param struct teavpn_reorder *ro
+ * @return uint64_t	Ticket of the next job (starts at 1).
+ */
+static inline uint64_t teavpn_reorder_ticket(struct teavpn_reorder *ro)
+{
+	return __atomic_add_fetch(&(ro->next_ticket), 1, __ATOMIC_RELAXED);
+}
+
+#endif
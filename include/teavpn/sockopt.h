@@ -0,0 +1,69 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__sockopt_h
+#define __teavpn__sockopt_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Client socket tuning.
+ *
+ * Global values come from the server config, a user can override
+ * them with <data_dir>/users/<username>/sockopt (same keys).
+ *
+ *   tcp_nodelay        Disable Nagle (default 1).
+ *   tcp_notsent_lowat  Unsent bytes allowed in the socket (0 = kernel default).
+ *   tcp_congestion     Congestion control algorithm (empty = kernel default).
+ *   busy_poll          SO_BUSY_POLL in microseconds (0 = off).
+ *   sndbuf, rcvbuf     Fixed buffer size in bytes, 0 = size them from
+ *                      the bandwidth-delay product (TCP_INFO).
+ *   buf_min, buf_max   Bounds of the BDP sizing.
+ *   zerocopy_threshold Send frames from this size on with MSG_ZEROCOPY
+ *                      (0 = off, see zerocopy.h).
+ */
+
+// How often the BDP sizing looks at the connections (seconds).
+#define TEAVPN_SOCK_AUTOTUNE_INTERVAL 1
+
+// A connection idle for this long shrinks to buf_min (milliseconds).
+#define TEAVPN_SOCK_IDLE_MS 5000
+
+struct teavpn_sock_tuning {
+	uint8_t nodelay;
+	uint32_t notsent_lowat;
+	uint32_t busy_poll;
+	uint32_t sndbuf;
+	uint32_t rcvbuf;
+	uint32_t buf_min;
+	uint32_t buf_max;
+	uint32_t zerocopy;
+	char congestion[16];
+};
+
+/**
+ * Buffer sizes currently set on a socket by the BDP sizing.
+ */
+struct teavpn_sock_bufs {
+	uint32_t sndbuf;
+	uint32_t rcvbuf;
+	uint32_t rtt_us;
+	uint64_t delivery_rate;		// Bytes per second used for the sizing.
+	uint64_t bytes_acked;		// At the previous autotune.
+	uint64_t acked_at_ms;
+};
+
+void teavpn_sock_tuning_default(struct teavpn_sock_tuning *t);
+bool teavpn_sock_tuning_set(struct teavpn_sock_tuning *t, const char *key, const char *value);
+bool teavpn_sock_tuning_load(struct teavpn_sock_tuning *t, const char *file);
+bool teavpn_sock_tune(int fd, const struct teavpn_sock_tuning *t, struct teavpn_sock_bufs *bufs);
+bool teavpn_sock_autotune(int fd, const struct teavpn_sock_tuning *t, struct teavpn_sock_bufs *bufs);
+void teavpn_sock_bufs_dump(FILE *fp, uint16_t conn, const struct teavpn_sock_bufs *bufs);
+
+#endif
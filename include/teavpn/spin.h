@@ -0,0 +1,108 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__spin_h
+#define __teavpn__spin_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <teavpn/tsc.h>
+
+// A budget below max / TEAVPN_SPIN_SHRINK_FLOOR drops to 0 (and
+// restarts there when it grows again).
+#define TEAVPN_SPIN_SHRINK_FLOOR 16
+
+/**
+ * Spin, then block (spin_us, low-latency mode).
+ *
+ * A thread which runs out of work polls for more during a budget
+ * of ticks before it goes to sleep. Work which comes within the
+ * budget is taken right away, without the scheduler wakeup of a
+ * sleeping thread. It costs a CPU while it lasts.
+ *
+ * The budget adapts like the halt polling of KVM: a thread which
+ * slept for less than the maximum budget would have caught its
+ * wakeup with a longer spin, the budget grows. One which slept
+ * for longer spun for nothing, the budget shrinks. Spinning goes
+ * away by itself when the work comes far apart.
+ *
+ * Each spinning thread has its own counters, the time spent on
+ * either side is reported by teavpn_spin_dump().
+ */
+struct teavpn_spin {
+	uint64_t max;					// Ticks, 0 = low-latency mode off.
+	uint64_t budget;				// Current, 0 = block right away.
+	uint64_t spin_ticks;
+	uint64_t block_ticks;
+	uint64_t hits;					// Work came while spinning.
+	uint64_t misses;				// The budget ran out, blocked.
+};
+
+void teavpn_spin_init(struct teavpn_spin *s, uint32_t budget_us);
+void teavpn_spin_reset(struct teavpn_spin *s);
+void teavpn_spin_dump(FILE *fp, const char *name, struct teavpn_spin *s);
+
+/**
+ * Body of a spin loop, lets the sibling hyperthread run.
+ *
+ * @return void
+ */
+static inline void teavpn_spin_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * @param struct teavpn_spin	*s
+ * @param uint64_t				start	Tick the spin began.
+ * @param uint64_t				end
+ * @param bool					hit		Work came before the budget ran out.
+ * @return void
+ */
+static inline void teavpn_spin_done(struct teavpn_spin *s, uint64_t start, uint64_t end, bool hit)
+{
+	__atomic_fetch_add(&(s->spin_ticks), end - start, __ATOMIC_RELAXED);
+	__atomic_fetch_add(hit ? &(s->hits) : &(s->misses), 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * The thread has slept, adapt the budget. Only the owning
+ * thread calls it.
+ *
+ * @param struct teavpn_spin	*s
+ * @param uint64_t				start	Tick the thread went to sleep.
+ * @param uint64_t				end
+ * @return void
+ */
+static inline void teavpn_spin_blocked(struct teavpn_spin *s, uint64_t start, uint64_t end)
+{
+	uint64_t slept = end - start, max = __atomic_load_n(&(s->max), __ATOMIC_RELAXED);
+	uint64_t budget = __atomic_load_n(&(s->budget), __ATOMIC_RELAXED);
+
+	__atomic_fetch_add(&(s->block_ticks), slept, __ATOMIC_RELAXED);
+
+	if (slept > max) {
+		budget /= 2;
+		if (budget < (max / TEAVPN_SPIN_SHRINK_FLOOR)) {
+			budget = 0;
+		}
+	} else if (slept > budget) {
+		budget = (budget == 0) ? (max / TEAVPN_SPIN_SHRINK_FLOOR) : (budget * 2);
+		if (budget > max) {
+			budget = max;
+		}
+	}
+	__atomic_store_n(&(s->budget), budget, __ATOMIC_RELAXED);
+}
+
+#endif
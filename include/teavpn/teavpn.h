@@ -12,31 +12,63 @@
 #include <arpa/inet.h>
 #include <inttypes.h>
 
+#include <teavpn/log.h>
+#include <teavpn/crypto.h>
+#include <teavpn/sockopt.h>
+
 typedef struct _server_config {
 	char *bind_addr;
 	char *config_file;
 	char *error_log_file;
 	char *data_dir;
+	char *stats_file;
+	char *flight_recorder_file;
+	char *upgrade_socket;
+	char *cpu_main;
+	char *cpu_workers;
+	char *cpu_housekeeping;
+	char *tls_cert_file;
+	char *tls_key_file;
 
 	// Interface information
 	char *dev;
+	char *iface_backend;
 	char *inet4;
 	char *inet4_broadcast;
 	uint16_t mtu;
 	// End interface information
 
+	// Client socket tuning
+	struct teavpn_sock_tuning sock_tuning;
+	uint8_t busy_poll_set;		// busy_poll is in the config, else it follows spin_us.
+	uint16_t listen_backlog;
+
 	uint16_t bind_port;
+	uint16_t watchdog_timeout;
 	uint8_t verbose_level;
 	uint8_t threads;
+	uint8_t threads_min;
+	uint8_t threads_max;
+	uint8_t lock_stats;
+	uint8_t upgrade;
+	uint8_t hugepages;
+	uint8_t cpu_affinity;
+	uint8_t encryption;
+	uint8_t tls;
+	uint8_t io_uring;
+	uint32_t spin_us;
+	uint8_t inline_write;
 } server_config;
 
 typedef struct _client_config {
 	char *server_ip;
 	char *config_file;
 	char *error_log_file;
+	char *tls_ca_file;
 
 	// Interface information
 	char *dev;
+	char *iface_backend;
 	uint16_t mtu;
 	// End interface information
 
@@ -50,6 +82,9 @@ typedef struct _client_config {
 	uint16_t server_port;
 	uint8_t verbose_level;
 	uint8_t threads;
+	uint8_t encryption;
+	uint8_t tls;
+	uint8_t io_uring;
 } client_config;
 
 enum _config_type {
@@ -71,6 +106,10 @@ struct teavpn_client_ip {
 	char inet4[sizeof("xxx.xxx.xxx.xxx/xx")];
 	char inet4_broadcast[sizeof("xxx.xxx.xxx.xxx")];
 	char inet4_route[sizeof("xxx.xxx.xxx.xxx")];
+
+	// Data channel (crypto.h), older servers send a shorter conf.
+	uint8_t cipher;
+	uint8_t kex_pub[TEAVPN_KEX_SIZE];
 };
 
 #define TEAVPN_TAP_READ_SIZE 3000
@@ -105,6 +144,10 @@ struct teavpn_packet_auth {
 	uint8_t password_len;
 	char username[256];
 	char password[256];
+
+	// Data channel (crypto.h), older clients send a shorter auth.
+	uint8_t ciphers;
+	uint8_t kex_pub[TEAVPN_KEX_SIZE];
 };
 
 struct teavpn_packet_sig {
@@ -133,9 +176,13 @@ typedef struct _teavpn_packet {
 
 int tun_alloc(char *dev, int flags);
 
-__attribute__((force_align_arg_pointer))
+__attribute__((force_align_arg_pointer, format(printf, 1, 2)))
 uint8_t __internal_debug_log(const char *msg, ...);
 
-#define debug_log(VLEVEL, Y, ...) if (VLEVEL <= verbose_level) {__internal_debug_log(Y, ##__VA_ARGS__);}
+/**
+ * Levels above TEAVPN_LOG_MAX_LEVEL are removed at compile time,
+ * the rest only cost a compare against verbose_level when disabled.
+ */
+#define debug_log(VLEVEL, Y, ...) if (((VLEVEL) <= TEAVPN_LOG_MAX_LEVEL) && __builtin_expect((VLEVEL) <= verbose_level, 0)) {__internal_debug_log(Y, ##__VA_ARGS__);}
 
 #endif
@@ -8,7 +8,7 @@
 #ifndef __teavpn__teavpn_config_parser_h
 #define __teavpn__teavpn_config_parser_h
 
-bool teavpn_server_config_parser(char *internal_buf, server_config *config);
-bool teavpn_client_config_parser(char *internal_buf, client_config *config);
+bool teavpn_server_config_parser(char *internal_buf, size_t size, server_config *config);
+bool teavpn_client_config_parser(char *internal_buf, size_t size, client_config *config);
 
 #endif
@@ -14,10 +14,24 @@
 #include <arpa/inet.h>
 
 #include <teavpn/teavpn.h>
+#include <teavpn/pktbuf.h>
+#include <teavpn/reorder.h>
+#include <teavpn/zerocopy.h>
+#include <teavpn/flight.h>
+#include <teavpn/lockstat.h>
+#include <teavpn/spin.h>
 #include <teavpn/teavpn_handshake.h>
 
-// Buffer channel amount
-#define BUFCHAN_ALLOC 24
+// Buffer channels per size class (pktbuf.h), a whole TUN burst
+// of small or of MTU sized frames fits.
+#define BUFCHAN_SMALL 64
+#define BUFCHAN_MEDIUM 64
+#define BUFCHAN_LARGE 16
+#define BUFCHAN_ALLOC (BUFCHAN_SMALL + BUFCHAN_MEDIUM + BUFCHAN_LARGE)
+
+// Storage of all buffer channels.
+#define BUFCHAN_ROOM ((BUFCHAN_SMALL * TEAVPN_PB_SMALL_ROOM) + (BUFCHAN_MEDIUM * TEAVPN_PB_MEDIUM_ROOM) + \
+	(BUFCHAN_LARGE * TEAVPN_PB_LARGE_ROOM))
 
 // Max connections
 #define CONNECTION_ALLOC 24
@@ -25,25 +39,140 @@
 // Queue amount.
 #define QUEUE_AMOUNT (CONNECTION_ALLOC * 2)
 
+// Max frames read from the TUN device per event loop pass.
+#define TUN_BURST_MAX 64
+
+// Max jobs a worker takes from the queue at once.
+#define WORKER_BURST 8
+
+#if (TUN_BURST_MAX > BUFCHAN_SMALL) || (TUN_BURST_MAX > BUFCHAN_MEDIUM)
+#error "A TUN burst needs a buffer channel per frame, BUFCHAN_SMALL or BUFCHAN_MEDIUM is too small"
+#endif
+
+// Every queued frame of a connection may be in its reorder buffer.
+#if QUEUE_AMOUNT > TEAVPN_REORDER_SLOTS
+#error "QUEUE_AMOUNT frames can be in flight, TEAVPN_REORDER_SLOTS is too small"
+#endif
+
+// Or wait for their zerocopy completion.
+#if QUEUE_AMOUNT > TEAVPN_ZC_SLOTS
+#error "QUEUE_AMOUNT frames can be in flight, TEAVPN_ZC_SLOTS is too small"
+#endif
+
+// Max worker threads (threads can be raised up to this on reload).
+#define WORKER_ALLOC 255
+
+// Every thread records into a flight recorder ring of its own.
+#if (WORKER_ALLOC + TEAVPN_FR_FIXED_THREADS) > TEAVPN_FR_MAX_THREADS
+#error "WORKER_ALLOC workers do not get a ring each, TEAVPN_FR_MAX_THREADS is too small"
+#endif
+
+/**
+ * Worker pool autoscaling (threads_min, threads_max). Jobs which
+ * find no idle worker activate a parked one, at most one per
+ * WORKER_POOL_GROW_MS. Once a second the pool grows when its
+ * utilisation is above WORKER_POOL_HIGH percent and parks a
+ * worker after WORKER_POOL_IDLE_TICKS seconds below
+ * WORKER_POOL_LOW percent.
+ */
+#define WORKER_POOL_GROW_MS 2
+#define WORKER_POOL_HIGH 75
+#define WORKER_POOL_LOW 25
+#define WORKER_POOL_IDLE_TICKS 5
+
 #define MAX_CLIENT_ERR 15
 
+/**
+ * Signals written to m_pipe_fd to interrupt the main event loop.
+ */
+#define SERVER_PIPE_SIG_CONN 0xff
+#define SERVER_PIPE_SIG_STATS 0x01
+#define SERVER_PIPE_SIG_STATS_RESET 0x02
+#define SERVER_PIPE_SIG_RELOAD 0x03
+
+/**
+ * Handshake stages of the accept worker (exported to tracers).
+ */
+enum teavpn_handshake_stage {
+	TEAVPN_HS_ACCEPTED = 1,
+	TEAVPN_HS_AUTH_READ = 2,
+	TEAVPN_HS_AUTH_REJECT = 3,
+	TEAVPN_HS_AUTH_OK = 4,
+	TEAVPN_HS_ACK = 5,
+	TEAVPN_HS_CONF_SENT = 6,
+	TEAVPN_HS_ESTABLISHED = 7
+};
+
+/**
+ * Why a connection entry has been closed.
+ */
+enum teavpn_conn_close_reason {
+	TEAVPN_CLOSE_BY_PEER = 1,
+	TEAVPN_CLOSE_MAX_ERR = 2,
+	TEAVPN_CLOSE_WRITE_ZERO = 3
+};
+
+/**
+ * Workers may still hold jobs of a closed connection. Its cipher
+ * state and its socket are torn down by whoever releases the last
+ * of them, only then the slot can take a new client. A socket with
+ * MSG_ZEROCOPY frames in flight lingers until their completions
+ * are in, the kernel may still send from those pages.
+ */
+enum conn_teardown {
+	CONN_LIVE = 0,
+	CONN_CLOSING = 1,					// Closed, jobs in flight.
+	CONN_TEARDOWN = 2,					// Being torn down.
+	CONN_LINGER = 3,					// Torn down, the socket waits for zerocopy completions.
+	CONN_FREE = 4						// The slot can take a new client.
+};
+
+// Time a closing socket gets to complete its zerocopy sends before it is aborted.
+#define CONN_LINGER_MS 1000
+
 uint8_t teavpn_udp_server(server_config *config);
 uint8_t teavpn_tcp_server(server_config *config);
 
 struct buffer_channel {
 	uint16_t ref_count;
+	uint8_t class;						// enum teavpn_pb_class
 	ssize_t len;
-	char buffer[sizeof(teavpn_packet) + 10];
+	uint64_t tsc;
+	struct teavpn_pktbuf pb;
+};
+
+/**
+ * Buffer channels first to first + count - 1 are of one class.
+ */
+struct buffer_class {
+	uint16_t first;
+	uint16_t count;
+	uint16_t used;						// Referenced by queued frames.
+	uint16_t max_used;
+	uint64_t frames;					// TUN frames read into the class.
+	uint64_t promoted;					// Of those, did not fit the first candidate.
 };
 
 struct connection_entry {
 	int fd;
 	bool connected;
+	uint32_t gen;						// Bumped by every clean up, tells apart the users of a slot.
+	uint8_t teardown;					// enum conn_teardown
+	uint16_t inflight;					// Jobs queued and not released, rx in progress.
+	int closed_fd;						// Socket of the closing connection, closed by the teardown.
+	bool zc_drain;						// Closing with zerocopy on, see conn_drain().
+	bool zc_aborted;
+	uint64_t closed_tsc;
 	uint8_t error;
 	uint64_t seq;
 	uint32_t priv_ip;
-	pthread_mutex_t mutex;
+	struct teavpn_sock_tuning tuning;
+	struct teavpn_sock_bufs bufs;
+	struct teavpn_crypto crypto;
+	struct teavpn_reorder reorder;		// Worker writes in enqueue order.
+	struct teavpn_zc zc;				// Frames sent with MSG_ZEROCOPY.
 	struct sockaddr_in addr;
+	char addr_str[INET_ADDRSTRLEN];
 };
 
 struct teavpn_tcp_queue {
@@ -52,14 +181,33 @@ struct teavpn_tcp_queue {
 	int64_t queue_id;
 	int16_t conn_index;
 	int16_t bufchan_index;
+	uint64_t enqueue_tsc;
+	uint64_t seq;						// Reorder ticket, frame seq on the wire.
+	bool sealed;						// Frame is in queue_bufs.
+	struct packet_info hdr;				// Header of a plaintext frame, it carries our seq.
+};
+
+/**
+ * Worker slot life cycle, workers can be added and
+ * removed by a config reload.
+ */
+enum worker_state {
+	WORKER_UNUSED = 0,
+	WORKER_RUNNING = 1,
+	WORKER_STOPPING = 2,
+	WORKER_EXITED = 3
 };
 
 struct worker_thread {
 	bool busy;
+	bool spinning;					// Polls the queue, needs no wakeup.
 	uint8_t num;
+	uint8_t state;
 	pthread_t thread;
-	pthread_mutex_t mutex;
+	struct teavpn_mutex mutex;
 	pthread_cond_t cond;
+	struct teavpn_spin spin;
+	uint64_t busy_ticks;			// TSC ticks spent on jobs (pool utilisation).
 };
 
 FILE *teavpn_auth_check(server_config *config, struct teavpn_packet_auth *auth);
@@ -0,0 +1,45 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__tls_h
+#define __teavpn__tls_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * TLS 1.3 for the TCP transport, offloaded to the kernel (kTLS).
+ *
+ * OpenSSL runs the handshake in user space, then hands the
+ * record keys of both directions to the socket (SOL_TLS). From
+ * there on the fd is used as a plain socket: read(2) returns
+ * decrypted records, write(2) is encrypted by the kernel (or
+ * the NIC when it has TLS offload) and sendfile/zerocopy sends
+ * keep working. A socket handed over by an upgrade keeps its
+ * keys and record sequence numbers in the kernel.
+ *
+ * There is no user space fallback: a handshake whose keys the
+ * kernel does not take (no tls module, cipher not supported)
+ * fails. No session tickets and no key updates are sent, the
+ * socket could not pass those records to OpenSSL.
+ *
+ * Needs libssl (make CRYPTO=0 builds without it).
+ */
+
+struct teavpn_tls {
+	void *ctx;			// SSL_CTX *
+	bool server;
+};
+
+bool teavpn_tls_init(struct teavpn_tls *tls, bool server, const char *cert_file, const char *key_file,
+	const char *ca_file);
+void teavpn_tls_destroy(struct teavpn_tls *tls);
+bool teavpn_tls_handshake(struct teavpn_tls *tls, int fd, const char *host);
+void teavpn_tls_dump(FILE *fp, uint16_t conn, int fd);
+
+#endif
@@ -0,0 +1,124 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__trace_h
+#define __teavpn__trace_h
+
+#include <stdint.h>
+
+/**
+ * Static tracepoints (USDT).
+ *
+ * Each probe compiles to a single nop plus an ELF note
+ * (.note.stapsdt), so it costs nothing until a tracer
+ * attaches. List them with:
+ *
+ *   bpftrace -l 'usdt:./teavpn:*'
+ *
+ * Example:
+ *
+ *   bpftrace -e 'usdt:./teavpn:teavpn:worker_write { @[arg1] = sum(arg2); }'
+ *
+ * Probes (all arguments are 64-bit, stage and reason values
+ * are enum teavpn_handshake_stage/teavpn_conn_close_reason):
+ *
+ *   tun_read(bufchan_index, nread)
+ *   packet_enqueue(conn_index, bufchan_index, queue_index)
+ *   worker_write(worker_num, conn_index, nwrite)
+ *   client_frame(conn_index, type, len, nread)
+ *   handshake(stage, client_fd, addr, port)
+ *   handshake_fail(last_stage, client_fd, addr, port)
+ *   conn_open(conn_index, fd, addr, port)
+ *   conn_close(conn_index, fd, reason)
+ *   bufchan_exhausted(wait_counter, sleep_state)
+ *
+ * Build with USDT=0 to compile them out entirely.
+ */
+
+#if defined(TEAVPN_NO_USDT)
+
+#define TEAVPN_TRACE0(NAME)
+#define TEAVPN_TRACE1(NAME, A1)
+#define TEAVPN_TRACE2(NAME, A1, A2)
+#define TEAVPN_TRACE3(NAME, A1, A2, A3)
+#define TEAVPN_TRACE4(NAME, A1, A2, A3, A4)
+
+#elif defined(__has_include) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+
+#define TEAVPN_TRACE0(NAME) DTRACE_PROBE(teavpn, NAME)
+#define TEAVPN_TRACE1(NAME, A1) DTRACE_PROBE1(teavpn, NAME, A1)
+#define TEAVPN_TRACE2(NAME, A1, A2) DTRACE_PROBE2(teavpn, NAME, A1, A2)
+#define TEAVPN_TRACE3(NAME, A1, A2, A3) DTRACE_PROBE3(teavpn, NAME, A1, A2, A3)
+#define TEAVPN_TRACE4(NAME, A1, A2, A3, A4) DTRACE_PROBE4(teavpn, NAME, A1, A2, A3, A4)
+
+#elif defined(__ELF__) && (defined(__x86_64__) || defined(__aarch64__))
+
+/**
+ * Minimal stapsdt v3 note emitter for hosts without
+ * systemtap-sdt-dev. Same layout as <sys/sdt.h>, but
+ * every argument is widened to an unsigned 64-bit value.
+ */
+#define __TEAVPN_SDT_ASM(NAME, ARGFMT)							\
+	"990:	nop\n"												\
+	".pushsection .note.stapsdt,\"?\",\"note\"\n"				\
+	".balign 4\n"												\
+	".4byte 992f-991f, 994f-993f, 3\n"							\
+	"991:	.asciz \"stapsdt\"\n"								\
+	"992:	.balign 4\n"										\
+	"993:	.8byte 990b\n"										\
+	".8byte _.stapsdt.base\n"									\
+	".8byte 0\n"												\
+	".asciz \"teavpn\"\n"										\
+	".asciz \"" #NAME "\"\n"									\
+	".asciz \"" ARGFMT "\"\n"									\
+	"994:	.balign 4\n"										\
+	".popsection\n"												\
+	".ifndef _.stapsdt.base\n"									\
+	".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+	".weak _.stapsdt.base\n"									\
+	".hidden _.stapsdt.base\n"									\
+	"_.stapsdt.base: .space 1\n"								\
+	".size _.stapsdt.base, 1\n"									\
+	".popsection\n"												\
+	".endif\n"
+
+#define __TEAVPN_SDT_ARG(N, X) [a##N] "nor" ((uint64_t)(X))
+
+#define TEAVPN_TRACE0(NAME)										\
+	__asm__ __volatile__(__TEAVPN_SDT_ASM(NAME, ""))
+
+#define TEAVPN_TRACE1(NAME, A1)									\
+	__asm__ __volatile__(__TEAVPN_SDT_ASM(NAME, "8@%[a1]")		\
+		:: __TEAVPN_SDT_ARG(1, A1))
+
+#define TEAVPN_TRACE2(NAME, A1, A2)								\
+	__asm__ __volatile__(__TEAVPN_SDT_ASM(NAME, "8@%[a1] 8@%[a2]") \
+		:: __TEAVPN_SDT_ARG(1, A1), __TEAVPN_SDT_ARG(2, A2))
+
+#define TEAVPN_TRACE3(NAME, A1, A2, A3)							\
+	__asm__ __volatile__(__TEAVPN_SDT_ASM(NAME, "8@%[a1] 8@%[a2] 8@%[a3]") \
+		:: __TEAVPN_SDT_ARG(1, A1), __TEAVPN_SDT_ARG(2, A2),	\
+		__TEAVPN_SDT_ARG(3, A3))
+
+#define TEAVPN_TRACE4(NAME, A1, A2, A3, A4)						\
+	__asm__ __volatile__(__TEAVPN_SDT_ASM(NAME, "8@%[a1] 8@%[a2] 8@%[a3] 8@%[a4]") \
+		:: __TEAVPN_SDT_ARG(1, A1), __TEAVPN_SDT_ARG(2, A2),	\
+		__TEAVPN_SDT_ARG(3, A3), __TEAVPN_SDT_ARG(4, A4))
+
+#else
+
+#define TEAVPN_TRACE0(NAME)
+#define TEAVPN_TRACE1(NAME, A1)
+#define TEAVPN_TRACE2(NAME, A1, A2)
+#define TEAVPN_TRACE3(NAME, A1, A2, A3)
+#define TEAVPN_TRACE4(NAME, A1, A2, A3, A4)
+
+#endif
+
+#endif
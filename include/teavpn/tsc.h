@@ -0,0 +1,44 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__tsc_h
+#define __teavpn__tsc_h
+
+#include <time.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/**
+ * Cheap timestamp for the packet path.
+ *
+ * On x86 this is the raw TSC (no serialization, we only need
+ * ordering within a few hundred nanoseconds). Other arches fall
+ * back to CLOCK_MONOTONIC in nanoseconds, so one tick is 1 ns.
+ *
+ * Use teavpn_tsc_hz() to convert ticks to wall time.
+ *
+ * @return uint64_t
+ */
+static inline uint64_t teavpn_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+void teavpn_tsc_calibrate();
+uint64_t teavpn_tsc_hz();
+uint64_t teavpn_tsc_to_ns(uint64_t ticks);
+
+#endif
@@ -0,0 +1,69 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__upgrade_h
+#define __teavpn__upgrade_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <arpa/inet.h>
+
+#include <teavpn/crypto.h>
+#include <teavpn/sockopt.h>
+
+/**
+ * Zero-downtime binary upgrade.
+ *
+ * The running server listens on the upgrade_socket Unix socket.
+ * A new binary started with --upgrade connects to it, the old
+ * process quiesces its workers and sends one message carrying
+ * teavpn_upgrade_state plus the listening socket, the TUN fd and
+ * every client socket as SCM_RIGHTS. Once the new process has
+ * its threads running it answers with one byte and waits for the
+ * old process to confirm with TEAVPN_UPGRADE_COMMIT (or to exit)
+ * before it touches the sockets. An old process which gave up
+ * answers TEAVPN_UPGRADE_ABORT and shuts the socket down before
+ * it resumes, so the two never forward at the same time.
+ *
+ * fds[0] is the listening socket, fds[1] the TUN fd and
+ * fds[2 + k] the socket of conns[k].
+ */
+
+#define TEAVPN_UPGRADE_MAGIC 0x50555654	// "TVUP"
+#define TEAVPN_UPGRADE_VERSION 5
+#define TEAVPN_UPGRADE_MAX_CONNS 64
+#define TEAVPN_UPGRADE_MAX_FDS (2 + TEAVPN_UPGRADE_MAX_CONNS)
+
+// Answer of the old process to the ack.
+#define TEAVPN_UPGRADE_ABORT 0
+#define TEAVPN_UPGRADE_COMMIT 1
+
+struct teavpn_upgrade_conn {
+	uint64_t seq;
+	uint32_t priv_ip;
+	uint8_t error;
+	struct sockaddr_in addr;
+	struct teavpn_sock_tuning tuning;
+	struct teavpn_crypto_state crypto;	// Session keys, the socket is root or same uid only.
+	uint32_t zc_next;					// Zerocopy sends counted by the socket.
+};
+
+struct teavpn_upgrade_state {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t nr_conns;
+	char dev[16];
+	struct teavpn_upgrade_conn conns[TEAVPN_UPGRADE_MAX_CONNS];
+};
+
+int teavpn_upgrade_listen(const char *path);
+int teavpn_upgrade_accept(int listen_fd);
+bool teavpn_upgrade_send(int fd, struct teavpn_upgrade_state *state, int *fds, uint16_t nr_fds);
+int teavpn_upgrade_recv(const char *path, struct teavpn_upgrade_state *state, int *fds, uint16_t *nr_fds);
+bool teavpn_upgrade_ack(int fd);
+
+#endif
@@ -0,0 +1,189 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__uring_h
+#define __teavpn__uring_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef TEAVPN_HAVE_URING
+#include <linux/io_uring.h>
+
+/**
+ * io_uring event loop backend (raw syscalls, no liburing).
+ *
+ * The event loops queue their reads and writes as SQEs and hand
+ * the whole pass to the kernel with one io_uring_enter(2), which
+ * also waits for the next completions. Sockets are read with
+ * multishot receives into a ring of provided buffers (one SQE
+ * stays armed for every receive), the TUN device with a multishot
+ * read when the kernel has it (6.7) or one posted read otherwise.
+ * The fds live in the registered file table and the packet buffers
+ * are registered, requests skip the fd lookup and the page pinning.
+ *
+ * Needs Linux 6.0 (multishot receive). teavpn_uring_init() probes
+ * the kernel, the caller falls back to select(2) when it fails.
+ */
+
+/**
+ * Newer than linux/io_uring.h may be, tested with the probe.
+ */
+#define TEAVPN_URING_OP_READ_MULTISHOT 49
+
+/**
+ * user_data: what (8 bits) | index (24 bits) | tag (32 bits).
+ */
+#define TEAVPN_URING_UD(WHAT, INDEX, TAG) \
+	(((uint64_t)(WHAT) << 56) | (((uint64_t)(INDEX) & 0xffffff) << 32) | (uint32_t)(TAG))
+#define TEAVPN_URING_UD_WHAT(UD) ((uint8_t)((UD) >> 56))
+#define TEAVPN_URING_UD_INDEX(UD) ((uint32_t)(((UD) >> 32) & 0xffffff))
+#define TEAVPN_URING_UD_TAG(UD) ((uint32_t)(UD))
+
+struct teavpn_uring {
+	int fd;
+	bool read_multishot;			// IORING_OP_READ_MULTISHOT is there.
+	bool fixed_bufs;				// teavpn_uring_register_bufs() succeeded.
+	uint32_t nr_files;
+
+	// Submission queue.
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	uint32_t sq_local;				// Tail of the SQEs not published yet.
+	struct io_uring_sqe *sqes;
+
+	// Completion queue.
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void *ring;
+	size_t ring_size;
+	size_t sqes_size;
+
+	// Stats.
+	uint64_t enters;
+	uint64_t submitted;
+	uint64_t completed;
+	uint64_t sq_full;				// Had to submit before the pass was over.
+};
+
+/**
+ * Ring of provided buffers (one buffer group).
+ */
+struct teavpn_uring_bufs {
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	uint16_t bgid;
+	uint16_t entries;
+	uint16_t tail;					// Local, published by teavpn_uring_bufs_commit().
+	uint16_t added;					// Buffers added since the last commit.
+	uint64_t empty;					// A multishot request ran out of buffers.
+};
+
+bool teavpn_uring_init(struct teavpn_uring *r, uint32_t entries, uint32_t nr_files);
+void teavpn_uring_destroy(struct teavpn_uring *r);
+struct io_uring_sqe *teavpn_uring_sqe(struct teavpn_uring *r);
+int teavpn_uring_enter(struct teavpn_uring *r, uint32_t wait_nr, uint32_t timeout_ms);
+bool teavpn_uring_file_set(struct teavpn_uring *r, uint32_t slot, int fd);
+bool teavpn_uring_register_bufs(struct teavpn_uring *r, void *base, size_t len);
+bool teavpn_uring_bufs_init(struct teavpn_uring *r, struct teavpn_uring_bufs *b, uint16_t bgid, uint16_t entries);
+void teavpn_uring_bufs_destroy(struct teavpn_uring *r, struct teavpn_uring_bufs *b);
+void teavpn_uring_dump(FILE *fp, const char *name, struct teavpn_uring *r);
+
+/**
+ * Next completion, NULL if there is none. Give it back with
+ * teavpn_uring_cqe_seen() before asking for the next one.
+ *
+ * @param struct teavpn_uring *r
+ * @return struct io_uring_cqe *
+ */
+static inline struct io_uring_cqe *teavpn_uring_cqe(struct teavpn_uring *r)
+{
+	uint32_t head = *(r->cq_head);
+
+	if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		return NULL;
+	}
+	return &(r->cqes[head & r->cq_mask]);
+}
+
+/**
+ * @param struct teavpn_uring *r
+ * @return void
+ */
+static inline void teavpn_uring_cqe_seen(struct teavpn_uring *r)
+{
+	__atomic_store_n(r->cq_head, *(r->cq_head) + 1, __ATOMIC_RELEASE);
+	r->completed++;
+}
+
+/**
+ * Offset 0, TUN devices, pipes and sockets have no position.
+ *
+ * @param struct io_uring_sqe	*sqe
+ * @param uint8_t				op
+ * @param int					fd		Slot of the file table with IOSQE_FIXED_FILE.
+ * @param const void			*addr
+ * @param uint32_t				len
+ * @param uint64_t				user_data
+ * @return void
+ */
+static inline void teavpn_uring_prep(struct io_uring_sqe *sqe, uint8_t op, int fd, const void *addr,
+	uint32_t len, uint64_t user_data)
+{
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)addr;
+	sqe->len = len;
+	sqe->user_data = user_data;
+}
+
+/**
+ * Give buffer bid back to the kernel. Only the thread which
+ * owns the ring may call it.
+ *
+ * @param struct teavpn_uring_bufs	*b
+ * @param void						*addr
+ * @param uint32_t					len
+ * @param uint16_t					bid
+ * @return void
+ */
+static inline void teavpn_uring_bufs_add(struct teavpn_uring_bufs *b, void *addr, uint32_t len, uint16_t bid)
+{
+	struct io_uring_buf *buf = &(b->br->bufs[(b->tail + b->added) & (b->entries - 1)]);
+
+	buf->addr = (uint64_t)(uintptr_t)addr;
+	buf->len = len;
+	buf->bid = bid;
+	b->added++;
+}
+
+/**
+ * Publish the buffers added since the last commit.
+ *
+ * @param struct teavpn_uring_bufs *b
+ * @return void
+ */
+static inline void teavpn_uring_bufs_commit(struct teavpn_uring_bufs *b)
+{
+	if (b->added == 0) {
+		return;
+	}
+	b->tail += b->added;
+	b->added = 0;
+	__atomic_store_n(&(b->br->tail), b->tail, __ATOMIC_RELEASE);
+}
+
+#endif /* #ifdef TEAVPN_HAVE_URING */
+
+#endif
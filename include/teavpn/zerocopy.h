@@ -0,0 +1,69 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#ifndef __teavpn__zerocopy_h
+#define __teavpn__zerocopy_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+
+#include <teavpn/lockstat.h>
+
+/**
+ * MSG_ZEROCOPY transmit (one per socket).
+ *
+ * The kernel sends straight from our pages and keeps them pinned
+ * until the data is acked, the buffer of a frame must not be
+ * reused before then. Every zerocopy sendmsg gets the next id of
+ * the socket, the kernel reports finished id ranges on the error
+ * queue and teavpn_zc_reap() releases the item sent with each id.
+ *
+ * One thread at a time sends on a socket, any thread may reap.
+ * At most TEAVPN_ZC_SLOTS sends may be pending, the caller bounds
+ * that (QUEUE_AMOUNT for the server). Pinning only pays off for
+ * large frames, smaller ones than the threshold are copied.
+ */
+
+#define TEAVPN_ZC_SLOTS 64
+#define TEAVPN_ZC_MASK (TEAVPN_ZC_SLOTS - 1)
+
+typedef void (*teavpn_zc_release_t)(void *item);
+
+struct teavpn_zc {
+	struct teavpn_mutex lock;
+	uint32_t threshold;				// Frame size from which to send zerocopy, 0 = off.
+	uint32_t next;					// Id of the next send, counted by the socket too.
+	uint32_t pending;
+	void *items[TEAVPN_ZC_SLOTS];
+
+	// Stats.
+	uint64_t sent;
+	uint64_t copied;				// Completed, but the kernel had copied anyway.
+	uint64_t fallback;				// Copied because the kernel refused (ENOBUFS).
+};
+
+void teavpn_zc_init(struct teavpn_zc *zc, int16_t index);
+bool teavpn_zc_enable(struct teavpn_zc *zc, int fd, uint32_t threshold, uint32_t next);
+ssize_t teavpn_zc_send(struct teavpn_zc *zc, int fd, const struct iovec *iov, int iovcnt, void *item, bool *held);
+uint32_t teavpn_zc_reap(struct teavpn_zc *zc, int fd, teavpn_zc_release_t release);
+void teavpn_zc_abort(int fd);
+void teavpn_zc_dump(FILE *fp, uint16_t conn, struct teavpn_zc *zc);
+
+/**
+ * @param struct teavpn_zc	*zc
+ * @param size_t			len		Frame size.
+ * @return bool
+ */
+static inline bool teavpn_zc_wanted(struct teavpn_zc *zc, size_t len)
+{
+	return (zc->threshold > 0) && (len >= zc->threshold);
+}
+
+#endif
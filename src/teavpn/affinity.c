@@ -0,0 +1,474 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+#include <arpa/inet.h>
+
+#include <teavpn/teavpn.h>
+#include <teavpn/affinity.h>
+
+extern uint8_t verbose_level;
+
+static void cpulist_to_set(const struct teavpn_cpulist *list, cpu_set_t *set);
+static void affinity_detect_nic(struct teavpn_affinity *aff, const char *bind_addr);
+static void affinity_node_cpus(int node, struct teavpn_cpulist *list);
+
+static const char *mode_names[] = {"off", "on", "auto"};
+
+/**
+ * @param const char *value	"off", "on" or "auto" (config value).
+ * @return uint8_t
+ */
+uint8_t teavpn_affinity_mode(const char *value)
+{
+	if ((!strcmp(value, "on")) || (!strcmp(value, "1"))) {
+		return TEAVPN_AFFINITY_ON;
+	}
+
+	if (!strcmp(value, "auto")) {
+		return TEAVPN_AFFINITY_AUTO;
+	}
+
+	return TEAVPN_AFFINITY_OFF;
+}
+
+/**
+ * Parse a kernel cpulist ("0-3,8,10-11").
+ *
+ * @param const char			*str
+ * @param struct teavpn_cpulist	*list
+ * @return bool
+ */
+bool teavpn_cpulist_parse(const char *str, struct teavpn_cpulist *list)
+{
+	char *end;
+	long first, last;
+
+	list->nr = 0;
+
+	while (*str != '\0') {
+		while ((*str == ' ') || (*str == ',')) str++;
+		if ((*str == '\0') || (*str == '\n')) {
+			break;
+		}
+
+		first = last = strtol(str, &end, 10);
+		if (end == str) {
+			return false;
+		}
+		str = end;
+
+		if (*str == '-') {
+			last = strtol(str + 1, &end, 10);
+			if (end == (str + 1)) {
+				return false;
+			}
+			str = end;
+		}
+
+		if ((first < 0) || (last < first) || (last >= TEAVPN_MAX_CPUS)) {
+			return false;
+		}
+
+		for (long cpu = first; (cpu <= last) && (list->nr < TEAVPN_MAX_CPUS); cpu++) {
+			list->cpus[list->nr++] = (uint16_t)cpu;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @param const struct teavpn_cpulist	*list
+ * @param char							*buf
+ * @param size_t						len
+ * @return void
+ */
+void teavpn_cpulist_str(const struct teavpn_cpulist *list, char *buf, size_t len)
+{
+	size_t pos = 0;
+
+	buf[0] = '\0';
+	if (list->nr == 0) {
+		snprintf(buf, len, "-");
+		return;
+	}
+
+	for (uint16_t i = 0; (i < list->nr) && (pos < len); ) {
+		uint16_t j = i;
+
+		while (((j + 1) < list->nr) && (list->cpus[j + 1] == (list->cpus[j] + 1))) j++;
+
+		if (j > i) {
+			pos += snprintf(&(buf[pos]), len - pos, "%s%d-%d", (i > 0) ? "," : "", list->cpus[i], list->cpus[j]);
+		} else {
+			pos += snprintf(&(buf[pos]), len - pos, "%s%d", (i > 0) ? "," : "", list->cpus[i]);
+		}
+		i = j + 1;
+	}
+}
+
+/**
+ * Build the placement from the config, lists left empty
+ * in auto mode are derived from the NUMA node of the NIC.
+ *
+ * @param struct teavpn_affinity	*aff
+ * @param uint8_t					mode
+ * @param const char				*bind_addr
+ * @param const char				*main			NULL = not set.
+ * @param const char				*workers		NULL = not set.
+ * @param const char				*housekeeping	NULL = not set.
+ * @return bool
+ */
+bool teavpn_affinity_init(struct teavpn_affinity *aff, uint8_t mode, const char *bind_addr,
+	const char *main, const char *workers, const char *housekeeping)
+{
+	struct teavpn_cpulist node_cpus;
+
+	memset(aff, 0, sizeof(*aff));
+	aff->mode = mode;
+	aff->nic_node = -1;
+
+	if (mode == TEAVPN_AFFINITY_OFF) {
+		return true;
+	}
+
+	#define PARSE_LIST(NAME)											\
+		if ((NAME != NULL) && (!teavpn_cpulist_parse(NAME, &(aff->NAME)))) {	\
+			debug_log(0, "Invalid cpu_" #NAME " list \"%s\"", NAME);		\
+			return false;											\
+		}
+
+	PARSE_LIST(main);
+	PARSE_LIST(workers);
+	PARSE_LIST(housekeeping);
+
+	#undef PARSE_LIST
+
+	if (mode != TEAVPN_AFFINITY_AUTO) {
+		return true;
+	}
+
+	affinity_detect_nic(aff, bind_addr);
+	affinity_node_cpus(aff->nic_node, &node_cpus);
+	if (node_cpus.nr == 0) {
+		return true;
+	}
+
+	if (aff->main.nr == 0) {
+		aff->main.cpus[aff->main.nr++] = node_cpus.cpus[0];
+	}
+
+	if (aff->housekeeping.nr == 0) {
+		aff->housekeeping.cpus[aff->housekeeping.nr++] = node_cpus.cpus[(node_cpus.nr > 1) ? 1 : 0];
+	}
+
+	if (aff->workers.nr == 0) {
+		for (uint16_t i = (node_cpus.nr > 2) ? 2 : 0; i < node_cpus.nr; i++) {
+			aff->workers.cpus[aff->workers.nr++] = node_cpus.cpus[i];
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Pin the calling thread to list (nothing if the list is empty).
+ *
+ * @param const struct teavpn_cpulist *list
+ * @return bool
+ */
+bool teavpn_affinity_pin_self(const struct teavpn_cpulist *list)
+{
+	cpu_set_t set;
+
+	if (list->nr == 0) {
+		return true;
+	}
+
+	cpulist_to_set(list, &set);
+	if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+		perror("sched_setaffinity()");
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Pin worker num to one CPU of the workers list.
+ *
+ * @param const struct teavpn_affinity	*aff
+ * @param pthread_t						thread
+ * @param uint8_t						num
+ * @return bool
+ */
+bool teavpn_affinity_pin_worker(const struct teavpn_affinity *aff, pthread_t thread, uint8_t num)
+{
+	cpu_set_t set;
+
+	if (aff->workers.nr == 0) {
+		return true;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(aff->workers.cpus[num % aff->workers.nr], &set);
+	if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+		debug_log(0, "Cannot pin worker %d to CPU %d", num, aff->workers.cpus[num % aff->workers.nr]);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Pin every thread which is neither the main thread nor a
+ * worker. They are created all over the tree (logger, watchdog,
+ * iface), so walk /proc/self/task instead of tracking them.
+ *
+ * @param const struct teavpn_affinity *aff
+ * @return void
+ */
+void teavpn_affinity_pin_housekeeping(const struct teavpn_affinity *aff)
+{
+	DIR *dir;
+	FILE *h;
+	cpu_set_t set;
+	struct dirent *ent;
+	char path[64], comm[32];
+
+	if (aff->housekeeping.nr == 0) {
+		return;
+	}
+
+	dir = opendir("/proc/self/task");
+	if (dir == NULL) {
+		return;
+	}
+
+	cpulist_to_set(&(aff->housekeeping), &set);
+
+	while ((ent = readdir(dir)) != NULL) {
+		pid_t tid = (pid_t)atoi(ent->d_name);
+
+		if ((tid <= 0) || (tid == getpid())) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+		h = fopen(path, "r");
+		if (h == NULL) {
+			continue;
+		}
+		comm[0] = '\0';
+		if (fgets(comm, sizeof(comm), h) == NULL) {
+			comm[0] = '\0';
+		}
+		fclose(h);
+
+		if (!strncmp(comm, TEAVPN_WORKER_COMM, sizeof(TEAVPN_WORKER_COMM) - 1)) {
+			continue;
+		}
+
+		if (sched_setaffinity(tid, sizeof(set), &set) < 0) {
+			debug_log(1, "Cannot pin thread %d", tid);
+		}
+	}
+
+	closedir(dir);
+}
+
+/**
+ * Configured placement and the affinity each thread really has.
+ *
+ * @param const struct teavpn_affinity	*aff
+ * @param FILE							*fp
+ * @return void
+ */
+void teavpn_affinity_dump(const struct teavpn_affinity *aff, FILE *fp)
+{
+	DIR *dir;
+	FILE *h;
+	cpu_set_t set;
+	struct dirent *ent;
+	struct teavpn_cpulist list;
+	char path[64], comm[32], main[128], workers[128], housekeeping[128];
+
+	teavpn_cpulist_str(&(aff->main), main, sizeof(main));
+	teavpn_cpulist_str(&(aff->workers), workers, sizeof(workers));
+	teavpn_cpulist_str(&(aff->housekeeping), housekeeping, sizeof(housekeeping));
+	fprintf(fp, "[topology] mode=%s nic=%s node=%d main=%s workers=%s housekeeping=%s\n",
+		mode_names[aff->mode], (aff->nic[0] != '\0') ? aff->nic : "-", aff->nic_node,
+		main, workers, housekeeping);
+
+	dir = opendir("/proc/self/task");
+	if (dir == NULL) {
+		return;
+	}
+
+	while ((ent = readdir(dir)) != NULL) {
+		pid_t tid = (pid_t)atoi(ent->d_name);
+
+		if (tid <= 0) {
+			continue;
+		}
+
+		snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+		h = fopen(path, "r");
+		if (h == NULL) {
+			continue;
+		}
+		comm[0] = '\0';
+		if (fgets(comm, sizeof(comm), h) != NULL) {
+			comm[strcspn(comm, "\n")] = '\0';
+		}
+		fclose(h);
+
+		if (sched_getaffinity(tid, sizeof(set), &set) < 0) {
+			continue;
+		}
+
+		list.nr = 0;
+		for (uint16_t cpu = 0; cpu < TEAVPN_MAX_CPUS; cpu++) {
+			if (CPU_ISSET(cpu, &set)) {
+				list.cpus[list.nr++] = cpu;
+			}
+		}
+
+		teavpn_cpulist_str(&list, main, sizeof(main));
+		fprintf(fp, "[topology] thread=%s tid=%d cpus=%s\n", comm, tid, main);
+	}
+
+	closedir(dir);
+}
+
+/**
+ * @param const struct teavpn_cpulist	*list
+ * @param cpu_set_t						*set
+ * @return void
+ */
+static void cpulist_to_set(const struct teavpn_cpulist *list, cpu_set_t *set)
+{
+	CPU_ZERO(set);
+	for (uint16_t i = 0; i < list->nr; i++) {
+		CPU_SET(list->cpus[i], set);
+	}
+}
+
+/**
+ * The interface which owns bind_addr, for 0.0.0.0 the first
+ * physical interface which is up.
+ *
+ * @param struct teavpn_affinity	*aff
+ * @param const char				*bind_addr
+ * @return void
+ */
+static void affinity_detect_nic(struct teavpn_affinity *aff, const char *bind_addr)
+{
+	FILE *h;
+	char path[128];
+	struct ifaddrs *ifap, *ifa;
+	in_addr_t addr = inet_addr(bind_addr);
+
+	if (getifaddrs(&ifap) < 0) {
+		return;
+	}
+
+	for (ifa = ifap; ifa != NULL; ifa = ifa->ifa_next) {
+		if ((ifa->ifa_addr == NULL) || (ifa->ifa_addr->sa_family != AF_INET) ||
+			(!(ifa->ifa_flags & IFF_UP)) || (ifa->ifa_flags & IFF_LOOPBACK)) {
+			continue;
+		}
+
+		if (addr != INADDR_ANY) {
+			if (((struct sockaddr_in *)ifa->ifa_addr)->sin_addr.s_addr != addr) {
+				continue;
+			}
+		} else {
+			snprintf(path, sizeof(path), "/sys/class/net/%s/device", ifa->ifa_name);
+			if (access(path, F_OK) < 0) {
+				continue;
+			}
+		}
+
+		snprintf(aff->nic, sizeof(aff->nic), "%s", ifa->ifa_name);
+		break;
+	}
+
+	freeifaddrs(ifap);
+
+	if (aff->nic[0] == '\0') {
+		return;
+	}
+
+	// Virtual devices (veth, bridges) have no node.
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node", aff->nic);
+	h = fopen(path, "r");
+	if (h != NULL) {
+		if (fscanf(h, "%d", &(aff->nic_node)) != 1) {
+			aff->nic_node = -1;
+		}
+		fclose(h);
+	}
+}
+
+/**
+ * CPUs of node which we are allowed to run on, every allowed
+ * CPU if node is unknown.
+ *
+ * @param int					node
+ * @param struct teavpn_cpulist	*list
+ * @return void
+ */
+static void affinity_node_cpus(int node, struct teavpn_cpulist *list)
+{
+	FILE *h;
+	cpu_set_t allowed;
+	char path[64], buf[256];
+	struct teavpn_cpulist node_list;
+	bool have_node = false;
+
+	list->nr = 0;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		return;
+	}
+
+	if (node >= 0) {
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+		h = fopen(path, "r");
+		if (h != NULL) {
+			have_node = (fgets(buf, sizeof(buf), h) != NULL) && teavpn_cpulist_parse(buf, &node_list);
+			fclose(h);
+		}
+	}
+
+	if (have_node) {
+		for (uint16_t i = 0; i < node_list.nr; i++) {
+			if (CPU_ISSET(node_list.cpus[i], &allowed)) {
+				list->cpus[list->nr++] = node_list.cpus[i];
+			}
+		}
+	}
+
+	// Node CPUs outside of our cpuset, use what we have.
+	if (list->nr == 0) {
+		for (uint16_t cpu = 0; cpu < TEAVPN_MAX_CPUS; cpu++) {
+			if (CPU_ISSET(cpu, &allowed)) {
+				list->cpus[list->nr++] = cpu;
+			}
+		}
+	}
+}
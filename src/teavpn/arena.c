@@ -0,0 +1,281 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include <teavpn/arena.h>
+#include <teavpn/teavpn.h>
+
+extern uint8_t verbose_level;
+
+static uint8_t arena_online_nodes(int *nodes);
+static bool arena_map(struct teavpn_arena *arena, size_t size, uint8_t mode, bool bind);
+
+static const char *backing_names[] = {"pages", "thp", "hugetlb"};
+
+/**
+ * @param const char *value	"on", "off" or "auto" (config value).
+ * @return uint8_t
+ */
+uint8_t teavpn_hugepages_mode(const char *value)
+{
+	if ((!strcmp(value, "on")) || (!strcmp(value, "1"))) {
+		return TEAVPN_HUGEPAGES_ON;
+	}
+
+	if ((!strcmp(value, "off")) || (!strcmp(value, "0"))) {
+		return TEAVPN_HUGEPAGES_OFF;
+	}
+
+	return TEAVPN_HUGEPAGES_AUTO;
+}
+
+/**
+ * Reserve size bytes (rounded up to a huge page) on every online node.
+ *
+ * @param struct teavpn_arena_set	*set
+ * @param size_t					size
+ * @param uint8_t					mode	enum teavpn_hugepages_mode
+ * @return bool
+ */
+bool teavpn_arena_init(struct teavpn_arena_set *set, size_t size, uint8_t mode)
+{
+	int nodes[TEAVPN_ARENA_MAX_NODES];
+
+	memset(set, 0, sizeof(*set));
+	size = (size + TEAVPN_HUGE_PAGE_SIZE - 1) & ~((size_t)TEAVPN_HUGE_PAGE_SIZE - 1);
+
+	set->nr_nodes = arena_online_nodes(nodes);
+	for (uint8_t i = 0; i < set->nr_nodes; i++) {
+		set->nodes[i].node = nodes[i];
+
+		// Binding only matters if there is another node to avoid.
+		if (!arena_map(&(set->nodes[i]), size, mode, set->nr_nodes > 1)) {
+			teavpn_arena_destroy(set);
+			return false;
+		}
+
+		debug_log(1, "Packet arena on node %d: %zu KB (%s%s)", nodes[i], size / 1024,
+			backing_names[set->nodes[i].backing], set->nodes[i].bound ? ", bound" : "");
+	}
+
+	return true;
+}
+
+/**
+ * @param struct teavpn_arena_set *set
+ * @return void
+ */
+void teavpn_arena_destroy(struct teavpn_arena_set *set)
+{
+	for (uint8_t i = 0; i < set->nr_nodes; i++) {
+		if (set->nodes[i].base != NULL) {
+			munmap(set->nodes[i].base, set->nodes[i].size);
+			set->nodes[i].base = NULL;
+		}
+	}
+	set->nr_nodes = 0;
+}
+
+/**
+ * @param struct teavpn_arena_set	*set
+ * @param int						node
+ * @return struct teavpn_arena *	The first arena if node has none.
+ */
+struct teavpn_arena *teavpn_arena_node(struct teavpn_arena_set *set, int node)
+{
+	for (uint8_t i = 0; i < set->nr_nodes; i++) {
+		if (set->nodes[i].node == node) {
+			return &(set->nodes[i]);
+		}
+	}
+
+	return (set->nr_nodes > 0) ? &(set->nodes[0]) : NULL;
+}
+
+/**
+ * Arena of the node the calling thread runs on.
+ *
+ * @param struct teavpn_arena_set *set
+ * @return struct teavpn_arena *
+ */
+struct teavpn_arena *teavpn_arena_local(struct teavpn_arena_set *set)
+{
+	unsigned int cpu, node = 0;
+
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) < 0) {
+		node = 0;
+	}
+
+	return teavpn_arena_node(set, (int)node);
+}
+
+/**
+ * @param struct teavpn_arena	*arena
+ * @param size_t				size
+ * @param size_t				align	Power of two.
+ * @return void *	NULL if the arena is exhausted.
+ */
+void *teavpn_arena_alloc(struct teavpn_arena *arena, size_t size, size_t align)
+{
+	size_t off;
+
+	if (arena == NULL) {
+		return NULL;
+	}
+
+	off = (arena->used + align - 1) & ~(align - 1);
+	if ((off + size) > arena->size) {
+		debug_log(0, "Packet arena on node %d is exhausted (%zu + %zu > %zu)",
+			arena->node, off, size, arena->size);
+		return NULL;
+	}
+
+	arena->used = off + size;
+	return arena->base + off;
+}
+
+/**
+ * @param struct teavpn_arena_set	*set
+ * @param FILE						*fp
+ * @return void
+ */
+void teavpn_arena_stats(struct teavpn_arena_set *set, FILE *fp)
+{
+	for (uint8_t i = 0; i < set->nr_nodes; i++) {
+		fprintf(fp, "[arena] node=%d size=%zu used=%zu backing=%s bound=%d\n",
+			set->nodes[i].node, set->nodes[i].size, set->nodes[i].used,
+			backing_names[set->nodes[i].backing], set->nodes[i].bound);
+	}
+}
+
+/**
+ * Parse /sys/devices/system/node/online ("0", "0-1", "0,2-3").
+ *
+ * @param int *nodes	TEAVPN_ARENA_MAX_NODES entries.
+ * @return uint8_t
+ */
+static uint8_t arena_online_nodes(int *nodes)
+{
+	FILE *h;
+	char buf[128], *p;
+	uint8_t n = 0;
+
+	h = fopen("/sys/devices/system/node/online", "r");
+	if ((h == NULL) || (fgets(buf, sizeof(buf), h) == NULL)) {
+		if (h != NULL) {
+			fclose(h);
+		}
+		nodes[0] = 0;
+		return 1;
+	}
+	fclose(h);
+
+	p = buf;
+	while ((*p >= '0') && (*p <= '9')) {
+		int first, last;
+
+		first = last = (int)strtol(p, &p, 10);
+		if (*p == '-') {
+			last = (int)strtol(p + 1, &p, 10);
+		}
+
+		for (int i = first; (i <= last) && (n < TEAVPN_ARENA_MAX_NODES); i++) {
+			nodes[n++] = i;
+		}
+
+		if (*p == ',') {
+			p++;
+		}
+	}
+
+	if (n == 0) {
+		nodes[n++] = 0;
+	}
+
+	return n;
+}
+
+/**
+ * Map, bind and fault in one node region.
+ *
+ * @param struct teavpn_arena	*arena
+ * @param size_t				size	Multiple of TEAVPN_HUGE_PAGE_SIZE.
+ * @param uint8_t				mode
+ * @param bool					bind
+ * @return bool
+ */
+static bool arena_map(struct teavpn_arena *arena, size_t size, uint8_t mode, bool bind)
+{
+	char *p = MAP_FAILED;
+
+	if (mode != TEAVPN_HUGEPAGES_OFF) {
+		p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED) {
+			arena->backing = TEAVPN_ARENA_HUGETLB;
+		} else if (mode == TEAVPN_HUGEPAGES_ON) {
+			debug_log(0, "No free 2 MB huge pages for the packet arena (see /proc/sys/vm/nr_hugepages)");
+			return false;
+		}
+	}
+
+	if (p == MAP_FAILED) {
+		char *raw;
+		size_t head;
+
+		/**
+		 * Over-map to get a 2 MB aligned region, THP can
+		 * only back aligned 2 MB ranges.
+		 */
+		raw = mmap(NULL, size + TEAVPN_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == MAP_FAILED) {
+			perror("Packet arena mmap");
+			return false;
+		}
+
+		head = (TEAVPN_HUGE_PAGE_SIZE - ((uintptr_t)raw & (TEAVPN_HUGE_PAGE_SIZE - 1))) & (TEAVPN_HUGE_PAGE_SIZE - 1);
+		if (head > 0) {
+			munmap(raw, head);
+		}
+		munmap(raw + head + size, TEAVPN_HUGE_PAGE_SIZE - head);
+		p = raw + head;
+
+		arena->backing = TEAVPN_ARENA_PAGES;
+		if ((mode == TEAVPN_HUGEPAGES_AUTO) && (madvise(p, size, MADV_HUGEPAGE) == 0)) {
+			arena->backing = TEAVPN_ARENA_THP;
+		}
+	}
+
+	arena->base = p;
+	arena->size = size;
+	arena->used = 0;
+
+	/**
+	 * Bind before the first touch, pages are placed on fault.
+	 * MPOL_PREFERRED so a full node falls back instead of OOM.
+	 */
+	if (bind) {
+		unsigned long mask = 1UL << arena->node;
+
+		arena->bound = (syscall(SYS_mbind, p, size, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) == 0);
+		if (!arena->bound) {
+			debug_log(1, "mbind(2) to node %d failed, using the default policy", arena->node);
+		}
+	}
+
+	memset(p, 0, size);
+	return true;
+}
@@ -12,6 +12,8 @@
 #include <unistd.h>
 #include <stdbool.h>
 
+#include <teavpn/arena.h>
+#include <teavpn/affinity.h>
 #include <teavpn/cli_arg.h>
 
 static const struct option server_options[] = {
@@ -25,6 +27,7 @@ static const struct option server_options[] = {
 	{"error-log",		required_argument,		0,		0x1},
 	{"verbose",			required_argument,		0,		0x2},
 	{"dev",				required_argument,		0,		0x3},
+	{"upgrade",			no_argument,			0,		0x4},
 	{"help",			no_argument,			0,		0xa},
 	{0, 0, 0, 0}
 };
@@ -102,14 +105,38 @@ static bool server_argv_parser(char *appname, server_config *server, int argc, c
 	server->bind_addr = bind_any_addr;
 	server->bind_port = 55555;
 	server->threads = 8;
+	server->threads_min = 0;
+	server->threads_max = 0;
 	server->verbose_level = 0;
 	server->error_log_file = NULL;
 	server->config_file = NULL;
 	server->mtu = 1500;
 	server->data_dir = NULL;
+	server->stats_file = NULL;
+	server->flight_recorder_file = NULL;
+	server->watchdog_timeout = 5;
+	server->lock_stats = 0;
 	server->inet4 = default_inet4;
 	server->inet4_broadcast = default_inet4_broadcast;
 	server->dev = default_dev_name;
+	server->iface_backend = NULL;
+	server->upgrade_socket = NULL;
+	server->upgrade = 0;
+	server->listen_backlog = 128;
+	server->hugepages = TEAVPN_HUGEPAGES_AUTO;
+	server->cpu_affinity = TEAVPN_AFFINITY_OFF;
+	server->cpu_main = NULL;
+	server->cpu_workers = NULL;
+	server->cpu_housekeeping = NULL;
+	server->encryption = TEAVPN_ENCRYPTION_ON;
+	server->tls = 0;
+	server->io_uring = 0;
+	server->spin_us = 0;
+	server->inline_write = 0;
+	server->tls_cert_file = NULL;
+	server->tls_key_file = NULL;
+	teavpn_sock_tuning_default(&server->sock_tuning);
+	server->busy_poll_set = 0;
 
 	while (true) {
 
@@ -154,6 +181,10 @@ static bool server_argv_parser(char *appname, server_config *server, int argc, c
 				server->dev = optarg;
 				break;
 
+			case 0x4:
+				server->upgrade = 1;
+				break;
+
 			case 0xa:
 				show_help_server(appname);
 				break;
@@ -202,6 +233,11 @@ static bool client_argv_parser(char *appname, client_config *client, int argc, c
 	client->config_file = NULL;
 	client->mtu = 1500;
 	client->dev = default_dev_name;
+	client->iface_backend = NULL;
+	client->encryption = TEAVPN_ENCRYPTION_ON;
+	client->tls = 0;
+	client->io_uring = 0;
+	client->tls_ca_file = NULL;
 
 	while (true) {
 
@@ -297,6 +333,7 @@ static void show_help_server(char *appname)
 	printf("\t--address, -h\t\tSet bind address (default 0.0.0.0).\n");
 	printf("\t--port, -p\t\tSet bind port (default 55555).\n");
 	printf("\t--threads, -t\t\tSet threads amount (default 8).\n");
+	printf("\t--upgrade\t\tTake over a running server through upgrade_socket.\n");
 	fflush(stdout);
 }
 
@@ -28,18 +28,89 @@
 
 #include <teavpn/teavpn.h>
 #include <teavpn/helpers.h>
+#include <teavpn/iface.h>
+#include <teavpn/pktbuf.h>
+#include <teavpn/tls.h>
+#include <teavpn/netlink.h>
 #include <teavpn/teavpn_server.h>
 #include <teavpn/teavpn_config_parser.h>
+#include <teavpn/framer.h>
+#include <teavpn/uring.h>
 
 extern char **_argv;
 extern uint8_t verbose_level;
 
 static int tap_fd;
+static struct teavpn_iface iface;
+static struct teavpn_nl nl = {.fd = -1};
+static volatile sig_atomic_t client_stop = 0;
 static int net_fd;
+static struct teavpn_kex kex = {.pkey = NULL};
+static struct teavpn_crypto crypto;
+static struct teavpn_pktbuf tx_pb, rx_pb;
+static uint8_t tx_room[TEAVPN_PB_SIZE] __attribute__((aligned(64)));
+static uint8_t rx_room[TEAVPN_PB_SIZE] __attribute__((aligned(64)));
 
 static void print_err_sig(uint8_t sig);
-static bool teavpn_tcp_client_init(char *config_buffer, client_config *config);
+static bool teavpn_tcp_client_init(char *config_buffer, size_t config_buffer_size, client_config *config);
 static bool teavpn_tcp_client_init_iface(client_config *config, struct teavpn_client_ip *ip);
+static void teavpn_tcp_client_signal_init();
+static bool teavpn_tcp_client_init_crypto(client_config *config, struct teavpn_client_ip *conf, ssize_t len);
+
+#ifdef TEAVPN_HAVE_URING
+#include <sys/uio.h>
+
+enum uring_req {
+	URING_TUN_READ = 1,
+	URING_TUN_WRITE = 2,
+	URING_RECV = 3
+};
+
+#define URING_ENTRIES 64
+#define URING_FILE_TUN 0
+#define URING_FILE_NET 1
+
+#define URING_BGID_RX 0
+#define URING_BGID_TUN 1
+
+#define URING_RX_BUFS 16
+#define URING_RX_BUF_SIZE 16384
+
+/**
+ * Frames from the server wait for their TUN write in the rx
+ * slots, TUN frames are read and sealed in the tx slots.
+ */
+#define URING_SLOTS 16
+
+static struct teavpn_uring ring;
+static struct teavpn_uring_bufs ring_rx = {.br = NULL}, ring_tun = {.br = NULL};
+static uint8_t uring_rx_room[URING_RX_BUFS * URING_RX_BUF_SIZE] __attribute__((aligned(64)));
+static uint8_t uring_slot_room[2 * URING_SLOTS][TEAVPN_PB_SIZE] __attribute__((aligned(64)));
+static struct teavpn_pktbuf uring_rx_pb[URING_SLOTS], uring_tx_pb[URING_SLOTS];
+static bool uring_rx_busy[URING_SLOTS];
+static struct teavpn_framer uring_fr;
+static bool uring_recv_armed = false, uring_tun_armed = false;
+static struct iovec uring_iov[URING_SLOTS];
+static uint16_t uring_tx[URING_SLOTS];
+static uint16_t uring_nr_tx = 0;
+static uint64_t *uring_seq;
+
+static bool teavpn_tcp_client_uring_init();
+static void teavpn_tcp_client_uring_loop(uint64_t *seq);
+static void uring_arm();
+static bool uring_reap();
+static void uring_tun_frame(uint16_t k, int32_t res);
+static bool uring_tx_flush();
+static teavpn_packet *uring_frame_alloc(void *arg, uint16_t len, intptr_t *ctx);
+static void uring_frame(void *arg, teavpn_packet *pkt, uint16_t len, intptr_t ctx);
+static void uring_frame_drop(void *arg, intptr_t ctx);
+
+static const struct teavpn_framer_ops uring_framer_ops = {
+	.alloc = uring_frame_alloc,
+	.frame = uring_frame,
+	.drop = uring_frame_drop
+};
+#endif
 
 /**
  * Main point of TeaVPN TCP Client.
@@ -49,7 +120,7 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 	fd_set rd_set;
 	uint64_t seq = 0;
 	int fd_ret, max_fd;
-	teavpn_packet packet;
+	teavpn_packet packet, *frame;
 	register ssize_t nwrite, nread;
 
 	/**
@@ -68,7 +139,7 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 	#define server_addr ((struct sockaddr_in *)&(packet.data.data))
 
 
-	if (teavpn_tcp_client_init(config_buffer, config)) {
+	if (teavpn_tcp_client_init(config_buffer, sizeof(config_buffer), config)) {
 		return 1;
 	}
 
@@ -94,6 +165,24 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 	}
 
 
+	/**
+	 * Over TLS the credentials never leave in the clear.
+	 */
+	if (config->tls) {
+		struct teavpn_tls tls;
+		bool ok;
+
+		if (!teavpn_tls_init(&tls, false, NULL, NULL, config->tls_ca_file)) {
+			goto close;
+		}
+		ok = teavpn_tls_handshake(&tls, net_fd, config->server_ip);
+		teavpn_tls_destroy(&tls);
+		if (!ok) {
+			goto close;
+		}
+	}
+
+
 	/**
 	 * Prepare auth packet.
 	 */
@@ -104,6 +193,17 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 	strcpy(packet.data.auth.username, config->username);
 	strcpy(packet.data.auth.password, config->password);
 
+	/**
+	 * Offer the ciphers we can run fast, with a fresh
+	 * key exchange key for this session.
+	 */
+	packet.data.auth.ciphers = TEAVPN_CIPHER_NONE;
+	memset(packet.data.auth.kex_pub, 0, sizeof(packet.data.auth.kex_pub));
+	if ((config->encryption != TEAVPN_ENCRYPTION_OFF) && (!config->tls) && teavpn_kex_init(&kex)) {
+		packet.data.auth.ciphers = teavpn_crypto_offer();
+		memcpy(packet.data.auth.kex_pub, kex.pub, sizeof(kex.pub));
+	}
+
 	/**
 	 * Debug only.
 	 */
@@ -219,6 +319,10 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 		goto close;
 	}
 
+	if (!teavpn_tcp_client_init_crypto(config, &(packet.data.conf), nread)) {
+		goto close;
+	}
+
 	/**
 	 * Debug only.
 	 */
@@ -231,20 +335,43 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 
 	/**
 	 * Apply network interface configuration to TUN/TAP interface.
+	 *
+	 * User space backends have no kernel device to configure.
 	 */
-	if (!teavpn_tcp_client_init_iface(config, &(packet.data.conf))) {
+	if (iface.ops->kernel && (!teavpn_tcp_client_init_iface(config, &(packet.data.conf)))) {
 		debug_log(0, "Cannot init TUN/TAP interface\n");
 		goto close;
 	}
 
 
 
+	/**
+	 * From here on SIGINT and SIGTERM leave through the
+	 * close path, which removes the installed routes.
+	 */
+	teavpn_tcp_client_signal_init();
+
+
+
 	/**
 	 * Calculate maximum value between tap_fd and net_fd.
 	 */
 	max_fd = (tap_fd > net_fd) ? tap_fd : net_fd;
 
-	packet.info.type = TEAVPN_PACKET_DATA;
+	teavpn_pb_init(&tx_pb, tx_room, sizeof(tx_room));
+	teavpn_pb_init(&rx_pb, rx_room, sizeof(rx_room));
+
+	if (config->io_uring) {
+#ifdef TEAVPN_HAVE_URING
+		if (teavpn_tcp_client_uring_init()) {
+			teavpn_tcp_client_uring_loop(&seq);
+			goto close;
+		}
+		debug_log(0, "io_uring is not available, using select(2)");
+#else
+		debug_log(0, "io_uring is set, but this build has no io_uring (linux/io_uring.h)");
+#endif
+	}
 
 	/**
 	 * TeaVPN client event loop.
@@ -277,6 +404,10 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 		 */
 		if ((fd_ret < 0) && (errno == EINTR)) {
 			debug_log(2, "select(2) got interrupt signal");
+			if (client_stop) {
+				debug_log(0, "Shutting down...");
+				goto close;
+			}
 			continue;
 		}
 
@@ -297,7 +428,8 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 			/**
 			 * Read from TUN/TAP.
 			 */
-			nread = read(tap_fd, &(packet.data.data), TEAVPN_TAP_READ_SIZE);
+			teavpn_pb_reset(&tx_pb, TEAVPN_PB_HEADROOM);
+			nread = read(tap_fd, teavpn_pb_tail(&tx_pb), TEAVPN_TAP_READ_SIZE);
 			debug_log(4, "Read from tap_fd %ld bytes", nread);
 			if (nread < 0) {
 				debug_log(0, "Error read from tap_fd");
@@ -305,12 +437,26 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 				goto next_1;
 			}
 
+			/**
+			 * Header in front, sealed in place.
+			 */
+			teavpn_pb_put(&tx_pb, nread);
+			frame = teavpn_pb_push(&tx_pb, TEAVPN_PACK(0));
+			frame->info.type = TEAVPN_PACKET_DATA;
+			frame->info.seq = ++seq;
+			frame->info.len = tx_pb.len;
+			if (crypto.st.cipher != TEAVPN_CIPHER_NONE) {
+				if (teavpn_crypto_seal(&crypto, frame, frame, ++(crypto.st.tx_seq)) == 0) {
+					debug_log(0, "Cannot encrypt a frame of %ld bytes", nread);
+					goto next_1;
+				}
+				teavpn_pb_put(&tx_pb, TEAVPN_AEAD_TAG_SIZE);
+			}
+
 			/**
 			 * Write to server fd.
 			 */
-			packet.info.seq = ++seq;
-			packet.info.len = TEAVPN_PACK(nread);
-			nwrite = write(net_fd, &packet, TEAVPN_PACK(nread));
+			nwrite = write(net_fd, teavpn_pb_data(&tx_pb), tx_pb.len);
 			debug_log(3, "[%ld] Write data to server %ld bytes", seq, nwrite);
 			if (nwrite == 0) {
 				debug_log(0, "Connection reset by peer");
@@ -333,7 +479,9 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 			 * Read from server fd.
 			 */
 			seq++;
-			nread = read(net_fd, &packet, sizeof(packet));
+			teavpn_pb_reset(&rx_pb, TEAVPN_PB_HEADROOM - TEAVPN_PACK(0));
+			frame = teavpn_pb_data(&rx_pb);
+			nread = read(net_fd, frame, sizeof(teavpn_packet));
 
 			if (nread == 0) {
 				debug_log(0, "Connection reset by peer");
@@ -345,16 +493,16 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 				goto next_2;
 			}
 
-			if (packet.info.type == TEAVPN_PACKET_DATA) {
+			if (frame->info.type == TEAVPN_PACKET_DATA) {
 
-				while (nread < (packet.info.len)) {
+				while (nread < (frame->info.len)) {
 					register ssize_t tmp_nread;
 
-					debug_log(3, "Read extra %ld/%ld bytes", nread, packet.info.len);
+					debug_log(3, "Read extra %ld/%d bytes", nread, frame->info.len);
 					tmp_nread = read(
 						net_fd,
-						&(((char *)&packet)[nread]),
-						packet.info.len - nread
+						&(((char *)frame)[nread]),
+						frame->info.len - nread
 					);
 
 					if (tmp_nread < 0) {
@@ -366,12 +514,19 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 				}
 
 				debug_log(3, "[%ld] Read data from server %ld bytes (client_seq: %ld) (server_seq: %ld) (seq %s)",
-					seq, nread, seq, packet.info.seq, (seq == packet.info.seq) ? "match" : "invalid");
+					seq, nread, seq, frame->info.seq, (seq == frame->info.seq) ? "match" : "invalid");
+
+				if ((crypto.st.cipher != TEAVPN_CIPHER_NONE) && ((nread = teavpn_crypto_open(&crypto, frame)) < 0)) {
+					debug_log(1, "Dropped a forged or replayed frame from the server");
+					goto next_2;
+				}
 
 				/**
-				 * Write to TUN/TAP.
+				 * Header and tag off, write to TUN/TAP.
 				 */
-				nwrite = write(tap_fd, &(packet.data.data), nread - OFFSETOF(teavpn_packet, data));
+				rx_pb.len = nread;
+				teavpn_pb_pull(&rx_pb, TEAVPN_PACK(0));
+				nwrite = write(tap_fd, teavpn_pb_data(&rx_pb), rx_pb.len);
 				debug_log(4, "Write to tap_fd %ld bytes", nwrite);
 				if (nread < 0) {
 					debug_log(0, "Error read from tap_fd");
@@ -386,7 +541,11 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_client(client_config
 	}
 
 close:
-	close(tap_fd);
+	teavpn_kex_destroy(&kex);
+	teavpn_crypto_free(&crypto);
+	teavpn_nl_cleanup(&nl);
+	teavpn_nl_close(&nl);
+	teavpn_iface_close(&iface);
 	close(net_fd);
 
 	return 1;
@@ -398,10 +557,10 @@ close:
 /**
  * Initialize TeaVPN client (socket, auth, etc.)
  */
-static bool teavpn_tcp_client_init(char *config_buffer, client_config *config)
+static bool teavpn_tcp_client_init(char *config_buffer, size_t config_buffer_size, client_config *config)
 {
 	if (config->config_file != NULL) {
-		if (!teavpn_client_config_parser(config_buffer, config)) {
+		if (!teavpn_client_config_parser(config_buffer, config_buffer_size, config)) {
 			debug_log(0, "Config error!");
 			return 1;
 		}
@@ -434,12 +593,17 @@ static bool teavpn_tcp_client_init(char *config_buffer, client_config *config)
 
 	verbose_level = config->verbose_level;
 
+	if (!teavpn_crypto_alloc(&crypto)) {
+		debug_log(0, "Cannot allocate the cipher contexts");
+		return 1;
+	}
+
 
 	/**
 	 * Create TUN/TAP interface.
 	 */
 	debug_log(2, "Allocating TUN/TAP interface...");
-	if ((tap_fd = tun_alloc(config->dev, IFF_TUN)) < 0) {
+	if ((tap_fd = teavpn_iface_open(&iface, config->iface_backend, config->dev)) < 0) {
 		debug_log(0, "Error connecting to TUN/TAP interface %s!", config->dev);
 		return 1;
 	}
@@ -451,7 +615,7 @@ static bool teavpn_tcp_client_init(char *config_buffer, client_config *config)
 	 */
 	debug_log(1, "Creating TCP socket...");
 	if ((net_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		close(tap_fd);
+		teavpn_iface_close(&iface);
 		perror("Socket creation failed");
 		return 1;
 	}
@@ -462,6 +626,56 @@ static bool teavpn_tcp_client_init(char *config_buffer, client_config *config)
 }
 
 
+/**
+ * Set up the data channel from the server conf packet. Older
+ * servers send a shorter one, without cipher (plaintext).
+ *
+ * @param client_config				*config
+ * @param struct teavpn_client_ip	*conf
+ * @param ssize_t					len		Bytes read for the conf packet.
+ * @return bool
+ */
+static bool teavpn_tcp_client_init_crypto(client_config *config, struct teavpn_client_ip *conf, ssize_t len)
+{
+	bool ret = true;
+	uint8_t cipher = TEAVPN_CIPHER_NONE;
+	struct teavpn_crypto_state st;
+
+	if ((kex.pkey != NULL) && (len >= TEAVPN_PACK(sizeof(*conf)))) {
+		cipher = conf->cipher;
+	}
+
+	if (cipher == TEAVPN_CIPHER_NONE) {
+		if (config->tls) {
+			debug_log(0, "Data channel is encrypted by TLS");
+		} else if (config->encryption == TEAVPN_ENCRYPTION_REQUIRED) {
+			debug_log(0, "The server does not encrypt the data channel (encryption = required)");
+			ret = false;
+		} else {
+			debug_log(0, "Data channel is not encrypted");
+		}
+		goto out;
+	}
+
+	if ((!(cipher & teavpn_crypto_offer())) ||
+		(!teavpn_crypto_derive(&st, cipher, &kex, conf->kex_pub, config->password, false))) {
+		debug_log(0, "Cannot set up the data channel cipher (%s)", teavpn_cipher_name(cipher));
+		ret = false;
+		goto out;
+	}
+
+	ret = teavpn_crypto_set(&crypto, &st);
+	explicit_bzero(&st, sizeof(st));
+	if (ret) {
+		debug_log(0, "Data channel uses %s", teavpn_cipher_name(cipher));
+	}
+
+	out:
+	teavpn_kex_destroy(&kex);
+	return ret;
+}
+
+
 /**
  * Print signal error message.
  */
@@ -496,115 +710,505 @@ static void print_err_sig(uint8_t sig)
  */
 static bool teavpn_tcp_client_init_iface(client_config *config, struct teavpn_client_ip *ip)
 {
-	bool ret;
-	char cmd[100],
-		data[100],
-		*escaped_dev,
-		*escaped_inet4,
-		*escaped_inet4_broadcast,
-		*p, *q;
-	FILE *fp = NULL;
-
-	escaped_dev = escapeshellarg(config->dev);
-	escaped_inet4 = escapeshellarg(ip->inet4);
-	escaped_inet4_broadcast = escapeshellarg(ip->inet4_broadcast);
+	int ifindex;
+	struct in_addr via;
+	struct teavpn_nl_route route;
+
+	ifindex = teavpn_nl_ifindex(config->dev);
+	if (ifindex == 0) {
+		debug_log(0, "Cannot find interface %s", config->dev);
+		return false;
+	}
+
+	if (!teavpn_nl_open(&nl)) {
+		return false;
+	}
 
 	/**
-	 * Set interface up.
+	 * Get server route data, before our routes take over.
 	 */
-	sprintf(
-		cmd,
-		"/sbin/ip link set dev %s up mtu %d",
-		escaped_dev,
-		config->mtu
-	);
-	debug_log(1, "Executing: %s\n", cmd);
-	if (system(cmd)) {
-		ret = false;
-		goto ret;
+	memset(&route, 0, sizeof(route));
+	route.dst = inet_addr(config->server_ip);
+	route.prefix = 32;
+	if (!teavpn_nl_route_get(&nl, route.dst, &(route.gateway), &(route.ifindex))) {
+		debug_log(0, "Cannot get server route via");
+		return false;
 	}
 
+	debug_log(0, "Setting up %s: mtu %d, address %s broadcast %s", config->dev, config->mtu,
+		ip->inet4, ip->inet4_broadcast);
 
 	/**
-	 * Assign private IP.
+	 * Link up, private IP and routes go in one batch.
 	 */
-	sprintf(
-		cmd,
-		"/sbin/ip addr add dev %s %s broadcast %s",
-		escaped_dev,
-		escaped_inet4,
-		escaped_inet4_broadcast
-	);
-	debug_log(0, "Executing: %s", cmd);
-	if (system(cmd)) {
-		ret = false;
-		goto ret;
+	if ((!teavpn_nl_link_up(&nl, ifindex, config->mtu)) ||
+		(!teavpn_nl_addr_add(&nl, ifindex, ip->inet4, ip->inet4_broadcast))) {
+		return false;
 	}
 
 	/**
-	 * Get server route data.
+	 * Keep the server reachable through the old path.
 	 */
-	sprintf(cmd, "/sbin/ip route get %s", config->server_ip);
-	debug_log(0, "Executing: %s", cmd);
-	fp = popen(cmd, "r");
-	q = fgets(data, 99, fp);
-	pclose(fp);
+	teavpn_nl_route_add(&nl, &route, true);
 
-	if (q == NULL) {
-		debug_log(0, "Cannot get server route via");
+	/**
+	 * 0.0.0.0/1 and 128.0.0.0/1 override the default
+	 * route without replacing it.
+	 */
+	inet_aton("5.5.0.1", &via);
+	route.gateway = via.s_addr;
+	route.ifindex = ifindex;
+	route.prefix = 1;
+	route.dst = inet_addr("0.0.0.0");
+	teavpn_nl_route_add(&nl, &route, true);
+	route.dst = inet_addr("128.0.0.0");
+	teavpn_nl_route_add(&nl, &route, true);
+
+	return teavpn_nl_commit(&nl);
+}
 
-		// Commented for debug only.
-		ret = false;
-		goto ret;
+
+/**
+ * @param int sig
+ * @return void
+ */
+static void teavpn_tcp_client_signal_handler(int sig)
+{
+	(void)sig;
+	client_stop = 1;
+}
+
+
+/**
+ * No SA_RESTART, select(2) must return EINTR.
+ *
+ * @return void
+ */
+static void teavpn_tcp_client_signal_init()
+{
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = teavpn_tcp_client_signal_handler;
+	sigemptyset(&(act.sa_mask));
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+}
+
+
+
+#ifdef TEAVPN_HAVE_URING
+/**
+ * Set up the io_uring event loop (io_uring = 1).
+ *
+ * @return bool	false to stay on select(2).
+ */
+static bool teavpn_tcp_client_uring_init()
+{
+	if (!teavpn_uring_init(&ring, URING_ENTRIES, URING_FILE_NET + 1)) {
+		return false;
+	}
+
+	/**
+	 * Not fatal, the requests then pin the pages themselves.
+	 */
+	teavpn_uring_register_bufs(&ring, uring_slot_room, sizeof(uring_slot_room));
+
+	if ((!teavpn_uring_bufs_init(&ring, &ring_rx, URING_BGID_RX, URING_RX_BUFS)) ||
+		(ring.read_multishot && (!teavpn_uring_bufs_init(&ring, &ring_tun, URING_BGID_TUN, URING_SLOTS))) ||
+		(!teavpn_uring_file_set(&ring, URING_FILE_TUN, tap_fd)) ||
+		(!teavpn_uring_file_set(&ring, URING_FILE_NET, net_fd))) {
+		teavpn_uring_bufs_destroy(&ring, &ring_rx);
+		teavpn_uring_bufs_destroy(&ring, &ring_tun);
+		teavpn_uring_destroy(&ring);
+		return false;
+	}
+
+	for (register uint16_t k = 0; k < URING_RX_BUFS; k++) {
+		teavpn_uring_bufs_add(&ring_rx, &(uring_rx_room[k * URING_RX_BUF_SIZE]), URING_RX_BUF_SIZE, k);
 	}
+	teavpn_uring_bufs_commit(&ring_rx);
 
-	p = strstr(data, "via");
-	if (p == NULL) {
-		p = strstr(data, "src");
-		if (p == NULL) {
-			debug_log(0, "Cannot get server route via");
+	for (register uint16_t k = 0; k < URING_SLOTS; k++) {
+		teavpn_pb_init(&(uring_rx_pb[k]), uring_slot_room[k], TEAVPN_PB_SIZE);
+		teavpn_pb_init(&(uring_tx_pb[k]), uring_slot_room[URING_SLOTS + k], TEAVPN_PB_SIZE);
+		uring_rx_busy[k] = false;
 
-			// Commented for debug only.
-			ret = false;
-			goto ret;
+		/**
+		 * With a multishot read every tx slot waits in the
+		 * kernel, it comes back once its frame is sent.
+		 */
+		if (ring.read_multishot) {
+			teavpn_pb_reset(&(uring_tx_pb[k]), TEAVPN_PB_HEADROOM);
+			teavpn_uring_bufs_add(&ring_tun, teavpn_pb_tail(&(uring_tx_pb[k])), TEAVPN_TAP_READ_SIZE, k);
+		}
+	}
+	teavpn_uring_bufs_commit(&ring_tun);
+
+	teavpn_framer_init(&uring_fr);
+
+	debug_log(0, "io_uring event loop (%s TUN read, %s buffers)", ring.read_multishot ? "multishot" : "single",
+		ring.fixed_bufs ? "registered" : "plain");
+	return true;
+}
+
+
+/**
+ * The io_uring event loop, does the work of the select(2) loop.
+ *
+ * Frames from the server are cut out of the multishot receive
+ * and written to TUN/TAP by queued requests. The TUN frames of
+ * a pass are sealed where they were read and go to the server
+ * with one writev(2), in the order they were read.
+ *
+ * @param uint64_t *seq
+ * @return void	When the client stops or the connection is gone.
+ */
+static void teavpn_tcp_client_uring_loop(uint64_t *seq)
+{
+	int ret;
+
+	uring_seq = seq;
+
+	while (true) {
+		uring_arm();
+
+		ret = teavpn_uring_enter(&ring, 1, 0);
+
+		if ((ret < 0) && (errno == EINTR)) {
+			debug_log(2, "io_uring_enter(2) got interrupt signal");
+			if (client_stop) {
+				debug_log(0, "Shutting down...");
+				break;
+			}
+		} else if ((ret < 0) && (errno != EBUSY)) {
+			debug_log(0, "io_uring_enter(2) got an error");
+			perror("io_uring_enter()");
 		}
+
+		if ((!uring_reap()) || (!uring_tx_flush())) {
+			break;
+		}
+	}
+
+	teavpn_uring_bufs_destroy(&ring, &ring_rx);
+	teavpn_uring_bufs_destroy(&ring, &ring_tun);
+	teavpn_uring_destroy(&ring);
+}
+
+
+/**
+ * Queue the requests which are not in flight.
+ *
+ * @return void
+ */
+static void uring_arm()
+{
+	int16_t k = 0;
+	struct io_uring_sqe *sqe;
+
+	if ((!uring_recv_armed) && ((sqe = teavpn_uring_sqe(&ring)) != NULL)) {
+		teavpn_uring_prep(sqe, IORING_OP_RECV, URING_FILE_NET, NULL, 0, TEAVPN_URING_UD(URING_RECV, 0, 0));
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->buf_group = URING_BGID_RX;
+		uring_recv_armed = true;
 	}
 
-	while ((*p) != ' ') p++;
-	p++;
-	q = p;
-	while ((*q) != ' ') q++;
-	*q = '\0';
+	if (uring_tun_armed || ((sqe = teavpn_uring_sqe(&ring)) == NULL)) {
+		return;
+	}
 
-	// Commented for debug only.
-	sprintf(cmd, "/sbin/ip route add %s/32 via %s", config->server_ip, p);
-	debug_log(1, "Executing: %s", cmd);
-	if (system(cmd)) {
-		debug_log(3, "Exit code is not zero");
+	if (ring.read_multishot) {
+		teavpn_uring_prep(sqe, TEAVPN_URING_OP_READ_MULTISHOT, URING_FILE_TUN, NULL, 0,
+			TEAVPN_URING_UD(URING_TUN_READ, 0, 0));
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID_TUN;
+	} else {
+		// One read at a time, it is sent before the next one.
+		teavpn_pb_reset(&(uring_tx_pb[k]), TEAVPN_PB_HEADROOM);
+		teavpn_uring_prep(sqe, ring.fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ, URING_FILE_TUN,
+			teavpn_pb_tail(&(uring_tx_pb[k])), TEAVPN_TAP_READ_SIZE, TEAVPN_URING_UD(URING_TUN_READ, 0, k));
+		sqe->flags = IOSQE_FIXED_FILE;
+		sqe->buf_index = 0;
 	}
+	uring_tun_armed = true;
+}
+
+
+/**
+ * Handle the completions.
+ *
+ * @return bool	false when the connection is gone.
+ */
+static bool uring_reap()
+{
+	int32_t res;
+	uint32_t flags;
+	uint64_t ud;
+	uint16_t k;
+	uint8_t *buf;
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = teavpn_uring_cqe(&ring)) != NULL) {
+		ud = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		teavpn_uring_cqe_seen(&ring);
+
+		switch (TEAVPN_URING_UD_WHAT(ud)) {
+			case URING_TUN_READ:
+				if (!(flags & IORING_CQE_F_MORE)) {
+					uring_tun_armed = false;
+				}
 
-	sprintf(cmd, "/sbin/ip route add 0.0.0.0/1 via %s", "5.5.0.1");
-	debug_log(0, "Executing: %s", cmd);
+				if (flags & IORING_CQE_F_BUFFER) {
+					k = flags >> IORING_CQE_BUFFER_SHIFT;
+				} else if (!ring.read_multishot) {
+					k = TEAVPN_URING_UD_TAG(ud);
+				} else {
+					k = URING_SLOTS;
+				}
+
+				if ((res > 0) && (k < URING_SLOTS)) {
+					uring_tun_frame(k, res);
+				} else if (res == -ENOBUFS) {
+					ring_tun.empty++;
+				} else if ((res < 0) && (res != -EAGAIN)) {
+					debug_log(0, "Error read from tap_fd: %s", strerror(-res));
+				}
+				break;
 
-	if (system(cmd)) {
-		debug_log(3, "Exit code is not zero");
-		// ret = false;
-		// goto ret;
+			case URING_TUN_WRITE:
+				debug_log(4, "Write to tap_fd %d bytes", res);
+				if ((res < 0) && (res != -EAGAIN)) {
+					debug_log(0, "Error write to tap_fd: %s", strerror(-res));
+				}
+				uring_frame_drop(NULL, TEAVPN_URING_UD_TAG(ud));
+				break;
+
+			case URING_RECV:
+				if (!(flags & IORING_CQE_F_MORE)) {
+					uring_recv_armed = false;
+				}
+
+				if (flags & IORING_CQE_F_BUFFER) {
+					k = flags >> IORING_CQE_BUFFER_SHIFT;
+					buf = &(uring_rx_room[k * URING_RX_BUF_SIZE]);
+
+					if ((res > 0) && (!teavpn_framer_feed(&uring_fr, buf, res, &uring_framer_ops, NULL))) {
+						debug_log(0, "The server sent a frame of impossible length");
+						return false;
+					}
+
+					teavpn_uring_bufs_add(&ring_rx, buf, URING_RX_BUF_SIZE, k);
+					teavpn_uring_bufs_commit(&ring_rx);
+				} else if (res == 0) {
+					debug_log(0, "Connection reset by peer");
+					return false;
+				} else if (res == -ENOBUFS) {
+					// Armed again by the next pass.
+					ring_rx.empty++;
+				} else if (res < 0) {
+					debug_log(0, "Error read from net_fd: %s", strerror(-res));
+				}
+				break;
+		}
 	}
 
-	sprintf(cmd, "/sbin/ip route add 128.0.0.0/1 via %s", "5.5.0.1");
-	debug_log(0, "Executing: %s", cmd);
+	return true;
+}
+
 
-	if (system(cmd)) {
-		debug_log(3, "Exit code is not zero");
-		// ret = false;
-		// goto ret;
+/**
+ * A TUN frame has been read into tx slot k: header in front,
+ * sealed in place and queued for the next writev(2).
+ *
+ * @param uint16_t	k
+ * @param int32_t	res	Bytes read.
+ * @return void
+ */
+static void uring_tun_frame(uint16_t k, int32_t res)
+{
+	teavpn_packet *frame;
+	struct teavpn_pktbuf *pb = &(uring_tx_pb[k]);
+
+	debug_log(4, "Read from tap_fd %d bytes", res);
+
+	teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM);
+	teavpn_pb_put(pb, res);
+	frame = teavpn_pb_push(pb, TEAVPN_PACK(0));
+	frame->info.type = TEAVPN_PACKET_DATA;
+	frame->info.seq = ++(*uring_seq);
+	frame->info.len = pb->len;
+	if (crypto.st.cipher != TEAVPN_CIPHER_NONE) {
+		if (teavpn_crypto_seal(&crypto, frame, frame, ++(crypto.st.tx_seq)) == 0) {
+			debug_log(0, "Cannot encrypt a frame of %d bytes", res);
+			pb->len = 0;
+		} else {
+			teavpn_pb_put(pb, TEAVPN_AEAD_TAG_SIZE);
+		}
 	}
 
-	ret = true;
-ret:
-	free(escaped_dev);
-	free(escaped_inet4);
-	free(escaped_inet4_broadcast);
-	return ret;
+	uring_iov[uring_nr_tx].iov_base = teavpn_pb_data(pb);
+	uring_iov[uring_nr_tx].iov_len = pb->len;
+	uring_tx[uring_nr_tx++] = k;
+}
+
+
+/**
+ * Send the frames sealed in this pass, then the tx slots go
+ * back to the kernel.
+ *
+ * @return bool	false when the connection is gone.
+ */
+static bool uring_tx_flush()
+{
+	ssize_t nwrite;
+	uint16_t first = 0;
+	struct teavpn_pktbuf *pb;
+
+	if (uring_nr_tx == 0) {
+		return true;
+	}
+
+	/**
+	 * A blocking socket only writes less when a signal comes,
+	 * the rest of the frames follow.
+	 */
+	while (first < uring_nr_tx) {
+		nwrite = writev(net_fd, &(uring_iov[first]), uring_nr_tx - first);
+		debug_log(3, "[%ld] Write data to server %ld bytes", *uring_seq, nwrite);
+		if (nwrite == 0) {
+			debug_log(0, "Connection reset by peer");
+			return false;
+		}
+		if (nwrite < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			debug_log(0, "Error write to net_fd");
+			perror("Error write to net_fd");
+			break;
+		}
+
+		while ((first < uring_nr_tx) && (((size_t)nwrite) >= uring_iov[first].iov_len)) {
+			nwrite -= uring_iov[first].iov_len;
+			first++;
+		}
+		if (first < uring_nr_tx) {
+			uring_iov[first].iov_base = (uint8_t *)uring_iov[first].iov_base + nwrite;
+			uring_iov[first].iov_len -= nwrite;
+		}
+	}
+
+	if (ring.read_multishot) {
+		for (register uint16_t j = 0; j < uring_nr_tx; j++) {
+			pb = &(uring_tx_pb[uring_tx[j]]);
+			teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM);
+			teavpn_uring_bufs_add(&ring_tun, teavpn_pb_tail(pb), TEAVPN_TAP_READ_SIZE, uring_tx[j]);
+		}
+		teavpn_uring_bufs_commit(&ring_tun);
+	}
+
+	uring_nr_tx = 0;
+	return true;
+}
+
+
+/**
+ * Rx slot of a frame from the server.
+ *
+ * @param void		*arg
+ * @param uint16_t	len
+ * @param intptr_t	*ctx	Rx slot.
+ * @return teavpn_packet *	NULL drops the frame.
+ */
+static teavpn_packet *uring_frame_alloc(void *arg, uint16_t len, intptr_t *ctx)
+{
+	struct teavpn_pktbuf *pb;
+
+	(void)arg;
+
+	for (register uint16_t k = 0; k < URING_SLOTS; k++) {
+		if (!uring_rx_busy[k]) {
+			// Held until the TUN write completes.
+			uring_rx_busy[k] = true;
+			pb = &(uring_rx_pb[k]);
+			teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM - TEAVPN_PACK(0));
+			*ctx = k;
+			return (teavpn_packet *)teavpn_pb_data(pb);
+		}
+	}
+
+	/**
+	 * Every slot waits for TUN/TAP, drop it like a full
+	 * tun txqueue would.
+	 */
+	debug_log(3, "No rx slot for a frame of %d bytes, dropped", len);
+	return NULL;
+}
+
+
+/**
+ * A whole frame from the server is in its rx slot.
+ *
+ * @param void			*arg
+ * @param teavpn_packet	*frame
+ * @param uint16_t		len
+ * @param intptr_t		ctx	Rx slot.
+ * @return void
+ */
+static void uring_frame(void *arg, teavpn_packet *frame, uint16_t len, intptr_t ctx)
+{
+	ssize_t nread = len;
+	struct io_uring_sqe *sqe;
+	struct teavpn_pktbuf *pb = &(uring_rx_pb[ctx]);
+
+	(void)arg;
+
+	(*uring_seq)++;
+	if (frame->info.type != TEAVPN_PACKET_DATA) {
+		goto release;
+	}
+
+	debug_log(3, "[%ld] Read data from server %ld bytes (client_seq: %ld) (server_seq: %ld) (seq %s)",
+		*uring_seq, nread, *uring_seq, frame->info.seq, (*uring_seq == frame->info.seq) ? "match" : "invalid");
+
+	if ((crypto.st.cipher != TEAVPN_CIPHER_NONE) && ((nread = teavpn_crypto_open(&crypto, frame)) < 0)) {
+		debug_log(1, "Dropped a forged or replayed frame from the server");
+		goto release;
+	}
+
+	/**
+	 * Header and tag off, write to TUN/TAP.
+	 */
+	pb->len = nread;
+	teavpn_pb_pull(pb, TEAVPN_PACK(0));
+
+	if ((sqe = teavpn_uring_sqe(&ring)) == NULL) {
+		goto release;
+	}
+
+	teavpn_uring_prep(sqe, ring.fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, URING_FILE_TUN,
+		teavpn_pb_data(pb), pb->len, TEAVPN_URING_UD(URING_TUN_WRITE, 0, ctx));
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->buf_index = 0;
+	return;
+
+	release:
+	uring_frame_drop(NULL, ctx);
+}
+
+
+/**
+ * @param void		*arg
+ * @param intptr_t	ctx	Of uring_frame_alloc().
+ * @return void
+ */
+static void uring_frame_drop(void *arg, intptr_t ctx)
+{
+	(void)arg;
+	uring_rx_busy[ctx] = false;
 }
+#endif
@@ -0,0 +1,581 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include <teavpn/teavpn.h>
+#include <teavpn/crypto.h>
+
+#ifdef TEAVPN_HAVE_CRYPTO
+#include <openssl/evp.h>
+#include <openssl/kdf.h>
+#include <openssl/crypto.h>
+#endif
+
+extern uint8_t verbose_level;
+
+#define AEAD_NONCE_SIZE 12
+#define AEAD_AAD_SIZE 14
+
+#ifdef TEAVPN_HAVE_CRYPTO
+static bool cpu_has_aes();
+static bool cpu_has_vaes();
+#endif
+
+/**
+ * @param const char *value	"off", "on" or "required" (config value).
+ * @return uint8_t
+ */
+uint8_t teavpn_encryption_mode(const char *value)
+{
+	if ((!strcmp(value, "off")) || (!strcmp(value, "0"))) {
+		return TEAVPN_ENCRYPTION_OFF;
+	}
+
+	if (!strcmp(value, "required")) {
+		return TEAVPN_ENCRYPTION_REQUIRED;
+	}
+
+	return TEAVPN_ENCRYPTION_ON;
+}
+
+/**
+ * @param uint8_t cipher
+ * @return const char *
+ */
+const char *teavpn_cipher_name(uint8_t cipher)
+{
+	switch (cipher) {
+		case TEAVPN_CIPHER_CHACHA20_POLY1305:
+			return "chacha20-poly1305";
+		case TEAVPN_CIPHER_AES_256_GCM:
+			return "aes-256-gcm";
+		default:
+			return "none";
+	}
+}
+
+/**
+ * Ciphers this build can run at full speed on this CPU.
+ *
+ * @return uint8_t	enum teavpn_cipher mask.
+ */
+uint8_t teavpn_crypto_offer()
+{
+#ifdef TEAVPN_HAVE_CRYPTO
+	uint8_t offer = TEAVPN_CIPHER_CHACHA20_POLY1305;
+
+	if (cpu_has_aes()) {
+		offer |= TEAVPN_CIPHER_AES_256_GCM;
+	}
+
+	return offer;
+#else
+	return TEAVPN_CIPHER_NONE;
+#endif
+}
+
+/**
+ * AES-GCM only if both ends have AES instructions.
+ *
+ * @param uint8_t offer
+ * @param uint8_t peer_offer
+ * @return uint8_t
+ */
+uint8_t teavpn_crypto_pick(uint8_t offer, uint8_t peer_offer)
+{
+	uint8_t common = offer & peer_offer;
+
+	if (common & TEAVPN_CIPHER_AES_256_GCM) {
+		return TEAVPN_CIPHER_AES_256_GCM;
+	}
+
+	if (common & TEAVPN_CIPHER_CHACHA20_POLY1305) {
+		return TEAVPN_CIPHER_CHACHA20_POLY1305;
+	}
+
+	return TEAVPN_CIPHER_NONE;
+}
+
+/**
+ * @param FILE						*fp
+ * @param uint16_t					conn
+ * @param const struct teavpn_crypto	*c
+ * @return void
+ */
+void teavpn_crypto_dump(FILE *fp, uint16_t conn, const struct teavpn_crypto *c)
+{
+	fprintf(fp, "[crypto] conn=%d cipher=%s tx_seq=%lu rx_seq=%lu rx_fail=%lu\n",
+		conn, teavpn_cipher_name(c->st.cipher), c->st.tx_seq, c->st.rx_seq, c->rx_fail);
+}
+
+#ifdef TEAVPN_HAVE_CRYPTO
+
+static void aead_nonce(uint8_t *nonce, const uint8_t *prefix, uint64_t seq);
+static void aead_aad(uint8_t *aad, const struct packet_info *info);
+
+/**
+ * Log what the data channel runs on.
+ *
+ * @return void
+ */
+void teavpn_crypto_log_cpu()
+{
+	debug_log(1, "Data channel ciphers: %s%s (AES instructions: %s%s)",
+		(teavpn_crypto_offer() & TEAVPN_CIPHER_AES_256_GCM) ? "aes-256-gcm, " : "",
+		"chacha20-poly1305",
+		cpu_has_aes() ? "yes" : "no",
+		cpu_has_vaes() ? ", vaes" : "");
+}
+
+/**
+ * Generate an ephemeral X25519 key pair.
+ *
+ * @param struct teavpn_kex *kex
+ * @return bool
+ */
+bool teavpn_kex_init(struct teavpn_kex *kex)
+{
+	size_t len = TEAVPN_KEX_SIZE;
+	EVP_PKEY_CTX *pctx;
+	EVP_PKEY *pkey = NULL;
+
+	kex->pkey = NULL;
+
+	pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_X25519, NULL);
+	if (pctx == NULL) {
+		return false;
+	}
+
+	if ((EVP_PKEY_keygen_init(pctx) <= 0) || (EVP_PKEY_keygen(pctx, &pkey) <= 0) ||
+		(EVP_PKEY_get_raw_public_key(pkey, kex->pub, &len) <= 0)) {
+		debug_log(0, "Cannot generate the key exchange key pair");
+		EVP_PKEY_free(pkey);
+		EVP_PKEY_CTX_free(pctx);
+		return false;
+	}
+
+	EVP_PKEY_CTX_free(pctx);
+	kex->pkey = pkey;
+	return true;
+}
+
+/**
+ * @param struct teavpn_kex *kex
+ * @return void
+ */
+void teavpn_kex_destroy(struct teavpn_kex *kex)
+{
+	EVP_PKEY_free((EVP_PKEY *)kex->pkey);
+	kex->pkey = NULL;
+}
+
+/**
+ * Derive the session keys of one side.
+ *
+ * OKM = HKDF-SHA256(salt = password, IKM = X25519(kex, peer_pub),
+ *   info = "teavpn data" | cipher | client pub | server pub)
+ * split into c2s key, s2c key, c2s prefix, s2c prefix.
+ *
+ * @param struct teavpn_crypto_state	*st
+ * @param uint8_t					cipher
+ * @param struct teavpn_kex			*kex		Our key pair.
+ * @param const uint8_t				*peer_pub
+ * @param const char				*password
+ * @param bool						server
+ * @return bool
+ */
+bool teavpn_crypto_derive(struct teavpn_crypto_state *st, uint8_t cipher, struct teavpn_kex *kex,
+	const uint8_t *peer_pub, const char *password, bool server)
+{
+	bool ret = false;
+	size_t len;
+	EVP_PKEY *peer;
+	EVP_PKEY_CTX *dctx = NULL, *hctx = NULL;
+	uint8_t shared[TEAVPN_KEX_SIZE], info[sizeof("teavpn data") + (2 * TEAVPN_KEX_SIZE)];
+	uint8_t okm[(2 * TEAVPN_AEAD_KEY_SIZE) + (2 * TEAVPN_AEAD_PREFIX_SIZE)], *c2s_key, *s2c_key;
+
+	peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_pub, TEAVPN_KEX_SIZE);
+	if (peer == NULL) {
+		goto out;
+	}
+
+	/**
+	 * OpenSSL refuses an all-zero result (low order peer point).
+	 */
+	len = sizeof(shared);
+	dctx = EVP_PKEY_CTX_new((EVP_PKEY *)kex->pkey, NULL);
+	if ((dctx == NULL) || (EVP_PKEY_derive_init(dctx) <= 0) ||
+		(EVP_PKEY_derive_set_peer(dctx, peer) <= 0) ||
+		(EVP_PKEY_derive(dctx, shared, &len) <= 0)) {
+		goto out;
+	}
+
+	memcpy(info, "teavpn data", sizeof("teavpn data") - 1);
+	info[sizeof("teavpn data") - 1] = cipher;
+	memcpy(&(info[sizeof("teavpn data")]), server ? peer_pub : kex->pub, TEAVPN_KEX_SIZE);
+	memcpy(&(info[sizeof("teavpn data") + TEAVPN_KEX_SIZE]), server ? kex->pub : peer_pub, TEAVPN_KEX_SIZE);
+
+	len = sizeof(okm);
+	hctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+	if ((hctx == NULL) || (EVP_PKEY_derive_init(hctx) <= 0) ||
+		(EVP_PKEY_CTX_set_hkdf_md(hctx, EVP_sha256()) <= 0) ||
+		(EVP_PKEY_CTX_set1_hkdf_salt(hctx, (const unsigned char *)password, (int)strlen(password)) <= 0) ||
+		(EVP_PKEY_CTX_set1_hkdf_key(hctx, shared, sizeof(shared)) <= 0) ||
+		(EVP_PKEY_CTX_add1_hkdf_info(hctx, info, sizeof(info)) <= 0) ||
+		(EVP_PKEY_derive(hctx, okm, &len) <= 0)) {
+		goto out;
+	}
+
+	c2s_key = okm;
+	s2c_key = &(okm[TEAVPN_AEAD_KEY_SIZE]);
+
+	memset(st, 0, sizeof(*st));
+	st->cipher = cipher;
+	memcpy(st->tx_key, server ? s2c_key : c2s_key, TEAVPN_AEAD_KEY_SIZE);
+	memcpy(st->rx_key, server ? c2s_key : s2c_key, TEAVPN_AEAD_KEY_SIZE);
+	memcpy(st->tx_prefix, &(okm[(2 * TEAVPN_AEAD_KEY_SIZE) + (server ? TEAVPN_AEAD_PREFIX_SIZE : 0)]),
+		TEAVPN_AEAD_PREFIX_SIZE);
+	memcpy(st->rx_prefix, &(okm[(2 * TEAVPN_AEAD_KEY_SIZE) + (server ? 0 : TEAVPN_AEAD_PREFIX_SIZE)]),
+		TEAVPN_AEAD_PREFIX_SIZE);
+	ret = true;
+
+	out:
+	if (!ret) {
+		debug_log(0, "Cannot derive the data channel keys");
+	}
+	OPENSSL_cleanse(shared, sizeof(shared));
+	OPENSSL_cleanse(okm, sizeof(okm));
+	EVP_PKEY_CTX_free(hctx);
+	EVP_PKEY_CTX_free(dctx);
+	EVP_PKEY_free(peer);
+	return ret;
+}
+
+/**
+ * @param struct teavpn_crypto *c
+ * @return bool
+ */
+bool teavpn_crypto_alloc(struct teavpn_crypto *c)
+{
+	bool ok;
+
+	memset(c, 0, sizeof(*c));
+	c->rx_ctx = EVP_CIPHER_CTX_new();
+	ok = (c->rx_ctx != NULL);
+	for (register uint8_t l = 0; l < TEAVPN_CRYPTO_TX_LANES; l++) {
+		c->tx_ctx[l] = EVP_CIPHER_CTX_new();
+		ok = ok && (c->tx_ctx[l] != NULL);
+	}
+
+	if (!ok) {
+		teavpn_crypto_free(c);
+	}
+
+	return ok;
+}
+
+/**
+ * @param struct teavpn_crypto *c
+ * @return void
+ */
+void teavpn_crypto_free(struct teavpn_crypto *c)
+{
+	for (register uint8_t l = 0; l < TEAVPN_CRYPTO_TX_LANES; l++) {
+		EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *)c->tx_ctx[l]);
+		c->tx_ctx[l] = NULL;
+	}
+	EVP_CIPHER_CTX_free((EVP_CIPHER_CTX *)c->rx_ctx);
+	c->rx_ctx = NULL;
+	OPENSSL_cleanse(&(c->st), sizeof(c->st));
+}
+
+/**
+ * Load the keys of st, this runs the key schedule once
+ * for the whole session.
+ *
+ * @param struct teavpn_crypto				*c
+ * @param const struct teavpn_crypto_state	*st
+ * @return bool
+ */
+bool teavpn_crypto_set(struct teavpn_crypto *c, const struct teavpn_crypto_state *st)
+{
+	const EVP_CIPHER *cipher;
+
+	if (st->cipher == TEAVPN_CIPHER_AES_256_GCM) {
+		cipher = EVP_aes_256_gcm();
+	} else if (st->cipher == TEAVPN_CIPHER_CHACHA20_POLY1305) {
+		cipher = EVP_chacha20_poly1305();
+	} else {
+		return false;
+	}
+
+	for (register uint8_t l = 0; l < TEAVPN_CRYPTO_TX_LANES; l++) {
+		if (EVP_EncryptInit_ex((EVP_CIPHER_CTX *)c->tx_ctx[l], cipher, NULL, st->tx_key, NULL) <= 0) {
+			goto err;
+		}
+	}
+
+	if (EVP_DecryptInit_ex((EVP_CIPHER_CTX *)c->rx_ctx, cipher, NULL, st->rx_key, NULL) <= 0) {
+		goto err;
+	}
+
+	memcpy(&(c->st), st, sizeof(*st));
+	c->rx_fail = 0;
+	return true;
+
+	err:
+	debug_log(0, "Cannot load the %s keys", teavpn_cipher_name(st->cipher));
+	teavpn_crypto_clear(c);
+	return false;
+}
+
+/**
+ * Back to plaintext, wipes the keys.
+ *
+ * @param struct teavpn_crypto *c
+ * @return void
+ */
+void teavpn_crypto_clear(struct teavpn_crypto *c)
+{
+	for (register uint8_t l = 0; l < TEAVPN_CRYPTO_TX_LANES; l++) {
+		if (c->tx_ctx[l] != NULL) {
+			EVP_CIPHER_CTX_reset((EVP_CIPHER_CTX *)c->tx_ctx[l]);
+		}
+	}
+	if (c->rx_ctx != NULL) {
+		EVP_CIPHER_CTX_reset((EVP_CIPHER_CTX *)c->rx_ctx);
+	}
+	OPENSSL_cleanse(&(c->st), sizeof(c->st));
+	c->st.cipher = TEAVPN_CIPHER_NONE;
+	c->rx_fail = 0;
+}
+
+/**
+ * Encrypt the DATA frame src into dst (may be the same buffer) as
+ * frame seq. Every seq must be used once per session, frames have
+ * to reach the peer in seq order. Thread safe, see the tx lanes.
+ *
+ * @param struct teavpn_crypto	*c
+ * @param teavpn_packet			*dst
+ * @param const teavpn_packet	*src
+ * @param uint64_t				seq
+ * @return uint16_t	Frame length, 0 on error.
+ */
+uint16_t teavpn_crypto_seal(struct teavpn_crypto *c, teavpn_packet *dst, const teavpn_packet *src, uint64_t seq)
+{
+	int outl, finl;
+	bool ok;
+	register uint8_t l = 0;
+	uint8_t nonce[AEAD_NONCE_SIZE], aad[AEAD_AAD_SIZE];
+	uint16_t plen = src->info.len - TEAVPN_PACK(0);
+	EVP_CIPHER_CTX *ctx;
+
+	if ((src->info.len < TEAVPN_PACK(0)) || (plen > (TEAVPN_PACKET_BUFFER - TEAVPN_AEAD_TAG_SIZE))) {
+		return 0;
+	}
+
+	dst->info.type = src->info.type;
+	dst->info.len = TEAVPN_PACK(plen + TEAVPN_AEAD_TAG_SIZE);
+	dst->info.seq = seq;
+
+	aead_nonce(nonce, c->st.tx_prefix, seq);
+	aead_aad(aad, &(dst->info));
+
+	/**
+	 * Take a free tx lane, there are fewer sealers of one
+	 * session than lanes nearly always.
+	 */
+	while (__atomic_exchange_n(&(c->tx_busy[l]), 1, __ATOMIC_ACQUIRE)) {
+		l = (l + 1) % TEAVPN_CRYPTO_TX_LANES;
+		if (l == 0) {
+			sched_yield();
+		}
+	}
+	ctx = (EVP_CIPHER_CTX *)c->tx_ctx[l];
+
+	ok = (EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, nonce) > 0) &&
+		(EVP_EncryptUpdate(ctx, NULL, &outl, aad, sizeof(aad)) > 0) &&
+		(EVP_EncryptUpdate(ctx, (uint8_t *)dst->data.data, &outl, (const uint8_t *)src->data.data, plen) > 0) &&
+		(EVP_EncryptFinal_ex(ctx, (uint8_t *)&(dst->data.data[outl]), &finl) > 0) &&
+		(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TEAVPN_AEAD_TAG_SIZE, &(dst->data.data[plen])) > 0);
+
+	__atomic_store_n(&(c->tx_busy[l]), 0, __ATOMIC_RELEASE);
+	return ok ? dst->info.len : 0;
+}
+
+/**
+ * Authenticate and decrypt a complete DATA frame in place.
+ *
+ * @param struct teavpn_crypto	*c
+ * @param teavpn_packet			*pkt
+ * @return ssize_t	Plaintext frame length, -1 if the frame is
+ *					forged, corrupt or replayed.
+ */
+ssize_t teavpn_crypto_open(struct teavpn_crypto *c, teavpn_packet *pkt)
+{
+	int outl, finl;
+	uint16_t clen;
+	uint8_t nonce[AEAD_NONCE_SIZE], aad[AEAD_AAD_SIZE];
+	EVP_CIPHER_CTX *ctx = (EVP_CIPHER_CTX *)c->rx_ctx;
+
+	if ((pkt->info.len < TEAVPN_PACK(TEAVPN_AEAD_TAG_SIZE)) || (pkt->info.seq <= c->st.rx_seq)) {
+		goto fail;
+	}
+
+	clen = pkt->info.len - TEAVPN_PACK(TEAVPN_AEAD_TAG_SIZE);
+
+	aead_nonce(nonce, c->st.rx_prefix, pkt->info.seq);
+	aead_aad(aad, &(pkt->info));
+
+	if ((EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, nonce) <= 0) ||
+		(EVP_DecryptUpdate(ctx, NULL, &outl, aad, sizeof(aad)) <= 0) ||
+		(EVP_DecryptUpdate(ctx, (uint8_t *)pkt->data.data, &outl, (const uint8_t *)pkt->data.data, clen) <= 0) ||
+		(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TEAVPN_AEAD_TAG_SIZE, &(pkt->data.data[clen])) <= 0) ||
+		(EVP_DecryptFinal_ex(ctx, (uint8_t *)&(pkt->data.data[outl]), &finl) <= 0)) {
+		goto fail;
+	}
+
+	c->st.rx_seq = pkt->info.seq;
+	pkt->info.len = TEAVPN_PACK(clen);
+	return pkt->info.len;
+
+	fail:
+	c->rx_fail++;
+	return -1;
+}
+
+/**
+ * prefix (4 bytes) | seq (8 bytes, big endian).
+ *
+ * @param uint8_t		*nonce
+ * @param const uint8_t	*prefix
+ * @param uint64_t		seq
+ * @return void
+ */
+static void aead_nonce(uint8_t *nonce, const uint8_t *prefix, uint64_t seq)
+{
+	memcpy(nonce, prefix, TEAVPN_AEAD_PREFIX_SIZE);
+	for (register int i = AEAD_NONCE_SIZE - 1; i >= TEAVPN_AEAD_PREFIX_SIZE; i--) {
+		nonce[i] = (uint8_t)seq;
+		seq >>= 8;
+	}
+}
+
+/**
+ * The frame header without its struct padding.
+ *
+ * @param uint8_t					*aad
+ * @param const struct packet_info	*info
+ * @return void
+ */
+static void aead_aad(uint8_t *aad, const struct packet_info *info)
+{
+	uint32_t type = (uint32_t)info->type;
+
+	memcpy(aad, &type, sizeof(type));
+	memcpy(&(aad[4]), &(info->len), sizeof(info->len));
+	memcpy(&(aad[6]), &(info->seq), sizeof(info->seq));
+}
+
+#else
+
+void teavpn_crypto_log_cpu()
+{
+	debug_log(1, "Data channel encryption is not compiled in (libcrypto not found)");
+}
+
+bool teavpn_kex_init(struct teavpn_kex *kex)
+{
+	kex->pkey = NULL;
+	return false;
+}
+
+void teavpn_kex_destroy(struct teavpn_kex *kex)
+{
+	kex->pkey = NULL;
+}
+
+bool teavpn_crypto_derive(struct teavpn_crypto_state *st, uint8_t cipher, struct teavpn_kex *kex,
+	const uint8_t *peer_pub, const char *password, bool server)
+{
+	return false;
+}
+
+bool teavpn_crypto_alloc(struct teavpn_crypto *c)
+{
+	memset(c, 0, sizeof(*c));
+	return true;
+}
+
+void teavpn_crypto_free(struct teavpn_crypto *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+bool teavpn_crypto_set(struct teavpn_crypto *c, const struct teavpn_crypto_state *st)
+{
+	return false;
+}
+
+void teavpn_crypto_clear(struct teavpn_crypto *c)
+{
+	memset(&(c->st), 0, sizeof(c->st));
+	c->rx_fail = 0;
+}
+
+uint16_t teavpn_crypto_seal(struct teavpn_crypto *c, teavpn_packet *dst, const teavpn_packet *src, uint64_t seq)
+{
+	return 0;
+}
+
+ssize_t teavpn_crypto_open(struct teavpn_crypto *c, teavpn_packet *pkt)
+{
+	c->rx_fail++;
+	return -1;
+}
+
+#endif
+
+#ifdef TEAVPN_HAVE_CRYPTO
+/**
+ * @return bool
+ */
+static bool cpu_has_aes()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul");
+#elif defined(__aarch64__) && defined(HWCAP_AES) && defined(HWCAP_PMULL)
+	return (getauxval(AT_HWCAP) & (HWCAP_AES | HWCAP_PMULL)) == (HWCAP_AES | HWCAP_PMULL);
+#else
+	return false;
+#endif
+}
+
+/**
+ * 256/512 bit wide AES-GCM (OpenSSL picks it on its own).
+ *
+ * @return bool
+ */
+static bool cpu_has_vaes()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("vaes") && __builtin_cpu_supports("vpclmulqdq");
+#else
+	return false;
+#endif
+}
+#endif
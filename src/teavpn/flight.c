@@ -0,0 +1,398 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include <teavpn/tsc.h>
+#include <teavpn/flight.h>
+#include <teavpn/teavpn.h>
+
+extern uint8_t verbose_level;
+
+__thread struct teavpn_fr_ring *teavpn_fr_tls = NULL;
+
+static char dump_path[256];
+static uint32_t fr_nr_rings = 0;
+static bool fr_dumping = false;
+static struct teavpn_fr_ring *fr_rings[TEAVPN_FR_MAX_THREADS];
+static bool fr_ring_used[TEAVPN_FR_MAX_THREADS];
+static pthread_key_t fr_ring_key;
+static pthread_once_t fr_ring_key_once = PTHREAD_ONCE_INIT;
+static __thread bool fr_no_ring = false;
+
+static volatile uint64_t *wd_busy_since;
+static uint32_t wd_timeout;
+static bool wd_started = false;
+
+static const int fatal_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+
+
+/**
+ * Async-signal-safe unsigned to decimal string.
+ *
+ * @param char		*out
+ * @param uint64_t	v
+ * @return size_t	length written (without NUL).
+ */
+static size_t fr_utoa(char *out, uint64_t v)
+{
+	char tmp[24];
+	size_t len = 0, i = 0;
+
+	do {
+		tmp[len++] = '0' + (v % 10);
+		v /= 10;
+	} while (v > 0);
+
+	while (len > 0) {
+		out[i++] = tmp[--len];
+	}
+	out[i] = '\0';
+
+	return i;
+}
+
+
+/**
+ * Give the ring of an exiting thread back (pthread key
+ * destructor). Its events stay for the dumps until
+ * another thread takes it, so keep its name too.
+ *
+ * @param void *arg	struct teavpn_fr_ring *
+ * @return void
+ */
+static void fr_ring_release(void *arg)
+{
+	struct teavpn_fr_ring *ring = (struct teavpn_fr_ring *)arg;
+	uint32_t nr = __atomic_load_n(&fr_nr_rings, __ATOMIC_ACQUIRE);
+
+	prctl(PR_GET_NAME, ring->hdr.name, 0, 0, 0);
+	teavpn_fr_tls = NULL;
+
+	for (register uint32_t i = 0; (i < nr) && (i < TEAVPN_FR_MAX_THREADS); i++) {
+		if (__atomic_load_n(&(fr_rings[i]), __ATOMIC_ACQUIRE) == ring) {
+			__atomic_store_n(&(fr_ring_used[i]), false, __ATOMIC_RELEASE);
+			break;
+		}
+	}
+}
+
+
+/**
+ * @return void
+ */
+static void fr_ring_key_init()
+{
+	pthread_key_create(&fr_ring_key, fr_ring_release);
+}
+
+
+/**
+ * Ring of the calling thread, the one of an exited thread
+ * if there is one, else a new one.
+ *
+ * @return struct teavpn_fr_ring *	NULL if there is none left.
+ */
+struct teavpn_fr_ring *teavpn_fr_register()
+{
+	uint32_t idx, nr;
+	bool expected;
+	struct teavpn_fr_ring *ring = NULL;
+
+	if (fr_no_ring) {
+		return NULL;
+	}
+
+	pthread_once(&fr_ring_key_once, fr_ring_key_init);
+
+	nr = __atomic_load_n(&fr_nr_rings, __ATOMIC_ACQUIRE);
+	for (idx = 0; (idx < nr) && (idx < TEAVPN_FR_MAX_THREADS); idx++) {
+		expected = false;
+		if ((__atomic_load_n(&(fr_rings[idx]), __ATOMIC_ACQUIRE) != NULL) &&
+			__atomic_compare_exchange_n(&(fr_ring_used[idx]), &expected, true, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			ring = fr_rings[idx];
+			memset(ring, 0, sizeof(*ring));
+			ring->hdr.tid = (uint32_t)syscall(SYS_gettid);
+			goto out;
+		}
+	}
+
+	if (nr >= TEAVPN_FR_MAX_THREADS) {
+		goto full;
+	}
+
+	if (posix_memalign((void **)&ring, 64, sizeof(*ring))) {
+		goto full;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	ring->hdr.tid = (uint32_t)syscall(SYS_gettid);
+
+	idx = __atomic_fetch_add(&fr_nr_rings, 1, __ATOMIC_ACQ_REL);
+	if (idx >= TEAVPN_FR_MAX_THREADS) {
+		free(ring);
+		goto full;
+	}
+
+	__atomic_store_n(&(fr_ring_used[idx]), true, __ATOMIC_RELAXED);
+	__atomic_store_n(&(fr_rings[idx]), ring, __ATOMIC_RELEASE);
+
+	out:
+	pthread_setspecific(fr_ring_key, ring);
+	teavpn_fr_tls = ring;
+	return ring;
+
+	full:
+	/**
+	 * More threads than TEAVPN_FR_MAX_THREADS, this one
+	 * does not record.
+	 */
+	fr_no_ring = true;
+	return NULL;
+}
+
+
+/**
+ * Fill ring name from /proc (async-signal-safe).
+ *
+ * @param struct teavpn_fr_ring *ring
+ * @return void
+ */
+static void fr_ring_name(struct teavpn_fr_ring *ring)
+{
+	int fd;
+	ssize_t n;
+	size_t len;
+	char path[64] = "/proc/self/task/";
+
+	len = strlen(path);
+	len += fr_utoa(&(path[len]), ring->hdr.tid);
+	memcpy(&(path[len]), "/comm", sizeof("/comm"));
+
+	memset(ring->hdr.name, 0, sizeof(ring->hdr.name));
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+
+	n = read(fd, ring->hdr.name, sizeof(ring->hdr.name) - 1);
+	if ((n > 0) && (ring->hdr.name[n - 1] == '\n')) {
+		ring->hdr.name[n - 1] = '\0';
+	}
+	close(fd);
+}
+
+
+/**
+ * Write all rings to the dump file.
+ *
+ * Only uses async-signal-safe functions, so it
+ * may be called from a signal handler.
+ *
+ * @param uint16_t	reason
+ * @param int		signo
+ * @return void
+ */
+void teavpn_fr_dump(uint16_t reason, int signo)
+{
+	int fd;
+	ssize_t ret;
+	struct timespec ts;
+	struct teavpn_fr_file_hdr hdr;
+	bool expected = false;
+	const char msg[] = "Flight recorder dumped to ";
+
+	if (dump_path[0] == '\0') {
+		return;
+	}
+
+	if (!__atomic_compare_exchange_n(&fr_dumping, &expected, true, false,
+		__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	fd = open(dump_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		goto out;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = TEAVPN_FR_MAGIC;
+	hdr.version = TEAVPN_FR_VERSION;
+	hdr.reason = reason;
+	hdr.signo = signo;
+	hdr.nr_rings = __atomic_load_n(&fr_nr_rings, __ATOMIC_ACQUIRE);
+	if (hdr.nr_rings > TEAVPN_FR_MAX_THREADS) {
+		hdr.nr_rings = TEAVPN_FR_MAX_THREADS;
+	}
+	hdr.ring_size = TEAVPN_FR_RING_SIZE;
+	hdr.pid = (uint32_t)getpid();
+	hdr.tsc_hz = teavpn_tsc_hz();
+	hdr.dump_tsc = teavpn_tsc();
+	hdr.dump_unix_ns = ((int64_t)ts.tv_sec * 1000000000ll) + ts.tv_nsec;
+
+	/**
+	 * A ring may be published a bit later than the counter
+	 * has been incremented, count only the visible ones.
+	 */
+	for (register uint32_t i = 0; i < hdr.nr_rings; i++) {
+		if (__atomic_load_n(&(fr_rings[i]), __ATOMIC_ACQUIRE) == NULL) {
+			hdr.nr_rings = i;
+			break;
+		}
+	}
+
+	ret = write(fd, &hdr, sizeof(hdr));
+	for (register uint32_t i = 0; (ret > 0) && (i < hdr.nr_rings); i++) {
+		// The name of an exited thread was kept by fr_ring_release().
+		if (__atomic_load_n(&(fr_ring_used[i]), __ATOMIC_ACQUIRE)) {
+			fr_ring_name(fr_rings[i]);
+		}
+		ret = write(fd, fr_rings[i], sizeof(*(fr_rings[i])));
+	}
+	close(fd);
+
+	ret = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+	ret = write(STDERR_FILENO, dump_path, strlen(dump_path));
+	ret = write(STDERR_FILENO, "\n", 1);
+	(void)ret;
+
+	out:
+	__atomic_store_n(&fr_dumping, false, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Dump, then let the signal kill us with the default action.
+ *
+ * @param int sig
+ * @return void
+ */
+static void fr_fatal_handler(int sig)
+{
+	teavpn_fr_dump(TEAVPN_FR_DUMP_FATAL, sig);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+
+/**
+ * Set dump file and install fatal signal handlers.
+ *
+ * @param const char *dump_file	NULL for /tmp/teavpn-flight.<pid>.bin
+ * @return void
+ */
+void teavpn_fr_init(const char *dump_file)
+{
+	struct sigaction act;
+
+	if (dump_file != NULL) {
+		snprintf(dump_path, sizeof(dump_path), "%s", dump_file);
+	} else {
+		snprintf(dump_path, sizeof(dump_path), "/tmp/teavpn-flight.%d.bin", getpid());
+	}
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = fr_fatal_handler;
+	act.sa_flags = SA_RESETHAND | SA_NODEFER;
+	sigemptyset(&(act.sa_mask));
+
+	for (register size_t i = 0; i < (sizeof(fatal_signals) / sizeof(fatal_signals[0])); i++) {
+		sigaction(fatal_signals[i], &act, NULL);
+	}
+}
+
+
+/**
+ * Watch the event loop.
+ *
+ * The loop stores teavpn_tsc() to *busy_since when it starts
+ * handling events and 0 when it goes back to sleep. If it
+ * stays busy for longer than wd_timeout the rings are dumped
+ * (once per stall). A timeout of 0 pauses the watchdog.
+ */
+static void *fr_watchdog_thread(void *arg)
+{
+	uint64_t since, stalled;
+	uint32_t timeout;
+	bool fired = false;
+
+	(void)arg;
+	while (true) {
+		sleep(1);
+
+		timeout = __atomic_load_n(&wd_timeout, __ATOMIC_RELAXED);
+		since = __atomic_load_n(wd_busy_since, __ATOMIC_ACQUIRE);
+		if ((since == 0) || (timeout == 0)) {
+			fired = false;
+			continue;
+		}
+
+		stalled = teavpn_tsc_to_ns(teavpn_tsc() - since) / 1000000000ull;
+		if (stalled < timeout) {
+			fired = false;
+			continue;
+		}
+
+		if (!fired) {
+			fired = true;
+			teavpn_fr_record(TEAVPN_FR_WATCHDOG, (uint16_t)stalled, 0, 0);
+			debug_log(0, "Watchdog: event loop has been stalled for %lu seconds", stalled);
+			teavpn_fr_dump(TEAVPN_FR_DUMP_WATCHDOG, 0);
+		}
+	}
+
+	return NULL;
+}
+
+
+/**
+ * @param volatile uint64_t	*busy_since
+ * @param uint32_t			timeout_sec
+ * @return bool
+ */
+bool teavpn_fr_watchdog_start(volatile uint64_t *busy_since, uint32_t timeout_sec)
+{
+	pthread_t thread;
+
+	/**
+	 * Already watching, only the timeout changes (config reload).
+	 */
+	if (wd_started) {
+		__atomic_store_n(&wd_timeout, timeout_sec, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	wd_busy_since = busy_since;
+	wd_timeout = timeout_sec;
+
+	if (pthread_create(&thread, NULL, fr_watchdog_thread, NULL) != 0) {
+		return false;
+	}
+	wd_started = true;
+
+	pthread_setname_np(thread, "teavpn-watchdog");
+	pthread_detach(thread);
+	return true;
+}
@@ -0,0 +1,107 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <string.h>
+
+#include <teavpn/teavpn.h>
+#include <teavpn/framer.h>
+
+/**
+ * @param struct teavpn_framer *fr
+ * @return void
+ */
+void teavpn_framer_init(struct teavpn_framer *fr)
+{
+	memset(fr, 0, sizeof(*fr));
+}
+
+/**
+ * Take len received bytes.
+ *
+ * @param struct teavpn_framer				*fr
+ * @param const uint8_t						*data
+ * @param size_t							len
+ * @param const struct teavpn_framer_ops	*ops
+ * @param void								*arg	Passed to ops.
+ * @return bool	false if a header announces an impossible length,
+ *				the stream cannot be followed any more.
+ */
+bool teavpn_framer_feed(struct teavpn_framer *fr, const uint8_t *data, size_t len,
+	const struct teavpn_framer_ops *ops, void *arg)
+{
+	size_t n;
+
+	while (len > 0) {
+		/**
+		 * Header first, kept aside until the length is known.
+		 */
+		if (fr->len == 0) {
+			n = sizeof(fr->hdr) - fr->hdr_have;
+			if (n > len) {
+				n = len;
+			}
+			memcpy((uint8_t *)&(fr->hdr) + fr->hdr_have, data, n);
+			fr->hdr_have += n;
+			data += n;
+			len -= n;
+
+			if (fr->hdr_have < sizeof(fr->hdr)) {
+				break;
+			}
+
+			if ((fr->hdr.len < TEAVPN_PACK(0)) || (fr->hdr.len > sizeof(teavpn_packet))) {
+				return false;
+			}
+
+			fr->len = fr->hdr.len;
+			fr->have = sizeof(fr->hdr);
+			fr->ctx = 0;
+			fr->dst = ops->alloc(arg, fr->len, &(fr->ctx));
+			if (fr->dst != NULL) {
+				fr->dst->info = fr->hdr;
+			}
+		}
+
+		n = fr->len - fr->have;
+		if (n > len) {
+			n = len;
+		}
+		if (fr->dst != NULL) {
+			memcpy((uint8_t *)fr->dst + fr->have, data, n);
+		}
+		fr->have += n;
+		data += n;
+		len -= n;
+
+		if (fr->have == fr->len) {
+			if (fr->dst != NULL) {
+				ops->frame(arg, fr->dst, fr->len, fr->ctx);
+			}
+			fr->dst = NULL;
+			fr->len = 0;
+			fr->hdr_have = 0;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Forget the frame in progress (connection gone).
+ *
+ * @param struct teavpn_framer				*fr
+ * @param const struct teavpn_framer_ops	*ops
+ * @param void								*arg
+ * @return void
+ */
+void teavpn_framer_reset(struct teavpn_framer *fr, const struct teavpn_framer_ops *ops, void *arg)
+{
+	if (fr->dst != NULL) {
+		ops->drop(arg, fr->ctx);
+	}
+	teavpn_framer_init(fr);
+}
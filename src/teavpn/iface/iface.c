@@ -0,0 +1,109 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <teavpn/iface.h>
+#include <teavpn/teavpn.h>
+
+extern uint8_t verbose_level;
+
+static const struct teavpn_iface_ops *backends[] = {
+	&teavpn_iface_tun_ops,
+	&teavpn_iface_mem_ops,
+	&teavpn_iface_pcap_ops
+};
+
+/**
+ * Open the backend described by spec ("name[:arg]").
+ *
+ * @param struct teavpn_iface	*iface
+ * @param const char			*spec	NULL means "tun".
+ * @param char					*dev	Device name, may be updated by the backend.
+ * @return int	iface->fd or negative value on error.
+ */
+int teavpn_iface_open(struct teavpn_iface *iface, const char *spec, char *dev)
+{
+	size_t name_len;
+	const char *arg;
+
+	if (spec == NULL) {
+		spec = "tun";
+	}
+
+	arg = strchr(spec, ':');
+	name_len = (arg == NULL) ? strlen(spec) : (size_t)(arg - spec);
+	arg = (arg == NULL) ? "" : (arg + 1);
+
+	memset(iface, 0, sizeof(*iface));
+	iface->fd = -1;
+	iface->peer_fd = -1;
+
+	for (register size_t i = 0; i < (sizeof(backends) / sizeof(backends[0])); i++) {
+		if ((strlen(backends[i]->name) == name_len) && (!strncmp(backends[i]->name, spec, name_len))) {
+			iface->ops = backends[i];
+			break;
+		}
+	}
+
+	if (iface->ops == NULL) {
+		debug_log(0, "Unknown iface backend \"%s\"", spec);
+		return -1;
+	}
+
+	if (iface->ops->open(iface, dev, arg) < 0) {
+		return -1;
+	}
+
+	snprintf(iface->dev, sizeof(iface->dev), "%s", dev);
+	debug_log(1, "Opened iface backend \"%s\" (fd %d)", spec, iface->fd);
+	return iface->fd;
+}
+
+/**
+ * Take over an already configured TUN fd (binary upgrade).
+ *
+ * @param struct teavpn_iface	*iface
+ * @param int					fd
+ * @param const char			*dev
+ * @return int	iface->fd
+ */
+int teavpn_iface_adopt(struct teavpn_iface *iface, int fd, const char *dev)
+{
+	memset(iface, 0, sizeof(*iface));
+	iface->fd = fd;
+	iface->peer_fd = -1;
+	iface->ops = &teavpn_iface_tun_ops;
+	snprintf(iface->dev, sizeof(iface->dev), "%s", dev);
+	debug_log(1, "Adopted tun fd %d (%s)", fd, iface->dev);
+	return iface->fd;
+}
+
+/**
+ * @param struct teavpn_iface *iface
+ * @return void
+ */
+void teavpn_iface_close(struct teavpn_iface *iface)
+{
+	if (iface->ops != NULL) {
+		iface->ops->close(iface);
+	}
+}
+
+/**
+ * @param struct teavpn_iface	*iface
+ * @param FILE					*fp
+ * @return void
+ */
+void teavpn_iface_stats(struct teavpn_iface *iface, FILE *fp)
+{
+	if ((iface->ops != NULL) && (iface->ops->stats != NULL)) {
+		iface->ops->stats(iface, fp);
+	}
+}
@@ -0,0 +1,211 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/ip.h>
+
+#include <teavpn/iface.h>
+#include <teavpn/teavpn.h>
+
+extern uint8_t verbose_level;
+
+static void *iface_mem_drain_thread(struct teavpn_iface *iface);
+static void *iface_mem_echo_thread(struct teavpn_iface *iface);
+
+
+/**
+ * Create the packet socketpair, iface->fd is the TeaVPN side
+ * and iface->peer_fd is the "kernel" side.
+ *
+ * @param struct teavpn_iface *iface
+ * @return int
+ */
+int teavpn_iface_socketpair(struct teavpn_iface *iface)
+{
+	int sv[2], bufsize = 4 * 1024 * 1024;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		perror("socketpair()");
+		return -1;
+	}
+
+	for (register int i = 0; i < 2; i++) {
+		setsockopt(sv[i], SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+		setsockopt(sv[i], SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+	}
+
+	iface->fd = sv[0];
+	iface->peer_fd = sv[1];
+	return 0;
+}
+
+
+/**
+ * Start a detached peer thread with all signals blocked.
+ *
+ * @param struct teavpn_iface	*iface
+ * @param void *(*fn)(struct teavpn_iface *)
+ * @param const char			*name
+ * @return bool
+ */
+bool teavpn_iface_peer_thread(struct teavpn_iface *iface, void *(*fn)(struct teavpn_iface *), const char *name)
+{
+	pthread_t thread;
+	sigset_t set, old;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if (pthread_create(&thread, NULL, (void * (*)(void *))fn, (void *)iface) != 0) {
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+		return false;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	pthread_setname_np(thread, name);
+	pthread_detach(thread);
+	return true;
+}
+
+
+/**
+ * Count and drop everything TeaVPN writes to the device.
+ *
+ * Exits when TeaVPN closes its side.
+ */
+static void *iface_mem_drain_thread(struct teavpn_iface *iface)
+{
+	ssize_t nread;
+	char buf[TEAVPN_PACKET_BUFFER];
+
+	while ((nread = recv(iface->peer_fd, buf, sizeof(buf), 0)) > 0) {
+		__atomic_fetch_add(&(iface->to_peer_pkts), 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&(iface->to_peer_bytes), nread, __ATOMIC_RELAXED);
+	}
+
+	close(iface->peer_fd);
+	return NULL;
+}
+
+
+/**
+ * Reflect every IPv4 packet back with source and
+ * destination swapped, as if a host behind the
+ * device had answered. Swapping keeps the IP and
+ * L4 checksums valid.
+ */
+static void *iface_mem_echo_thread(struct teavpn_iface *iface)
+{
+	uint32_t tmp;
+	ssize_t nread;
+	struct iphdr *ip;
+	char buf[TEAVPN_PACKET_BUFFER];
+
+	ip = (struct iphdr *)buf;
+	while ((nread = recv(iface->peer_fd, buf, sizeof(buf), 0)) > 0) {
+		__atomic_fetch_add(&(iface->to_peer_pkts), 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&(iface->to_peer_bytes), nread, __ATOMIC_RELAXED);
+
+		if ((nread < (ssize_t)sizeof(*ip)) || (ip->version != 4)) {
+			continue;
+		}
+
+		tmp = ip->saddr;
+		ip->saddr = ip->daddr;
+		ip->daddr = tmp;
+
+		if (send(iface->peer_fd, buf, nread, MSG_NOSIGNAL) < 0) {
+			break;
+		}
+
+		__atomic_fetch_add(&(iface->from_peer_pkts), 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&(iface->from_peer_bytes), nread, __ATOMIC_RELAXED);
+	}
+
+	close(iface->peer_fd);
+	return NULL;
+}
+
+
+/**
+ * @param struct teavpn_iface	*iface
+ * @param char					*dev
+ * @param const char			*arg	"" or "echo"
+ * @return int
+ */
+static int iface_mem_open(struct teavpn_iface *iface, char *dev, const char *arg)
+{
+	bool echo = !strcmp(arg, "echo");
+
+	(void)dev;
+	if ((arg[0] != '\0') && (!echo)) {
+		debug_log(0, "Unknown mem iface mode \"%s\"", arg);
+		return -1;
+	}
+
+	if (teavpn_iface_socketpair(iface) < 0) {
+		return -1;
+	}
+
+	if (!teavpn_iface_peer_thread(iface, echo ? iface_mem_echo_thread : iface_mem_drain_thread, "teavpn-iface")) {
+		debug_log(0, "Cannot create iface peer thread");
+		close(iface->fd);
+		close(iface->peer_fd);
+		return -1;
+	}
+
+	return iface->fd;
+}
+
+
+/**
+ * Closing our side makes the peer thread see EOF,
+ * it closes the peer fd itself when it exits.
+ *
+ * @param struct teavpn_iface *iface
+ * @return void
+ */
+void teavpn_iface_peer_close(struct teavpn_iface *iface)
+{
+	if (iface->fd >= 0) {
+		shutdown(iface->fd, SHUT_RDWR);
+		close(iface->fd);
+		iface->fd = -1;
+	}
+}
+
+
+/**
+ * @param struct teavpn_iface	*iface
+ * @param FILE					*fp
+ * @return void
+ */
+void teavpn_iface_peer_stats(struct teavpn_iface *iface, FILE *fp)
+{
+	fprintf(fp, "[iface] backend=%s to_peer_pkts=%lu to_peer_bytes=%lu from_peer_pkts=%lu from_peer_bytes=%lu\n",
+		iface->ops->name,
+		__atomic_load_n(&(iface->to_peer_pkts), __ATOMIC_RELAXED),
+		__atomic_load_n(&(iface->to_peer_bytes), __ATOMIC_RELAXED),
+		__atomic_load_n(&(iface->from_peer_pkts), __ATOMIC_RELAXED),
+		__atomic_load_n(&(iface->from_peer_bytes), __ATOMIC_RELAXED)
+	);
+}
+
+const struct teavpn_iface_ops teavpn_iface_mem_ops = {
+	.name = "mem",
+	.kernel = false,
+	.open = iface_mem_open,
+	.close = teavpn_iface_peer_close,
+	.stats = teavpn_iface_peer_stats
+};
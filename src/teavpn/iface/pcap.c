@@ -0,0 +1,414 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <poll.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+
+#include <teavpn/iface.h>
+#include <teavpn/teavpn.h>
+
+extern uint8_t verbose_level;
+
+#define PCAP_MAGIC_US 0xa1b2c3d4u
+#define PCAP_MAGIC_NS 0xa1b23c4du
+
+/**
+ * Link types we can strip down to the IP header.
+ */
+#define LINKTYPE_NULL 0
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+#define LINKTYPE_IPV6 229
+
+struct pcap_file_hdr {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_rec_hdr {
+	uint32_t ts_sec;
+	uint32_t ts_frac;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct pcap_pkt {
+	uint32_t off;
+	uint16_t len;
+};
+
+struct iface_pcap {
+	char *data;
+	struct pcap_pkt *pkts;
+	uint32_t nr_pkts;
+	uint32_t pps;			// 0 = as fast as possible.
+	uint32_t loop;
+};
+
+static void *iface_pcap_thread(struct teavpn_iface *iface);
+
+
+/**
+ * @param uint32_t	v
+ * @param bool		swap
+ * @return uint32_t
+ */
+static inline uint32_t pcap_u32(uint32_t v, bool swap)
+{
+	return swap ? __builtin_bswap32(v) : v;
+}
+
+
+/**
+ * Size of the link layer header in front of the IP header,
+ * -1 if the frame does not carry IP.
+ *
+ * @param uint32_t		linktype
+ * @param const uint8_t	*frame
+ * @param uint32_t		len
+ * @return int
+ */
+static int pcap_l2_len(uint32_t linktype, const uint8_t *frame, uint32_t len)
+{
+	uint16_t proto;
+
+	switch (linktype) {
+		case LINKTYPE_RAW:
+		case LINKTYPE_IPV4:
+		case LINKTYPE_IPV6:
+			return 0;
+		case LINKTYPE_NULL:
+			return (len > 4) ? 4 : -1;
+		case LINKTYPE_ETHERNET:
+			if (len <= 14) return -1;
+			proto = (frame[12] << 8) | frame[13];
+			return ((proto == 0x0800) || (proto == 0x86dd)) ? 14 : -1;
+		case LINKTYPE_LINUX_SLL:
+			if (len <= 16) return -1;
+			proto = (frame[14] << 8) | frame[15];
+			return ((proto == 0x0800) || (proto == 0x86dd)) ? 16 : -1;
+		default:
+			return -1;
+	}
+}
+
+
+/**
+ * Load every IP packet of the file into memory, the replay
+ * must not be bound by disk reads.
+ *
+ * @param struct iface_pcap	*pc
+ * @param const char		*file
+ * @return bool
+ */
+static bool iface_pcap_load(struct iface_pcap *pc, const char *file)
+{
+	FILE *h;
+	bool swap;
+	long size;
+	int l2_len;
+	uint8_t *frame;
+	uint32_t off = 0, alloc = 0;
+	struct pcap_rec_hdr rec;
+	struct pcap_file_hdr hdr;
+
+	h = fopen(file, "rb");
+	if (h == NULL) {
+		debug_log(0, "Cannot open pcap file %s", file);
+		perror("fopen()");
+		return false;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, h) != 1) {
+		goto invalid;
+	}
+
+	if ((hdr.magic == PCAP_MAGIC_US) || (hdr.magic == PCAP_MAGIC_NS)) {
+		swap = false;
+	} else if ((hdr.magic == __builtin_bswap32(PCAP_MAGIC_US)) || (hdr.magic == __builtin_bswap32(PCAP_MAGIC_NS))) {
+		swap = true;
+	} else {
+		goto invalid;
+	}
+	hdr.linktype = pcap_u32(hdr.linktype, swap) & 0xffff;
+
+	fseek(h, 0, SEEK_END);
+	size = ftell(h);
+	fseek(h, sizeof(hdr), SEEK_SET);
+
+	pc->data = malloc(size);
+	frame = malloc(65536);
+	if ((pc->data == NULL) || (frame == NULL)) {
+		free(frame);
+		goto nomem;
+	}
+
+	while (fread(&rec, sizeof(rec), 1, h) == 1) {
+		rec.incl_len = pcap_u32(rec.incl_len, swap);
+		if ((rec.incl_len > 65536) || (fread(frame, 1, rec.incl_len, h) != rec.incl_len)) {
+			break;
+		}
+
+		l2_len = pcap_l2_len(hdr.linktype, frame, rec.incl_len);
+		if ((l2_len < 0) || ((rec.incl_len - l2_len) > TEAVPN_TAP_READ_SIZE)) {
+			continue;
+		}
+
+		if (pc->nr_pkts == alloc) {
+			struct pcap_pkt *tmp;
+
+			alloc = alloc ? (alloc * 2) : 1024;
+			tmp = realloc(pc->pkts, alloc * sizeof(*tmp));
+			if (tmp == NULL) {
+				free(frame);
+				goto nomem;
+			}
+			pc->pkts = tmp;
+		}
+
+		pc->pkts[pc->nr_pkts].off = off;
+		pc->pkts[pc->nr_pkts].len = (uint16_t)(rec.incl_len - l2_len);
+		memcpy(&(pc->data[off]), &(frame[l2_len]), rec.incl_len - l2_len);
+		off += rec.incl_len - l2_len;
+		pc->nr_pkts++;
+	}
+
+	free(frame);
+	fclose(h);
+
+	if (pc->nr_pkts == 0) {
+		debug_log(0, "pcap file %s does not contain IP packets (linktype %u)", file, hdr.linktype);
+		return false;
+	}
+
+	debug_log(0, "Loaded %u packets from %s", pc->nr_pkts, file);
+	return true;
+
+	invalid:
+	debug_log(0, "%s is not a pcap file", file);
+	fclose(h);
+	return false;
+
+	nomem:
+	debug_log(0, "Cannot allocate memory for %s", file);
+	fclose(h);
+	return false;
+}
+
+
+/**
+ * @param struct iface_pcap *pc
+ * @return void
+ */
+static void iface_pcap_free(struct iface_pcap *pc)
+{
+	free(pc->data);
+	free(pc->pkts);
+	free(pc);
+}
+
+
+/**
+ * @param struct teavpn_iface	*iface
+ * @param char					*dev
+ * @param const char			*arg	"<file>[,pps=N][,loop=N]"
+ * @return int
+ */
+static int iface_pcap_open(struct teavpn_iface *iface, char *dev, const char *arg)
+{
+	char file[256], *opt, *next;
+	struct iface_pcap *pc;
+
+	(void)dev;
+	snprintf(file, sizeof(file), "%s", arg);
+
+	pc = calloc(1, sizeof(*pc));
+	if (pc == NULL) {
+		return -1;
+	}
+	pc->loop = 1;
+
+	/**
+	 * Split options off the file name.
+	 */
+	opt = strchr(file, ',');
+	if (opt != NULL) {
+		*opt++ = '\0';
+	}
+
+	for (; opt != NULL; opt = next) {
+		next = strchr(opt, ',');
+		if (next != NULL) {
+			*next++ = '\0';
+		}
+
+		if (!strncmp(opt, "pps=", 4)) {
+			pc->pps = (uint32_t)strtoul(&(opt[4]), NULL, 10);
+		} else if (!strncmp(opt, "loop=", 5)) {
+			pc->loop = (uint32_t)strtoul(&(opt[5]), NULL, 10);
+		} else {
+			debug_log(0, "Unknown pcap iface option \"%s\"", opt);
+			iface_pcap_free(pc);
+			return -1;
+		}
+	}
+
+	if ((file[0] == '\0') || (!iface_pcap_load(pc, file))) {
+		iface_pcap_free(pc);
+		return -1;
+	}
+
+	if (teavpn_iface_socketpair(iface) < 0) {
+		iface_pcap_free(pc);
+		return -1;
+	}
+
+	iface->priv = pc;
+	if (!teavpn_iface_peer_thread(iface, iface_pcap_thread, "teavpn-pcap")) {
+		debug_log(0, "Cannot create pcap replay thread");
+		close(iface->fd);
+		close(iface->peer_fd);
+		iface_pcap_free(pc);
+		return -1;
+	}
+
+	return iface->fd;
+}
+
+
+/**
+ * @return uint64_t
+ */
+static inline uint64_t pcap_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+
+/**
+ * Replay the packets at the configured rate and drain
+ * whatever TeaVPN writes back. Nothing here blocks on
+ * a full socket buffer, otherwise we could deadlock
+ * with the event loop writing to us.
+ */
+static void *iface_pcap_thread(struct teavpn_iface *iface)
+{
+	ssize_t ret;
+	bool finished = false;
+	struct pollfd pfd;
+	struct timespec ts, *timeout;
+	struct iface_pcap *pc = (struct iface_pcap *)iface->priv;
+	char buf[TEAVPN_PACKET_BUFFER];
+	uint64_t start, sent = 0, due, total;
+
+	total = (uint64_t)pc->nr_pkts * pc->loop;
+	start = pcap_now_ns();
+
+	while (true) {
+
+		/**
+		 * Drain.
+		 */
+		while ((ret = recv(iface->peer_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+			__atomic_fetch_add(&(iface->to_peer_pkts), 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&(iface->to_peer_bytes), ret, __ATOMIC_RELAXED);
+		}
+
+		if ((ret == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+			break;
+		}
+
+		/**
+		 * Replay whatever is due.
+		 */
+		due = (pc->pps == 0) ? total : (((pcap_now_ns() - start) * pc->pps) / 1000000000ull) + 1;
+		if (due > total) {
+			due = total;
+		}
+
+		while (sent < due) {
+			struct pcap_pkt *pkt = &(pc->pkts[sent % pc->nr_pkts]);
+
+			ret = send(iface->peer_fd, &(pc->data[pkt->off]), pkt->len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (ret < 0) {
+				break;
+			}
+
+			__atomic_fetch_add(&(iface->from_peer_pkts), 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&(iface->from_peer_bytes), pkt->len, __ATOMIC_RELAXED);
+			sent++;
+		}
+
+		if ((sent < due) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+			break;
+		}
+
+		/**
+		 * Sleep until something is readable, there is room
+		 * for a due packet or the next packet becomes due.
+		 */
+		pfd.fd = iface->peer_fd;
+		pfd.events = POLLIN;
+		timeout = NULL;
+
+		if (sent < due) {
+			pfd.events |= POLLOUT;
+		} else if (sent < total) {
+			uint64_t next = start + ((sent * 1000000000ull) / pc->pps);
+			uint64_t now = pcap_now_ns();
+
+			next = (next > now) ? (next - now) : 0;
+			ts.tv_sec = next / 1000000000ull;
+			ts.tv_nsec = next % 1000000000ull;
+			timeout = &ts;
+		} else if (!finished) {
+			finished = true;
+			debug_log(1, "pcap replay finished (%lu packets)", sent);
+		}
+
+		if (ppoll(&pfd, 1, timeout, NULL) < 0) {
+			break;
+		}
+
+		if (pfd.revents & (POLLHUP | POLLERR)) {
+			break;
+		}
+	}
+
+	close(iface->peer_fd);
+	iface_pcap_free(pc);
+	return NULL;
+}
+
+
+const struct teavpn_iface_ops teavpn_iface_pcap_ops = {
+	.name = "pcap",
+	.kernel = false,
+	.open = iface_pcap_open,
+	.close = teavpn_iface_peer_close,
+	.stats = teavpn_iface_peer_stats
+};
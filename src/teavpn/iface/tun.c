@@ -0,0 +1,45 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <unistd.h>
+#include <linux/if_tun.h>
+
+#include <teavpn/iface.h>
+#include <teavpn/teavpn.h>
+
+/**
+ * @param struct teavpn_iface	*iface
+ * @param char					*dev
+ * @param const char			*arg
+ * @return int
+ */
+static int iface_tun_open(struct teavpn_iface *iface, char *dev, const char *arg)
+{
+	(void)arg;
+	iface->fd = tun_alloc(dev, IFF_TUN);
+	return iface->fd;
+}
+
+/**
+ * @param struct teavpn_iface *iface
+ * @return void
+ */
+static void iface_tun_close(struct teavpn_iface *iface)
+{
+	if (iface->fd >= 0) {
+		close(iface->fd);
+		iface->fd = -1;
+	}
+}
+
+const struct teavpn_iface_ops teavpn_iface_tun_ops = {
+	.name = "tun",
+	.kernel = true,
+	.open = iface_tun_open,
+	.close = iface_tun_close,
+	.stats = NULL
+};
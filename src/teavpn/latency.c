@@ -0,0 +1,186 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <teavpn/tsc.h>
+#include <teavpn/latency.h>
+
+static struct teavpn_lat_hist hists[TEAVPN_LAT_STAGE_NUM];
+
+static const char *stage_names[TEAVPN_LAT_STAGE_NUM] = {
+	"tun_read_to_enqueue",
+	"queue_wait",
+	"sock_write",
+	"sock_read_to_tun_write"
+};
+
+/**
+ * @param uint64_t v
+ * @return uint16_t
+ */
+static inline uint16_t lat_bucket_index(uint64_t v)
+{
+	register uint8_t e;
+
+	if (v < TEAVPN_LAT_SUB_COUNT) {
+		return (uint16_t)v;
+	}
+
+	e = 63 - __builtin_clzll(v);
+	return TEAVPN_LAT_SUB_COUNT
+		+ ((e - TEAVPN_LAT_SUB_BITS) * TEAVPN_LAT_SUB_COUNT)
+		+ ((v >> (e - TEAVPN_LAT_SUB_BITS)) & (TEAVPN_LAT_SUB_COUNT - 1));
+}
+
+/**
+ * Highest value (in ticks) which falls into bucket i.
+ *
+ * @param uint16_t i
+ * @return uint64_t
+ */
+static uint64_t lat_bucket_upper(uint16_t i)
+{
+	uint8_t e;
+	uint64_t m;
+
+	if (i < TEAVPN_LAT_SUB_COUNT) {
+		return i;
+	}
+
+	i -= TEAVPN_LAT_SUB_COUNT;
+	e = (i / TEAVPN_LAT_SUB_COUNT) + TEAVPN_LAT_SUB_BITS;
+	m = (i % TEAVPN_LAT_SUB_COUNT) | TEAVPN_LAT_SUB_COUNT;
+
+	return ((m + 1) << (e - TEAVPN_LAT_SUB_BITS)) - 1;
+}
+
+/**
+ * Must be called once before the first record.
+ */
+void teavpn_lat_init()
+{
+	teavpn_tsc_calibrate();
+	teavpn_lat_reset();
+}
+
+/**
+ * Record one sample. Safe to call from any thread.
+ *
+ * @param enum teavpn_lat_stage stage
+ * @param uint64_t start_tsc
+ * @param uint64_t end_tsc
+ * @return void
+ */
+void teavpn_lat_record(enum teavpn_lat_stage stage, uint64_t start_tsc, uint64_t end_tsc)
+{
+	uint64_t d, max;
+	struct teavpn_lat_hist *h = &(hists[stage]);
+
+	/**
+	 * TSC of different cores may be slightly skewed.
+	 */
+	d = (end_tsc > start_tsc) ? (end_tsc - start_tsc) : 0;
+
+	__atomic_fetch_add(&(h->buckets[lat_bucket_index(d)]), 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(h->count), 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(h->sum), d, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&(h->max), __ATOMIC_RELAXED);
+	while (d > max) {
+		if (__atomic_compare_exchange_n(&(h->max), &max, d, true,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+}
+
+/**
+ * Reset all histograms.
+ *
+ * Samples recorded concurrently with the reset may
+ * land on either side of it.
+ */
+void teavpn_lat_reset()
+{
+	for (register uint8_t s = 0; s < TEAVPN_LAT_STAGE_NUM; s++) {
+		for (register uint16_t i = 0; i < TEAVPN_LAT_BUCKETS; i++) {
+			__atomic_store_n(&(hists[s].buckets[i]), 0, __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&(hists[s].count), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(hists[s].sum), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(hists[s].max), 0, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Get percentile p (0.0 - 100.0) of a stage in nanoseconds.
+ *
+ * @param enum teavpn_lat_stage stage
+ * @param double p
+ * @return uint64_t
+ */
+uint64_t teavpn_lat_percentile(enum teavpn_lat_stage stage, double p)
+{
+	uint64_t count = 0, target, seen = 0, c;
+	struct teavpn_lat_hist *h = &(hists[stage]);
+
+	for (register uint16_t i = 0; i < TEAVPN_LAT_BUCKETS; i++) {
+		count += __atomic_load_n(&(h->buckets[i]), __ATOMIC_RELAXED);
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+
+	target = (uint64_t)(((double)count * p) / 100.0);
+	if (target == 0) {
+		target = 1;
+	}
+
+	for (register uint16_t i = 0; i < TEAVPN_LAT_BUCKETS; i++) {
+		c = __atomic_load_n(&(h->buckets[i]), __ATOMIC_RELAXED);
+		seen += c;
+		if ((c > 0) && (seen >= target)) {
+			return teavpn_tsc_to_ns(lat_bucket_upper(i));
+		}
+	}
+
+	return teavpn_tsc_to_ns(__atomic_load_n(&(h->max), __ATOMIC_RELAXED));
+}
+
+/**
+ * Print all stages as a table.
+ *
+ * @param FILE *fp
+ * @return void
+ */
+void teavpn_lat_dump(FILE *fp)
+{
+	uint64_t count, sum;
+
+	fprintf(fp, "[latency] tsc_hz=%lu\n", teavpn_tsc_hz());
+	fprintf(fp, "[latency] %-24s %12s %10s %10s %10s %10s %10s\n",
+		"stage", "count", "avg(ns)", "p50(ns)", "p99(ns)", "p99.9(ns)", "max(ns)");
+
+	for (register uint8_t s = 0; s < TEAVPN_LAT_STAGE_NUM; s++) {
+		count = __atomic_load_n(&(hists[s].count), __ATOMIC_RELAXED);
+		sum = __atomic_load_n(&(hists[s].sum), __ATOMIC_RELAXED);
+
+		fprintf(fp, "[latency] %-24s %12lu %10lu %10lu %10lu %10lu %10lu\n",
+			stage_names[s],
+			count,
+			count ? teavpn_tsc_to_ns(sum / count) : 0,
+			teavpn_lat_percentile(s, 50.0),
+			teavpn_lat_percentile(s, 99.0),
+			teavpn_lat_percentile(s, 99.9),
+			teavpn_tsc_to_ns(__atomic_load_n(&(hists[s].max), __ATOMIC_RELAXED))
+		);
+	}
+}
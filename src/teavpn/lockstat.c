@@ -0,0 +1,144 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <teavpn/tsc.h>
+#include <teavpn/lockstat.h>
+
+bool teavpn_lockstat_enabled = false;
+
+static struct teavpn_mutex *locks_head = NULL;
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Initialize the mutex and register it to the lock stats.
+ *
+ * Must only be called once per lock.
+ *
+ * @param struct teavpn_mutex	*lock
+ * @param const char			*name
+ * @param int16_t				index	-1 for singleton locks.
+ * @return void
+ */
+void teavpn_mutex_init(struct teavpn_mutex *lock, const char *name, int16_t index)
+{
+	memset(lock, 0, sizeof(*lock));
+	pthread_mutex_init(&(lock->mutex), NULL);
+	lock->name = name;
+	lock->index = index;
+
+	pthread_mutex_lock(&registry_mutex);
+	lock->next = locks_head;
+	locks_head = lock;
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+/**
+ * The TSC must already be calibrated (teavpn_lat_init()).
+ *
+ * @param bool enable
+ * @return void
+ */
+void teavpn_lockstat_enable(bool enable)
+{
+#ifndef TEAVPN_NO_LOCKSTAT
+	__atomic_store_n(&teavpn_lockstat_enabled, enable, __ATOMIC_RELEASE);
+#else
+	(void)enable;
+#endif
+}
+
+/**
+ * Clear all counters.
+ *
+ * Lock owners may race with us, the worst case is one
+ * sample which survives the reset.
+ *
+ * @return void
+ */
+void teavpn_lockstat_reset()
+{
+	struct teavpn_mutex *lock;
+
+	pthread_mutex_lock(&registry_mutex);
+	for (lock = locks_head; lock != NULL; lock = lock->next) {
+		__atomic_store_n(&(lock->acquired), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(lock->contended), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(lock->wait_tsc), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(lock->max_wait_tsc), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(lock->hold_tsc), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(lock->max_hold_tsc), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(lock->cond_waits), 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&(lock->cond_wait_tsc), 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+/**
+ * Print one line per lock which has been acquired or waited on
+ * at least once.
+ *
+ * @param FILE *fp
+ * @return void
+ */
+void teavpn_lockstat_dump(FILE *fp)
+{
+	char name[48];
+	struct teavpn_mutex *lock;
+	uint64_t acquired, contended, cond_waits;
+
+#ifdef TEAVPN_NO_LOCKSTAT
+	fprintf(fp, "[locks] lock stats are compiled out (LOCKSTAT=0)\n");
+	return;
+#endif
+
+	if (!__atomic_load_n(&teavpn_lockstat_enabled, __ATOMIC_ACQUIRE)) {
+		fprintf(fp, "[locks] lock stats are disabled (lock_stats = 0)\n");
+		return;
+	}
+
+	fprintf(fp, "[locks] %-24s %12s %12s %8s %14s %12s %14s %12s %12s %16s\n",
+		"lock", "acquired", "contended", "cont(%)",
+		"wait_total(ns)", "wait_max(ns)", "hold_total(ns)", "hold_max(ns)",
+		"cond_waits", "cond_wait(ns)");
+
+	pthread_mutex_lock(&registry_mutex);
+	for (lock = locks_head; lock != NULL; lock = lock->next) {
+		acquired = __atomic_load_n(&(lock->acquired), __ATOMIC_RELAXED);
+		contended = __atomic_load_n(&(lock->contended), __ATOMIC_RELAXED);
+		cond_waits = __atomic_load_n(&(lock->cond_waits), __ATOMIC_RELAXED);
+
+		if ((acquired == 0) && (cond_waits == 0)) {
+			continue;
+		}
+
+		if (lock->index < 0) {
+			snprintf(name, sizeof(name), "%s", lock->name);
+		} else {
+			snprintf(name, sizeof(name), "%s[%d]", lock->name, lock->index);
+		}
+
+		fprintf(fp, "[locks] %-24s %12lu %12lu %8.2f %14lu %12lu %14lu %12lu %12lu %16lu\n",
+			name,
+			acquired,
+			contended,
+			acquired ? (((double)contended * 100.0) / (double)acquired) : 0.0,
+			teavpn_tsc_to_ns(__atomic_load_n(&(lock->wait_tsc), __ATOMIC_RELAXED)),
+			teavpn_tsc_to_ns(__atomic_load_n(&(lock->max_wait_tsc), __ATOMIC_RELAXED)),
+			teavpn_tsc_to_ns(__atomic_load_n(&(lock->hold_tsc), __ATOMIC_RELAXED)),
+			teavpn_tsc_to_ns(__atomic_load_n(&(lock->max_hold_tsc), __ATOMIC_RELAXED)),
+			cond_waits,
+			teavpn_tsc_to_ns(__atomic_load_n(&(lock->cond_wait_tsc), __ATOMIC_RELAXED))
+		);
+	}
+	pthread_mutex_unlock(&registry_mutex);
+}
@@ -0,0 +1,773 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include <teavpn/log.h>
+#include <teavpn/teavpn.h>
+
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_LINE_MAX 1024
+
+/**
+ * Argument kinds, derived from the conversion specifier.
+ */
+enum log_arg_kind {
+	LOG_ARG_NONE = 0,
+	LOG_ARG_INT = 1,
+	LOG_ARG_UINT = 2,
+	LOG_ARG_DBL = 3,
+	LOG_ARG_LDBL = 4,
+	LOG_ARG_STR = 5,
+	LOG_ARG_PTR = 6
+};
+
+/**
+ * Length modifiers.
+ */
+enum log_arg_lmod {
+	LOG_LMOD_NONE = 0,
+	LOG_LMOD_HH = 1,
+	LOG_LMOD_H = 2,
+	LOG_LMOD_L = 3,
+	LOG_LMOD_LL = 4,
+	LOG_LMOD_J = 5,
+	LOG_LMOD_Z = 6,
+	LOG_LMOD_T = 7,
+	LOG_LMOD_BIG_L = 8
+};
+
+struct log_spec {
+	const char *start;
+	size_t len;
+	uint8_t kind;
+	uint8_t lmod;
+	uint8_t stars;
+};
+
+static bool logger_running = false;
+static bool logger_sleeping = false;
+static int logger_wake_fd = -1;
+static pthread_t logger_thread;
+static pthread_key_t ring_key;
+static struct teavpn_log_ring *rings = NULL;
+static __thread struct teavpn_log_ring *ring_tls = NULL;
+static pthread_mutex_t drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t cached_sec = -1;
+static char cached_time[32];
+static char batch[LOG_BATCH_SIZE];
+static size_t batch_len = 0;
+
+static void *teavpn_log_thread(void *arg);
+
+
+/**
+ * Parse the next conversion specification.
+ *
+ * @param const char		*p
+ * @param struct log_spec	*spec
+ * @return const char *	pointer after the spec, NULL if there is none.
+ */
+static const char *log_next_spec(const char *p, struct log_spec *spec)
+{
+	while ((*p != '\0') && (*p != '%')) p++;
+	if (*p == '\0') {
+		return NULL;
+	}
+
+	spec->start = p++;
+	spec->lmod = LOG_LMOD_NONE;
+	spec->stars = 0;
+
+	if (*p == '%') {
+		spec->kind = LOG_ARG_NONE;
+		spec->len = 2;
+		return p + 1;
+	}
+
+	// Flags.
+	while ((*p == '-') || (*p == '+') || (*p == ' ') || (*p == '#') || (*p == '0') || (*p == '\'')) p++;
+
+	// Width.
+	if (*p == '*') {
+		spec->stars++;
+		p++;
+	} else {
+		while ((*p >= '0') && (*p <= '9')) p++;
+	}
+
+	// Precision.
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->stars++;
+			p++;
+		} else {
+			while ((*p >= '0') && (*p <= '9')) p++;
+		}
+	}
+
+	// Length modifier.
+	switch (*p) {
+		case 'h':
+			p++;
+			if (*p == 'h') {
+				spec->lmod = LOG_LMOD_HH;
+				p++;
+			} else {
+				spec->lmod = LOG_LMOD_H;
+			}
+			break;
+		case 'l':
+			p++;
+			if (*p == 'l') {
+				spec->lmod = LOG_LMOD_LL;
+				p++;
+			} else {
+				spec->lmod = LOG_LMOD_L;
+			}
+			break;
+		case 'j': spec->lmod = LOG_LMOD_J; p++; break;
+		case 'z': spec->lmod = LOG_LMOD_Z; p++; break;
+		case 't': spec->lmod = LOG_LMOD_T; p++; break;
+		case 'L': spec->lmod = LOG_LMOD_BIG_L; p++; break;
+	}
+
+	switch (*p) {
+		case 'd': case 'i':
+			spec->kind = LOG_ARG_INT;
+			break;
+		case 'u': case 'o': case 'x': case 'X': case 'c':
+			spec->kind = LOG_ARG_UINT;
+			break;
+		case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+			spec->kind = (spec->lmod == LOG_LMOD_BIG_L) ? LOG_ARG_LDBL : LOG_ARG_DBL;
+			break;
+		case 's':
+			spec->kind = LOG_ARG_STR;
+			break;
+		case 'p': case 'n':
+			spec->kind = LOG_ARG_PTR;
+			break;
+		case '\0':
+			spec->kind = LOG_ARG_NONE;
+			spec->len = p - spec->start;
+			return p;
+		default:
+			spec->kind = LOG_ARG_NONE;
+			break;
+	}
+
+	p++;
+	spec->len = p - spec->start;
+	return p;
+}
+
+
+/**
+ * Copy raw arguments of `fmt` from `ap` into the slot.
+ *
+ * @param struct teavpn_log_slot	*slot
+ * @param const char				*fmt
+ * @param va_list					ap
+ * @return void
+ */
+static void log_pack_args(struct teavpn_log_slot *slot, const char *fmt, va_list ap)
+{
+	struct log_spec spec;
+	char *out = slot->args;
+	const char *end = slot->args + sizeof(slot->args);
+
+	slot->truncated = false;
+
+	#define need(N)					\
+		if ((size_t)(end - out) < (N)) {	\
+			slot->truncated = true;		\
+			goto ret;					\
+		}
+
+	while ((fmt = log_next_spec(fmt, &spec)) != NULL) {
+
+		for (register uint8_t i = 0; i < spec.stars; i++) {
+			int star = va_arg(ap, int);
+			need(sizeof(star));
+			memcpy(out, &star, sizeof(star));
+			out += sizeof(star);
+		}
+
+		switch (spec.kind) {
+			case LOG_ARG_INT: {
+				int64_t v;
+				switch (spec.lmod) {
+					case LOG_LMOD_L: v = va_arg(ap, long); break;
+					case LOG_LMOD_LL: v = va_arg(ap, long long); break;
+					case LOG_LMOD_J: v = va_arg(ap, intmax_t); break;
+					case LOG_LMOD_Z: v = va_arg(ap, ssize_t); break;
+					case LOG_LMOD_T: v = va_arg(ap, ptrdiff_t); break;
+					default: v = va_arg(ap, int); break;
+				}
+				need(sizeof(v));
+				memcpy(out, &v, sizeof(v));
+				out += sizeof(v);
+				break;
+			}
+
+			case LOG_ARG_UINT: {
+				uint64_t v;
+				switch (spec.lmod) {
+					case LOG_LMOD_L: v = va_arg(ap, unsigned long); break;
+					case LOG_LMOD_LL: v = va_arg(ap, unsigned long long); break;
+					case LOG_LMOD_J: v = va_arg(ap, uintmax_t); break;
+					case LOG_LMOD_Z: v = va_arg(ap, size_t); break;
+					case LOG_LMOD_T: v = va_arg(ap, ptrdiff_t); break;
+					default: v = va_arg(ap, unsigned int); break;
+				}
+				need(sizeof(v));
+				memcpy(out, &v, sizeof(v));
+				out += sizeof(v);
+				break;
+			}
+
+			case LOG_ARG_DBL: {
+				double v = va_arg(ap, double);
+				need(sizeof(v));
+				memcpy(out, &v, sizeof(v));
+				out += sizeof(v);
+				break;
+			}
+
+			case LOG_ARG_LDBL: {
+				long double v = va_arg(ap, long double);
+				need(sizeof(v));
+				memcpy(out, &v, sizeof(v));
+				out += sizeof(v);
+				break;
+			}
+
+			case LOG_ARG_PTR: {
+				void *v = va_arg(ap, void *);
+				need(sizeof(v));
+				memcpy(out, &v, sizeof(v));
+				out += sizeof(v);
+				break;
+			}
+
+			case LOG_ARG_STR: {
+				uint16_t len;
+				const char *v = va_arg(ap, const char *);
+
+				if (v == NULL) {
+					v = "(null)";
+				}
+
+				need(sizeof(len) + 1);
+				len = strnlen(v, (end - out) - sizeof(len) - 1);
+				memcpy(out, &len, sizeof(len));
+				out += sizeof(len);
+				memcpy(out, v, len);
+				out[len] = '\0';
+				out += len + 1;
+
+				if (v[len] != '\0') {
+					slot->truncated = true;
+					goto ret;
+				}
+				break;
+			}
+		}
+	}
+
+	ret:
+	slot->len = out - slot->args;
+
+	#undef need
+}
+
+
+/**
+ * Format one slot into `out` (without timestamp).
+ *
+ * @param char							*out
+ * @param size_t						cap
+ * @param const struct teavpn_log_slot	*slot
+ * @return size_t
+ */
+static size_t log_format_slot(char *out, size_t cap, const struct teavpn_log_slot *slot)
+{
+	int ret;
+	int st[2];
+	size_t len = 0;
+	char spec_buf[32];
+	struct log_spec spec;
+	const char *fmt = slot->fmt, *next;
+	const char *argp = slot->args, *end = slot->args + slot->len;
+
+	#define emit(N) len += ((size_t)(N) < (cap - len)) ? (size_t)(N) : (cap - len - 1)
+
+	#define fmt_call(VAL)																\
+		((spec.stars == 0) ? snprintf(&(out[len]), cap - len, spec_buf, VAL) :			\
+		((spec.stars == 1) ? snprintf(&(out[len]), cap - len, spec_buf, st[0], VAL) :	\
+		snprintf(&(out[len]), cap - len, spec_buf, st[0], st[1], VAL)))
+
+	#define take(VAR)											\
+		if ((size_t)(end - argp) < sizeof(VAR)) goto truncated;	\
+		memcpy(&(VAR), argp, sizeof(VAR));						\
+		argp += sizeof(VAR)
+
+	out[0] = '\0';
+
+	while ((next = log_next_spec(fmt, &spec)) != NULL) {
+
+		// Literal text before the spec.
+		if (spec.start > fmt) {
+			ret = snprintf(&(out[len]), cap - len, "%.*s", (int)(spec.start - fmt), fmt);
+			emit(ret);
+		}
+		fmt = next;
+
+		if (spec.len >= sizeof(spec_buf)) {
+			continue;
+		}
+		memcpy(spec_buf, spec.start, spec.len);
+		spec_buf[spec.len] = '\0';
+
+		for (register uint8_t i = 0; i < spec.stars; i++) {
+			take(st[i]);
+		}
+
+		switch (spec.kind) {
+			case LOG_ARG_NONE:
+				if ((spec.len == 2) && (spec.start[1] == '%')) {
+					ret = snprintf(&(out[len]), cap - len, "%%");
+					emit(ret);
+				}
+				break;
+
+			case LOG_ARG_INT: {
+				int64_t v;
+				take(v);
+				switch (spec.lmod) {
+					case LOG_LMOD_L: ret = fmt_call((long)v); break;
+					case LOG_LMOD_LL: ret = fmt_call((long long)v); break;
+					case LOG_LMOD_J: ret = fmt_call((intmax_t)v); break;
+					case LOG_LMOD_Z: ret = fmt_call((ssize_t)v); break;
+					case LOG_LMOD_T: ret = fmt_call((ptrdiff_t)v); break;
+					default: ret = fmt_call((int)v); break;
+				}
+				emit(ret);
+				break;
+			}
+
+			case LOG_ARG_UINT: {
+				uint64_t v;
+				take(v);
+				switch (spec.lmod) {
+					case LOG_LMOD_L: ret = fmt_call((unsigned long)v); break;
+					case LOG_LMOD_LL: ret = fmt_call((unsigned long long)v); break;
+					case LOG_LMOD_J: ret = fmt_call((uintmax_t)v); break;
+					case LOG_LMOD_Z: ret = fmt_call((size_t)v); break;
+					case LOG_LMOD_T: ret = fmt_call((ptrdiff_t)v); break;
+					default: ret = fmt_call((unsigned int)v); break;
+				}
+				emit(ret);
+				break;
+			}
+
+			case LOG_ARG_DBL: {
+				double v;
+				take(v);
+				ret = fmt_call(v);
+				emit(ret);
+				break;
+			}
+
+			case LOG_ARG_LDBL: {
+				long double v;
+				take(v);
+				ret = fmt_call(v);
+				emit(ret);
+				break;
+			}
+
+			case LOG_ARG_PTR: {
+				void *v;
+				take(v);
+				if (spec.start[spec.len - 1] == 'p') {
+					ret = fmt_call(v);
+					emit(ret);
+				}
+				break;
+			}
+
+			case LOG_ARG_STR: {
+				uint16_t slen;
+				take(slen);
+				if ((size_t)(end - argp) < (size_t)slen + 1) goto truncated;
+				ret = fmt_call(argp);
+				emit(ret);
+				argp += slen + 1;
+				break;
+			}
+		}
+	}
+
+	// Trailing literal text.
+	ret = snprintf(&(out[len]), cap - len, "%s", fmt);
+	emit(ret);
+
+	if (slot->truncated) {
+		goto truncated;
+	}
+
+	return len;
+
+	truncated:
+	ret = snprintf(&(out[len]), cap - len, "...");
+	emit(ret);
+	return len;
+
+	#undef take
+	#undef fmt_call
+	#undef emit
+}
+
+
+/**
+ * @param time_t sec
+ * @return const char *
+ */
+static const char *log_time_str(time_t sec)
+{
+	struct tm tm;
+
+	if (sec != cached_sec) {
+		localtime_r(&sec, &tm);
+		strftime(cached_time, sizeof(cached_time), "%a %b %e %H:%M:%S %Y", &tm);
+		cached_sec = sec;
+	}
+
+	return cached_time;
+}
+
+
+/**
+ * Write out batch buffer. Caller holds drain_mutex.
+ */
+static void log_batch_flush()
+{
+	if (batch_len > 0) {
+		fwrite(batch, 1, batch_len, stdout);
+		fflush(stdout);
+		batch_len = 0;
+	}
+}
+
+
+/**
+ * Drain all rings into the batch buffer.
+ *
+ * @return bool	true if anything was written.
+ */
+static bool log_drain()
+{
+	int ret;
+	bool wrote = false;
+	uint32_t head, tail;
+	uint64_t dropped;
+	struct teavpn_log_slot *slot;
+	struct teavpn_log_ring *ring, *prev = NULL, *next;
+
+	pthread_mutex_lock(&drain_mutex);
+
+	ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (; ring != NULL; prev = ring, ring = next) {
+		next = ring->next;
+		head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+		tail = ring->tail;
+
+		while (tail != head) {
+			if ((LOG_BATCH_SIZE - batch_len) < LOG_LINE_MAX) {
+				log_batch_flush();
+			}
+
+			slot = &(ring->slots[tail & (TEAVPN_LOG_RING_SIZE - 1)]);
+			ret = snprintf(&(batch[batch_len]), LOG_LINE_MAX, "[%s]: ", log_time_str(slot->sec));
+			batch_len += ret;
+			batch_len += log_format_slot(&(batch[batch_len]), LOG_LINE_MAX - ret - 1, slot);
+			batch[batch_len++] = '\n';
+
+			tail++;
+			__atomic_store_n(&(ring->tail), tail, __ATOMIC_RELEASE);
+			wrote = true;
+		}
+
+		dropped = __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+		if (dropped != ring->reported_dropped) {
+			if ((LOG_BATCH_SIZE - batch_len) < LOG_LINE_MAX) {
+				log_batch_flush();
+			}
+
+			batch_len += snprintf(&(batch[batch_len]), LOG_LINE_MAX,
+				"[%s]: Log ring of thread \"%s\" is full, %lu message(s) dropped\n",
+				log_time_str(time(NULL)), ring->name, dropped - ring->reported_dropped);
+			ring->reported_dropped = dropped;
+			wrote = true;
+		}
+
+		/**
+		 * Its thread is gone and everything is written. New
+		 * rings are pushed in front of the head, so only
+		 * the head stays until another one comes.
+		 */
+		if ((prev != NULL) && __atomic_load_n(&(ring->exited), __ATOMIC_ACQUIRE) &&
+			(__atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) == ring->tail)) {
+			prev->next = next;
+			free(ring);
+			ring = prev;
+		}
+	}
+
+	log_batch_flush();
+	pthread_mutex_unlock(&drain_mutex);
+
+	return wrote;
+}
+
+
+/**
+ * The thread of ring exits (pthread key destructor), the
+ * logger frees the ring once it has drained it.
+ *
+ * @param void *arg	struct teavpn_log_ring *
+ * @return void
+ */
+static void log_ring_unregister(void *arg)
+{
+	struct teavpn_log_ring *ring = (struct teavpn_log_ring *)arg;
+
+	prctl(PR_GET_NAME, ring->name, 0, 0, 0);
+	ring_tls = NULL;
+	__atomic_store_n(&(ring->exited), true, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Allocate and publish the ring of the calling thread.
+ *
+ * @return struct teavpn_log_ring *
+ */
+static struct teavpn_log_ring *log_ring_register()
+{
+	struct teavpn_log_ring *ring;
+
+	if (posix_memalign((void **)&ring, 64, sizeof(*ring))) {
+		return NULL;
+	}
+
+	memset(ring, 0, sizeof(*ring));
+	prctl(PR_GET_NAME, ring->name, 0, 0, 0);
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+
+	while (!__atomic_compare_exchange_n(&rings, &(ring->next), ring, true,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	pthread_setspecific(ring_key, ring);
+	ring_tls = ring;
+	return ring;
+}
+
+
+/**
+ * Wake the logger if it sleeps, called after a message
+ * has been published.
+ *
+ * @return void
+ */
+static inline void log_wake()
+{
+	uint64_t one = 1;
+
+	/**
+	 * Pairs with teavpn_log_thread(): either it sees the
+	 * message or we see it sleeping.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&logger_sleeping, __ATOMIC_RELAXED) &&
+		__atomic_exchange_n(&logger_sleeping, false, __ATOMIC_ACQ_REL)) {
+		if (write(logger_wake_fd, &one, sizeof(one)) < 0) {
+			__atomic_store_n(&logger_sleeping, true, __ATOMIC_RELAXED);
+		}
+	}
+}
+
+
+/**
+ * Format synchronously (logger thread not running).
+ *
+ * @param const char	*msg
+ * @param va_list		ap
+ * @return void
+ */
+static void log_sync(const char *msg, va_list ap)
+{
+	pthread_mutex_lock(&sync_mutex);
+	fprintf(stdout, "[%s]: ", log_time_str(time(NULL)));
+	vfprintf(stdout, msg, ap);
+	fprintf(stdout, "\n");
+	fflush(stdout);
+	pthread_mutex_unlock(&sync_mutex);
+}
+
+
+/**
+ * Enqueue a log message into the ring of the calling thread.
+ *
+ * Never blocks, if the ring is full the message is dropped
+ * and accounted (the logger thread reports drops).
+ */
+uint8_t __internal_debug_log(const char *msg, ...)
+{
+	va_list argp;
+	uint32_t head, tail;
+	struct timespec ts;
+	struct teavpn_log_slot *slot;
+	struct teavpn_log_ring *ring = ring_tls;
+
+	if (!__atomic_load_n(&logger_running, __ATOMIC_ACQUIRE)) {
+		va_start(argp, msg);
+		log_sync(msg, argp);
+		va_end(argp);
+		return 0;
+	}
+
+	if (ring == NULL) {
+		ring = log_ring_register();
+		if (ring == NULL) {
+			return 1;
+		}
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+	if ((head - tail) >= TEAVPN_LOG_RING_SIZE) {
+		__atomic_fetch_add(&(ring->dropped), 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+
+	slot = &(ring->slots[head & (TEAVPN_LOG_RING_SIZE - 1)]);
+	slot->fmt = msg;
+	slot->sec = ts.tv_sec;
+
+	va_start(argp, msg);
+	log_pack_args(slot, msg, argp);
+	va_end(argp);
+
+	__atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+	log_wake();
+	return 0;
+}
+
+
+/**
+ * Background thread which formats and writes log messages.
+ *
+ * Sleeps on logger_wake_fd while every ring is empty, the
+ * first message after that wakes it up (log_wake()).
+ */
+static void *teavpn_log_thread(void *arg)
+{
+	uint64_t n;
+
+	(void)arg;
+	while (true) {
+		if (log_drain()) {
+			continue;
+		}
+
+		__atomic_store_n(&logger_sleeping, true, __ATOMIC_SEQ_CST);
+		if (log_drain()) {
+			__atomic_store_n(&logger_sleeping, false, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		if (read(logger_wake_fd, &n, sizeof(n)) < 0) {
+			__atomic_store_n(&logger_sleeping, false, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Start the logger thread.
+ *
+ * Messages logged before this point (or if the thread
+ * cannot be created) are written synchronously.
+ */
+void teavpn_log_init()
+{
+	sigset_t mask, old;
+
+	if (logger_running) {
+		return;
+	}
+
+	logger_wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (logger_wake_fd < 0) {
+		return;
+	}
+
+	if (pthread_key_create(&ring_key, log_ring_unregister) != 0) {
+		close(logger_wake_fd);
+		logger_wake_fd = -1;
+		return;
+	}
+
+	/**
+	 * The logger must never take process signals.
+	 */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_BLOCK, &mask, &old);
+
+	if (pthread_create(&logger_thread, NULL, teavpn_log_thread, NULL) == 0) {
+		pthread_setname_np(logger_thread, "teavpn-logger");
+		pthread_detach(logger_thread);
+		__atomic_store_n(&logger_running, true, __ATOMIC_RELEASE);
+		atexit(teavpn_log_flush);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/**
+ * Write out everything which has been logged so far.
+ */
+void teavpn_log_flush()
+{
+	log_drain();
+}
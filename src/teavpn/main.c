@@ -20,6 +20,7 @@ int main(int argc, char **_argv, char **envp)
 	teavpn_config config;
 
 	argv = _argv;
+	teavpn_log_init();
 
 	if (!argv_parser(&config, argc, _argv, envp)) {
 		exit_code = 1;
@@ -0,0 +1,534 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <teavpn/teavpn.h>
+#include <teavpn/netlink.h>
+
+extern uint8_t verbose_level;
+
+static struct nlmsghdr *nl_msg_begin(struct teavpn_nl *nl, uint16_t type, uint16_t flags, size_t hdr_len,
+	const char *what, bool fatal);
+static bool nl_attr(struct teavpn_nl *nl, struct nlmsghdr *nlh, uint16_t type, const void *data, size_t len);
+
+
+/**
+ * @param struct teavpn_nl *nl
+ * @return bool
+ */
+bool teavpn_nl_open(struct teavpn_nl *nl)
+{
+	struct sockaddr_nl addr;
+
+	memset(nl, 0, sizeof(*nl));
+	nl->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (nl->fd < 0) {
+		perror("socket(AF_NETLINK)");
+		return false;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	if (bind(nl->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind(AF_NETLINK)");
+		close(nl->fd);
+		nl->fd = -1;
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * @param struct teavpn_nl *nl
+ * @return void
+ */
+void teavpn_nl_close(struct teavpn_nl *nl)
+{
+	if (nl->fd >= 0) {
+		close(nl->fd);
+		nl->fd = -1;
+	}
+}
+
+
+/**
+ * @param const char *dev
+ * @return int	0 if the device does not exist.
+ */
+int teavpn_nl_ifindex(const char *dev)
+{
+	return (int)if_nametoindex(dev);
+}
+
+
+/**
+ * Append a new request to the batch.
+ *
+ * @param struct teavpn_nl	*nl
+ * @param uint16_t			type
+ * @param uint16_t			flags
+ * @param size_t			hdr_len		Size of the family header.
+ * @param const char		*what		For error messages.
+ * @param bool				fatal
+ * @return struct nlmsghdr *
+ */
+static struct nlmsghdr *nl_msg_begin(struct teavpn_nl *nl, uint16_t type, uint16_t flags, size_t hdr_len,
+	const char *what, bool fatal)
+{
+	struct nlmsghdr *nlh;
+	struct teavpn_nl_req *req;
+
+	if ((nl->nr_reqs == TEAVPN_NL_MAX_REQS) || ((nl->len + NLMSG_SPACE(hdr_len)) > sizeof(nl->buf))) {
+		debug_log(0, "netlink: too many requests in one batch");
+		return NULL;
+	}
+
+	nlh = (struct nlmsghdr *)&(nl->buf[nl->len]);
+	memset(nlh, 0, NLMSG_SPACE(hdr_len));
+	nlh->nlmsg_len = NLMSG_LENGTH(hdr_len);
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = ++(nl->seq);
+
+	req = &(nl->reqs[nl->nr_reqs++]);
+	memset(req, 0, sizeof(*req));
+	req->seq = nlh->nlmsg_seq;
+	req->fatal = fatal;
+	req->what = what;
+
+	return nlh;
+}
+
+
+/**
+ * Append an attribute to the last queued request.
+ *
+ * @param struct teavpn_nl	*nl
+ * @param struct nlmsghdr	*nlh
+ * @param uint16_t			type
+ * @param const void		*data
+ * @param size_t			len
+ * @return bool
+ */
+static bool nl_attr(struct teavpn_nl *nl, struct nlmsghdr *nlh, uint16_t type, const void *data, size_t len)
+{
+	struct rtattr *rta;
+	size_t off = ((char *)nlh - nl->buf) + NLMSG_ALIGN(nlh->nlmsg_len);
+
+	if ((off + RTA_SPACE(len)) > sizeof(nl->buf)) {
+		debug_log(0, "netlink: request buffer is full");
+		return false;
+	}
+
+	rta = (struct rtattr *)&(nl->buf[off]);
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+	return true;
+}
+
+
+/**
+ * Close the last queued request.
+ *
+ * @param struct teavpn_nl	*nl
+ * @param struct nlmsghdr	*nlh
+ * @return void
+ */
+static inline void nl_msg_end(struct teavpn_nl *nl, struct nlmsghdr *nlh)
+{
+	nl->len = ((char *)nlh - nl->buf) + NLMSG_ALIGN(nlh->nlmsg_len);
+}
+
+
+/**
+ * Queue: set link up and its MTU.
+ *
+ * @param struct teavpn_nl	*nl
+ * @param int				ifindex
+ * @param uint16_t			mtu
+ * @return bool
+ */
+bool teavpn_nl_link_up(struct teavpn_nl *nl, int ifindex, uint16_t mtu)
+{
+	struct ifinfomsg *ifi;
+	struct nlmsghdr *nlh;
+	uint32_t mtu32 = mtu;
+
+	nlh = nl_msg_begin(nl, RTM_NEWLINK, 0, sizeof(*ifi), "link up", true);
+	if (nlh == NULL) {
+		return false;
+	}
+
+	ifi = NLMSG_DATA(nlh);
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_index = ifindex;
+	ifi->ifi_flags = IFF_UP;
+	ifi->ifi_change = IFF_UP;
+
+	if (!nl_attr(nl, nlh, IFLA_MTU, &mtu32, sizeof(mtu32))) {
+		nl->nr_reqs--;
+		return false;
+	}
+
+	nl_msg_end(nl, nlh);
+	return true;
+}
+
+
+/**
+ * Queue: add an IPv4 address.
+ *
+ * @param struct teavpn_nl	*nl
+ * @param int				ifindex
+ * @param const char		*inet4		"a.b.c.d/prefix"
+ * @param const char		*broadcast	"a.b.c.d"
+ * @return bool
+ */
+bool teavpn_nl_addr_add(struct teavpn_nl *nl, int ifindex, const char *inet4, const char *broadcast)
+{
+	char addr_str[sizeof("xxx.xxx.xxx.xxx")];
+	const char *slash;
+	struct nlmsghdr *nlh;
+	struct ifaddrmsg *ifa;
+	struct in_addr addr, brd;
+	unsigned long prefix = 32;
+
+	slash = strchr(inet4, '/');
+	snprintf(addr_str, sizeof(addr_str), "%.*s", (int)(slash ? (size_t)(slash - inet4) : strlen(inet4)), inet4);
+	if (slash != NULL) {
+		prefix = strtoul(&(slash[1]), NULL, 10);
+	}
+
+	if ((!inet_pton(AF_INET, addr_str, &addr)) || (prefix > 32) || (!inet_pton(AF_INET, broadcast, &brd))) {
+		debug_log(0, "netlink: invalid address %s broadcast %s", inet4, broadcast);
+		return false;
+	}
+
+	nlh = nl_msg_begin(nl, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, sizeof(*ifa), "addr add", true);
+	if (nlh == NULL) {
+		return false;
+	}
+
+	ifa = NLMSG_DATA(nlh);
+	ifa->ifa_family = AF_INET;
+	ifa->ifa_prefixlen = (uint8_t)prefix;
+	ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+	ifa->ifa_index = ifindex;
+
+	if ((!nl_attr(nl, nlh, IFA_LOCAL, &addr, sizeof(addr))) ||
+		(!nl_attr(nl, nlh, IFA_ADDRESS, &addr, sizeof(addr))) ||
+		(!nl_attr(nl, nlh, IFA_BROADCAST, &brd, sizeof(brd)))) {
+		nl->nr_reqs--;
+		return false;
+	}
+
+	nl_msg_end(nl, nlh);
+	return true;
+}
+
+
+/**
+ * Fill a route request (RTM_NEWROUTE, RTM_DELROUTE or RTM_GETROUTE).
+ *
+ * @param struct teavpn_nl			*nl
+ * @param struct nlmsghdr			*nlh
+ * @param struct teavpn_nl_route	*route
+ * @return bool
+ */
+static bool nl_route_fill(struct teavpn_nl *nl, struct nlmsghdr *nlh, struct teavpn_nl_route *route)
+{
+	struct rtmsg *rtm = NLMSG_DATA(nlh);
+
+	rtm->rtm_family = AF_INET;
+	rtm->rtm_dst_len = route->prefix;
+	rtm->rtm_table = RT_TABLE_MAIN;
+	rtm->rtm_protocol = RTPROT_BOOT;
+	rtm->rtm_scope = route->gateway ? RT_SCOPE_UNIVERSE : RT_SCOPE_LINK;
+	rtm->rtm_type = RTN_UNICAST;
+
+	if (!nl_attr(nl, nlh, RTA_DST, &(route->dst), sizeof(route->dst))) {
+		return false;
+	}
+
+	if (route->gateway && (!nl_attr(nl, nlh, RTA_GATEWAY, &(route->gateway), sizeof(route->gateway)))) {
+		return false;
+	}
+
+	if ((route->ifindex > 0) && (!nl_attr(nl, nlh, RTA_OIF, &(route->ifindex), sizeof(route->ifindex)))) {
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Queue: add a route. Route errors are not fatal for the commit,
+ * they are logged.
+ *
+ * @param struct teavpn_nl			*nl
+ * @param struct teavpn_nl_route	*route
+ * @param bool						track	Remove it on cleanup.
+ * @return bool
+ */
+bool teavpn_nl_route_add(struct teavpn_nl *nl, struct teavpn_nl_route *route, bool track)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nl_msg_begin(nl, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, sizeof(struct rtmsg), "route add", false);
+	if (nlh == NULL) {
+		return false;
+	}
+
+	if (!nl_route_fill(nl, nlh, route)) {
+		nl->nr_reqs--;
+		return false;
+	}
+
+	nl->reqs[nl->nr_reqs - 1].track = track;
+	nl->reqs[nl->nr_reqs - 1].route = *route;
+	nl_msg_end(nl, nlh);
+	return true;
+}
+
+
+/**
+ * @param struct teavpn_nl_route	*route
+ * @param char						*buf
+ * @param size_t					size
+ * @return const char *
+ */
+static const char *nl_route_str(struct teavpn_nl_route *route, char *buf, size_t size)
+{
+	char dst[INET_ADDRSTRLEN], gw[INET_ADDRSTRLEN];
+
+	inet_ntop(AF_INET, &(route->dst), dst, sizeof(dst));
+	inet_ntop(AF_INET, &(route->gateway), gw, sizeof(gw));
+	snprintf(buf, size, "%s/%u via %s ifindex %d", dst, route->prefix, route->gateway ? gw : "-", route->ifindex);
+	return buf;
+}
+
+
+/**
+ * Send the queued batch and wait for every ack.
+ *
+ * @param struct teavpn_nl *nl
+ * @return bool	false if a fatal request failed.
+ */
+bool teavpn_nl_commit(struct teavpn_nl *nl)
+{
+	ssize_t ret;
+	bool ok = true;
+	uint8_t acked = 0;
+	struct nlmsghdr *nlh;
+	struct nlmsgerr *err;
+	char rbuf[TEAVPN_NL_BUF_SIZE] __attribute__((aligned(4))), route_str[64];
+
+	if (nl->nr_reqs == 0) {
+		return true;
+	}
+
+	if (send(nl->fd, nl->buf, nl->len, 0) < 0) {
+		perror("send(AF_NETLINK)");
+		ok = false;
+		goto out;
+	}
+
+	while (acked < nl->nr_reqs) {
+		ret = recv(nl->fd, rbuf, sizeof(rbuf), 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("recv(AF_NETLINK)");
+			ok = false;
+			goto out;
+		}
+
+		for (nlh = (struct nlmsghdr *)rbuf; NLMSG_OK(nlh, (size_t)ret); nlh = NLMSG_NEXT(nlh, ret)) {
+			struct teavpn_nl_req *req = NULL;
+
+			if (nlh->nlmsg_type != NLMSG_ERROR) {
+				continue;
+			}
+
+			for (register uint8_t i = 0; i < nl->nr_reqs; i++) {
+				if (nl->reqs[i].seq == nlh->nlmsg_seq) {
+					req = &(nl->reqs[i]);
+					break;
+				}
+			}
+
+			if (req == NULL) {
+				continue;
+			}
+
+			acked++;
+			err = NLMSG_DATA(nlh);
+
+			if (err->error == 0) {
+				if (req->track && (nl->nr_routes < TEAVPN_NL_MAX_ROUTES)) {
+					nl->routes[nl->nr_routes++] = req->route;
+				}
+				if (req->track) {
+					debug_log(1, "netlink: %s %s", req->what, nl_route_str(&(req->route), route_str,
+						sizeof(route_str)));
+				} else {
+					debug_log(1, "netlink: %s", req->what);
+				}
+				continue;
+			}
+
+			if (req->fatal) {
+				debug_log(0, "netlink: %s failed: %s", req->what, strerror(-(err->error)));
+				ok = false;
+			} else {
+				debug_log(1, "netlink: %s failed: %s", req->what, strerror(-(err->error)));
+			}
+		}
+	}
+
+	out:
+	nl->len = 0;
+	nl->nr_reqs = 0;
+	return ok;
+}
+
+
+/**
+ * Ask the kernel which way a packet to dst would go.
+ *
+ * @param struct teavpn_nl	*nl
+ * @param uint32_t			dst
+ * @param uint32_t			*gateway	0 if directly connected.
+ * @param int				*ifindex
+ * @return bool
+ */
+bool teavpn_nl_route_get(struct teavpn_nl *nl, uint32_t dst, uint32_t *gateway, int *ifindex)
+{
+	ssize_t ret;
+	struct rtmsg *rtm;
+	struct rtattr *rta;
+	struct nlmsghdr *nlh;
+	struct teavpn_nl_route route;
+	char rbuf[TEAVPN_NL_BUF_SIZE] __attribute__((aligned(4)));
+
+	if (nl->nr_reqs > 0) {
+		debug_log(0, "netlink: route get with uncommitted requests");
+		return false;
+	}
+
+	memset(&route, 0, sizeof(route));
+	route.dst = dst;
+	route.prefix = 32;
+
+	nlh = nl_msg_begin(nl, RTM_GETROUTE, 0, sizeof(struct rtmsg), "route get", true);
+	if ((nlh == NULL) || (!nl_route_fill(nl, nlh, &route))) {
+		nl->len = nl->nr_reqs = 0;
+		return false;
+	}
+	nlh->nlmsg_flags &= ~NLM_F_ACK;
+	nl_msg_end(nl, nlh);
+
+	ret = send(nl->fd, nl->buf, nl->len, 0);
+	nl->len = nl->nr_reqs = 0;
+	if (ret < 0) {
+		perror("send(AF_NETLINK)");
+		return false;
+	}
+
+	*gateway = 0;
+	*ifindex = 0;
+
+	while (true) {
+		ret = recv(nl->fd, rbuf, sizeof(rbuf), 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("recv(AF_NETLINK)");
+			return false;
+		}
+
+		for (nlh = (struct nlmsghdr *)rbuf; NLMSG_OK(nlh, (size_t)ret); nlh = NLMSG_NEXT(nlh, ret)) {
+			size_t len;
+
+			if (nlh->nlmsg_seq != nl->seq) {
+				continue;
+			}
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+				debug_log(0, "netlink: route get failed: %s", strerror(-(err->error)));
+				return false;
+			}
+
+			if (nlh->nlmsg_type != RTM_NEWROUTE) {
+				continue;
+			}
+
+			rtm = NLMSG_DATA(nlh);
+			len = RTM_PAYLOAD(nlh);
+			for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+				if (rta->rta_type == RTA_GATEWAY) {
+					memcpy(gateway, RTA_DATA(rta), sizeof(*gateway));
+				} else if (rta->rta_type == RTA_OIF) {
+					memcpy(ifindex, RTA_DATA(rta), sizeof(*ifindex));
+				}
+			}
+
+			return *ifindex > 0;
+		}
+	}
+}
+
+
+/**
+ * Remove every tracked route, in one batch.
+ *
+ * @param struct teavpn_nl *nl
+ * @return void
+ */
+void teavpn_nl_cleanup(struct teavpn_nl *nl)
+{
+	struct nlmsghdr *nlh;
+
+	if (nl->fd < 0) {
+		return;
+	}
+
+	for (register uint8_t i = 0; i < nl->nr_routes; i++) {
+		nlh = nl_msg_begin(nl, RTM_DELROUTE, 0, sizeof(struct rtmsg), "route del", false);
+		if (nlh == NULL) {
+			break;
+		}
+
+		if (!nl_route_fill(nl, nlh, &(nl->routes[i]))) {
+			nl->nr_reqs--;
+			break;
+		}
+		nl_msg_end(nl, nlh);
+	}
+
+	nl->nr_routes = 0;
+	teavpn_nl_commit(nl);
+}
@@ -0,0 +1,97 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <teavpn/reorder.h>
+
+/**
+ * @param struct teavpn_reorder	*ro
+ * @param int16_t				index	Lock stats index (connection).
+ * @return void
+ */
+void teavpn_reorder_init(struct teavpn_reorder *ro, int16_t index)
+{
+	memset(ro, 0, sizeof(*ro));
+	teavpn_mutex_init(&(ro->lock), "reorder", index);
+	ro->head = 1;
+}
+
+/**
+ * Continue after ticket last, nothing may be in flight.
+ *
+ * @param struct teavpn_reorder	*ro
+ * @param uint64_t				last
+ * @return void
+ */
+void teavpn_reorder_reset(struct teavpn_reorder *ro, uint64_t last)
+{
+	teavpn_mutex_lock(&(ro->lock));
+	memset(ro->items, 0, sizeof(ro->items));
+	ro->next_ticket = last;
+	ro->head = last + 1;
+	ro->emitting = false;
+	teavpn_mutex_unlock(&(ro->lock));
+}
+
+/**
+ * Park the finished job seq and emit what is in order.
+ *
+ * @param struct teavpn_reorder	*ro
+ * @param uint64_t				seq		Ticket of the job.
+ * @param void					*item	Not NULL.
+ * @param teavpn_reorder_emit_t	emit
+ * @return void
+ */
+void teavpn_reorder_done(struct teavpn_reorder *ro, uint64_t seq, void *item, teavpn_reorder_emit_t emit)
+{
+	teavpn_mutex_lock(&(ro->lock));
+
+	ro->items[seq & TEAVPN_REORDER_MASK] = item;
+	if (seq != ro->head) {
+		ro->parked++;
+		if ((seq - ro->head) > ro->max_depth) {
+			ro->max_depth = (uint32_t)(seq - ro->head);
+		}
+	}
+
+	/**
+	 * The current emitter picks it up.
+	 */
+	if (ro->emitting) {
+		teavpn_mutex_unlock(&(ro->lock));
+		return;
+	}
+
+	ro->emitting = true;
+	while ((item = ro->items[ro->head & TEAVPN_REORDER_MASK]) != NULL) {
+		ro->items[ro->head & TEAVPN_REORDER_MASK] = NULL;
+		seq = ro->head++;
+		ro->emitted++;
+
+		teavpn_mutex_unlock(&(ro->lock));
+		emit(seq, item);
+		teavpn_mutex_lock(&(ro->lock));
+	}
+	ro->emitting = false;
+
+	teavpn_mutex_unlock(&(ro->lock));
+}
+
+/**
+ * @param FILE					*fp
+ * @param uint16_t				conn
+ * @param struct teavpn_reorder	*ro
+ * @return void
+ */
+void teavpn_reorder_dump(FILE *fp, uint16_t conn, struct teavpn_reorder *ro)
+{
+	fprintf(fp, "[reorder] conn=%d emitted=%lu parked=%lu max_depth=%u in_flight=%lu\n",
+		conn, ro->emitted, ro->parked, ro->max_depth,
+		__atomic_load_n(&(ro->next_ticket), __ATOMIC_RELAXED) + 1 - ro->head);
+}
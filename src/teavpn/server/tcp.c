@@ -7,6 +7,7 @@
 
 #define _GNU_SOURCE
 
+#include <poll.h>
 #include <stdio.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -14,12 +15,14 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <pthread.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/select.h>
@@ -27,9 +30,22 @@
 #include <linux/ip.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/if_ether.h>
 
+#include <teavpn/arena.h>
 #include <teavpn/teavpn.h>
+#include <teavpn/affinity.h>
 #include <teavpn/helpers.h>
+#include <teavpn/iface.h>
+#include <teavpn/tls.h>
+#include <teavpn/trace.h>
+#include <teavpn/uring.h>
+#include <teavpn/flight.h>
+#include <teavpn/framer.h>
+#include <teavpn/latency.h>
+#include <teavpn/netlink.h>
+#include <teavpn/upgrade.h>
+#include <teavpn/lockstat.h>
 #include <teavpn/teavpn_server.h>
 #include <teavpn/teavpn_config_parser.h>
 
@@ -37,28 +53,180 @@ extern char **_argv;
 extern uint8_t verbose_level;
 
 static int tap_fd;
+static struct teavpn_iface iface;
 static int net_fd;
 static int m_pipe_fd[2];
 static uint8_t thread_amount;
+static uint8_t thread_spawned = 0;
 static uint16_t conn_count = 0;
 static struct teavpn_tcp_queue *queues;
+static struct teavpn_pktbuf *queue_bufs;
 static struct buffer_channel *bufchan;
+static struct buffer_class bufchan_class[TEAVPN_PB_CLASSES];
 static struct connection_entry *connections;
 static struct worker_thread *workers;
+static struct teavpn_arena_set arena;
+static struct teavpn_affinity affinity;
+static struct teavpn_tls tls = {.ctx = NULL};
 static pthread_cond_t accept_worker_cond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t accept_worker_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t worker_job_pull_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct teavpn_mutex accept_worker_mutex;
+static struct teavpn_mutex worker_job_pull_mutex;
+static sigset_t server_sigset;
+static volatile uint64_t loop_busy_since = 0;
+static char *pending_data_dir = NULL;
+static int upgrade_fd = -1;
+static int upgrade_peer_fd = -1;
+static __thread uint8_t worker_num_tls = 0;
+static uint64_t burst_count = 0, burst_frames = 0, burst_unicast = 0, burst_dropped = 0;
+static struct teavpn_spin loop_spin;
+static uint16_t conns_draining = 0;
+static bool inline_write = false;
+static uint8_t pool_min = 0, pool_max = 0;
+static uint8_t pool_idle_ticks = 0;
+static uint64_t pool_grow_gap = 0, pool_grow_last = 0;
+static uint64_t pool_busy_last = 0, pool_tick_last = 0;
+static uint64_t pool_grown = 0, pool_parked = 0;
+static uint16_t pool_depth_max = 0;
+static double pool_util = 0.0;
 
 static void thread_job_broadcast();
+static void thread_job_wake(uint16_t jobs);
+static uint16_t tun_burst();
+static void tun_forward(const int16_t *bufs, uint16_t n);
+static ssize_t tun_read_classed(const int16_t link[TEAVPN_PB_CLASSES], uint8_t *class);
+static uint32_t tun_frame_daddr(const uint8_t *frame, size_t len);
+static int16_t conn_lookup_priv_ip(uint32_t daddr);
 static void enqueue_packet(uint16_t conn, uint16_t bufchan_index);
-static uint8_t teavpn_tcp_server_init(char *config_buffer, server_config *config);
+static uint8_t teavpn_tcp_server_init(char *config_buffer, size_t config_buffer_size, server_config *config);
 static void *teavpn_tcp_accept_worker_thread(server_config *config);
 static void *teavpn_tcp_worker_thread(struct worker_thread *worker);
-static int16_t get_bufchan_index();
+static int16_t get_bufchan_index(uint8_t class);
+static void bufchan_setup(uint8_t *storage);
+static ssize_t conn_read_frame_rest(uint16_t i, teavpn_packet *pkt, ssize_t nread);
 static void queue_zero(register uint16_t i);
 static void connection_zero(register uint16_t i);
+static bool conn_hold(uint16_t i);
+static void conn_put(uint16_t i);
+static void conn_teardown(uint16_t i);
+static ssize_t conn_crypto_open(uint16_t i, teavpn_packet *pkt);
+static void conn_drain();
 static bool teavpn_tcp_server_socket_setup(int sock_fd);
 static bool teavpn_tcp_server_init_iface(server_config *config);
+static void teavpn_tcp_server_signal_init();
+static void teavpn_tcp_server_stats_dump(server_config *config, bool reset);
+static bool worker_spawn(uint8_t i);
+static void worker_resize(uint8_t amount);
+static void teavpn_tcp_server_reload(server_config *config);
+static bool teavpn_tcp_server_takeover(server_config *config);
+static void teavpn_tcp_server_handoff();
+static void teavpn_tcp_server_autotune();
+static void worker_emit(uint64_t seq, void *item);
+static void job_release(int16_t i);
+static void zc_release(void *item);
+static void zc_reap_all();
+static void spin_apply(uint32_t spin_us);
+static void spin_busy_poll(server_config *config);
+static bool worker_spin(struct worker_thread *worker);
+static bool worker_job_pending();
+static void worker_jobs_run(const int16_t *jobs, uint8_t n, uint8_t num);
+static void worker_jobs_inline();
+static bool worker_pool_apply(server_config *config, uint8_t active);
+static void worker_pool_grow();
+static void worker_autoscale();
+
+#ifdef TEAVPN_HAVE_URING
+/**
+ * io_uring event loop (io_uring = 1), see include/teavpn/uring.h.
+ *
+ * Client sockets are received into the rx buffer ring and cut
+ * into frames by a framer per connection, each frame is copied
+ * into a buffer channel of its class and written to the TUN
+ * device from there. TUN frames land in buffer channels given to
+ * the kernel. The workers still write to the client sockets
+ * themselves, in reorder buffer order.
+ */
+enum uring_req {
+	URING_TUN_READ = 1,
+	URING_TUN_WRITE = 2,
+	URING_RECV = 3,
+	URING_PIPE = 4,
+	URING_POLL_NET = 5,
+	URING_POLL_UPGRADE = 6,
+	URING_CANCEL = 7
+};
+
+#define URING_ENTRIES 256
+
+// File table: the TUN fd, then a slot per connection.
+#define URING_FILE_TUN 0
+#define URING_FILE_CONN(I) (1 + (I))
+
+// Provided buffer groups.
+#define URING_BGID_RX 0
+#define URING_BGID_TUN 1
+
+#define URING_RX_BUFS 64
+#define URING_RX_BUF_SIZE 16384
+#define URING_LANDING_MAX 32
+
+/**
+ * TUN writes in flight, the txqueue of the loop. A write waits
+ * while the device is full and holds its buffer channel, more
+ * of them would take the buffers the TUN reads land in.
+ */
+#define URING_TUN_WRITES_MAX 16
+
+struct uring_conn {
+	bool armed;						// Multishot receive for gen in flight.
+	bool in_table;					// The file slot holds the socket of gen.
+	uint32_t gen;					// connection_entry gen.
+	struct teavpn_framer fr;
+};
+
+static bool uring_on = false;
+static bool uring_handoff = false;
+static struct teavpn_uring ring;
+static struct teavpn_uring_bufs ring_rx = {.br = NULL}, ring_tun = {.br = NULL};
+static uint8_t *bufchan_room;
+static uint8_t *uring_rx_room;
+static uint8_t uring_pipe_sig;
+static bool uring_pipe_armed = false, uring_net_armed = false, uring_upgrade_armed = false;
+static bool uring_tun_armed = false;
+static uint64_t uring_tun_ud;
+static uint16_t uring_recvs = 0, uring_tun_writes = 0;
+static struct uring_conn uring_conns[CONNECTION_ALLOC];
+static uint8_t uring_landing_class;
+static uint16_t uring_nr_landing = 0;
+static int16_t uring_landing[URING_LANDING_MAX];
+static bool uring_landing_in[URING_LANDING_MAX];
+static int16_t uring_burst[TUN_BURST_MAX], uring_small[TUN_BURST_MAX];
+static uint16_t uring_nr_burst = 0, uring_nr_small = 0, uring_next_small = 0;
+
+static bool teavpn_tcp_server_uring_init(server_config *config);
+static void teavpn_tcp_server_uring_loop(server_config *config);
+static void uring_arm();
+static void uring_landing_give(uint16_t k);
+static uint32_t uring_landing_cap(struct teavpn_pktbuf *pb);
+static void uring_tun_arm();
+static void uring_reap(server_config *config);
+static void uring_tun_frame(int16_t b, uint32_t len);
+static void uring_tun_flush();
+static void uring_recv_done(uint16_t i, uint32_t gen, int32_t res, uint32_t flags);
+static void uring_conn_close(uint16_t i, uint8_t reason);
+static teavpn_packet *uring_frame_alloc(void *arg, uint16_t len, intptr_t *ctx);
+static void uring_frame(void *arg, teavpn_packet *pkt, uint16_t len, intptr_t ctx);
+static void uring_frame_drop(void *arg, intptr_t ctx);
+static void uring_tun_written(int16_t b, uint16_t i, int32_t res);
+static void uring_quiesce(server_config *config);
+static int uring_wait();
+static void uring_drain(server_config *config);
+
+static const struct teavpn_framer_ops uring_framer_ops = {
+	.alloc = uring_frame_alloc,
+	.frame = uring_frame,
+	.drop = uring_frame_drop
+};
+#endif
 
 
 /**
@@ -68,12 +236,12 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 {
 	fd_set rd_set;
 	int  fd_ret, max_fd;
+	struct timeval tick;
+	time_t now, next_autotune = 0;
 	ssize_t nwrite, nread;
 	int16_t bufchan_index;
 	pthread_t accept_worker;
 	struct sockaddr_in server_addr;
-	struct teavpn_tcp_queue _queues[QUEUE_AMOUNT];
-	struct buffer_channel _bufchan[BUFCHAN_ALLOC];
 	struct connection_entry _connections[CONNECTION_ALLOC];
 
 	/**
@@ -89,82 +257,87 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 	/** 
 	 * Assign internal stack allocation to global vars
 	 * in order to make other threads can access them.
+	 *
+	 * Buffer channels and queues live in the packet
+	 * arena (see teavpn_tcp_server_init()).
 	 */
-	queues = _queues;
-	bufchan = _bufchan;
 	connections = _connections;
 
 	/**
 	 * Initialize TeaVPN server (vars, socket, iface, etc.)
 	 */
-	if (teavpn_tcp_server_init(config_buffer, config)) {
+	if (teavpn_tcp_server_init(config_buffer, sizeof(config_buffer), config)) {
 		return 1;
 	}
 
-	thread_amount = config->threads;
+	/**
+	 * Stats signals must only be handled by the main thread,
+	 * otherwise they would interrupt blocking socket calls
+	 * of the workers. Threads inherit this mask.
+	 */
+	teavpn_tcp_server_signal_init();
+	pthread_sigmask(SIG_BLOCK, &server_sigset, NULL);
 
 	/**
 	 * Prepare worker threads.
 	 * (Threads which transmit data to client).
 	 *
-	 * Use stack allocation as long as possible.
+	 * Use stack allocation as long as possible. Allocate
+	 * every slot so a reload can add workers.
 	 */
-	struct worker_thread _workers[thread_amount];
+	struct worker_thread _workers[WORKER_ALLOC];
+	memset(_workers, 0, sizeof(_workers));
 	workers = _workers;
 
-	if (thread_amount < 3) {
-		debug_log(0, "Minimal threads amount is 3, but %d given", thread_amount);
-		goto close_server;
-	}
-
-
 	/**
 	 * Create the worker threads.
 	 */
-	for (register uint8_t i = 0; i < config->threads; ++i) {
-		workers[i].busy = false;
-		workers[i].num = i;
-		pthread_cond_init(&(workers[i].cond), NULL);
-		pthread_mutex_init(&(workers[i].mutex), NULL);
-		pthread_create(
-			&(workers[i].thread),
-			NULL,
-			(void * (*)(void *))teavpn_tcp_worker_thread,
-			(void *)&(workers[i])
-		);
-		pthread_detach(workers[i].thread);
-
-		#define thread_name (bufchan[0].buffer)
-		sprintf(thread_name, "teavpn-worker-%d", i);
-		pthread_setname_np(workers[i].thread, thread_name);
-		#undef thread_name
+	if (!worker_pool_apply(config, config->threads)) {
+		goto close_server;
 	}
-	memset(bufchan[0].buffer, 0, sizeof("teavpn-worker-xxx"));
 
 	/**
-	 * Prepare server bind address data.
+	 * Low-latency mode.
 	 */
-	memset(&server_addr, 0, sizeof(server_addr));
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(config->bind_port);
-	server_addr.sin_addr.s_addr = inet_addr(config->bind_addr);
+	spin_apply(config->spin_us);
+	spin_busy_poll(config);
+	inline_write = (config->inline_write != 0);
 
-	/**
-	 * Bind socket to address.
-	 */
-	if (bind(net_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-		debug_log(0, "Bind socket failed");
-		perror("Bind failed");
-		goto close_server;
-	}
+	if (config->upgrade) {
+		/**
+		 * Take the listening socket, the interface and the
+		 * clients over from the running server. Done as late
+		 * as possible, the old process stops forwarding here.
+		 */
+		if (!teavpn_tcp_server_takeover(config)) {
+			goto close_server;
+		}
+	} else {
+		/**
+		 * Prepare server bind address data.
+		 */
+		memset(&server_addr, 0, sizeof(server_addr));
+		server_addr.sin_family = AF_INET;
+		server_addr.sin_port = htons(config->bind_port);
+		server_addr.sin_addr.s_addr = inet_addr(config->bind_addr);
 
-	/**
-	 * Listen
-	 */
-	if (listen(net_fd, 3) < 0) {
-		debug_log(0, "Listen socket failed");
-		perror("Listen failed");
-		goto close_server;
+		/**
+		 * Bind socket to address.
+		 */
+		if (bind(net_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+			debug_log(0, "Bind socket failed");
+			perror("Bind failed");
+			goto close_server;
+		}
+
+		/**
+		 * Listen
+		 */
+		if (listen(net_fd, config->listen_backlog) < 0) {
+			debug_log(0, "Listen socket failed");
+			perror("Listen failed");
+			goto close_server;
+		}
 	}
 
 	/**
@@ -185,8 +358,70 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 	pthread_setname_np(accept_worker, "accept-worker");
 	pthread_detach(accept_worker);
 
+	/**
+	 * Watchdog dumps the flight recorder if the event
+	 * loop gets stuck (e.g. waiting for buffer channel).
+	 */
+	if (config->watchdog_timeout > 0) {
+		if (!teavpn_fr_watchdog_start(&loop_busy_since, config->watchdog_timeout)) {
+			debug_log(0, "Cannot create watchdog thread");
+		}
+	}
+
+	/**
+	 * Everything is running, let the old process exit
+	 * and take its place on the upgrade socket.
+	 */
+	if (upgrade_peer_fd != -1) {
+		bool acked = teavpn_upgrade_ack(upgrade_peer_fd);
+
+		upgrade_peer_fd = -1;
+
+		/**
+		 * Without the commit the old process resumes on the same
+		 * sockets. Let go of our copies, leave it the upgrade
+		 * socket.
+		 */
+		if (!acked) {
+			debug_log(0, "Upgrade: the running server did not commit the upgrade, exiting");
+			for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+				if (connections[i].connected) {
+					connections[i].connected = false;
+					close(connections[i].fd);
+				}
+			}
+			goto close_server;
+		}
+	}
+
+	if (config->upgrade_socket != NULL) {
+		upgrade_fd = teavpn_upgrade_listen(config->upgrade_socket);
+	}
+
+	// Everything but the main loop and the workers.
+	teavpn_affinity_pin_housekeeping(&affinity);
+
+	pthread_sigmask(SIG_UNBLOCK, &server_sigset, NULL);
+
 	debug_log(0, "Listening on %s:%d...", config->bind_addr, config->bind_port);
 
+	if (config->io_uring) {
+#ifdef TEAVPN_HAVE_URING
+		uring_on = teavpn_tcp_server_uring_init(config);
+		if (uring_on) {
+			teavpn_tcp_server_uring_loop(config);
+		}
+		debug_log(0, "io_uring is not available, using select(2)");
+#else
+		debug_log(0, "io_uring is set, but this build has no io_uring (linux/io_uring.h)");
+#endif
+	}
+
+	/**
+	 * tun_burst() reads until the device is empty.
+	 */
+	fcntl(tap_fd, F_SETFL, fcntl(tap_fd, F_GETFL) | O_NONBLOCK);
+
 	/**
 	 * TeaVPN server event loop.
 	 */
@@ -197,6 +432,9 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 		 */
 		max_fd = (((tap_fd > net_fd) && (tap_fd > m_pipe_fd[0])) ? tap_fd :
 				(net_fd > m_pipe_fd[0]) ? net_fd : m_pipe_fd[0]);
+		if (upgrade_fd > max_fd) {
+			max_fd = upgrade_fd;
+		}
 
 		/**
 		 * Set rd_set to zero.
@@ -212,7 +450,9 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 		FD_SET(net_fd, &rd_set);
 		FD_SET(tap_fd, &rd_set);
 		FD_SET(m_pipe_fd[0], &rd_set);
-
+		if (upgrade_fd != -1) {
+			FD_SET(upgrade_fd, &rd_set);
+		}
 
 		/**
 		 * Add all connected clients file descriptor to rd_set.
@@ -241,7 +481,7 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 		 * Get buffer channel index.
 		 */
 		do {
-			bufchan_index = get_bufchan_index();
+			bufchan_index = get_bufchan_index(TEAVPN_PB_LARGE);
 		} while (bufchan_index == -1);
 
 
@@ -249,7 +489,60 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 		 * Block main process until there is one or more ready fd.
 		 * Read `man 2 select_tut` for details.
 		 */
-		fd_ret = select(max_fd + 1, &rd_set, NULL, NULL, NULL);
+		__atomic_store_n(&loop_busy_since, 0, __ATOMIC_RELEASE);
+		fd_ret = 0;
+
+		/**
+		 * Low-latency mode: poll the fds without sleeping
+		 * for spin_us first.
+		 */
+		if (loop_spin.budget > 0) {
+			fd_set wanted = rd_set;
+			uint64_t start = teavpn_tsc(), end, budget = loop_spin.budget;
+
+			do {
+				rd_set = wanted;
+				tick.tv_sec = tick.tv_usec = 0;
+				fd_ret = select(max_fd + 1, &rd_set, NULL, NULL, &tick);
+				end = teavpn_tsc();
+			} while ((fd_ret == 0) && ((end - start) < budget));
+
+			teavpn_spin_done(&loop_spin, start, end, fd_ret != 0);
+			if (fd_ret == 0) {
+				rd_set = wanted;
+			}
+		}
+
+		if (fd_ret == 0) {
+			uint64_t start = teavpn_tsc();
+
+			tick.tv_sec = TEAVPN_SOCK_AUTOTUNE_INTERVAL;
+			tick.tv_usec = 0;
+			fd_ret = select(max_fd + 1, &rd_set, NULL, NULL, &tick);
+			if (loop_spin.max > 0) {
+				teavpn_spin_blocked(&loop_spin, start, teavpn_tsc());
+			}
+		}
+		__atomic_store_n(&loop_busy_since, teavpn_tsc(), __ATOMIC_RELEASE);
+
+		/**
+		 * Resize the client socket buffers from their
+		 * bandwidth-delay product.
+		 */
+		now = time(NULL);
+		if (now >= next_autotune) {
+			teavpn_tcp_server_autotune();
+			worker_autoscale();
+			next_autotune = now + TEAVPN_SOCK_AUTOTUNE_INTERVAL;
+		}
+
+		if (__atomic_load_n(&conns_draining, __ATOMIC_ACQUIRE) > 0) {
+			conn_drain();
+		}
+
+		if (fd_ret == 0) {
+			continue;
+		}
 
 		/**
 		 * Got interrupt signal.
@@ -263,6 +556,7 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 		 * Got an error.
 		 */
 		if (fd_ret < 0) {
+			teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_SELECT, errno, 0);
 			debug_log(0, "select(2) got an error");
 			perror("select()");
 			continue;
@@ -274,42 +568,19 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 		 * Don't make a new variable as long as we can use the available
 		 * resources in safely way.
 		 */
-		#define packet ((teavpn_packet *)(bufchan[bufchan_index].buffer))
+		#define pb (&(bufchan[bufchan_index].pb))
+		#define packet ((teavpn_packet *)teavpn_pb_data(pb))
 
 
 		/**
-		 * Read data from server TUN/TAP.
+		 * Read data from server TUN/TAP, as many frames
+		 * as there are (up to TUN_BURST_MAX).
 		 */
 		if (FD_ISSET(tap_fd, &rd_set)) {
-			/**
-			 * Read from TUN/TAP.
-			 */
-			nread = read(tap_fd, packet->data.data, TEAVPN_TAP_READ_SIZE);
-			if (nread < 0) {
-				debug_log(0, "Error read from tap_fd");
-				perror("Error read from tap_fd");
-				goto next_1;
-			}
-
-			packet->info.type = TEAVPN_PACKET_DATA;
-			packet->info.len = TEAVPN_PACK(nread);
-			for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
-				if (connections[i].connected) {
-					/**
-					 * Insert write queue.
-					 *
-					 * Send bufchan_index to connection i.
-					 */
-					bufchan[bufchan_index].ref_count++;
-					// printf("i = %d;  r = %d\n", bufchan_index, bufchan[bufchan_index].ref_count);
-					enqueue_packet(i, bufchan_index);
-					thread_job_broadcast();
-				}
-			}
+			tun_burst();
 		}
 
 
-		next_1:
 		/**
 		 * Traverse clients fd and read data from clients.
 		 */
@@ -317,23 +588,41 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 			if (connections[i].connected) {
 				if (FD_ISSET(connections[i].fd, &rd_set)) {
 
+					/**
+					 * Zerocopy completions wake us up as well, they
+					 * are no data so do not block on the read then.
+					 */
+					if (connections[i].zc.threshold > 0) {
+						teavpn_zc_reap(&(connections[i].zc), connections[i].fd, zc_release);
+					}
+
 					/**
 					 * Get buffer channel index.
 					 */
 					do {
-						bufchan_index = get_bufchan_index();
+						bufchan_index = get_bufchan_index(TEAVPN_PB_LARGE);
 					} while (bufchan_index == -1);
 
-					nread = read(connections[i].fd, packet, TEAVPN_PACKET_BUFFER);
+					/**
+					 * The payload lands where a tun read puts it.
+					 */
+					teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM - TEAVPN_PACK(0));
+					nread = recv(connections[i].fd, packet, TEAVPN_PACKET_BUFFER,
+						(connections[i].zc.threshold > 0) ? MSG_DONTWAIT : 0);
+					if ((nread < 0) && (errno == EAGAIN)) {
+						continue;
+					}
+					bufchan[bufchan_index].tsc = teavpn_tsc();
 
 					/**
 					 * Connection closed by client.
 					 */
 					if (nread == 0) {
+						TEAVPN_TRACE3(conn_close, i, connections[i].fd, TEAVPN_CLOSE_BY_PEER);
+						teavpn_fr_record(TEAVPN_FR_CONN_CLOSE, i, connections[i].fd, TEAVPN_CLOSE_BY_PEER);
 						FD_CLR(connections[i].fd, &rd_set);
-						close(connections[i].fd);
 						debug_log(1, "(%s:%d) connection closed",
-							inet_ntoa(connections[i].addr.sin_addr),
+							connections[i].addr_str,
 							ntohs(connections[i].addr.sin_port)
 						);
 						connection_zero(i);
@@ -344,9 +633,10 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 					 * Error read from client fd.
 					 */
 					if (nread < 0) {
-						char *remote_addr = inet_ntoa(connections[i].addr.sin_addr);
+						char *remote_addr = connections[i].addr_str;
 						uint16_t remote_port = ntohs(connections[i].addr.sin_port);
 
+						teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_SOCK_READ, errno, i);
 						debug_log(0, "Error read from (%s:%d)", remote_addr, remote_port);
 						perror("Error read from connection fd");
 
@@ -362,11 +652,12 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 						if (connections[i].error > MAX_CLIENT_ERR) {
 							debug_log(0,
 								"Client %s:%d has been disconnected because it has reached the max number of errors",
-								remote_port,
+								remote_addr,
 								remote_port
 							);
+							TEAVPN_TRACE3(conn_close, i, connections[i].fd, TEAVPN_CLOSE_MAX_ERR);
+							teavpn_fr_record(TEAVPN_FR_CONN_CLOSE, i, connections[i].fd, TEAVPN_CLOSE_MAX_ERR);
 							FD_CLR(connections[i].fd, &rd_set);
-							close(connections[i].fd);
 							connection_zero(i);
 						}
 
@@ -374,45 +665,68 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 					}
 
 
+					TEAVPN_TRACE4(client_frame, i, packet->info.type, packet->info.len, nread);
+
 					/**
 					 * Write to TUN/TAP server.
 					 */
 					if (packet->info.type == TEAVPN_PACKET_DATA) {
 
-						while (nread < (packet->info.len)) {
-							register ssize_t tmp_nread;
-							debug_log(3, "Read extra %ld/%ld bytes", nread, packet->info.len);
-							tmp_nread = read(
-								connections[i].fd,
-								&(((char *)packet)[nread]),
-								packet->info.len - nread
-							);
+						/**
+						 * The rest of the stream can not be framed after
+						 * a bad length or a short read, drop the client.
+						 */
+						if ((nread = conn_read_frame_rest(i, packet, nread)) < 0) {
+							teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_SOCK_READ, errno, i);
+							connections[i].error++;
+							TEAVPN_TRACE3(conn_close, i, connections[i].fd, TEAVPN_CLOSE_MAX_ERR);
+							teavpn_fr_record(TEAVPN_FR_CONN_CLOSE, i, connections[i].fd, TEAVPN_CLOSE_MAX_ERR);
+							FD_CLR(connections[i].fd, &rd_set);
+							debug_log(0, "Client %s:%d has been disconnected, its frame could not be read",
+								connections[i].addr_str, ntohs(connections[i].addr.sin_port));
+							connection_zero(i);
+							continue;
+						}
 
-							if (tmp_nread < 0) {
-								connections[i].error++;
-								perror("Error read extra");
-							} else {
-								nread += tmp_nread;
-							}
+						if ((connections[i].crypto.st.cipher != TEAVPN_CIPHER_NONE) &&
+							((nread = conn_crypto_open(i, packet)) < 0)) {
+							teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_DECRYPT, EBADMSG, i);
+							debug_log(1, "Dropped a forged or replayed frame from %s:%d",
+								connections[i].addr_str, ntohs(connections[i].addr.sin_port));
+							connections[i].error++;
+							continue;
 						}
 
 						connections[i].seq++;
 						debug_log(3, "[%ld] Read from client %s:%d (server_seq: %ld) (client_seq: %ld) (seq %s)",
 							connections[i].seq,
-							inet_ntoa(connections[i].addr.sin_addr),
+							connections[i].addr_str,
 							ntohs(connections[i].addr.sin_port),
 							connections[i].seq,
 							packet->info.seq,
 							(connections[i].seq == packet->info.seq) ? "match" : "invalid"
 						);
 
-						nwrite = write(tap_fd, &(packet->data.data), nread - TEAVPN_PACK(0));
+						/**
+						 * Header and tag off, nread is the opened frame.
+						 */
+						pb->len = nread;
+						teavpn_pb_pull(pb, TEAVPN_PACK(0));
+						nwrite = write(tap_fd, teavpn_pb_data(pb), pb->len);
+						if ((nwrite < 0) && (errno == EAGAIN)) {
+							// Full like a tun txqueue, not the client's fault.
+							debug_log(3, "tap_fd is full, dropped %ld bytes", (ssize_t)pb->len);
+							continue;
+						}
+
 						if (nwrite < 0) {
+							teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_TAP_WRITE, errno, i);
 							connections[i].error++;
 							perror("Error write to tap_fd");
 							continue;
 						}
 
+						teavpn_lat_record(TEAVPN_LAT_SOCK_TO_TUN, bufchan[bufchan_index].tsc, teavpn_tsc());
 						debug_log(3, "Write to tap_fd %ld bytes", nwrite);
 
 					} else {
@@ -433,6 +747,12 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 			if (nread < 0) {
 				debug_log(0, "Error read from m_pipe_fd[0]");
 				perror("Error read from m_pipe_fd[0]");
+			} else if (sig_x == SERVER_PIPE_SIG_STATS) {
+				teavpn_tcp_server_stats_dump(config, false);
+			} else if (sig_x == SERVER_PIPE_SIG_STATS_RESET) {
+				teavpn_tcp_server_stats_dump(config, true);
+			} else if (sig_x == SERVER_PIPE_SIG_RELOAD) {
+				teavpn_tcp_server_reload(config);
 			}
 		}
 
@@ -440,38 +760,51 @@ __attribute__((force_align_arg_pointer)) uint8_t teavpn_tcp_server(server_config
 			pthread_cond_signal(&accept_worker_cond);
 		}
 
+		/**
+		 * A new binary wants to take over (does not return on success).
+		 */
+		if ((upgrade_fd != -1) && FD_ISSET(upgrade_fd, &rd_set)) {
+			teavpn_tcp_server_handoff();
+		}
+
 		/**
 		 * Since macro doesn't have scope limit, we have to undef here
 		 * so that it doesn't distrub the outer scope of variable usage.
 		 */
 		#undef packet
+		#undef pb
 	}
 
 	close_server:
 	close(m_pipe_fd[0]);
 	close(m_pipe_fd[1]);
 	close(net_fd);
-	close(tap_fd);
+	teavpn_iface_close(&iface);
 	return 1;
 }
 
 
 
 /**
- * Pull job from thread.
+ * Pull up to max jobs at once.
+ *
+ * @param int16_t	*jobs	Queue indexes.
+ * @param uint8_t	max
+ * @return uint8_t	Number of jobs taken.
  */
-static int16_t worker_job_pull()
+static uint8_t worker_job_pull(int16_t *jobs, uint8_t max)
 {
-	pthread_mutex_lock(&worker_job_pull_mutex);
-	for (register int16_t i = 0; i < QUEUE_AMOUNT; ++i) {
-		if ((queues[i].used) && (!queues[i].taken)) {
+	uint8_t n = 0;
+
+	teavpn_mutex_lock(&worker_job_pull_mutex);
+	for (register int16_t i = 0; (i < QUEUE_AMOUNT) && (n < max); ++i) {
+		if (__atomic_load_n(&(queues[i].used), __ATOMIC_ACQUIRE) && (!queues[i].taken)) {
 			queues[i].taken = true;
-			pthread_mutex_unlock(&worker_job_pull_mutex);
-			return i;
+			jobs[n++] = i;
 		}
 	}
-	pthread_mutex_unlock(&worker_job_pull_mutex);
-	return -1;
+	teavpn_mutex_unlock(&worker_job_pull_mutex);
+	return n;
 }
 
 
@@ -480,17 +813,38 @@ static int16_t worker_job_pull()
  */
 static void enqueue_packet(uint16_t conn, uint16_t bufchan_index)
 {
+	bool full = false;
+
 	while (true) {
 		for (register int16_t i = 0; i < QUEUE_AMOUNT; ++i) {
 			if (!queues[i].used) {
-				queues[i].used = true;
 				queues[i].taken = false;
 				queues[i].conn_index = conn;
 				queues[i].bufchan_index = bufchan_index;
+				queues[i].enqueue_tsc = teavpn_tsc();
+				queues[i].seq = teavpn_reorder_ticket(&(connections[conn].reorder));
+
+				/**
+				 * Published last, a worker takes the job as soon
+				 * as it sees it used (worker_job_pull()). A stale
+				 * seq would leave its ticket undone.
+				 */
+				__atomic_store_n(&(queues[i].used), true, __ATOMIC_RELEASE);
+				TEAVPN_TRACE3(packet_enqueue, conn, bufchan_index, i);
+				teavpn_fr_record(TEAVPN_FR_ENQUEUE, conn, bufchan_index, i);
 				return;
 			}
 		}
+
+		if (!full) {
+			full = true;
+			teavpn_fr_record(TEAVPN_FR_QUEUE_FULL, conn, bufchan_index, 0);
+		}
 		debug_log(0, "Packet queue is full");
+
+		// A burst wakes the workers after its last enqueue.
+		thread_job_broadcast();
+		zc_reap_all();
 	}
 }
 
@@ -500,681 +854,3524 @@ static void enqueue_packet(uint16_t conn, uint16_t bufchan_index)
  */
 static void thread_job_broadcast()
 {
-	for (register uint8_t i = 0; i < thread_amount; i++) {
-		if (!workers[i].busy) {
-			pthread_cond_signal(&(workers[i].cond));
-			return;
-		}
-	}
+	thread_job_wake(1);
 }
 
 
 /**
- * Worker which dispatches data to clients.
+ * Wake an idle worker per WORKER_BURST new jobs. With none
+ * idle the pool grows (threads_max).
+ *
+ * @param uint16_t jobs
+ * @return void
  */
-static void *teavpn_tcp_worker_thread(struct worker_thread *worker)
+static void thread_job_wake(uint16_t jobs)
 {
+	uint16_t want = (jobs + WORKER_BURST - 1) / WORKER_BURST;
+	uint16_t first = want;
 
-	#define packet ((teavpn_packet *)(bufchan[queues[i].bufchan_index].buffer))
-
-	register int16_t i;
-	register ssize_t nwrite;
-
-	while (true) {
-		pthread_mutex_lock(&(worker->mutex));
-		pthread_cond_wait(&(worker->cond), &(worker->mutex));
-
-		worker->busy = true;
+	if (jobs > pool_depth_max) {
+		pool_depth_max = jobs;
+	}
 
-		i = worker_job_pull();
+	/**
+	 * Pairs with worker_spin(): either we see the worker
+	 * spinning or it sees the jobs once it stops.
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
 
-		/**
-		 * There is no queue.
-		 */
-		if (i == -1) {
-			goto job_done;
+	for (register uint8_t i = 0; (i < thread_amount) && (want > 0); i++) {
+		if (__atomic_load_n(&(workers[i].spinning), __ATOMIC_RELAXED)) {
+			want--;
+		} else if (!workers[i].busy) {
+			pthread_cond_signal(&(workers[i].cond));
+			want--;
 		}
+	}
 
-		packet->info.seq = ++(connections[queues[i].conn_index].seq);
-
-		nwrite = write(connections[queues[i].conn_index].fd, packet, packet->info.len);
+	/**
+	 * Every worker is busy, the jobs would wait.
+	 */
+	if ((want == first) && (thread_amount < pool_max)) {
+		worker_pool_grow();
+	}
+}
 
-		debug_log(3, "[%ld] Write to client %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
-			connections[queues[i].conn_index].seq,
-			inet_ntoa(connections[queues[i].conn_index].addr.sin_addr),
-			ntohs(connections[queues[i].conn_index].addr.sin_port),
-			nwrite,
-			connections[queues[i].conn_index].seq,
-			packet->info.seq,
-			(connections[queues[i].conn_index].seq == packet->info.seq) ? "match" : "invalid"
-		);
 
-		/**
-		 * Connection closed by client.
-		 */
-		if (nwrite == 0) {
-			close(connections[queues[i].conn_index].fd);
-			debug_log(1, "(%s:%d) connection closed",
-				inet_ntoa(connections[queues[i].conn_index].addr.sin_addr),
-				ntohs(connections[queues[i].conn_index].addr.sin_port)
-			);
-			connection_zero(i);
-			goto job_release;
+/**
+ * IPv4 destination of a frame read from the TUN device.
+ *
+ * @param const uint8_t	*frame
+ * @param size_t		len
+ * @return uint32_t	Network order, 0 if it is no IPv4 packet.
+ */
+static uint32_t tun_frame_daddr(const uint8_t *frame, size_t len)
+{
+	/**
+	 * The tun device is opened without IFF_NO_PI, its frames
+	 * start with struct tun_pi. The user space backends pass
+	 * bare IP packets.
+	 */
+	if ((len >= sizeof(struct tun_pi)) && ((frame[0] >> 4) != 4)) {
+		if (((const struct tun_pi *)frame)->proto != htons(ETH_P_IP)) {
+			return 0;
 		}
+		frame += sizeof(struct tun_pi);
+		len -= sizeof(struct tun_pi);
+	}
 
+	if ((len < sizeof(struct iphdr)) || ((frame[0] >> 4) != 4)) {
+		return 0;
+	}
 
-		if (nwrite < 0) {
-			char *remote_addr = inet_ntoa(connections[queues[i].conn_index].addr.sin_addr);
-			uint16_t remote_port = ntohs(connections[queues[i].conn_index].addr.sin_port);
+	return ((const struct iphdr *)frame)->daddr;
+}
 
-			debug_log(0, "Error write to %s:%d", remote_addr, remote_port);
-			perror("Error write to connection fd");
 
-			/**
-			 * Increment the error counter.
-			 */
-			connections[queues[i].conn_index].error++;
+/**
+ * Connection owning a private address (priv_ip as filled
+ * in by the accept worker).
+ *
+ * @param uint32_t daddr	Network order.
+ * @return int16_t	-1 if no connected client owns it, or more
+ *					than one does (sessions of the same user).
+ */
+static int16_t conn_lookup_priv_ip(uint32_t daddr)
+{
+	int16_t found = -1;
 
-			/**
-			 * Force disconnect client if it has
-			 * reached the max number of errors.
-			 */
-			if (connections[queues[i].conn_index].error > MAX_CLIENT_ERR) {
-				debug_log(0,
-					"Client %s:%d has been disconnected because it has reached the max number of errors",
-					remote_port,
-					remote_port
-				);
-				close(connections[queues[i].conn_index].fd);
-				connection_zero(i);
+	if (daddr == 0) {
+		return -1;
+	}
+
+	for (register int16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if ((connections[i].priv_ip == daddr) && connections[i].connected) {
+			if (found != -1) {
+				return -1;
 			}
+			found = i;
 		}
+	}
+	return found;
+}
 
 
-		job_release:
-		bufchan[queues[i].bufchan_index].ref_count--;
-		// printf("i = %d;  r = %d\n", queues[i].bufchan_index, bufchan[queues[i].bufchan_index].ref_count);
-
-		pthread_mutex_lock(&worker_job_pull_mutex);
-		queues[i].used = false;
-		queues[i].taken = false;
-		pthread_mutex_unlock(&worker_job_pull_mutex);
+/**
+ * Queue a TUN frame for connection conn.
+ *
+ * @param uint16_t	conn
+ * @param int16_t	b		Buffer channel of the frame.
+ * @return bool	false if a worker has closed the connection.
+ */
+static inline bool tun_enqueue(uint16_t conn, int16_t b)
+{
+	struct buffer_class *bc = &(bufchan_class[bufchan[b].class]);
+	uint16_t used;
 
-		job_done:
-		worker->busy = false;
-		pthread_mutex_unlock(&(worker->mutex));
+	if (!conn_hold(conn)) {
+		return false;
 	}
-	return NULL;
 
-	#undef packet
+	if (__atomic_fetch_add(&(bufchan[b].ref_count), 1, __ATOMIC_ACQ_REL) == 0) {
+		teavpn_fr_record(TEAVPN_FR_BUF_ALLOC, b, 0, 0);
+		used = __atomic_add_fetch(&(bc->used), 1, __ATOMIC_RELAXED);
+		if (used > bc->max_used) {
+			bc->max_used = used;
+		}
+	}
+	enqueue_packet(conn, b);
+	teavpn_lat_record(TEAVPN_LAT_TUN_TO_ENQUEUE, bufchan[b].tsc, teavpn_tsc());
+	return true;
 }
 
 
 /**
- * Get index of free connection entry.
+ * Read one frame from the TUN device into the smallest buffer
+ * class it fits in.
+ *
+ * The read is scattered over one free buffer of each class
+ * (link): the bytes from the capacity of one class up to the
+ * capacity of the next go straight to the buffer of the next
+ * class. A frame is in place when it fits the first buffer, a
+ * longer one gets the head moved up into the buffer it ends in
+ * (promotion), its tail is not copied.
+ *
+ * @param const int16_t	link[TEAVPN_PB_CLASSES]	-1 = none of that class.
+ * @param uint8_t		*class					Class the frame is in.
+ * @return ssize_t	As read(2).
  */
-static int16_t get_free_conn_index()
+static ssize_t tun_read_classed(const int16_t link[TEAVPN_PB_CLASSES], uint8_t *class)
 {
-	for (int16_t i = 0; i < CONNECTION_ALLOC; ++i) {
-		if (!connections[i].connected) {
-			return i;
+	ssize_t nread;
+	int iovcnt = 0, k;
+	size_t off = 0, cap, start[TEAVPN_PB_CLASSES];
+	uint8_t owner[TEAVPN_PB_CLASSES];
+	struct iovec iov[TEAVPN_PB_CLASSES];
+	struct teavpn_pktbuf *pb;
+
+	for (register uint8_t c = 0; (c < TEAVPN_PB_CLASSES) && (off < TEAVPN_TAP_READ_SIZE); c++) {
+		if (link[c] == -1) {
+			continue;
+		}
+
+		pb = &(bufchan[link[c]].pb);
+		teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM);
+		cap = teavpn_pb_tailroom(pb) - TEAVPN_PB_TAILROOM;
+		if (cap > TEAVPN_TAP_READ_SIZE) {
+			cap = TEAVPN_TAP_READ_SIZE;
+		}
+
+		iov[iovcnt].iov_base = (uint8_t *)teavpn_pb_tail(pb) + off;
+		iov[iovcnt].iov_len = cap - off;
+		start[iovcnt] = off;
+		owner[iovcnt++] = c;
+		off = cap;
+	}
+
+	nread = readv(tap_fd, iov, iovcnt);
+	if (nread <= 0) {
+		return nread;
+	}
+
+	for (k = 0; k < (iovcnt - 1); k++) {
+		if ((size_t)nread <= (start[k] + iov[k].iov_len)) {
+			break;
 		}
 	}
 
-	return -1;
+	*class = owner[k];
+	pb = &(bufchan[link[owner[k]]].pb);
+	for (register int j = 0; j < k; j++) {
+		memcpy((uint8_t *)teavpn_pb_tail(pb) + start[j], iov[j].iov_base, iov[j].iov_len);
+	}
+	teavpn_pb_put(pb, nread);
+
+	bufchan_class[owner[k]].frames++;
+	if (k > 0) {
+		bufchan_class[owner[k]].promoted++;
+	}
+
+	return nread;
 }
 
 
 /**
- * Worker which accepts new connection.
+ * Forward the frames waiting on the TUN device to the clients.
+ *
+ * Each stage runs over the whole burst before the next one
+ * starts, and the workers are woken once at the end. A frame
+ * for the private address of a client goes to that client,
+ * any other one (broadcast, multicast, not IPv4, no owner)
+ * to every client. The frames are sealed by the workers.
+ *
+ * @return uint16_t	Number of frames read.
  */
-static void *teavpn_tcp_accept_worker_thread(server_config *config)
+static uint16_t tun_burst()
 {
-	FILE *h;
-	int client_fd;
-	uint64_t seq = 0;
-	char *remote_addr;
-	int16_t conn_index;
-	uint16_t remote_port;
-	teavpn_packet packet;
-	ssize_t nread, nwrite;
-	struct timeval timeout;
-	struct sockaddr_in client_addr;
-	socklen_t rlen = sizeof(struct sockaddr_in);
+	ssize_t nread;
+	uint8_t class;
+	uint16_t n = 0, max, free_q = 0;
+	uint16_t nfree[TEAVPN_PB_CLASSES] = {0}, next[TEAVPN_PB_CLASSES] = {0};
+	int16_t bufs[TUN_BURST_MAX], link[TEAVPN_PB_CLASSES];
+	int16_t free_bufs[TEAVPN_PB_CLASSES][TUN_BURST_MAX];
 
 	/**
-	 * NDF
+	 * Room: at least one queue slot per frame. The first frame
+	 * is read anyway, enqueue_packet() waits for the slots a
+	 * broadcast lacks.
 	 */
-	char buffer[64 + OFFSETOF(teavpn_packet, data)], *pbuf;
-	size_t len, sp = 0;
-	const uint8_t sig = 0xff;
-
+	for (register uint16_t i = 0; i < QUEUE_AMOUNT; i++) {
+		if (!queues[i].used) {
+			free_q++;
+		}
+	}
+	max = (free_q > TUN_BURST_MAX) ? TUN_BURST_MAX : ((free_q > 0) ? free_q : 1);
 
 	/**
-	 * Set timeout to 10 seconds.
+	 * And the free buffer channels of each class.
 	 */
-	timeout.tv_sec = 10;
-	timeout.tv_usec = 0;
+	for (register uint8_t c = 0; c < TEAVPN_PB_CLASSES; c++) {
+		for (register uint16_t i = bufchan_class[c].first;
+			(i < (bufchan_class[c].first + bufchan_class[c].count)) && (nfree[c] < max); i++) {
+			if (bufchan[i].ref_count == 0) {
+				free_bufs[c][nfree[c]++] = i;
+			}
+		}
+	}
 
+	/**
+	 * Stage 1: read until the device is empty (tap_fd is
+	 * non-blocking) or the burst is full. Every read needs a
+	 * large buffer in reach, a frame may be that long.
+	 */
+	while (n < max) {
+		for (register uint8_t c = 0; c < TEAVPN_PB_CLASSES; c++) {
+			link[c] = (next[c] < nfree[c]) ? free_bufs[c][next[c]] : -1;
+		}
 
-	while (true) {
+		if (link[TEAVPN_PB_LARGE] == -1) {
+			break;
+		}
 
-		pthread_mutex_lock(&accept_worker_mutex);
-		pthread_cond_wait(&accept_worker_cond, &accept_worker_mutex);
+		nread = tun_read_classed(link, &class);
+		if (nread <= 0) {
+			if ((nread < 0) && (errno != EAGAIN)) {
+				teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_TAP_READ, errno, 0);
+				debug_log(0, "Error read from tap_fd");
+				perror("Error read from tap_fd");
+			}
+			break;
+		}
+
+		bufs[n] = link[class];
+		next[class]++;
+		bufchan[bufs[n]].tsc = teavpn_tsc();
+		TEAVPN_TRACE2(tun_read, bufs[n], nread);
+		n++;
+	}
+
+	if (n == 0) {
+		return 0;
+	}
+
+	tun_forward(bufs, n);
+	return n;
+}
+
+
+/**
+ * Stages 2 to 5 of a TUN burst (see tun_burst()), for n frames
+ * read into the buffer channels bufs. Their reference counts are
+ * still 0.
+ *
+ * @param const int16_t	*bufs
+ * @param uint16_t		n
+ * @return void
+ */
+static void tun_forward(const int16_t *bufs, uint16_t n)
+{
+	teavpn_packet *pkt;
+	struct teavpn_pktbuf *pb;
+	uint16_t jobs = 0, connected = 0;
+	int16_t dst[TUN_BURST_MAX];
+	uint32_t daddr[TUN_BURST_MAX];
+
+	/**
+	 * Stage 2: classify, the frame header goes in front of
+	 * the payload.
+	 */
+	for (register uint16_t k = 0; k < n; k++) {
+		if ((k + 1) < n) {
+			__builtin_prefetch(teavpn_pb_data(&(bufchan[bufs[k + 1]].pb)));
+		}
+
+		pb = &(bufchan[bufs[k]].pb);
+		daddr[k] = tun_frame_daddr(teavpn_pb_data(pb), pb->len);
+
+		pkt = (teavpn_packet *)teavpn_pb_push(pb, TEAVPN_PACK(0));
+		pkt->info.type = TEAVPN_PACKET_DATA;
+		pkt->info.len = pb->len;
+	}
+
+	/**
+	 * Stage 3: route lookup.
+	 */
+	for (register uint16_t k = 0; k < n; k++) {
+		dst[k] = conn_lookup_priv_ip(daddr[k]);
+	}
+
+	/**
+	 * Stage 4: filter, nobody to send to. The buffer channel
+	 * of a dropped frame is still free.
+	 */
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if (connections[i].connected) {
+			connected++;
+		}
+	}
+
+	for (register uint16_t k = 0; k < n; k++) {
+		if ((dst[k] == -1) && (connected == 0)) {
+			dst[k] = -2;
+			burst_dropped++;
+		}
+	}
+
+	/**
+	 * Stage 5: per-connection enqueue.
+	 */
+	for (register uint16_t k = 0; k < n; k++) {
+		if (dst[k] >= 0) {
+			if (tun_enqueue(dst[k], bufs[k])) {
+				jobs++;
+				burst_unicast++;
+			}
+			continue;
+		}
+
+		if (dst[k] == -1) {
+			for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+				if (connections[i].connected && tun_enqueue(i, bufs[k])) {
+					jobs++;
+				}
+			}
+		}
+	}
+
+	if (inline_write) {
+		worker_jobs_inline();
+	} else {
+		thread_job_wake(jobs);
+	}
+
+	burst_count++;
+	burst_frames += n;
+}
+
+
+/**
+ * Worker which dispatches data to clients.
+ *
+ * Jobs of one connection run on any worker, the frames leave
+ * through the reorder buffer of the connection in enqueue order
+ * (worker_emit()).
+ */
+static void *teavpn_tcp_worker_thread(struct worker_thread *worker)
+{
+	uint8_t n;
+	uint64_t start;
+	int16_t jobs[WORKER_BURST];
+
+	worker_num_tls = worker->num;
+
+	while (true) {
+		teavpn_mutex_lock(&(worker->mutex));
+		if ((__atomic_load_n(&(worker->state), __ATOMIC_ACQUIRE) == WORKER_RUNNING) && (!worker_spin(worker))) {
+			start = teavpn_tsc();
+			teavpn_cond_wait(&(worker->cond), &(worker->mutex));
+			if (worker->spin.max > 0) {
+				teavpn_spin_blocked(&(worker->spin), start, teavpn_tsc());
+			}
+		}
+
+		/**
+		 * Removed by a reload, unless the reload
+		 * has taken the slot back in the meantime.
+		 */
+		if (__atomic_load_n(&(worker->state), __ATOMIC_ACQUIRE) == WORKER_STOPPING) {
+			uint8_t expected = WORKER_STOPPING;
+
+			if (__atomic_compare_exchange_n(&(worker->state), &expected, WORKER_EXITED, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				teavpn_mutex_unlock(&(worker->mutex));
+				debug_log(1, "Worker %d has been stopped", worker->num);
+				break;
+			}
+		}
+
+		worker->busy = true;
+		start = teavpn_tsc();
+
+		/**
+		 * Take jobs until the queue is empty, WORKER_BURST
+		 * at a time. A wakeup sent while we were busy is lost,
+		 * a job left behind would hold up every later frame
+		 * of its connection.
+		 */
+		while ((n = worker_job_pull(jobs, WORKER_BURST)) > 0) {
+			worker_jobs_run(jobs, n, worker->num);
+		}
+
+		__atomic_fetch_add(&(worker->busy_ticks), teavpn_tsc() - start, __ATOMIC_RELAXED);
+		worker->busy = false;
+		teavpn_mutex_unlock(&(worker->mutex));
+	}
+	return NULL;
+}
+
+
+/**
+ * Seal and send the jobs taken by worker_job_pull().
+ *
+ * @param const int16_t	*jobs
+ * @param uint8_t		n
+ * @param uint8_t		num		Worker number, WORKER_ALLOC for the event loop.
+ * @return void
+ */
+static void worker_jobs_run(const int16_t *jobs, uint8_t n, uint8_t num)
+{
+
+	#define packet ((teavpn_packet *)teavpn_pb_data(&(bufchan[queues[i].bufchan_index].pb)))
+
+	register int16_t i;
+	register uint16_t conn;
+
+	/**
+	 * The parallel part, the buffer is shared by every
+	 * connection it is queued for so the sealed frame
+	 * goes to the buffer of the job.
+	 */
+	for (register uint8_t k = 0; k < n; k++) {
+		i = jobs[k];
+		conn = queues[i].conn_index;
+
+		if ((k + 1) < n) {
+			__builtin_prefetch(teavpn_pb_data(&(bufchan[queues[jobs[k + 1]].bufchan_index].pb)));
+		}
+
+		teavpn_lat_record(TEAVPN_LAT_QUEUE_WAIT, queues[i].enqueue_tsc, teavpn_tsc());
+		teavpn_fr_record(TEAVPN_FR_DEQUEUE, num, i, conn);
+
+		queues[i].sealed = (connections[conn].crypto.st.cipher != TEAVPN_CIPHER_NONE);
+		if (queues[i].sealed) {
+			teavpn_pb_reset(&(queue_bufs[i]), TEAVPN_PB_HEADROOM - TEAVPN_PACK(0));
+			queue_bufs[i].len = teavpn_crypto_seal(&(connections[conn].crypto),
+				teavpn_pb_data(&(queue_bufs[i])), packet, queues[i].seq);
+		}
+	}
+
+	for (register uint8_t k = 0; k < n; k++) {
+		i = jobs[k];
+		conn = queues[i].conn_index;
+		teavpn_reorder_done(&(connections[conn].reorder), queues[i].seq, &(queues[i]), worker_emit);
+	}
+
+	#undef packet
+}
+
+
+/**
+ * inline_write: the event loop sends what it has just queued,
+ * nobody is woken up. Jobs a worker has taken already leave
+ * in order through the reorder buffer.
+ *
+ * @return void
+ */
+static void worker_jobs_inline()
+{
+	uint8_t n;
+	int16_t jobs[WORKER_BURST];
+
+	while ((n = worker_job_pull(jobs, WORKER_BURST)) > 0) {
+		worker_jobs_run(jobs, n, WORKER_ALLOC);
+	}
+}
+
+
+/**
+ * @return bool	A job waits for a worker.
+ */
+static bool worker_job_pending()
+{
+	for (register int16_t i = 0; i < QUEUE_AMOUNT; ++i) {
+		if (__atomic_load_n(&(queues[i].used), __ATOMIC_RELAXED) &&
+			(!__atomic_load_n(&(queues[i].taken), __ATOMIC_RELAXED))) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * Poll the queue for the spin budget before the worker sleeps
+ * (spin_us), the event loop does not wake a spinning worker.
+ *
+ * @param struct worker_thread *worker
+ * @return bool	There is a job, no need to sleep.
+ */
+static bool worker_spin(struct worker_thread *worker)
+{
+	bool found = false;
+	uint64_t start, end, budget = __atomic_load_n(&(worker->spin.budget), __ATOMIC_RELAXED);
+
+	// Parked (threads_max), nobody counts on it.
+	if ((budget == 0) || (worker->num >= __atomic_load_n(&thread_amount, __ATOMIC_RELAXED))) {
+		return false;
+	}
+
+	start = end = teavpn_tsc();
+	__atomic_store_n(&(worker->spinning), true, __ATOMIC_SEQ_CST);
+	while (((end - start) < budget) &&
+		(__atomic_load_n(&(worker->state), __ATOMIC_ACQUIRE) == WORKER_RUNNING)) {
+		if (worker_job_pending()) {
+			found = true;
+			break;
+		}
+		teavpn_spin_relax();
+		end = teavpn_tsc();
+	}
+	__atomic_store_n(&(worker->spinning), false, __ATOMIC_SEQ_CST);
+
+	/**
+	 * Jobs queued after the last look were not signalled
+	 * (thread_job_wake() saw us spinning).
+	 */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!found) {
+		found = worker_job_pending();
+	}
+
+	teavpn_spin_done(&(worker->spin), start, end, found);
+	return found;
+}
+
+
+/**
+ * Spin budget of the event loop and of every worker slot.
+ *
+ * @param uint32_t spin_us	0 = off.
+ * @return void
+ */
+static void spin_apply(uint32_t spin_us)
+{
+	cpu_set_t cpus;
+	int nr_cpus = 1;
+	uint32_t worker_us = spin_us;
+
+	/**
+	 * A thread spinning on a shared CPU holds up the thread
+	 * it waits for. Workers only spin with a CPU of their own.
+	 */
+	if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+		nr_cpus = CPU_COUNT(&cpus);
+	}
+
+	if ((spin_us > 0) && (nr_cpus < 2)) {
+		debug_log(0, "spin_us needs more than one CPU, not spinning");
+		spin_us = worker_us = 0;
+	} else if ((spin_us > 0) && (nr_cpus < (1 + thread_spawned))) {
+		debug_log(0, "spin_us: %d CPUs for the event loop and %d workers, only the event loop spins",
+			nr_cpus, thread_spawned);
+		worker_us = 0;
+	}
+
+	teavpn_spin_init(&loop_spin, spin_us);
+	for (register uint8_t i = 0; i < WORKER_ALLOC; i++) {
+		teavpn_spin_init(&(workers[i].spin), worker_us);
+	}
+}
+
+
+/**
+ * The client sockets busy poll for as long as we spin,
+ * unless busy_poll is set in the config. Taken by the
+ * sockets of the next handshakes.
+ *
+ * @param server_config *config
+ * @return void
+ */
+static void spin_busy_poll(server_config *config)
+{
+	if (!config->busy_poll_set) {
+		config->sock_tuning.busy_poll = config->spin_us;
+	}
+}
+
+
+/**
+ * Write the frame of one job and release the job. Called by the
+ * reorder buffer in ticket order, one thread per connection.
+ *
+ * @param uint64_t	seq		Ticket of the job, seq of the frame.
+ * @param void		*item	struct teavpn_tcp_queue *
+ * @return void
+ */
+static void worker_emit(uint64_t seq, void *item)
+{
+
+	#define packet ((teavpn_packet *)teavpn_pb_data(&(bufchan[queues[i].bufchan_index].pb)))
+
+	register int16_t i = (int16_t)((struct teavpn_tcp_queue *)item - queues);
+	register uint16_t conn = queues[i].conn_index;
+	register ssize_t nwrite;
+	struct iovec iov[2];
+	int iovcnt;
+	bool held = false;
+	uint64_t tsc = teavpn_tsc();
+
+	// Closed meanwhile, the job only holds up the teardown.
+	if (__atomic_load_n(&(connections[conn].teardown), __ATOMIC_ACQUIRE) != CONN_LIVE) {
+		goto job_release;
+	}
+
+	if (queues[i].sealed) {
+		connections[conn].crypto.st.tx_seq = seq;
+		iov[0].iov_base = teavpn_pb_data(&(queue_bufs[i]));
+		iov[0].iov_len = queue_bufs[i].len;
+		iovcnt = 1;
+	} else {
+		/**
+		 * Our seq goes out of a private copy of the header,
+		 * kept in the job for zerocopy.
+		 */
+		queues[i].hdr = packet->info;
+		queues[i].hdr.seq = seq;
+		iov[0].iov_base = &(queues[i].hdr);
+		iov[0].iov_len = TEAVPN_PACK(0);
+		iov[1].iov_base = packet->data.data;
+		iov[1].iov_len = packet->info.len - TEAVPN_PACK(0);
+		iovcnt = 2;
+	}
+
+	if (iov[0].iov_len == 0) {
+		errno = EPROTO;
+		nwrite = -1;
+	} else if (teavpn_zc_wanted(&(connections[conn].zc), (iovcnt == 1) ? iov[0].iov_len : packet->info.len)) {
+		/**
+		 * The job (queue slot and buffer) stays until the
+		 * kernel is done with the pages.
+		 */
+		nwrite = teavpn_zc_send(&(connections[conn].zc), connections[conn].fd, iov, iovcnt, item, &held);
+		teavpn_zc_reap(&(connections[conn].zc), connections[conn].fd, zc_release);
+	} else {
+		nwrite = writev(connections[conn].fd, iov, iovcnt);
+	}
+
+	teavpn_lat_record(TEAVPN_LAT_SOCK_WRITE, tsc, teavpn_tsc());
+	TEAVPN_TRACE3(worker_write, worker_num_tls, conn, nwrite);
+
+	debug_log(3, "[%ld] Write to client %s:%d %ld bytes",
+		seq,
+		connections[conn].addr_str,
+		ntohs(connections[conn].addr.sin_port),
+		nwrite
+	);
+
+	/**
+	 * Connection closed by client.
+	 */
+	if (nwrite == 0) {
+		TEAVPN_TRACE3(conn_close, conn, connections[conn].fd, TEAVPN_CLOSE_WRITE_ZERO);
+		teavpn_fr_record(TEAVPN_FR_CONN_CLOSE, conn, connections[conn].fd, TEAVPN_CLOSE_WRITE_ZERO);
+		debug_log(1, "(%s:%d) connection closed",
+			connections[conn].addr_str,
+			ntohs(connections[conn].addr.sin_port)
+		);
+		connection_zero(conn);
+		goto job_release;
+	}
+
+
+	if (nwrite < 0) {
+		char *remote_addr = connections[conn].addr_str;
+		uint16_t remote_port = ntohs(connections[conn].addr.sin_port);
+
+		teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_SOCK_WRITE, errno, conn);
+		debug_log(0, "Error write to %s:%d", remote_addr, remote_port);
+		perror("Error write to connection fd");
+
+		/**
+		 * Increment the error counter.
+		 */
+		connections[conn].error++;
+
+		/**
+		 * Force disconnect client if it has
+		 * reached the max number of errors.
+		 */
+		if (connections[conn].error > MAX_CLIENT_ERR) {
+			debug_log(0,
+				"Client %s:%d has been disconnected because it has reached the max number of errors",
+				remote_addr,
+				remote_port
+			);
+			TEAVPN_TRACE3(conn_close, conn, connections[conn].fd, TEAVPN_CLOSE_MAX_ERR);
+			teavpn_fr_record(TEAVPN_FR_CONN_CLOSE, conn, connections[conn].fd, TEAVPN_CLOSE_MAX_ERR);
+			connection_zero(conn);
+		}
+	}
+
+
+	job_release:
+	if (!held) {
+		job_release(i);
+	}
+
+	#undef packet
+}
+
+
+/**
+ * Give the buffer reference and the queue slot of a
+ * written job back.
+ *
+ * @param int16_t i	Queue index.
+ * @return void
+ */
+static void job_release(int16_t i)
+{
+	int16_t b = queues[i].bufchan_index;
+	uint16_t conn = queues[i].conn_index;
+	uint16_t ref_count;
+
+	/**
+	 * Workers of other connections release the same buffer.
+	 */
+	ref_count = __atomic_sub_fetch(&(bufchan[b].ref_count), 1, __ATOMIC_ACQ_REL);
+	teavpn_fr_record(TEAVPN_FR_BUF_FREE, b, ref_count, 0);
+	if (ref_count == 0) {
+		__atomic_sub_fetch(&(bufchan_class[bufchan[b].class].used), 1, __ATOMIC_RELAXED);
+	}
+
+	teavpn_mutex_lock(&worker_job_pull_mutex);
+	queues[i].used = false;
+	queues[i].taken = false;
+	teavpn_mutex_unlock(&worker_job_pull_mutex);
+
+	conn_put(conn);
+}
+
+
+/**
+ * The kernel is done with the pages of a zerocopy frame.
+ *
+ * @param void *item	struct teavpn_tcp_queue *
+ * @return void
+ */
+static void zc_release(void *item)
+{
+	job_release((int16_t)((struct teavpn_tcp_queue *)item - queues));
+}
+
+
+/**
+ * Reap the zerocopy completions of every connection, closed ones
+ * included. Called by the main loop when it runs out of buffers or
+ * queue slots, the pending frames may be what holds them.
+ *
+ * @return void
+ */
+static void zc_reap_all()
+{
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if (connections[i].connected) {
+			teavpn_zc_reap(&(connections[i].zc), connections[i].fd, zc_release);
+		}
+	}
+
+	if (__atomic_load_n(&conns_draining, __ATOMIC_ACQUIRE) > 0) {
+		conn_drain();
+	}
+}
+
+
+/**
+ * Get index of free connection entry.
+ */
+static int16_t get_free_conn_index()
+{
+	for (int16_t i = 0; i < CONNECTION_ALLOC; ++i) {
+		if ((!connections[i].connected) &&
+			(__atomic_load_n(&(connections[i].teardown), __ATOMIC_ACQUIRE) == CONN_FREE)) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+/**
+ * Worker which accepts new connection.
+ */
+static void *teavpn_tcp_accept_worker_thread(server_config *config)
+{
+	FILE *h;
+	int client_fd;
+	uint64_t seq = 0;
+	char remote_addr[INET_ADDRSTRLEN];
+	int16_t conn_index;
+	uint16_t remote_port;
+	uint8_t hs_stage, cipher;
+	teavpn_packet packet;
+	ssize_t nread, nwrite, auth_len;
+	struct teavpn_kex kex;
+	struct teavpn_crypto_state crypto_st;
+	uint8_t kex_pub[TEAVPN_KEX_SIZE];
+	struct timeval timeout;
+	struct pollfd net_pfd;
+	struct sockaddr_in client_addr;
+	socklen_t rlen = sizeof(struct sockaddr_in);
+
+	/**
+	 * NDF
+	 */
+	char buffer[64 + OFFSETOF(teavpn_packet, data)], *pbuf;
+	size_t len, sp = 0;
+	const uint8_t sig = SERVER_PIPE_SIG_CONN;
+
+
+	/**
+	 * Set timeout to 10 seconds.
+	 */
+	timeout.tv_sec = 10;
+	timeout.tv_usec = 0;
+
+
+	while (true) {
+
+		teavpn_mutex_lock(&accept_worker_mutex);
+		teavpn_cond_wait(&accept_worker_cond, &accept_worker_mutex);
+
+		/**
+		 * User store changed by a reload, switch between
+		 * handshakes so one handshake sees one data_dir.
+		 */
+		if (__atomic_load_n(&pending_data_dir, __ATOMIC_ACQUIRE) != NULL) {
+			static bool data_dir_owned = false;
+			char *old = config->data_dir;
+
+			config->data_dir = __atomic_exchange_n(&pending_data_dir, NULL, __ATOMIC_ACQ_REL);
+			if (data_dir_owned) {
+				free(old);
+			}
+			data_dir_owned = true;
+			debug_log(0, "data_dir is now %s", config->data_dir);
+		}
+
+		/**
+		 * Set client_addr to zero.
+		 */
+		seq = 0;
+		hs_stage = 0;
+		memset(&client_addr, 0, sizeof(client_addr));
+
+		/**
+		 * The main loop can signal again for a connection we
+		 * already took. Do not sit in accept(2) with the lock
+		 * held, a reload and an upgrade take it from the main loop.
+		 */
+		net_pfd.fd = net_fd;
+		net_pfd.events = POLLIN;
+		if (poll(&net_pfd, 1, 0) <= 0) {
+			goto next_cycle;
+		}
+
+		client_fd = accept(net_fd, (struct sockaddr *)&client_addr, &rlen);
+
+		if (client_fd < 0) {
+			teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_ACCEPT, errno, 0);
+			debug_log(0, "Error on accept");
+			perror("Error on accept");
+			goto next_cycle;
+		}
+
+		inet_ntop(AF_INET, &(client_addr.sin_addr), remote_addr, sizeof(remote_addr));
+		remote_port = ntohs(client_addr.sin_port);
+
+		#define hs_trace(STAGE)									\
+			do {												\
+				hs_stage = STAGE;								\
+				TEAVPN_TRACE4(handshake, STAGE, client_fd,		\
+					client_addr.sin_addr.s_addr, remote_port);	\
+			} while (0)
+
+		hs_trace(TEAVPN_HS_ACCEPTED);
+
+		debug_log(3, "%s:%d is attempting to make a connection...", remote_addr, remote_port);
+
+		conn_index = get_free_conn_index();
+
+		if (conn_index == -1) {
+			debug_log(0, "Connection entry is full, cannot accept more client");
+			debug_log(0, "Dropping connection from %s:%d...", remote_addr, remote_port);
+			close(client_fd);
+			goto next_cycle;
+		}
+
+		/**
+		 * Set recv timeout.
+		 */
+		if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
+			debug_log(0, "Error set recv timeout");
+			perror("Error set recv timeout");
+			goto next_cycle;
+		}
+
+		/**
+		 * Set send timeout.
+		 */
+		if (setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
+			debug_log(0, "Error set recv timeout");
+			perror("Error set recv timeout");
+			goto next_cycle;
+		}
+
+		/**
+		 * TLS first, the auth packet then goes through the kernel.
+		 */
+		if (config->tls && (!teavpn_tls_handshake(&tls, client_fd, NULL))) {
+			debug_log(0, "Dropping connection from %s:%d, TLS failed", remote_addr, remote_port);
+			close(client_fd);
+			goto next_cycle;
+		}
+
+		/**
+		 * Read auth packet (username and password).
+		 */
+		seq++; // seq 1
+		nread = read(client_fd, &packet, sizeof(packet));
+
+		debug_log(3, "[%ld] Read auth packet from %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
+				seq, remote_addr, remote_port, nread, seq, packet.info.seq,
+				(seq == packet.info.seq) ? "match" : "invalid");
+
+		if (nread == 0) {
+			debug_log(3, "Client %s:%d closed connection", remote_addr, remote_port);
+			close(client_fd);
+			goto next_cycle;
+		}
+
+		if (nread < 0) {
+			debug_log(3, "An error occured when reading auth packet from %s:%d", remote_addr, remote_port);
+			perror("Error read from client (acceptor)");
+			close(client_fd);
+			goto next_cycle;
+		}
+
+		if (seq != packet.info.seq) {
+			debug_log(0, "Invalid packet sequence from %s:%d (client_seq: %ld) (server_seq: %ld)",
+				remote_addr, remote_port, seq, packet.info.seq);
+			close(client_fd);
+			goto next_cycle;
+		}
+
+		hs_trace(TEAVPN_HS_AUTH_READ);
+		auth_len = nread;
+
+		/**
+		 * Validate credential from auth packet.
+		 */
+		if (packet.info.type == TEAVPN_PACKET_AUTH) {
+			h = teavpn_auth_check(config, &(packet.data.auth));
+		} else {
+			debug_log(3, "Invalid auth packet from %s:%d", remote_addr, remote_port);
+			debug_log(3, "Dropping connection from %s:%d...", remote_addr, remote_port);
+			close(client_fd);
+			goto next_cycle;
+		}
+
+		if (h == NULL) {
+			/**
+			 * Invalid username or password.
+			 */
+			packet.info.type = TEAVPN_PACKET_SIG;
+			packet.info.len = TEAVPN_PACK(sizeof(packet.data.sig));
+			packet.info.seq = ++seq; // seq 2
+			packet.data.sig.sig = TEAVPN_SIG_AUTH_REJECT;
+			nwrite = write(client_fd, &packet, TEAVPN_PACK(sizeof(packet.data.sig)));
+			hs_trace(TEAVPN_HS_AUTH_REJECT);
+			debug_log(3, "Invalid username or password from %s:%d", remote_addr, remote_port);
+			debug_log(3, "Dropping connection from %s:%d...", remote_addr, remote_port);
+			close(client_fd);
+			goto next_cycle;
+		}
+
+
+		/**
+		 * Preparing client network interface configuration.
+		 */
+		memset(buffer, 0, sizeof(buffer));
+		pbuf = fgets(buffer, 63, h);
+		fclose(h);
+		if (pbuf == NULL) {
+			debug_log(0, "Invalid IP configuration for username %s", packet.data.auth.username);
+		}
+
+		len = strlen(buffer);
+
+		while (buffer[sp] != ' ') {
+			if (sp >= len) {
+				close(client_fd);
+				debug_log(0, "Invalid IP configuration for username %s", packet.data.auth.username);
+				goto next_cycle;
+			}
+			sp++;
+		}
+
+		if ((sp > sizeof("xxx.xxx.xxx.xxx/xx")) || ((len - (sp - 1)) > sizeof("xxx.xxx.xxx.xxx"))) {
+			close(client_fd);
+			debug_log(0, "Invalid IP configuration for username %s", packet.data.auth.username);
+			goto next_cycle;	
+		}
+
+		debug_log(1, "%s connected from (%s:%d) [%s]", packet.data.auth.username, remote_addr, remote_port, buffer);
+
+
+		/**
+		 * Assign client fd to connection entry.
+		 */
+		__atomic_store_n(&(connections[conn_index].teardown), CONN_LIVE, __ATOMIC_RELEASE);
+		connections[conn_index].fd = client_fd;
+		connections[conn_index].priv_ip = ip_read_conv(buffer);
+		connections[conn_index].error = 0;
+		connections[conn_index].addr = client_addr;
+		strcpy(connections[conn_index].addr_str, remote_addr);
+
+
+		/**
+		 * Socket tuning, the user may override the global one.
+		 */
+		{
+			char file[512];
+			struct teavpn_sock_tuning *tuning = &(connections[conn_index].tuning);
+
+			memcpy(tuning, &(config->sock_tuning), sizeof(*tuning));
+			snprintf(file, sizeof(file), "%s/users/%s/sockopt", config->data_dir, packet.data.auth.username);
+			teavpn_sock_tuning_load(tuning, file);
+			teavpn_sock_tune(client_fd, tuning, &(connections[conn_index].bufs));
+			teavpn_zc_enable(&(connections[conn_index].zc), client_fd, tuning->zerocopy, 0);
+		}
+
+
+		/**
+		 * Data channel keys. Older clients send a shorter auth
+		 * packet without cipher offer and key exchange key.
+		 * Over TLS the kernel already encrypts everything.
+		 */
+		cipher = TEAVPN_CIPHER_NONE;
+		memset(kex_pub, 0, sizeof(kex_pub));
+		if ((config->encryption != TEAVPN_ENCRYPTION_OFF) && (!config->tls) &&
+			(auth_len >= TEAVPN_PACK(sizeof(packet.data.auth)))) {
+			cipher = teavpn_crypto_pick(teavpn_crypto_offer(), packet.data.auth.ciphers);
+		}
+
+		if ((cipher == TEAVPN_CIPHER_NONE) && (!config->tls) && (config->encryption == TEAVPN_ENCRYPTION_REQUIRED)) {
+			debug_log(0, "Dropping %s:%d, it cannot encrypt the data channel (encryption = required)",
+				remote_addr, remote_port);
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+		if (cipher != TEAVPN_CIPHER_NONE) {
+			bool ok;
+
+			ok = teavpn_kex_init(&kex) &&
+				teavpn_crypto_derive(&crypto_st, cipher, &kex, packet.data.auth.kex_pub,
+					packet.data.auth.password, true) &&
+				teavpn_crypto_set(&(connections[conn_index].crypto), &crypto_st);
+
+			memcpy(kex_pub, kex.pub, sizeof(kex_pub));
+			teavpn_kex_destroy(&kex);
+			explicit_bzero(&crypto_st, sizeof(crypto_st));
+
+			if (!ok) {
+				connection_zero(conn_index);
+				goto next_cycle;
+			}
+
+			debug_log(2, "Data channel of %s:%d uses %s", remote_addr, remote_port, teavpn_cipher_name(cipher));
+		}
+
+
+		/**
+		 * Send auth ok signal.
+		 */
+		packet.info.type = TEAVPN_PACKET_SIG;
+		packet.info.len = TEAVPN_PACK(sizeof(packet.data.sig));
+		packet.data.sig.sig = TEAVPN_SIG_AUTH_OK;
+		packet.info.seq = ++seq; // seq 2
+
+		nwrite = write(client_fd, &packet, TEAVPN_PACK(sizeof(packet.data.sig)));
+		hs_trace(TEAVPN_HS_AUTH_OK);
+
+		debug_log(3, "[%ld] Write sig auth to %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
+				seq, remote_addr, remote_port, nwrite, seq, packet.info.seq,
+				(seq == packet.info.seq) ? "match" : "invalid");
+
+		if (nwrite == 0) {
+			debug_log(3, "Client %s:%d closed connection (authenticated)", remote_addr, remote_port);
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+		if (nwrite < 0) {
+			debug_log(3, "Error send auth ok signal to %s:%d", remote_addr, remote_port);
+			perror("Error write to client_fd (acceptor)");
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+
+		/**
+		 * Wait for ack signal.
+		 */
+		seq++; // seq 3
+		nread = read(client_fd, &packet, sizeof(packet));
+
+		debug_log(3, "[%ld] Read sig ack from %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
+				seq, remote_addr, remote_port, nread, seq, packet.info.seq,
+				(seq == packet.info.seq) ? "match" : "invalid");
+
+		if (nread == 0) {
+			debug_log(3, "Client %s:%d closed connection (authenticated)", remote_addr, remote_port);
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+		if (nread < 0) {
+			debug_log(3, "Error read ack packet from %s:%d", remote_addr, remote_port);
+			perror("Error read from client_fd (acceptor)");
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+		if (seq != packet.info.seq) {
+			debug_log(0, "Invalid packet sequence from %s:%d (client_seq: %ld) (server_seq: %ld) (authenticated)",
+				remote_addr, remote_port, seq, packet.info.seq);
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+		/**
+		 * Verify ack signal..
+		 */
+		if ((packet.info.type == TEAVPN_PACKET_SIG) && (packet.data.sig.sig == TEAVPN_SIG_ACK)) {
+			debug_log(3, "[%ld] Got ack from %s:%d (connection established)", seq, remote_addr, remote_port);
+			hs_trace(TEAVPN_HS_ACK);
+		} else {
+			debug_log(3, "[%ld] Invalid ack signal from %s:%d (authenticated)", seq, remote_addr, remote_port);
+			debug_log(0, "Dropping connection from %s:%d...", remote_addr, remote_port);
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+
+		/**
+		 * Send network interface configuration.
+		 */
+		packet.info.type = TEAVPN_PACKET_CONF;
+		packet.info.seq = ++seq; // seq 4
+		packet.info.len = TEAVPN_PACK(sizeof(packet.data.conf));
+		memcpy(packet.data.conf.inet4, buffer, sp);
+		packet.data.conf.inet4[sp] = '\0';
+		strcpy(packet.data.conf.inet4_broadcast, &(buffer[sp+1]));
+		packet.data.conf.cipher = cipher;
+		memcpy(packet.data.conf.kex_pub, kex_pub, sizeof(kex_pub));
+		nwrite = write(client_fd, &packet, TEAVPN_PACK(sizeof(packet.data.conf)));
+		hs_trace(TEAVPN_HS_CONF_SENT);
+
+		debug_log(3, "[%ld] Write packet conf to %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
+				seq, remote_addr, remote_port, nwrite, seq, packet.info.seq,
+				(seq == packet.info.seq) ? "match" : "invalid");
+
+		if (nwrite == 0) {
+			debug_log(3, "Client %s:%d closed connection (authenticated)", remote_addr, remote_port);
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+		if (nwrite < 0) {
+			debug_log(3, "Error send network config to %s:%d", remote_addr, remote_port);
+			perror("Error write to client_fd (acceptor)");
+			connection_zero(conn_index);
+			goto next_cycle;
+		}
+
+
+		/**
+		 * Set entry to connected state.
+		 */
+		connections[conn_index].connected = true;
+		connections[conn_index].seq = seq;
+		conn_count++;
+
+		hs_trace(TEAVPN_HS_ESTABLISHED);
+		TEAVPN_TRACE4(conn_open, conn_index, client_fd, client_addr.sin_addr.s_addr, remote_port);
+		teavpn_fr_record(TEAVPN_FR_CONN_OPEN, conn_index, client_fd, 0);
+
+
+		/**
+		 * Interrupt main process in order to read rd_set.
+		 */
+		nwrite = write(m_pipe_fd[1], &sig, sizeof(sig));
+		if (nwrite < 0) {
+			debug_log(0, "Error write to m_pipe_fd[1]");
+			perror("Error write to m_pipe_fd[1]");
+			goto next_cycle;
+		}
+
+		next_cycle:
+		if ((hs_stage != 0) && (hs_stage != TEAVPN_HS_ESTABLISHED)) {
+			TEAVPN_TRACE4(handshake_fail, hs_stage, client_fd, client_addr.sin_addr.s_addr, remote_port);
+		}
+		teavpn_mutex_unlock(&accept_worker_mutex);
+	}
+
+	#undef hs_trace
+
+	return NULL;
+}
+
+
+
+/**
+ * Initialize TeaVPN server (socket, pipe, etc.)
+ */
+static uint8_t teavpn_tcp_server_init(char *config_buffer, size_t config_buffer_size, server_config *config)
+{
+	uint8_t *room;
+	size_t uring_room = 0;
+	struct teavpn_arena *local;
+
+	// Initialize connection entry value.
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; ++i) {
+		teavpn_reorder_init(&(connections[i].reorder), i);
+		teavpn_zc_init(&(connections[i].zc), i);
+		connections[i].gen = 0;
+		connections[i].teardown = CONN_LIVE;
+		connections[i].inflight = 0;
+		connections[i].fd = connections[i].closed_fd = -1;
+		connections[i].zc_drain = false;
+		if (!teavpn_crypto_alloc(&(connections[i].crypto))) {
+			debug_log(0, "Cannot allocate the cipher contexts");
+			return 1;
+		}
+		connection_zero(i);
+	}
+
+	teavpn_mutex_init(&accept_worker_mutex, "accept_worker_mutex", -1);
+	teavpn_mutex_init(&worker_job_pull_mutex, "worker_job_pull_mutex", -1);
+
+	// Load config file.
+	if (config->config_file != NULL) {
+		if (!teavpn_server_config_parser(config_buffer, config_buffer_size, config)) {
+			debug_log(0, "Config error!");
+			return 1;
+		}
+	}
+
+	// Set verbose_level (global var).
+	verbose_level = config->verbose_level;
+
+	teavpn_crypto_log_cpu();
+	if ((config->encryption == TEAVPN_ENCRYPTION_REQUIRED) && (teavpn_crypto_offer() == TEAVPN_CIPHER_NONE)) {
+		debug_log(0, "encryption = required, but this build has no cipher (libcrypto)");
+		return 1;
+	}
+
+	if (config->tls && (!teavpn_tls_init(&tls, true, config->tls_cert_file, config->tls_key_file, NULL))) {
+		return 1;
+	}
+
+	// Calibrate TSC and clear latency histograms.
+	teavpn_lat_init();
+
+	// Lock contention profiling (needs calibrated TSC).
+	teavpn_lockstat_enable(config->lock_stats != 0);
+
+	// Flight recorder dump file and fatal signal handlers.
+	teavpn_fr_init(config->flight_recorder_file);
+
+	/**
+	 * Pin the main loop first, the packet arena below is
+	 * picked from the node it runs on. Threads created from
+	 * here on inherit this until they get their own CPUs.
+	 */
+	if (!teavpn_affinity_init(&affinity, config->cpu_affinity, config->bind_addr,
+		config->cpu_main, config->cpu_workers, config->cpu_housekeeping)) {
+		return 1;
+	}
+	teavpn_affinity_pin_self(&(affinity.main));
+
+	/**
+	 * Buffer channels and queues come from the packet arena,
+	 * on the node of the main loop which fills them.
+	 */
+#ifdef TEAVPN_HAVE_URING
+	if (config->io_uring) {
+		uring_room = ((size_t)URING_RX_BUFS * URING_RX_BUF_SIZE) + 64;
+	}
+#endif
+
+	if (!teavpn_arena_init(&arena,
+		(sizeof(struct buffer_channel) * BUFCHAN_ALLOC) + BUFCHAN_ROOM +
+		(sizeof(struct teavpn_tcp_queue) * QUEUE_AMOUNT) +
+		((sizeof(struct teavpn_pktbuf) + TEAVPN_PB_SIZE) * QUEUE_AMOUNT) + 320 + uring_room,
+		config->hugepages)) {
+		debug_log(0, "Cannot reserve the packet arena");
+		return 1;
+	}
+
+	local = teavpn_arena_local(&arena);
+	bufchan = teavpn_arena_alloc(local, sizeof(struct buffer_channel) * BUFCHAN_ALLOC, 64);
+	queues = teavpn_arena_alloc(local, sizeof(struct teavpn_tcp_queue) * QUEUE_AMOUNT, 64);
+	queue_bufs = teavpn_arena_alloc(local, sizeof(struct teavpn_pktbuf) * QUEUE_AMOUNT, 64);
+	room = teavpn_arena_alloc(local, BUFCHAN_ROOM + (TEAVPN_PB_SIZE * QUEUE_AMOUNT), 64);
+
+	// Initialize buffer channels, sealed frames get full size buffers.
+	bufchan_setup(room);
+#ifdef TEAVPN_HAVE_URING
+	bufchan_room = room;
+	if (config->io_uring) {
+		uring_rx_room = teavpn_arena_alloc(local, (size_t)URING_RX_BUFS * URING_RX_BUF_SIZE, 64);
+	}
+#endif
+	room += BUFCHAN_ROOM;
+	for (register uint16_t i = 0; i < QUEUE_AMOUNT; ++i) {
+		teavpn_pb_init(&(queue_bufs[i]), room, TEAVPN_PB_SIZE);
+		room += TEAVPN_PB_SIZE;
+	}
+
+	// Initialize queues.
+	for (register uint16_t  i = 0; i < QUEUE_AMOUNT; ++i) {
+		queue_zero(i);
+	}
+
+	// data_dir is a directory that saves TeaVPN data
+	// such as user, password, etc.
+	if (config->data_dir == NULL) {
+		debug_log(0, "Data dir cannot be empty!");
+		return 1;
+	}
+
+	/**
+	 * This pipe is purposed to interrupt main
+	 * process when a new connection is made.
+	 */
+	if (pipe(m_pipe_fd) < 0) {
+		debug_log(0, "Cannot open pipe for m_pipe_fd");
+		perror("Cannot open pipe for m_pipe_fd");
+		return 1;
+	}
+
+	/**
+	 * With --upgrade the interface and the sockets are
+	 * taken over from the running server later on.
+	 */
+	if (config->upgrade) {
+		if (config->upgrade_socket == NULL) {
+			debug_log(0, "--upgrade needs upgrade_socket in the config file");
+			close(m_pipe_fd[0]);
+			close(m_pipe_fd[1]);
+			return 1;
+		}
+		net_fd = -1;
+		tap_fd = -1;
+		return 0;
+	}
+
+	/**
+	 * Create TUN/TAP interface (or the user space backend).
+	 */
+	debug_log(2, "Allocating TUN/TAP interface...");
+	if ((tap_fd = teavpn_iface_open(&iface, config->iface_backend, config->dev)) < 0) {
+		debug_log(0, "Error connecting to TUN/TAP interface \"%s\"!", config->dev);
+		close(m_pipe_fd[0]);
+		close(m_pipe_fd[1]);
+		return 1;
+	}
+	debug_log(0, "Successfully created a new interface \"%s\".", config->dev);
+
+	/**
+	 * Initialize TUN/TAP interface.
+	 *
+	 * User space backends have no kernel device to configure.
+	 */
+	if (iface.ops->kernel && (!teavpn_tcp_server_init_iface(config))) {
+		debug_log(0, "Cannot init interface");
+		close(m_pipe_fd[0]);
+		close(m_pipe_fd[1]);
+		teavpn_iface_close(&iface);
+		return 1;
+	}
+
+	/**
+	 * Create TCP socket.
+	 */
+	debug_log(1, "Creating TCP socket...");
+	if ((net_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		debug_log(0, "Cannot create TCP socket");
+		perror("Socket creation failed");
+		close(m_pipe_fd[0]);
+		close(m_pipe_fd[1]);
+		teavpn_iface_close(&iface);
+		return 1;
+	}
+	debug_log(1, "TCP socket created successfully");
+
+	/**
+	 * Setting up socket.
+	 */
+	debug_log(1, "Setting up socket file descriptor...");
+	if (!teavpn_tcp_server_socket_setup(net_fd)) {
+		debug_log(0, "Cannot setup socket");
+		close(m_pipe_fd[0]);
+		close(m_pipe_fd[1]);
+		close(net_fd);
+		teavpn_iface_close(&iface);
+		return 1;
+	}
+	debug_log(1, "Socket file descriptor set up successfully");
+
+	return 0;
+}
+
+
+
+/**
+ * Get non-busy buffer channel index of class or a bigger one.
+ *
+ * @param uint8_t class	enum teavpn_pb_class
+ * @return int16_t
+ */
+static int16_t get_bufchan_index(uint8_t class)
+{
+	static bool sleep_state = false;
+	static uint8_t buf_chan_wait = 0;
+
+	for (int16_t i = bufchan_class[class].first; i < BUFCHAN_ALLOC; i++) {
+		if (bufchan[i].ref_count == 0) {
+			if (buf_chan_wait > 0) buf_chan_wait--;
+			return i;
+		}
+	}
+
+	TEAVPN_TRACE2(bufchan_exhausted, buf_chan_wait, sleep_state);
+	zc_reap_all();
+
+	if (buf_chan_wait == 0) {
+		teavpn_fr_record(TEAVPN_FR_BUF_EXHAUSTED, buf_chan_wait, sleep_state, 0);
+	}
+
+	if (buf_chan_wait > 30) {
+		if (!sleep_state) {
+			teavpn_fr_record(TEAVPN_FR_BUF_EXHAUSTED, buf_chan_wait, true, 0);
+		}
+		sleep_state = true;
+	} else {
+		if (buf_chan_wait <= 100) buf_chan_wait++;
+	}
+
+	if (sleep_state) {
+		debug_log(1, "Buffer channel got sleep state...\n");
+
+		// Make sure no worker sleeps on a pending job.
+		thread_job_broadcast();
+		usleep(10000);
+		buf_chan_wait--;
+		if (buf_chan_wait <= 20) {
+			debug_log(1, "Sleep state has been released\n");
+			teavpn_fr_record(TEAVPN_FR_BUF_EXHAUSTED, buf_chan_wait, false, 0);
+			sleep_state = false;
+		}
+	}
+
+	return -1;
+}
+
+
+
+/**
+ * Carve the buffer channels out of storage, class by class
+ * in ascending size.
+ *
+ * @param uint8_t *storage	BUFCHAN_ROOM bytes, 64-byte aligned.
+ * @return void
+ */
+static void bufchan_setup(uint8_t *storage)
+{
+	const uint16_t count[TEAVPN_PB_CLASSES] = {BUFCHAN_SMALL, BUFCHAN_MEDIUM, BUFCHAN_LARGE};
+	uint16_t i = 0;
+
+	memset(bufchan_class, 0, sizeof(bufchan_class));
+	for (register uint8_t c = 0; c < TEAVPN_PB_CLASSES; c++) {
+		bufchan_class[c].first = i;
+		bufchan_class[c].count = count[c];
+
+		for (register uint16_t k = 0; k < count[c]; k++, i++) {
+			bufchan[i].ref_count = 0;
+			bufchan[i].class = c;
+			teavpn_pb_init(&(bufchan[i].pb), storage, teavpn_pb_class_room(c));
+			storage += teavpn_pb_class_room(c);
+		}
+	}
+}
+
+
+
+/**
+ * Keep reading until the whole frame announced by
+ * the header in pkt is in the buffer.
+ *
+ * The length comes from the client, it is checked against
+ * the buffer like the io_uring framer does before anything
+ * lands past the frame.
+ *
+ * @param uint16_t		i		Connection index.
+ * @param teavpn_packet	*pkt
+ * @param ssize_t		nread	Bytes already in pkt.
+ * @return ssize_t	-1 on an impossible length, EOF or a read error.
+ */
+static ssize_t conn_read_frame_rest(uint16_t i, teavpn_packet *pkt, ssize_t nread)
+{
+	if ((pkt->info.len < TEAVPN_PACK(0)) || (pkt->info.len > sizeof(teavpn_packet))) {
+		debug_log(0, "Client %s:%d sent a frame of impossible length (%d)",
+			connections[i].addr_str, ntohs(connections[i].addr.sin_port), pkt->info.len);
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	while (nread < (pkt->info.len)) {
+		register ssize_t tmp_nread;
+		debug_log(3, "Read extra %ld/%d bytes", nread, pkt->info.len);
+		tmp_nread = read(
+			connections[i].fd,
+			&(((char *)pkt)[nread]),
+			pkt->info.len - nread
+		);
+
+		if ((tmp_nread < 0) && (errno == EINTR)) {
+			continue;
+		}
+
+		if (tmp_nread <= 0) {
+			if (tmp_nread < 0) {
+				perror("Error read extra");
+			} else {
+				errno = 0;
+			}
+			return -1;
+		}
+
+		nread += tmp_nread;
+	}
+
+	return nread;
+}
+
+
+
+/**
+ * Set queue entry to zero (clean up).
+ */
+static void queue_zero(register uint16_t i)
+{
+	queues[i].used = false;
+	queues[i].queue_id = -1;
+	queues[i].conn_index = -1;
+	queues[i].bufchan_index = -1;
+}
+
+
+
+/**
+ * Set connection entry to zero (clean up), the entry owns its
+ * socket and closes it.
+ *
+ * The cipher state and the socket are torn down once no worker
+ * holds a job of the connection any more, see conn_teardown().
+ */
+static void connection_zero(register uint16_t i)
+{
+	uint8_t expected = CONN_LIVE;
+
+	/**
+	 * Held until the entry is ready for the teardown. Closed
+	 * twice (worker and event loop), once is enough.
+	 */
+	__atomic_add_fetch(&(connections[i].inflight), 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_compare_exchange_n(&(connections[i].teardown), &expected, CONN_CLOSING, false,
+		__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		conn_put(i);
+		return;
+	}
+
+	__atomic_add_fetch(&(connections[i].gen), 1, __ATOMIC_ACQ_REL);
+	connections[i].closed_fd = connections[i].fd;
+	connections[i].fd = -1;
+	connections[i].connected = false;
+	connections[i].error = 0;
+	connections[i].seq = 0;
+	connections[i].priv_ip = 0;
+	memset(&(connections[i].addr), 0, sizeof(connections[i].addr));
+	connections[i].addr_str[0] = '\0';
+
+	/**
+	 * A worker may be sending a zerocopy frame right now, the
+	 * event loop reaps the completions until the last job is
+	 * released.
+	 */
+	if ((connections[i].closed_fd != -1) && (connections[i].zc.threshold > 0)) {
+		connections[i].zc_drain = true;
+		connections[i].zc_aborted = false;
+		connections[i].closed_tsc = teavpn_tsc();
+		__atomic_add_fetch(&conns_draining, 1, __ATOMIC_RELEASE);
+	}
+
+	conn_put(i);
+}
+
+
+
+/**
+ * Count a job (or a frame being opened) of connection i in flight.
+ *
+ * @param uint16_t i
+ * @return bool	false if the connection is closing, nothing held.
+ */
+static bool conn_hold(uint16_t i)
+{
+	__atomic_add_fetch(&(connections[i].inflight), 1, __ATOMIC_SEQ_CST);
+
+	/**
+	 * Pairs with connection_zero(): either we see it closing
+	 * or its conn_teardown() sees our count.
+	 */
+	if (__atomic_load_n(&(connections[i].teardown), __ATOMIC_SEQ_CST) == CONN_LIVE) {
+		return true;
+	}
+
+	conn_put(i);
+	return false;
+}
+
+
+
+/**
+ * @param uint16_t i
+ * @return void
+ */
+static void conn_put(uint16_t i)
+{
+	if (__atomic_sub_fetch(&(connections[i].inflight), 1, __ATOMIC_SEQ_CST) == 0) {
+		conn_teardown(i);
+	}
+}
+
+
+
+/**
+ * Free the cipher state of a closed connection when nothing of
+ * it is in flight. Called by connection_zero() and by the last
+ * conn_put(), only one of them gets to do it.
+ *
+ * @param uint16_t i
+ * @return void
+ */
+static void conn_teardown(uint16_t i)
+{
+	uint8_t expected = CONN_CLOSING;
+
+	if (__atomic_load_n(&(connections[i].inflight), __ATOMIC_SEQ_CST) != 0) {
+		return;
+	}
+
+	if (!__atomic_compare_exchange_n(&(connections[i].teardown), &expected, CONN_TEARDOWN, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+
+	teavpn_crypto_clear(&(connections[i].crypto));
+
+	// conn_drain() closes it, it may be reaping right now.
+	if (connections[i].zc_drain) {
+		__atomic_store_n(&(connections[i].teardown), CONN_LINGER, __ATOMIC_RELEASE);
+		return;
+	}
+
+	if (connections[i].closed_fd != -1) {
+		close(connections[i].closed_fd);
+		connections[i].closed_fd = -1;
+	}
+	__atomic_store_n(&(connections[i].teardown), CONN_FREE, __ATOMIC_RELEASE);
+}
+
+
+
+/**
+ * Reap the zerocopy completions of closed connections, called by
+ * the event loop. The frames stay queued while the kernel may send
+ * from their pages, a peer which does not take them gets reset
+ * after CONN_LINGER_MS. The socket is closed once the last job of
+ * the connection is released.
+ *
+ * @return void
+ */
+static void conn_drain()
+{
+	uint64_t now = teavpn_tsc();
+	uint64_t linger = (teavpn_tsc_hz() / 1000) * CONN_LINGER_MS;
+
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		struct connection_entry *conn = &(connections[i]);
+
+		if (!conn->zc_drain) {
+			continue;
+		}
+
+		if (__atomic_load_n(&(conn->teardown), __ATOMIC_ACQUIRE) == CONN_LINGER) {
+			close(conn->closed_fd);
+			conn->closed_fd = -1;
+			conn->zc_drain = false;
+			__atomic_sub_fetch(&conns_draining, 1, __ATOMIC_RELEASE);
+			__atomic_store_n(&(conn->teardown), CONN_FREE, __ATOMIC_RELEASE);
+			continue;
+		}
+
+		teavpn_zc_reap(&(conn->zc), conn->closed_fd, zc_release);
+
+		if ((!conn->zc_aborted) && ((now - conn->closed_tsc) > linger) &&
+			(__atomic_load_n(&(conn->zc.pending), __ATOMIC_ACQUIRE) > 0)) {
+			debug_log(1, "Connection %d is closed with %u zerocopy frames unsent, resetting it",
+				i, __atomic_load_n(&(conn->zc.pending), __ATOMIC_RELAXED));
+			teavpn_zc_abort(conn->closed_fd);
+			conn->zc_aborted = true;
+		}
+	}
+}
+
+
+
+/**
+ * Authenticate and decrypt a client frame, a worker may close
+ * the connection meanwhile.
+ *
+ * @param uint16_t		i
+ * @param teavpn_packet	*pkt
+ * @return ssize_t	As teavpn_crypto_open(), -1 if the connection is closing.
+ */
+static ssize_t conn_crypto_open(uint16_t i, teavpn_packet *pkt)
+{
+	ssize_t ret;
+
+	if (!conn_hold(i)) {
+		return -1;
+	}
+
+	ret = teavpn_crypto_open(&(connections[i].crypto), pkt);
+	conn_put(i);
+	return ret;
+}
+
+
+
+/**
+ * Initialize network interface for TeaVPN server.
+ *
+ * @param server_config *config
+ * @return bool
+ */
+static bool teavpn_tcp_server_init_iface(server_config *config)
+{
+	int ifindex;
+	bool ret = false;
+	struct teavpn_nl nl;
+
+	ifindex = teavpn_nl_ifindex(config->dev);
+	if (ifindex == 0) {
+		debug_log(0, "Cannot find interface %s", config->dev);
+		return false;
+	}
+
+	if (!teavpn_nl_open(&nl)) {
+		return false;
+	}
+
+	debug_log(0, "Setting up %s: mtu %d, address %s broadcast %s", config->dev, config->mtu,
+		config->inet4, config->inet4_broadcast);
+
+	if ((!teavpn_nl_link_up(&nl, ifindex, config->mtu)) ||
+		(!teavpn_nl_addr_add(&nl, ifindex, config->inet4, config->inet4_broadcast))) {
+		goto out;
+	}
+
+	ret = teavpn_nl_commit(&nl);
+
+	out:
+	teavpn_nl_close(&nl);
+	return ret;
+}
+
+
+
+/**
+ * @param int sock_fd
+ * @return void
+ */
+static bool teavpn_tcp_server_socket_setup(int sock_fd)
+{
+	int optval = 1;
+
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval)) < 0) {
+		perror("setsockopt()");
+		return false;
+	}
+
+	return true;
+}
+
+
+
+/**
+ * Signal handler for stats dump.
+ *
+ * Only forward the signal to the main event loop
+ * through m_pipe_fd, write(2) is async-signal-safe.
+ *
+ * @param int sig
+ * @return void
+ */
+static void teavpn_tcp_server_signal_handler(int sig)
+{
+	ssize_t ret;
+	uint8_t sig_x;
+
+	if (sig == SIGUSR1) {
+		sig_x = SERVER_PIPE_SIG_STATS;
+	} else if (sig == SIGHUP) {
+		sig_x = SERVER_PIPE_SIG_RELOAD;
+	} else {
+		sig_x = SERVER_PIPE_SIG_STATS_RESET;
+	}
+
+	ret = write(m_pipe_fd[1], &sig_x, sizeof(sig_x));
+	(void)ret;
+}
+
+
+
+/**
+ * Signal handler for flight recorder dump.
+ *
+ * Dump directly from the handler, the event loop
+ * may be the thing which is stuck.
+ *
+ * @param int sig
+ * @return void
+ */
+static void teavpn_tcp_server_fr_signal_handler(int sig)
+{
+	teavpn_fr_dump(TEAVPN_FR_DUMP_SIGNAL, sig);
+}
+
+
+
+/**
+ * Install signal handlers.
+ *
+ * SIGUSR1	-> dump stats.
+ * SIGUSR2	-> dump flight recorder.
+ * SIGRTMIN	-> dump stats and reset them.
+ * SIGHUP	-> reload the config file.
+ *
+ * @return void
+ */
+static void teavpn_tcp_server_signal_init()
+{
+	struct sigaction act;
+
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = teavpn_tcp_server_signal_handler;
+	act.sa_flags = SA_RESTART;
+	sigemptyset(&(act.sa_mask));
+
+	sigemptyset(&server_sigset);
+	sigaddset(&server_sigset, SIGUSR1);
+	sigaddset(&server_sigset, SIGUSR2);
+	sigaddset(&server_sigset, SIGRTMIN);
+	sigaddset(&server_sigset, SIGHUP);
+
+	sigaction(SIGUSR1, &act, NULL);
+	sigaction(SIGRTMIN, &act, NULL);
+	sigaction(SIGHUP, &act, NULL);
+
+	act.sa_handler = teavpn_tcp_server_fr_signal_handler;
+	sigaction(SIGUSR2, &act, NULL);
+}
+
+
+
+/**
+ * Dump server statistics to stats_file (stdout by default).
+ *
+ * @param server_config *config
+ * @param bool reset
+ * @return void
+ */
+static void teavpn_tcp_server_stats_dump(server_config *config, bool reset)
+{
+	FILE *fp = stdout;
+	uint16_t connected = 0;
+	const char *class_name[TEAVPN_PB_CLASSES] = {"small", "medium", "large"};
+
+	if (config->stats_file != NULL) {
+		fp = fopen(config->stats_file, "a");
+		if (fp == NULL) {
+			debug_log(0, "Cannot open stats file %s", config->stats_file);
+			perror("Cannot open stats file");
+			return;
+		}
+	}
+
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if (connections[i].connected) {
+			connected++;
+		}
+	}
+
+	fprintf(fp, "[stats] time=%ld connections=%d threads=%d\n", time(NULL), connected, thread_amount);
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if (connections[i].connected) {
+			teavpn_sock_bufs_dump(fp, i, &(connections[i].bufs));
+			teavpn_crypto_dump(fp, i, &(connections[i].crypto));
+			teavpn_reorder_dump(fp, i, &(connections[i].reorder));
+			teavpn_tls_dump(fp, i, connections[i].fd);
+			teavpn_zc_dump(fp, i, &(connections[i].zc));
+		}
+	}
+	if (affinity.mode != TEAVPN_AFFINITY_OFF) {
+		teavpn_affinity_dump(&affinity, fp);
+	}
+	for (register uint8_t c = 0; c < TEAVPN_PB_CLASSES; c++) {
+		fprintf(fp, "[pktbuf] class=%s room=%zu bufs=%d bytes=%zu used=%d max_used=%d frames=%lu promoted=%lu\n",
+			class_name[c], teavpn_pb_class_room(c), bufchan_class[c].count,
+			teavpn_pb_class_room(c) * bufchan_class[c].count,
+			__atomic_load_n(&(bufchan_class[c].used), __ATOMIC_RELAXED), bufchan_class[c].max_used,
+			bufchan_class[c].frames, bufchan_class[c].promoted);
+	}
+	fprintf(fp, "[burst] tun bursts=%lu frames=%lu avg=%.1f unicast=%lu dropped=%lu\n",
+		burst_count, burst_frames, (burst_count > 0) ? ((double)burst_frames / burst_count) : 0.0,
+		burst_unicast, burst_dropped);
+	if ((config->spin_us > 0) || inline_write) {
+		fprintf(fp, "[spin] spin_us=%u inline_write=%d\n", config->spin_us, inline_write);
+		if (loop_spin.max > 0) {
+			teavpn_spin_dump(fp, "loop", &loop_spin);
+		}
+		for (register uint8_t i = 0; i < thread_spawned; i++) {
+			char name[32];
+
+			if (workers[i].spin.max > 0) {
+				sprintf(name, "worker-%d", i);
+				teavpn_spin_dump(fp, name, &(workers[i].spin));
+			}
+		}
+	}
+#ifdef TEAVPN_HAVE_URING
+	if (uring_on) {
+		teavpn_uring_dump(fp, "server", &ring);
+		fprintf(fp, "[io_uring] rx_bufs=%d rx_empty=%lu tun_landing=%d tun_empty=%lu\n",
+			URING_RX_BUFS, ring_rx.empty, uring_nr_landing, ring_tun.empty);
+	}
+#endif
+	if (pool_max > 0) {
+		fprintf(fp, "[workers] active=%d parked=%d min=%d max=%d util=%.1f%% depth_max=%d grown=%lu parked_total=%lu\n",
+			thread_amount, thread_spawned - thread_amount, pool_min, pool_max, pool_util,
+			pool_depth_max, pool_grown, pool_parked);
+	}
+	teavpn_arena_stats(&arena, fp);
+	teavpn_lat_dump(fp);
+	teavpn_lockstat_dump(fp);
+	teavpn_iface_stats(&iface, fp);
+
+	if (reset) {
+		teavpn_lat_reset();
+		teavpn_lockstat_reset();
+		burst_count = burst_frames = burst_unicast = burst_dropped = 0;
+		pool_grown = pool_parked = 0;
+		pool_depth_max = 0;
+		teavpn_spin_reset(&loop_spin);
+		for (register uint8_t i = 0; i < WORKER_ALLOC; i++) {
+			teavpn_spin_reset(&(workers[i].spin));
+		}
+#ifdef TEAVPN_HAVE_URING
+		ring.enters = ring.submitted = ring.completed = ring.sq_full = 0;
+		ring_rx.empty = ring_tun.empty = 0;
+#endif
+		for (register uint8_t c = 0; c < TEAVPN_PB_CLASSES; c++) {
+			bufchan_class[c].max_used = bufchan_class[c].used;
+			bufchan_class[c].frames = bufchan_class[c].promoted = 0;
+		}
+		fprintf(fp, "[stats] latency histograms and lock stats have been reset\n");
+	}
+
+	fflush(fp);
+	if (fp != stdout) {
+		fclose(fp);
+	}
+}
+
+
+
+/**
+ * Start the worker of slot i.
+ *
+ * @param uint8_t i
+ * @return bool
+ */
+static bool worker_spawn(uint8_t i)
+{
+	char thread_name[sizeof(TEAVPN_WORKER_COMM "xxx")];
+	uint8_t expected = WORKER_STOPPING;
+
+	/**
+	 * Still on its way out, keep it.
+	 */
+	if (__atomic_compare_exchange_n(&(workers[i].state), &expected, WORKER_RUNNING, false,
+		__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return true;
+	}
+
+	if (expected == WORKER_RUNNING) {
+		return true;
+	}
+
+	if (expected == WORKER_UNUSED) {
+		workers[i].num = i;
+		pthread_cond_init(&(workers[i].cond), NULL);
+		teavpn_mutex_init(&(workers[i].mutex), "worker", i);
+	}
+
+	workers[i].busy = false;
+	__atomic_store_n(&(workers[i].state), WORKER_RUNNING, __ATOMIC_RELEASE);
+
+	if (pthread_create(
+		&(workers[i].thread),
+		NULL,
+		(void * (*)(void *))teavpn_tcp_worker_thread,
+		(void *)&(workers[i])
+	) != 0) {
+		__atomic_store_n(&(workers[i].state), WORKER_EXITED, __ATOMIC_RELEASE);
+		return false;
+	}
+	pthread_detach(workers[i].thread);
+
+	sprintf(thread_name, TEAVPN_WORKER_COMM "%d", i);
+	pthread_setname_np(workers[i].thread, thread_name);
+	teavpn_affinity_pin_worker(&affinity, workers[i].thread, i);
+	return true;
+}
+
+
+
+/**
+ * Change the number of worker threads, called from the event
+ * loop. New threads are parked until the caller raises
+ * thread_amount.
+ *
+ * Removed workers finish the packet they are writing and exit,
+ * queued packets are picked up by the remaining ones.
+ *
+ * @param uint8_t amount
+ * @return void
+ */
+static void worker_resize(uint8_t amount)
+{
+	uint8_t old = thread_spawned;
+
+	if (amount > old) {
+		for (register uint8_t i = old; i < amount; i++) {
+			if (!worker_spawn(i)) {
+				debug_log(0, "Cannot create worker thread %d", i);
+				amount = i;
+				break;
+			}
+		}
+		thread_spawned = amount;
+		return;
+	}
+
+	/**
+	 * Shrink first, thread_job_broadcast() must not
+	 * signal the workers which are being removed.
+	 */
+	if (thread_amount > amount) {
+		__atomic_store_n(&thread_amount, amount, __ATOMIC_RELAXED);
+	}
+	thread_spawned = amount;
+	for (register uint8_t i = amount; i < old; i++) {
+		uint8_t expected = WORKER_RUNNING;
+
+		if (!__atomic_compare_exchange_n(&(workers[i].state), &expected, WORKER_STOPPING, false,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			continue;
+		}
+
+		/**
+		 * A busy worker sees the new state before it waits again.
+		 * An idle one only holds its mutex for a moment before
+		 * pthread_cond_wait(), never block the event loop on a
+		 * worker which is writing to a slow client.
+		 */
+		for (register uint8_t retry = 0; (retry < 100) && (!workers[i].busy); retry++) {
+			if (pthread_mutex_trylock(&(workers[i].mutex.mutex)) == 0) {
+				pthread_cond_signal(&(workers[i].cond));
+				pthread_mutex_unlock(&(workers[i].mutex.mutex));
+				break;
+			}
+			sched_yield();
+		}
+	}
+}
+
+
+
+/**
+ * Size the worker pool from threads, threads_min and threads_max.
+ *
+ * Without threads_max the pool is threads workers. With it
+ * threads_max workers are started and active of them (clamped
+ * to threads_min..threads_max) take jobs, the others stay parked
+ * in pthread_cond_wait() until worker_pool_grow() wakes them.
+ *
+ * @param server_config	*config
+ * @param uint8_t		active
+ * @return bool	false if the values are invalid (nothing changed)
+ *				or a thread could not be created.
+ */
+static bool worker_pool_apply(server_config *config, uint8_t active)
+{
+	uint8_t min = (config->threads_min > 0) ? config->threads_min : 3;
+	uint8_t max = config->threads_max;
+
+	if (max == 0) {
+		if (config->threads < 3) {
+			debug_log(0, "Minimal threads amount is 3, but %d given", config->threads);
+			return false;
+		}
+		pool_min = pool_max = 0;
+		worker_resize(config->threads);
+		__atomic_store_n(&thread_amount, thread_spawned, __ATOMIC_RELAXED);
+		return thread_spawned == config->threads;
+	}
+
+	if ((min < 3) || (min > max)) {
+		debug_log(0, "threads_min must be at least 3 and at most threads_max, but %d and %d given", min, max);
+		return false;
+	}
+
+	if (active < min) {
+		active = min;
+	} else if (active > max) {
+		active = max;
+	}
+
+	pool_min = min;
+	pool_max = max;
+	pool_grow_gap = (teavpn_tsc_hz() / 1000) * WORKER_POOL_GROW_MS;
+	pool_idle_ticks = 0;
+	worker_resize(max);
+	if (active > thread_spawned) {
+		active = thread_spawned;
+	}
+	__atomic_store_n(&thread_amount, active, __ATOMIC_RELAXED);
+	return thread_spawned == max;
+}
+
+
+
+/**
+ * Activate a parked worker and give it the jobs which found no
+ * idle one. At most one per WORKER_POOL_GROW_MS, a worker needs
+ * that long to take its first burst.
+ *
+ * @return void
+ */
+static void worker_pool_grow()
+{
+	uint64_t now = teavpn_tsc();
+	uint8_t i = thread_amount;
+
+	if ((i >= thread_spawned) || ((now - pool_grow_last) < pool_grow_gap)) {
+		return;
+	}
+
+	pool_grow_last = now;
+	pool_idle_ticks = 0;
+	pool_grown++;
+	__atomic_store_n(&thread_amount, i + 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&(workers[i].cond));
+	debug_log(3, "Worker %d activated (queue depth)", i);
+}
+
+
+
+/**
+ * Once a second from the event loop: grow or shrink the pool by
+ * one worker from its utilisation since the last call. The gap
+ * between WORKER_POOL_LOW and WORKER_POOL_HIGH and the slow
+ * shrink keep it from flapping.
+ *
+ * @return void
+ */
+static void worker_autoscale()
+{
+	uint64_t busy = 0, now = teavpn_tsc();
+
+	if (pool_max == 0) {
+		return;
+	}
+
+	for (register uint8_t i = 0; i < thread_spawned; i++) {
+		busy += __atomic_load_n(&(workers[i].busy_ticks), __ATOMIC_RELAXED);
+	}
+
+	if ((pool_tick_last > 0) && (now > pool_tick_last)) {
+		pool_util = (100.0 * (double)(busy - pool_busy_last)) /
+			((double)(now - pool_tick_last) * thread_amount);
+
+		if ((pool_util > WORKER_POOL_HIGH) && (thread_amount < thread_spawned)) {
+			pool_grow_last = 0;
+			worker_pool_grow();
+		} else if ((pool_util < WORKER_POOL_LOW) && (thread_amount > pool_min) && (!worker_job_pending())) {
+			if (++pool_idle_ticks >= WORKER_POOL_IDLE_TICKS) {
+				/**
+				 * No signal: it finishes the jobs it has
+				 * and waits until it is activated again.
+				 */
+				pool_idle_ticks = 0;
+				pool_parked++;
+				__atomic_store_n(&thread_amount, thread_amount - 1, __ATOMIC_RELAXED);
+				debug_log(3, "Worker %d parked (utilisation %.1f%%)", thread_amount, pool_util);
+			}
+		} else {
+			pool_idle_ticks = 0;
+		}
+	}
+
+	pool_busy_last = busy;
+	pool_tick_last = now;
+}
+
+
+
+/**
+ * @param const char *a
+ * @param const char *b
+ * @return bool
+ */
+static inline bool reload_str_changed(const char *a, const char *b)
+{
+	if ((a == NULL) || (b == NULL)) {
+		return a != b;
+	}
+	return strcmp(a, b) != 0;
+}
+
+
+
+/**
+ * Reload the config file (SIGHUP).
+ *
+ * Worker pool, verbose level, lock stats, watchdog timeout,
+ * stats_file and data_dir are applied live. Everything that
+ * belongs to the socket or the interface is only reported,
+ * it needs a restart. Connections are not touched.
+ *
+ * @param server_config *config
+ * @return void
+ */
+static void teavpn_tcp_server_reload(server_config *config)
+{
+	char buffer[4096];
+	server_config new_config;
+	uint8_t applied = 0, restart = 0;
+	static char *live_data_dir = NULL;
+	static bool stats_file_owned = false;
+
+	if (config->config_file == NULL) {
+		debug_log(0, "Reload: the server has been started without a config file");
+		return;
+	}
+
+	debug_log(0, "Reloading %s...", config->config_file);
+
+	/**
+	 * Keys which are not in the file keep their running value.
+	 * data_dir is owned by the accept worker, use our copy.
+	 */
+	memcpy(&new_config, config, sizeof(new_config));
+	new_config.data_dir = (live_data_dir != NULL) ? live_data_dir : config->data_dir;
+
+	if (!teavpn_server_config_parser(buffer, sizeof(buffer), &new_config)) {
+		debug_log(0, "Reload: config error, keeping the running configuration");
+		return;
+	}
+
+	// A spin_us change moves a derived busy_poll, see the socket tuning below.
+	spin_busy_poll(&new_config);
+
+	#define RELOAD_RESTART_STR(KEY)															\
+		if (reload_str_changed(config->KEY, new_config.KEY)) {								\
+			debug_log(0, "Reload: " #KEY " cannot be changed live (%s -> %s), restart needed",	\
+				config->KEY, new_config.KEY);												\
+			restart++;																		\
+		}
+
+	#define RELOAD_RESTART_NUM(KEY)															\
+		if (config->KEY != new_config.KEY) {												\
+			debug_log(0, "Reload: " #KEY " cannot be changed live (%d -> %d), restart needed",	\
+				config->KEY, new_config.KEY);												\
+			restart++;																		\
+		}
+
+	RELOAD_RESTART_STR(bind_addr);
+	RELOAD_RESTART_NUM(bind_port);
+	RELOAD_RESTART_STR(dev);
+	RELOAD_RESTART_STR(iface_backend);
+	RELOAD_RESTART_STR(inet4);
+	RELOAD_RESTART_STR(inet4_broadcast);
+	RELOAD_RESTART_NUM(mtu);
+	RELOAD_RESTART_STR(error_log_file);
+	RELOAD_RESTART_STR(flight_recorder_file);
+	RELOAD_RESTART_STR(upgrade_socket);
+	RELOAD_RESTART_NUM(hugepages);
+	RELOAD_RESTART_NUM(cpu_affinity);
+	RELOAD_RESTART_STR(cpu_main);
+	RELOAD_RESTART_STR(cpu_workers);
+	RELOAD_RESTART_STR(cpu_housekeeping);
+	RELOAD_RESTART_NUM(tls);
+	RELOAD_RESTART_NUM(io_uring);
+	RELOAD_RESTART_STR(tls_cert_file);
+	RELOAD_RESTART_STR(tls_key_file);
+
+	#undef RELOAD_RESTART_STR
+	#undef RELOAD_RESTART_NUM
+
+	/**
+	 * An autoscaled pool keeps its size, clamped to the
+	 * new range.
+	 */
+	if ((new_config.threads != config->threads) || (new_config.threads_min != config->threads_min) ||
+		(new_config.threads_max != config->threads_max)) {
+		if (worker_pool_apply(&new_config,
+			((pool_max > 0) && (new_config.threads_max > 0)) ? thread_amount : new_config.threads)) {
+			debug_log(0, "Reload: threads %d (min %d, max %d), %d workers, %d active",
+				new_config.threads, new_config.threads_min, new_config.threads_max,
+				thread_spawned, thread_amount);
+			config->threads = new_config.threads;
+			config->threads_min = new_config.threads_min;
+			config->threads_max = new_config.threads_max;
+			spin_apply(config->spin_us);
+			applied++;
+		} else {
+			debug_log(0, "Reload: keeping %d workers, %d active", thread_spawned, thread_amount);
+		}
+	}
+
+	if (new_config.spin_us != config->spin_us) {
+		debug_log(0, "Reload: spin_us %u -> %u", config->spin_us, new_config.spin_us);
+		config->spin_us = new_config.spin_us;
+		spin_apply(config->spin_us);
+		applied++;
+	}
+
+	if (new_config.inline_write != config->inline_write) {
+		debug_log(0, "Reload: inline_write %d -> %d", config->inline_write, new_config.inline_write);
+		config->inline_write = new_config.inline_write;
+		inline_write = (config->inline_write != 0);
+		applied++;
+	}
+
+	if (new_config.verbose_level != config->verbose_level) {
+		debug_log(0, "Reload: verbose_level %d -> %d", config->verbose_level, new_config.verbose_level);
+		config->verbose_level = new_config.verbose_level;
+		verbose_level = new_config.verbose_level;
+		applied++;
+	}
+
+	if (new_config.lock_stats != config->lock_stats) {
+		debug_log(0, "Reload: lock_stats %d -> %d", config->lock_stats, new_config.lock_stats);
+		config->lock_stats = new_config.lock_stats;
+		teavpn_lockstat_enable(config->lock_stats != 0);
+		applied++;
+	}
+
+	if (new_config.watchdog_timeout != config->watchdog_timeout) {
+		debug_log(0, "Reload: watchdog_timeout %d -> %d", config->watchdog_timeout,
+			new_config.watchdog_timeout);
+		if (teavpn_fr_watchdog_start(&loop_busy_since, new_config.watchdog_timeout)) {
+			config->watchdog_timeout = new_config.watchdog_timeout;
+			// A new watchdog thread inherits the main loop CPUs.
+			teavpn_affinity_pin_housekeeping(&affinity);
+			applied++;
+		} else {
+			debug_log(0, "Cannot create watchdog thread");
+		}
+	}
+
+	if (reload_str_changed(config->stats_file, new_config.stats_file)) {
+		char *old = config->stats_file;
+
+		debug_log(0, "Reload: stats_file %s -> %s", config->stats_file, new_config.stats_file);
+		config->stats_file = (new_config.stats_file != NULL) ? strdup(new_config.stats_file) : NULL;
+		if (stats_file_owned) {
+			free(old);
+		}
+		stats_file_owned = true;
+		applied++;
+	}
+
+	if ((new_config.data_dir != NULL) &&
+		reload_str_changed((live_data_dir != NULL) ? live_data_dir : config->data_dir, new_config.data_dir)) {
+		char *copy = strdup(new_config.data_dir), *stale;
+
+		debug_log(0, "Reload: data_dir -> %s (from the next handshake)", new_config.data_dir);
+
+		free(live_data_dir);
+		live_data_dir = strdup(new_config.data_dir);
+
+		stale = __atomic_exchange_n(&pending_data_dir, copy, __ATOMIC_ACQ_REL);
+		free(stale);
+		applied++;
+	}
+
+	/**
+	 * Picked up by the next handshake, the accept
+	 * worker reads it with accept_worker_mutex held.
+	 */
+	if (memcmp(&(new_config.sock_tuning), &(config->sock_tuning), sizeof(config->sock_tuning))) {
+		debug_log(0, "Reload: socket tuning changed (from the next handshake)");
+		teavpn_mutex_lock(&accept_worker_mutex);
+		memcpy(&(config->sock_tuning), &(new_config.sock_tuning), sizeof(config->sock_tuning));
+		teavpn_mutex_unlock(&accept_worker_mutex);
+		applied++;
+	}
+	config->busy_poll_set = new_config.busy_poll_set;
+
+	if (new_config.encryption != config->encryption) {
+		if ((new_config.encryption == TEAVPN_ENCRYPTION_REQUIRED) && (teavpn_crypto_offer() == TEAVPN_CIPHER_NONE)) {
+			debug_log(0, "Reload: encryption = required, but this build has no cipher (ignored)");
+		} else {
+			debug_log(0, "Reload: encryption %d -> %d (from the next handshake)", config->encryption,
+				new_config.encryption);
+			teavpn_mutex_lock(&accept_worker_mutex);
+			config->encryption = new_config.encryption;
+			teavpn_mutex_unlock(&accept_worker_mutex);
+			applied++;
+		}
+	}
+
+	/**
+	 * listen(2) on a listening socket only updates the backlog.
+	 */
+	if (new_config.listen_backlog != config->listen_backlog) {
+		if (listen(net_fd, new_config.listen_backlog) < 0) {
+			perror("Reload: listen()");
+		} else {
+			debug_log(0, "Reload: listen_backlog %d -> %d", config->listen_backlog, new_config.listen_backlog);
+			config->listen_backlog = new_config.listen_backlog;
+			applied++;
+		}
+	}
+
+	debug_log(0, "Reload done: %d change(s) applied, %d change(s) need a restart", applied, restart);
+}
+
+
+
+/**
+ * Receive the listening socket, the TUN fd and the clients
+ * of the running server (binary upgrade, new process side).
+ *
+ * @param server_config *config
+ * @return bool
+ */
+static bool teavpn_tcp_server_takeover(server_config *config)
+{
+	int fds[TEAVPN_UPGRADE_MAX_FDS];
+	uint16_t nr_fds;
+	struct teavpn_upgrade_state state;
+
+	debug_log(0, "Taking over the server on %s...", config->upgrade_socket);
+
+	upgrade_peer_fd = teavpn_upgrade_recv(config->upgrade_socket, &state, fds, &nr_fds);
+	if (upgrade_peer_fd == -1) {
+		return false;
+	}
+
+	if (state.nr_conns > CONNECTION_ALLOC) {
+		debug_log(0, "Upgrade: %d connections do not fit in %d slots", state.nr_conns, CONNECTION_ALLOC);
+		for (uint16_t i = 0; i < nr_fds; i++) {
+			close(fds[i]);
+		}
+		close(upgrade_peer_fd);
+		upgrade_peer_fd = -1;
+		return false;
+	}
+
+	net_fd = fds[0];
+	tap_fd = teavpn_iface_adopt(&iface, fds[1], state.dev);
+
+	for (uint16_t k = 0; k < state.nr_conns; k++) {
+		struct connection_entry *conn = &(connections[k]);
+
+		/**
+		 * Without the cipher (libcrypto-less build) the
+		 * session cannot continue.
+		 */
+		if ((state.conns[k].crypto.cipher != TEAVPN_CIPHER_NONE) &&
+			(!teavpn_crypto_set(&(conn->crypto), &(state.conns[k].crypto)))) {
+			debug_log(0, "Cannot take over the encrypted session of fd %d, closing it", fds[2 + k]);
+			close(fds[2 + k]);
+			continue;
+		}
+
+		/**
+		 * Frame seq goes on where the old process stopped.
+		 */
+		teavpn_reorder_reset(&(conn->reorder), state.conns[k].crypto.tx_seq);
+
+		conn->fd = fds[2 + k];
+		conn->seq = state.conns[k].seq;
+		conn->priv_ip = state.conns[k].priv_ip;
+		conn->error = state.conns[k].error;
+		conn->addr = state.conns[k].addr;
+		memcpy(&(conn->tuning), &(state.conns[k].tuning), sizeof(conn->tuning));
+		memset(&(conn->bufs), 0, sizeof(conn->bufs));
+		teavpn_zc_enable(&(conn->zc), conn->fd, conn->tuning.zerocopy, state.conns[k].zc_next);
+		inet_ntop(AF_INET, &(conn->addr.sin_addr), conn->addr_str, sizeof(conn->addr_str));
+		conn->teardown = CONN_LIVE;
+		conn->connected = true;
+		conn_count++;
+		teavpn_fr_record(TEAVPN_FR_CONN_OPEN, k, conn->fd, 0);
+		debug_log(1, "Took over client %s:%d", conn->addr_str, ntohs(conn->addr.sin_port));
+	}
+
+	debug_log(0, "Took over %d connection(s) from the running server", state.nr_conns);
+	explicit_bzero(&state, sizeof(state));
+	return true;
+}
+
+
+
+/**
+ * Hand the listening socket, the TUN fd and the clients over
+ * to a new binary (binary upgrade, old process side).
+ *
+ * Does not return if the new process took over.
+ *
+ * @return void
+ */
+static void teavpn_tcp_server_handoff()
+{
+	int fd, fds[TEAVPN_UPGRADE_MAX_FDS];
+	uint16_t nr_fds = 2, wait = 0;
+	bool pending;
+	struct teavpn_upgrade_state state;
+
+	fd = teavpn_upgrade_accept(upgrade_fd);
+	if (fd == -1) {
+		return;
+	}
+
+	/**
+	 * The user space backends live in this process.
+	 */
+	if ((!iface.ops->kernel) || (CONNECTION_ALLOC > TEAVPN_UPGRADE_MAX_CONNS)) {
+		debug_log(0, "Upgrade: the %s backend cannot be handed over", iface.ops->name);
+		close(fd);
+		return;
+	}
+
+	/**
+	 * No handshake may be in progress and every queued frame
+	 * must be written, frames must not be split between the
+	 * two processes. The main loop is the only producer.
+	 */
+	teavpn_mutex_lock(&accept_worker_mutex);
+
+	do {
+		pending = false;
+		for (register uint16_t i = 0; i < QUEUE_AMOUNT; i++) {
+			if (__atomic_load_n(&(queues[i].used), __ATOMIC_ACQUIRE)) {
+				pending = true;
+				break;
+			}
+		}
+
+		if (pending) {
+			thread_job_broadcast();
+			zc_reap_all();
+			usleep(1000);
+		}
+	} while (pending && (++wait < 1000));
+
+	if (pending) {
+		debug_log(0, "Upgrade: workers did not drain the queue, upgrade aborted");
+		goto abort;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.magic = TEAVPN_UPGRADE_MAGIC;
+	state.version = TEAVPN_UPGRADE_VERSION;
+	snprintf(state.dev, sizeof(state.dev), "%s", iface.dev);
+
+	fds[0] = net_fd;
+	fds[1] = tap_fd;
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if (connections[i].connected) {
+			struct teavpn_upgrade_conn *conn = &(state.conns[state.nr_conns++]);
+
+			conn->seq = connections[i].seq;
+			conn->priv_ip = connections[i].priv_ip;
+			conn->error = connections[i].error;
+			conn->addr = connections[i].addr;
+			memcpy(&(conn->tuning), &(connections[i].tuning), sizeof(conn->tuning));
+			memcpy(&(conn->crypto), &(connections[i].crypto.st), sizeof(conn->crypto));
+			conn->zc_next = connections[i].zc.next;
+			fds[nr_fds++] = connections[i].fd;
+		}
+	}
+
+	debug_log(0, "Upgrade: handing over %d connection(s)...", state.nr_conns);
+
+	if (teavpn_upgrade_send(fd, &state, fds, nr_fds)) {
+		/**
+		 * The new process owns everything now (including
+		 * the upgrade socket path, do not unlink it).
+		 */
+		debug_log(0, "Upgrade done, exiting");
+		teavpn_log_flush();
+		exit(0);
+	}
+
+	debug_log(0, "Upgrade aborted, resuming");
+	explicit_bzero(&state, sizeof(state));
+
+	abort:
+	teavpn_mutex_unlock(&accept_worker_mutex);
+	close(fd);
+}
+
+
+
+/**
+ * Size the socket buffers of every client from its
+ * bandwidth-delay product (see teavpn_sock_autotune()).
+ *
+ * @return void
+ */
+static void teavpn_tcp_server_autotune()
+{
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if (connections[i].connected) {
+			teavpn_sock_autotune(connections[i].fd, &(connections[i].tuning), &(connections[i].bufs));
+		}
+	}
+}
 
-		/**
-		 * Set client_addr to zero.
-		 */
-		seq = 0;
-		memset(&client_addr, 0, sizeof(client_addr));
 
-		client_fd = accept(net_fd, (struct sockaddr *)&client_addr, &rlen);
 
-		if (client_fd < 0) {
-			debug_log(0, "Error on accept");
-			perror("Error on accept");
-			goto next_cycle;
+#ifdef TEAVPN_HAVE_URING
+/**
+ * Set up the io_uring event loop (io_uring = 1).
+ *
+ * The TUN fd and the client sockets go into the file table,
+ * the buffer channels are the registered buffers. Part of the
+ * landing class is given to the kernel for the TUN reads, the
+ * rest of the pool is shared as before.
+ *
+ * @param server_config *config
+ * @return bool	false to stay on select(2).
+ */
+static bool teavpn_tcp_server_uring_init(server_config *config)
+{
+	struct buffer_class *bc;
+
+	if (!teavpn_uring_init(&ring, URING_ENTRIES, URING_FILE_CONN(CONNECTION_ALLOC))) {
+		return false;
+	}
+
+	/**
+	 * Not fatal, the requests then pin the pages themselves.
+	 */
+	teavpn_uring_register_bufs(&ring, bufchan_room, BUFCHAN_ROOM);
+
+	if ((!teavpn_uring_bufs_init(&ring, &ring_rx, URING_BGID_RX, URING_RX_BUFS)) ||
+		(ring.read_multishot && (!teavpn_uring_bufs_init(&ring, &ring_tun, URING_BGID_TUN, URING_LANDING_MAX))) ||
+		(!teavpn_uring_file_set(&ring, URING_FILE_TUN, tap_fd))) {
+		teavpn_uring_bufs_destroy(&ring, &ring_rx);
+		teavpn_uring_bufs_destroy(&ring, &ring_tun);
+		teavpn_uring_destroy(&ring);
+		return false;
+	}
+
+	for (register uint16_t k = 0; k < URING_RX_BUFS; k++) {
+		teavpn_uring_bufs_add(&ring_rx, uring_rx_room + ((size_t)k * URING_RX_BUF_SIZE), URING_RX_BUF_SIZE, k);
+	}
+	teavpn_uring_bufs_commit(&ring_rx);
+
+	/**
+	 * TUN frames land in medium buffers when the MTU fits.
+	 * With a multishot read the last half of the class (the
+	 * end get_bufchan_index() reaches last) belongs to the
+	 * kernel, it comes back once a frame is written.
+	 */
+	uring_landing_class = ((config->mtu + sizeof(struct tun_pi)) <= TEAVPN_PB_MEDIUM_CAP) ?
+		TEAVPN_PB_MEDIUM : TEAVPN_PB_LARGE;
+
+	if (ring.read_multishot) {
+		bc = &(bufchan_class[uring_landing_class]);
+		uring_nr_landing = (bc->count / 2) > URING_LANDING_MAX ? URING_LANDING_MAX : (bc->count / 2);
+		for (register uint16_t k = 0; k < uring_nr_landing; k++) {
+			uring_landing[k] = bc->first + bc->count - uring_nr_landing + k;
+			uring_landing_give(k);
 		}
+		teavpn_uring_bufs_commit(&ring_tun);
+	}
 
-		remote_addr = inet_ntoa(client_addr.sin_addr);
-		remote_port = ntohs(client_addr.sin_port);
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		memset(&(uring_conns[i]), 0, sizeof(uring_conns[i]));
+		teavpn_framer_init(&(uring_conns[i].fr));
+	}
 
-		debug_log(3, "%s:%d is attempting to make a connection...", remote_addr, remote_port);
+	/**
+	 * io_uring fails reads of an O_NONBLOCK file with EAGAIN
+	 * instead of waiting for it.
+	 */
+	fcntl(tap_fd, F_SETFL, fcntl(tap_fd, F_GETFL) & ~O_NONBLOCK);
 
-		conn_index = get_free_conn_index();
+	debug_log(0, "io_uring event loop (%s TUN read, %s buffers)", ring.read_multishot ? "multishot" : "single",
+		ring.fixed_bufs ? "registered" : "plain");
+	return true;
+}
 
-		if (conn_index == -1) {
-			debug_log(0, "Connection entry is full, cannot accept more client");
-			debug_log(0, "Dropping connection from %s:%d...", remote_addr, remote_port);
-			close(client_fd);
-			goto next_cycle;
+
+/**
+ * The io_uring event loop, does the work of the select(2) loop.
+ *
+ * Every pass arms what is missing (a receive per client, the
+ * TUN read, the pipe and the listening socket), then submits
+ * it together with the TUN writes queued by the last pass and
+ * waits for completions in one io_uring_enter(2). Consecutive
+ * TUN frames are forwarded as one burst (tun_forward()).
+ *
+ * @param server_config *config
+ * @return void	Does not return.
+ */
+static void teavpn_tcp_server_uring_loop(server_config *config)
+{
+	int ret;
+	time_t now, next_autotune = 0;
+
+	while (true) {
+		uring_arm();
+
+		__atomic_store_n(&loop_busy_since, 0, __ATOMIC_RELEASE);
+		ret = uring_wait();
+		__atomic_store_n(&loop_busy_since, teavpn_tsc(), __ATOMIC_RELEASE);
+
+		if ((ret < 0) && (errno != ETIME) && (errno != EINTR) && (errno != EBUSY)) {
+			teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_SELECT, errno, 0);
+			debug_log(0, "io_uring_enter(2) got an error");
+			perror("io_uring_enter()");
 		}
 
-		/**
-		 * Set recv timeout.
-		 */
-		if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
-			debug_log(0, "Error set recv timeout");
-			perror("Error set recv timeout");
-			goto next_cycle;
+		now = time(NULL);
+		if (now >= next_autotune) {
+			teavpn_tcp_server_autotune();
+			worker_autoscale();
+			next_autotune = now + TEAVPN_SOCK_AUTOTUNE_INTERVAL;
 		}
 
-		/**
-		 * Set send timeout.
-		 */
-		if (setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, (char *)&timeout, sizeof(timeout)) < 0) {
-			debug_log(0, "Error set recv timeout");
-			perror("Error set recv timeout");
-			goto next_cycle;
+		if (__atomic_load_n(&conns_draining, __ATOMIC_ACQUIRE) > 0) {
+			conn_drain();
 		}
 
+		uring_reap(config);
+
 		/**
-		 * Read auth packet (username and password).
+		 * No socket wakes us up for its zerocopy completions.
 		 */
-		seq++; // seq 1
-		nread = read(client_fd, &packet, sizeof(packet));
+		zc_reap_all();
 
-		debug_log(3, "[%ld] Read auth packet from %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
-				seq, remote_addr, remote_port, nread, seq, packet.info.seq,
-				(seq == packet.info.seq) ? "match" : "invalid");
-
-		if (nread == 0) {
-			debug_log(3, "Client %s:%d closed connection");
-			close(client_fd);
-			goto next_cycle;
+		if (uring_handoff) {
+			uring_quiesce(config);
+			teavpn_tcp_server_handoff();
+			uring_handoff = false;
 		}
+	}
+}
 
-		if (nread < 0) {
-			debug_log(3, "An error occured when reading auth packet from %s:%d", remote_addr, remote_port);
-			perror("Error read from client (acceptor)");
-			close(client_fd);
-			goto next_cycle;
-		}
 
-		if (seq != packet.info.seq) {
-			debug_log(0, "Invalid packet sequence from %s:%d (client_seq: %ld) (server_seq: %ld)",
-				remote_addr, remote_port, seq, packet.info.seq);
-			close(client_fd);
-			goto next_cycle;
+/**
+ * Submit the pass and wait for a completion. In low-latency
+ * mode the completion queue is polled for spin_us first, it
+ * lives in shared memory.
+ *
+ * @return int	Of teavpn_uring_enter().
+ */
+static int uring_wait()
+{
+	int ret;
+	uint64_t start, end, budget = loop_spin.budget;
+
+	if (loop_spin.max == 0) {
+		return teavpn_uring_enter(&ring, 1, TEAVPN_SOCK_AUTOTUNE_INTERVAL * 1000);
+	}
+
+	if (budget > 0) {
+		if ((ret = teavpn_uring_enter(&ring, 0, 0)) < 0) {
+			return ret;
 		}
 
-		/**
-		 * Validate credential from auth packet.
-		 */
-		if (packet.info.type == TEAVPN_PACKET_AUTH) {
-			h = teavpn_auth_check(config, &(packet.data.auth));
-		} else {
-			debug_log(3, "Invalid auth packet from %s:%d", remote_addr, remote_port);
-			debug_log(3, "Dropping connection from %s:%d...", remote_addr, remote_port);
-			close(client_fd);
-			goto next_cycle;
+		start = end = teavpn_tsc();
+		while ((teavpn_uring_cqe(&ring) == NULL) && ((end - start) < budget)) {
+			teavpn_spin_relax();
+			end = teavpn_tsc();
 		}
 
-		if (h == NULL) {
-			/**
-			 * Invalid username or password.
-			 */
-			packet.info.type = TEAVPN_PACKET_SIG;
-			packet.info.len = TEAVPN_PACK(sizeof(packet.data.sig));
-			packet.info.seq = ++seq; // seq 2
-			packet.data.sig.sig = TEAVPN_SIG_AUTH_REJECT;
-			nwrite = write(client_fd, &packet, TEAVPN_PACK(sizeof(packet.data.sig)));
-			debug_log(3, "Invalid username or password from %s:%d", remote_addr, remote_port);
-			debug_log(3, "Dropping connection from %s:%d...", remote_addr, remote_port);
-			close(client_fd);
-			goto next_cycle;
+		if (teavpn_uring_cqe(&ring) != NULL) {
+			teavpn_spin_done(&loop_spin, start, end, true);
+			return ret;
 		}
+		teavpn_spin_done(&loop_spin, start, end, false);
+	}
+
+	start = teavpn_tsc();
+	ret = teavpn_uring_enter(&ring, 1, TEAVPN_SOCK_AUTOTUNE_INTERVAL * 1000);
+	teavpn_spin_blocked(&loop_spin, start, teavpn_tsc());
+	return ret;
+}
+
+
+/**
+ * Queue the requests which are not in flight.
+ *
+ * @return void
+ */
+static void uring_arm()
+{
+	uint32_t gen;
+	bool live;
+	struct uring_conn *uc;
+	struct io_uring_sqe *sqe;
 
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		uc = &(uring_conns[i]);
+		gen = __atomic_load_n(&(connections[i].gen), __ATOMIC_ACQUIRE);
+		live = connections[i].connected && (connections[i].fd != -1);
 
 		/**
-		 * Preparing client network interface configuration.
+		 * Closed (maybe by a worker) or the slot has a new
+		 * client: the file table holds the old socket open.
 		 */
-		memset(buffer, 0, sizeof(buffer));
-		pbuf = fgets(buffer, 63, h);
-		fclose(h);
-		if (pbuf == NULL) {
-			debug_log(0, "Invalid IP configuration for username %s", packet.data.auth.username);
+		if (uc->in_table && ((!live) || (uc->gen != gen))) {
+			if (uc->armed && ((sqe = teavpn_uring_sqe(&ring)) != NULL)) {
+				teavpn_uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, TEAVPN_URING_UD(URING_CANCEL, i, 0));
+				sqe->addr = TEAVPN_URING_UD(URING_RECV, i, uc->gen);
+			}
+			uc->armed = false;
+			uc->in_table = false;
+			teavpn_framer_reset(&(uc->fr), &uring_framer_ops, (void *)(intptr_t)i);
+			teavpn_uring_file_set(&ring, URING_FILE_CONN(i), -1);
 		}
 
-		len = strlen(buffer);
+		if ((!live) || uring_handoff) {
+			continue;
+		}
 
-		while (buffer[sp] != ' ') {
-			if (sp >= len) {
-				close(client_fd);
-				debug_log(0, "Invalid IP configuration for username %s", packet.data.auth.username);
-				goto next_cycle;
+		if (!uc->in_table) {
+			if (!teavpn_uring_file_set(&ring, URING_FILE_CONN(i), connections[i].fd)) {
+				continue;
 			}
-			sp++;
+			uc->gen = gen;
+			uc->in_table = true;
 		}
 
-		if ((sp > sizeof("xxx.xxx.xxx.xxx/xx")) || ((len - (sp - 1)) > sizeof("xxx.xxx.xxx.xxx"))) {
-			close(client_fd);
-			debug_log(0, "Invalid IP configuration for username %s", packet.data.auth.username);
-			goto next_cycle;	
+		if ((!uc->armed) && ((sqe = teavpn_uring_sqe(&ring)) != NULL)) {
+			teavpn_uring_prep(sqe, IORING_OP_RECV, URING_FILE_CONN(i), NULL, 0,
+				TEAVPN_URING_UD(URING_RECV, i, uc->gen));
+			sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+			sqe->ioprio = IORING_RECV_MULTISHOT;
+			sqe->buf_group = URING_BGID_RX;
+			uc->armed = true;
+			uring_recvs++;
 		}
+	}
 
-		debug_log(1, "%s connected from (%s:%d) [%s]", packet.data.auth.username, remote_addr, remote_port, buffer);
+	uring_tun_arm();
 
+	if ((!uring_pipe_armed) && ((sqe = teavpn_uring_sqe(&ring)) != NULL)) {
+		teavpn_uring_prep(sqe, IORING_OP_READ, m_pipe_fd[0], &uring_pipe_sig, sizeof(uring_pipe_sig),
+			TEAVPN_URING_UD(URING_PIPE, 0, 0));
+		uring_pipe_armed = true;
+	}
 
-		/**
-		 * Assign client fd to connection entry.
-		 */
-		connections[conn_index].fd = client_fd;
-		connections[conn_index].priv_ip = ip_read_conv(buffer);
-		connections[conn_index].error = 0;
-		connections[conn_index].addr = client_addr;
+	/**
+	 * One-shot polls, ready as long as the fd is (like select(2)).
+	 */
+	if ((!uring_net_armed) && ((sqe = teavpn_uring_sqe(&ring)) != NULL)) {
+		teavpn_uring_prep(sqe, IORING_OP_POLL_ADD, net_fd, NULL, 0, TEAVPN_URING_UD(URING_POLL_NET, 0, 0));
+		sqe->poll32_events = POLLIN;
+		uring_net_armed = true;
+	}
 
+	if ((upgrade_fd != -1) && (!uring_upgrade_armed) && (!uring_handoff) &&
+		((sqe = teavpn_uring_sqe(&ring)) != NULL)) {
+		teavpn_uring_prep(sqe, IORING_OP_POLL_ADD, upgrade_fd, NULL, 0, TEAVPN_URING_UD(URING_POLL_UPGRADE, 0, 0));
+		sqe->poll32_events = POLLIN;
+		uring_upgrade_armed = true;
+	}
+}
 
-		/**
-		 * Send auth ok signal.
-		 */
-		packet.info.type = TEAVPN_PACKET_SIG;
-		packet.info.len = TEAVPN_PACK(sizeof(packet.data.sig));
-		packet.data.sig.sig = TEAVPN_SIG_AUTH_OK;
-		packet.info.seq = ++seq; // seq 2
 
-		nwrite = write(client_fd, &packet, TEAVPN_PACK(sizeof(packet.data.sig)));
+/**
+ * Give landing buffer k to the kernel (commit follows).
+ *
+ * @param uint16_t k
+ * @return void
+ */
+static void uring_landing_give(uint16_t k)
+{
+	struct teavpn_pktbuf *pb = &(bufchan[uring_landing[k]].pb);
 
-		debug_log(3, "[%ld] Write sig auth to %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
-				seq, remote_addr, remote_port, nwrite, seq, packet.info.seq,
-				(seq == packet.info.seq) ? "match" : "invalid");
+	// Hidden from get_bufchan_index() while the kernel has it.
+	__atomic_store_n(&(bufchan[uring_landing[k]].ref_count), 1, __ATOMIC_RELEASE);
+	uring_landing_in[k] = true;
 
-		if (nwrite == 0) {
-			debug_log(3, "Client %s:%d closed connection (authenticated)", remote_addr, remote_port);
-			close(client_fd);
-			connection_zero(conn_index);
-			goto next_cycle;
-		}
+	teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM);
+	teavpn_uring_bufs_add(&ring_tun, teavpn_pb_tail(pb), uring_landing_cap(pb), k);
+}
 
-		if (nwrite < 0) {
-			debug_log(3, "Error send auth ok signal to %s:%d", remote_addr, remote_port);
-			perror("Error write to client_fd (acceptor)");
-			close(client_fd);
-			connection_zero(conn_index);
-			goto next_cycle;
-		}
 
+/**
+ * @param struct teavpn_pktbuf *pb	Reset to TEAVPN_PB_HEADROOM.
+ * @return uint32_t	Bytes a TUN read may put at the tail of pb.
+ */
+static uint32_t uring_landing_cap(struct teavpn_pktbuf *pb)
+{
+	size_t cap = teavpn_pb_tailroom(pb) - TEAVPN_PB_TAILROOM;
 
-		/**
-		 * Wait for ack signal.
-		 */
-		seq++; // seq 3
-		nread = read(client_fd, &packet, sizeof(packet));
+	return (cap > TEAVPN_TAP_READ_SIZE) ? TEAVPN_TAP_READ_SIZE : cap;
+}
 
-		debug_log(3, "[%ld] Read sig ack from %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
-				seq, remote_addr, remote_port, nread, seq, packet.info.seq,
-				(seq == packet.info.seq) ? "match" : "invalid");
 
-		if (nread == 0) {
-			debug_log(3, "Client %s:%d closed connection (authenticated)", remote_addr, remote_port);
-			close(client_fd);
-			connection_zero(conn_index);
-			goto next_cycle;
+/**
+ * Give the landing buffers back whose frames are gone and keep
+ * a TUN read in flight.
+ *
+ * @return void
+ */
+static void uring_tun_arm()
+{
+	int16_t b;
+	struct teavpn_pktbuf *pb;
+	struct io_uring_sqe *sqe;
+	uint16_t given = 0;
+
+	for (register uint16_t k = 0; k < uring_nr_landing; k++) {
+		if ((!uring_landing_in[k]) && (__atomic_load_n(&(bufchan[uring_landing[k]].ref_count), __ATOMIC_ACQUIRE) == 0)) {
+			uring_landing_give(k);
 		}
+		given += uring_landing_in[k];
+	}
+	teavpn_uring_bufs_commit(&ring_tun);
 
-		if (nread < 0) {
-			debug_log(3, "Error read ack packet from %s:%d", remote_addr, remote_port);
-			perror("Error read from client_fd (acceptor)");
-			close(client_fd);
-			connection_zero(conn_index);
-			goto next_cycle;
-		}
+	if (uring_tun_armed || uring_handoff) {
+		return;
+	}
 
-		if (seq != packet.info.seq) {
-			debug_log(0, "Invalid packet sequence from %s:%d (client_seq: %ld) (server_seq: %ld) (authenticated)",
-				remote_addr, remote_port, seq, packet.info.seq);
-			close(client_fd);
-			connection_zero(conn_index);
-			goto next_cycle;
+	if (ring.read_multishot) {
+		if ((given == 0) || ((sqe = teavpn_uring_sqe(&ring)) == NULL)) {
+			return;
 		}
+		uring_tun_ud = TEAVPN_URING_UD(URING_TUN_READ, 0, 0);
+		teavpn_uring_prep(sqe, TEAVPN_URING_OP_READ_MULTISHOT, URING_FILE_TUN, NULL, 0, uring_tun_ud);
+		sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+		sqe->buf_group = URING_BGID_TUN;
+		uring_tun_armed = true;
+		return;
+	}
 
-		/**
-		 * Verify ack signal..
-		 */
-		if ((packet.info.type == TEAVPN_PACKET_SIG) && (packet.data.sig.sig == TEAVPN_SIG_ACK)) {
-			debug_log(3, "[%ld] Got ack from %s:%d (connection established)", seq, remote_addr, remote_port);
-		} else {
-			debug_log(3, "[%ld] Invalid ack signal from %s:%d (authenticated)", seq, remote_addr, remote_port);
-			debug_log(0, "Dropping connection from %s:%d...", remote_addr, remote_port);
-			close(client_fd);
-			connection_zero(conn_index);
-			goto next_cycle;
+	/**
+	 * One read at a time, two reads waiting on the device
+	 * could complete out of order.
+	 */
+	for (b = bufchan_class[uring_landing_class].first; b < BUFCHAN_ALLOC; b++) {
+		if (__atomic_load_n(&(bufchan[b].ref_count), __ATOMIC_ACQUIRE) == 0) {
+			break;
 		}
+	}
+
+	if ((b == BUFCHAN_ALLOC) || ((sqe = teavpn_uring_sqe(&ring)) == NULL)) {
+		return;
+	}
+
+	bufchan[b].ref_count = 1;
+	pb = &(bufchan[b].pb);
+	teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM);
+	uring_tun_ud = TEAVPN_URING_UD(URING_TUN_READ, 0, b);
+	teavpn_uring_prep(sqe, ring.fixed_bufs ? IORING_OP_READ_FIXED : IORING_OP_READ, URING_FILE_TUN,
+		teavpn_pb_tail(pb), uring_landing_cap(pb), uring_tun_ud);
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->buf_index = 0;
+	uring_tun_armed = true;
+}
+
+
+/**
+ * Handle the completions, consecutive TUN frames are
+ * forwarded together.
+ *
+ * @param server_config *config
+ * @return void
+ */
+static void uring_reap(server_config *config)
+{
+	int16_t b;
+	int32_t res;
+	uint32_t flags;
+	uint64_t ud;
+	struct io_uring_cqe *cqe;
+
+	while ((cqe = teavpn_uring_cqe(&ring)) != NULL) {
+		ud = cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+		teavpn_uring_cqe_seen(&ring);
+
+		switch (TEAVPN_URING_UD_WHAT(ud)) {
+			case URING_TUN_READ:
+				if (!(flags & IORING_CQE_F_MORE)) {
+					uring_tun_armed = false;
+				}
 
+				b = -1;
+				if (flags & IORING_CQE_F_BUFFER) {
+					uint16_t k = flags >> IORING_CQE_BUFFER_SHIFT;
 
-		/**
-		 * Send network interface configuration.
-		 */
-		packet.info.type = TEAVPN_PACKET_CONF;
-		packet.info.seq = ++seq; // seq 4
-		packet.info.len = TEAVPN_PACK(sizeof(packet.data.conf));
-		memcpy(packet.data.conf.inet4, buffer, sp);
-		packet.data.conf.inet4[sp] = '\0';
-		strcpy(packet.data.conf.inet4_broadcast, &(buffer[sp+1]));
-		nwrite = write(client_fd, &packet, TEAVPN_PACK(sizeof(packet.data.conf)));
+					uring_landing_in[k] = false;
+					b = uring_landing[k];
+				} else if (!ring.read_multishot) {
+					b = (int16_t)TEAVPN_URING_UD_TAG(ud);
+				}
 
-		debug_log(3, "[%ld] Write packet conf to %s:%d %ld bytes (server_seq: %ld) (client_seq: %ld) (seq %s)",
-				seq, remote_addr, remote_port, nwrite, seq, packet.info.seq,
-				(seq == packet.info.seq) ? "match" : "invalid");
+				if (b != -1) {
+					__atomic_store_n(&(bufchan[b].ref_count), 0, __ATOMIC_RELEASE);
+				}
 
-		if (nwrite == 0) {
-			debug_log(3, "Client %s:%d closed connection (authenticated)", remote_addr, remote_port);
-			close(client_fd);
-			connection_zero(conn_index);
-			goto next_cycle;
-		}
+				if ((res > 0) && (b != -1)) {
+					uring_tun_frame(b, res);
+				} else if (res == -ENOBUFS) {
+					ring_tun.empty++;
+				} else if ((res < 0) && (res != -ECANCELED) && (res != -EAGAIN)) {
+					teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_TAP_READ, -res, 0);
+					debug_log(0, "Error read from tap_fd: %s", strerror(-res));
+				}
+				break;
 
-		if (nwrite < 0) {
-			debug_log(3, "Error send network config to %s:%d", remote_addr, remote_port);
-			perror("Error write to client_fd (acceptor)");
-			close(client_fd);
-			connection_zero(conn_index);
-			goto next_cycle;
+			case URING_TUN_WRITE:
+				uring_tun_writes--;
+				uring_tun_written(TEAVPN_URING_UD_TAG(ud), TEAVPN_URING_UD_INDEX(ud), res);
+				break;
+
+			case URING_RECV:
+				/**
+				 * Frames of the client take buffer channels,
+				 * the ones held by the burst must go first.
+				 */
+				uring_tun_flush();
+				uring_recv_done(TEAVPN_URING_UD_INDEX(ud), TEAVPN_URING_UD_TAG(ud), res, flags);
+				break;
+
+			case URING_PIPE:
+				uring_pipe_armed = false;
+				if (res != sizeof(uring_pipe_sig)) {
+					debug_log(0, "Error read from m_pipe_fd[0]: %s", (res < 0) ? strerror(-res) : "closed");
+				} else if (uring_pipe_sig == SERVER_PIPE_SIG_STATS) {
+					teavpn_tcp_server_stats_dump(config, false);
+				} else if (uring_pipe_sig == SERVER_PIPE_SIG_STATS_RESET) {
+					teavpn_tcp_server_stats_dump(config, true);
+				} else if (uring_pipe_sig == SERVER_PIPE_SIG_RELOAD) {
+					teavpn_tcp_server_reload(config);
+				}
+				break;
+
+			case URING_POLL_NET:
+				uring_net_armed = false;
+				if (res > 0) {
+					pthread_cond_signal(&accept_worker_cond);
+				}
+				break;
+
+			case URING_POLL_UPGRADE:
+				uring_upgrade_armed = false;
+				if (res > 0) {
+					uring_handoff = true;
+				}
+				break;
 		}
+	}
 
+	uring_tun_flush();
+}
 
-		/**
-		 * Set entry to connected state.
-		 */
-		connections[conn_index].connected = true;
-		connections[conn_index].seq = seq;
-		conn_count++;
 
+/**
+ * A frame has been read from the TUN device into buffer
+ * channel b, add it to the burst.
+ *
+ * @param int16_t	b
+ * @param uint32_t	len
+ * @return void
+ */
+static void uring_tun_frame(int16_t b, uint32_t len)
+{
+	int16_t s;
+	uint8_t class = bufchan[b].class;
+	struct teavpn_pktbuf *pb = &(bufchan[b].pb);
 
-		/**
-		 * Interrupt main process in order to read rd_set.
-		 */
-		nwrite = write(m_pipe_fd[1], &sig, sizeof(sig));
-		if (nwrite < 0) {
-			debug_log(0, "Error write to m_pipe_fd[1]");
-			perror("Error write to m_pipe_fd[1]");
-			goto next_cycle;
+	/**
+	 * The small buffers of this burst, nothing else takes
+	 * buffer channels until it is forwarded.
+	 */
+	if (uring_nr_burst == 0) {
+		uring_nr_small = uring_next_small = 0;
+		for (register int16_t i = bufchan_class[TEAVPN_PB_SMALL].first;
+			(i < (bufchan_class[TEAVPN_PB_SMALL].first + bufchan_class[TEAVPN_PB_SMALL].count)) &&
+			(uring_nr_small < TUN_BURST_MAX); i++) {
+			if (__atomic_load_n(&(bufchan[i].ref_count), __ATOMIC_ACQUIRE) == 0) {
+				uring_small[uring_nr_small++] = i;
+			}
 		}
+	}
 
-		next_cycle:
-		(void)1;
-		pthread_mutex_unlock(&accept_worker_mutex);
+	teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM);
+	teavpn_pb_put(pb, len);
+
+	/**
+	 * Short frames (most of them) move down to a small buffer,
+	 * the landing buffer goes back to the kernel right away.
+	 */
+	if ((len <= TEAVPN_PB_SMALL_CAP) && (uring_next_small < uring_nr_small)) {
+		s = uring_small[uring_next_small++];
+		teavpn_pb_reset(&(bufchan[s].pb), TEAVPN_PB_HEADROOM);
+		memcpy(teavpn_pb_put(&(bufchan[s].pb), len), teavpn_pb_data(pb), len);
+		b = s;
+		class = TEAVPN_PB_SMALL;
 	}
 
-	return NULL;
-}
+	bufchan_class[class].frames++;
+	bufchan[b].tsc = teavpn_tsc();
+	TEAVPN_TRACE2(tun_read, b, len);
 
+	uring_burst[uring_nr_burst++] = b;
+	if (uring_nr_burst == TUN_BURST_MAX) {
+		uring_tun_flush();
+	}
+}
 
 
 /**
- * Initialize TeaVPN server (socket, pipe, etc.)
+ * @return void
  */
-static uint8_t teavpn_tcp_server_init(char *config_buffer, server_config *config)
+static void uring_tun_flush()
 {
-	// Initialize buffer channel value.
-	for (register uint16_t i = 0; i < BUFCHAN_ALLOC; ++i) {
-		bufchan[i].ref_count = 0;
+	if (uring_nr_burst > 0) {
+		tun_forward(uring_burst, uring_nr_burst);
+		uring_nr_burst = 0;
 	}
+}
 
-	// Initialize queues.
-	for (register uint16_t  i = 0; i < QUEUE_AMOUNT; ++i) {
-		queue_zero(i);
-	}
 
-	// Initialize connection entry value.
-	for (register uint16_t i = 0; i < CONNECTION_ALLOC; ++i) {
-		connection_zero(i);
+/**
+ * Completion of a multishot receive of connection i.
+ *
+ * @param uint16_t	i
+ * @param uint32_t	gen		Of the connection the receive was armed for.
+ * @param int32_t	res
+ * @param uint32_t	flags
+ * @return void
+ */
+static void uring_recv_done(uint16_t i, uint32_t gen, int32_t res, uint32_t flags)
+{
+	uint8_t *buf;
+	uint16_t bid;
+	struct uring_conn *uc = &(uring_conns[i]);
+	bool current = uc->in_table && (uc->gen == gen) && connections[i].connected;
+
+	if (!(flags & IORING_CQE_F_MORE)) {
+		uring_recvs--;
+		if (uc->gen == gen) {
+			uc->armed = false;
+		}
 	}
 
-	// Load config file.
-	if (config->config_file != NULL) {
-		if (!teavpn_server_config_parser(config_buffer, config)) {
-			debug_log(0, "Config error!");
-			return 1;
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		buf = uring_rx_room + ((size_t)bid * URING_RX_BUF_SIZE);
+
+		if (current && (res > 0) &&
+			(!teavpn_framer_feed(&(uc->fr), buf, res, &uring_framer_ops, (void *)(intptr_t)i))) {
+			debug_log(0, "Client %s:%d sent a frame of impossible length, closing",
+				connections[i].addr_str, ntohs(connections[i].addr.sin_port));
+			uring_conn_close(i, TEAVPN_CLOSE_MAX_ERR);
 		}
-	}
 
-	// Set verbose_level (global var).
-	verbose_level = config->verbose_level;
+		teavpn_uring_bufs_add(&ring_rx, buf, URING_RX_BUF_SIZE, bid);
+		teavpn_uring_bufs_commit(&ring_rx);
+		return;
+	}
 
-	// data_dir is a directory that saves TeaVPN data
-	// such as user, password, etc.
-	if (config->data_dir == NULL) {
-		debug_log(0, "Data dir cannot be empty!");
-		return 1;
+	if ((!current) || (res == -ECANCELED)) {
+		return;
 	}
 
 	/**
-	 * This pipe is purposed to interrupt main
-	 * process when a new connection is made.
+	 * Connection closed by client.
 	 */
-	if (pipe(m_pipe_fd) < 0) {
-		debug_log(0, "Cannot open pipe for m_pipe_fd");
-		perror("Cannot open pipe for m_pipe_fd");
-		return 1;
+	if (res == 0) {
+		debug_log(1, "(%s:%d) connection closed", connections[i].addr_str, ntohs(connections[i].addr.sin_port));
+		uring_conn_close(i, TEAVPN_CLOSE_BY_PEER);
+		return;
 	}
 
 	/**
-	 * Create TUN/TAP interface.
+	 * Out of receive buffers, armed again by the next pass.
 	 */
-	debug_log(2, "Allocating TUN/TAP interface...");
-	if ((tap_fd = tun_alloc(config->dev, IFF_TUN)) < 0) {
-		debug_log(0, "Error connecting to TUN/TAP interface \"%s\"!", config->dev);
-		close(m_pipe_fd[0]);
-		close(m_pipe_fd[1]);
-		return 1;
+	if (res == -ENOBUFS) {
+		ring_rx.empty++;
+		return;
 	}
-	debug_log(0, "Successfully created a new interface \"%s\".", config->dev);
 
-	/**
-	 * Initialize TUN/TAP interface.
-	 */
-	if (!teavpn_tcp_server_init_iface(config)) {
-		debug_log(0, "Cannot init interface");
-		close(m_pipe_fd[0]);
-		close(m_pipe_fd[1]);
-		close(tap_fd);
-		return 1;
+	teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_SOCK_READ, -res, i);
+	debug_log(0, "Error read from (%s:%d): %s", connections[i].addr_str, ntohs(connections[i].addr.sin_port),
+		strerror(-res));
+
+	connections[i].error++;
+	if (connections[i].error > MAX_CLIENT_ERR) {
+		debug_log(0, "Client %s:%d has been disconnected because it has reached the max number of errors",
+			connections[i].addr_str, ntohs(connections[i].addr.sin_port));
+		uring_conn_close(i, TEAVPN_CLOSE_MAX_ERR);
 	}
+}
 
-	/**
-	 * Create TCP socket.
-	 */
-	debug_log(1, "Creating TCP socket...");
-	if ((net_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		debug_log(0, "Cannot create TCP socket");
-		perror("Socket creation failed");
-		close(m_pipe_fd[0]);
-		close(m_pipe_fd[1]);
-		close(tap_fd);
-		return 1;
+
+/**
+ * @param uint16_t	i
+ * @param uint8_t	reason	enum teavpn_conn_close_reason
+ * @return void
+ */
+static void uring_conn_close(uint16_t i, uint8_t reason)
+{
+	TEAVPN_TRACE3(conn_close, i, connections[i].fd, reason);
+	teavpn_fr_record(TEAVPN_FR_CONN_CLOSE, i, connections[i].fd, reason);
+	connection_zero(i);
+}
+
+
+/**
+ * Buffer of a client frame of len bytes, a buffer channel of
+ * the class it fits in.
+ *
+ * @param void		*arg	Connection index.
+ * @param uint16_t	len
+ * @param intptr_t	*ctx	Buffer channel.
+ * @return teavpn_packet *	NULL drops the frame.
+ */
+static teavpn_packet *uring_frame_alloc(void *arg, uint16_t len, intptr_t *ctx)
+{
+	uint8_t class = TEAVPN_PB_LARGE;
+	struct teavpn_pktbuf *pb;
+
+	(void)arg;
+
+	if ((len - TEAVPN_PACK(0)) <= TEAVPN_PB_SMALL_CAP) {
+		class = TEAVPN_PB_SMALL;
+	} else if ((len - TEAVPN_PACK(0)) <= TEAVPN_PB_MEDIUM_CAP) {
+		class = TEAVPN_PB_MEDIUM;
 	}
-	debug_log(1, "TCP socket created successfully");
 
-	/**
-	 * Setting up socket.
-	 */
-	debug_log(1, "Setting up socket file descriptor...");
-	if (!teavpn_tcp_server_socket_setup(net_fd)) {
-		debug_log(0, "Cannot setup socket");
-		close(m_pipe_fd[0]);
-		close(m_pipe_fd[1]);
-		close(net_fd);
-		close(tap_fd);
-		return 1;
+	for (register int16_t b = bufchan_class[class].first; b < BUFCHAN_ALLOC; b++) {
+		if (__atomic_load_n(&(bufchan[b].ref_count), __ATOMIC_ACQUIRE) == 0) {
+			// Held until the TUN write completes.
+			bufchan[b].ref_count = 1;
+			bufchan[b].tsc = teavpn_tsc();
+			pb = &(bufchan[b].pb);
+			teavpn_pb_reset(pb, TEAVPN_PB_HEADROOM - TEAVPN_PACK(0));
+			*ctx = b;
+			return (teavpn_packet *)teavpn_pb_data(pb);
+		}
 	}
-	debug_log(1, "Socket file descriptor set up successfully");
 
-	return 0;
+	/**
+	 * Every buffer is queued or being written, drop it like
+	 * a full tun txqueue would. Waiting here would stop the
+	 * TUN reads which give buffers back.
+	 */
+	debug_log(3, "No buffer for a frame of %d bytes, dropped", len);
+	return NULL;
 }
 
 
-
 /**
- * Get non-busy buffer channel index.
+ * A complete client frame, open it and queue the TUN write.
+ *
+ * @param void			*arg	Connection index.
+ * @param teavpn_packet	*pkt
+ * @param uint16_t		len
+ * @param intptr_t		ctx		Of uring_frame_alloc().
+ * @return void
  */
-static int16_t get_bufchan_index()
+static void uring_frame(void *arg, teavpn_packet *pkt, uint16_t len, intptr_t ctx)
 {
-	static bool sleep_state = false;
-	static uint8_t buf_chan_wait = 0;
+	uint16_t i = (uint16_t)(intptr_t)arg;
+	int16_t b = (int16_t)ctx;
+	ssize_t nread = len;
+	struct io_uring_sqe *sqe;
 
-	for (int16_t i = 0; i < BUFCHAN_ALLOC; i++) {
-		if (bufchan[i].ref_count == 0) {
-			if (buf_chan_wait > 0) buf_chan_wait--;
-			return i;
-		}
+	TEAVPN_TRACE4(client_frame, i, pkt->info.type, pkt->info.len, nread);
+
+	if (pkt->info.type != TEAVPN_PACKET_DATA) {
+		connections[i].error++;
+		goto release;
 	}
 
-	if (buf_chan_wait > 30) {
-		sleep_state = true;
-	} else {
-		if (buf_chan_wait <= 100) buf_chan_wait++;
+	if ((connections[i].crypto.st.cipher != TEAVPN_CIPHER_NONE) &&
+		((nread = conn_crypto_open(i, pkt)) < 0)) {
+		teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_DECRYPT, EBADMSG, i);
+		debug_log(1, "Dropped a forged or replayed frame from %s:%d",
+			connections[i].addr_str, ntohs(connections[i].addr.sin_port));
+		connections[i].error++;
+		goto release;
 	}
 
-	if (sleep_state) {
-		debug_log(1, "Buffer channel got sleep state...\n");
-		usleep(10000);
-		buf_chan_wait--;
-		if (buf_chan_wait <= 20) {
-			debug_log(1, "Sleep state has been released\n");
-			sleep_state = false;
-		}
+	connections[i].seq++;
+	debug_log(3, "[%ld] Read from client %s:%d (server_seq: %ld) (client_seq: %ld) (seq %s)",
+		connections[i].seq,
+		connections[i].addr_str,
+		ntohs(connections[i].addr.sin_port),
+		connections[i].seq,
+		pkt->info.seq,
+		(connections[i].seq == pkt->info.seq) ? "match" : "invalid"
+	);
+
+	/**
+	 * Header and tag off, nread is the opened frame.
+	 */
+	nread -= TEAVPN_PACK(0);
+
+	if (uring_tun_writes >= URING_TUN_WRITES_MAX) {
+		uring_tun_written(b, i, -EAGAIN);
+		return;
 	}
 
-	return -1;
-}
+	if ((sqe = teavpn_uring_sqe(&ring)) == NULL) {
+		uring_tun_written(b, i, -EBUSY);
+		return;
+	}
 
+	teavpn_uring_prep(sqe, ring.fixed_bufs ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, URING_FILE_TUN,
+		pkt->data.data, nread, TEAVPN_URING_UD(URING_TUN_WRITE, i, b));
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->buf_index = 0;
+	uring_tun_writes++;
+	return;
+
+	release:
+	uring_frame_drop(arg, ctx);
+}
 
 
 /**
- * Set queue entry to zero (clean up).
+ * @param void		*arg
+ * @param intptr_t	ctx	Of uring_frame_alloc().
+ * @return void
  */
-static void queue_zero(register uint16_t i)
+static void uring_frame_drop(void *arg, intptr_t ctx)
 {
-	queues[i].used = false;
-	queues[i].queue_id = -1;
-	queues[i].conn_index = -1;
-	queues[i].bufchan_index = -1;
+	(void)arg;
+	__atomic_store_n(&(bufchan[ctx].ref_count), 0, __ATOMIC_RELEASE);
 }
 
 
-
 /**
- * Set connection entry to zero (clean up).
+ * A client frame has been written to the TUN device.
+ *
+ * @param int16_t	b	Buffer channel.
+ * @param uint16_t	i	Connection index.
+ * @param int32_t	res	As write(2), -errno.
+ * @return void
  */
-static void connection_zero(register uint16_t i)
+static void uring_tun_written(int16_t b, uint16_t i, int32_t res)
 {
-	connections[i].fd = -1;
-	connections[i].connected = false;
-	connections[i].error = 0;
-	connections[i].seq = 0;
-	connections[i].priv_ip = 0;
-	memset(&(connections[i].addr), 0, sizeof(connections[i].addr));
-	memset(&(connections[i].mutex), 0, sizeof(connections[i].mutex));
-	pthread_mutex_init(&(connections[i].mutex), NULL);
-}
+	if (res == -EAGAIN) {
+		// Full like a tun txqueue, not the client's fault.
+		debug_log(3, "tap_fd is full, dropped a frame");
+	} else if (res < 0) {
+		teavpn_fr_record(TEAVPN_FR_ERROR, TEAVPN_FR_ERR_TAP_WRITE, -res, i);
+		connections[i].error++;
+		debug_log(0, "Error write to tap_fd: %s", strerror(-res));
+	} else {
+		teavpn_lat_record(TEAVPN_LAT_SOCK_TO_TUN, bufchan[b].tsc, teavpn_tsc());
+		debug_log(3, "Write to tap_fd %d bytes", res);
+	}
 
+	uring_frame_drop(NULL, b);
+}
 
 
 /**
- * Initialize network interface for TeaVPN server.
+ * Stop reading before a handoff. Nothing may be in flight that
+ * takes bytes the new process should get, and no client frame
+ * may be cut between the two processes.
  *
  * @param server_config *config
- * @return bool
+ * @return void
  */
-static bool teavpn_tcp_server_init_iface(server_config *config)
+static void uring_quiesce(server_config *config)
 {
-	char cmd1[100], cmd2[100],
-		*escaped_dev,
-		*escaped_inet4,
-		*escaped_inet4_broadcast;
-
-	escaped_dev = escapeshellarg(config->dev);
-	escaped_inet4 = escapeshellarg(config->inet4);
-	escaped_inet4_broadcast = escapeshellarg(config->inet4_broadcast);
+	ssize_t nread;
+	size_t missing;
+	struct io_uring_sqe *sqe;
+	uint8_t buf[sizeof(teavpn_packet)];
 
-	sprintf(
-		cmd1,
-		"/sbin/ip link set dev %s up mtu %d",
-		escaped_dev,
-		config->mtu
-	);
+	/**
+	 * uring_handoff is set, uring_arm() arms nothing.
+	 */
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if (uring_conns[i].armed && ((sqe = teavpn_uring_sqe(&ring)) != NULL)) {
+			teavpn_uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, TEAVPN_URING_UD(URING_CANCEL, i, 0));
+			sqe->addr = TEAVPN_URING_UD(URING_RECV, i, uring_conns[i].gen);
+		}
+	}
 
-	sprintf(
-		cmd2,
-		"/sbin/ip addr add dev %s %s broadcast %s",
-		escaped_dev,
-		escaped_inet4,
-		escaped_inet4_broadcast
-	);
+	if (uring_tun_armed && ((sqe = teavpn_uring_sqe(&ring)) != NULL)) {
+		teavpn_uring_prep(sqe, IORING_OP_ASYNC_CANCEL, -1, NULL, 0, TEAVPN_URING_UD(URING_CANCEL, 0, 0));
+		sqe->addr = uring_tun_ud;
+	}
 
-	free(escaped_dev);
-	free(escaped_inet4);
-	free(escaped_inet4_broadcast);
+	uring_drain(config);
 
-	debug_log(0, "Executing: %s", cmd1);
-	if (system(cmd1)) {
-		return false;
-	}
+	/**
+	 * The rest of a half received frame is read right here,
+	 * the sockets are blocking (SO_RCVTIMEO bounds the wait).
+	 */
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		if ((!uring_conns[i].in_table) || (!connections[i].connected)) {
+			continue;
+		}
 
-	debug_log(0, "Executing: %s", cmd2);
-	if (system(cmd2)) {
-		return false;
+		while ((missing = teavpn_framer_missing(&(uring_conns[i].fr))) > 0) {
+			nread = recv(connections[i].fd, buf, (missing > sizeof(buf)) ? sizeof(buf) : missing, 0);
+			if ((nread <= 0) ||
+				(!teavpn_framer_feed(&(uring_conns[i].fr), buf, nread, &uring_framer_ops, (void *)(intptr_t)i))) {
+				debug_log(0, "Cannot finish the frame of %s:%d before the upgrade",
+					connections[i].addr_str, ntohs(connections[i].addr.sin_port));
+				break;
+			}
+		}
 	}
 
-	return true;
+	uring_drain(config);
 }
 
 
-
 /**
- * @param int sock_fd
+ * Reap until no receive, TUN read or TUN write is in flight.
+ *
+ * @param server_config *config
  * @return void
  */
-static bool teavpn_tcp_server_socket_setup(int sock_fd)
+static void uring_drain(server_config *config)
 {
-	int optval = 1;
-
-	if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, (char *)&optval, sizeof(optval)) < 0) {
-		perror("setsockopt()");
-		return false;
+	for (register uint16_t wait = 0;
+		((uring_recvs > 0) || uring_tun_armed || (uring_tun_writes > 0)) && (wait < 1000); wait++) {
+		teavpn_uring_enter(&ring, 1, 10);
+		uring_reap(config);
 	}
-
-	return true;
 }
-
+#endif /* #ifdef TEAVPN_HAVE_URING */
@@ -0,0 +1,344 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#define _GNU_SOURCE
+
+#include <poll.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+
+#include <teavpn/teavpn.h>
+#include <teavpn/upgrade.h>
+
+extern uint8_t verbose_level;
+
+// How long the old process waits for the new one to take over.
+#define UPGRADE_ACK_TIMEOUT_MS 10000
+
+static bool upgrade_addr(struct sockaddr_un *addr, const char *path);
+static void upgrade_abort(int fd);
+
+/**
+ * Create the upgrade Unix socket, only the owner may connect.
+ *
+ * @param const char *path
+ * @return int	Listening fd or -1 on error.
+ */
+int teavpn_upgrade_listen(const char *path)
+{
+	int fd;
+	mode_t old_umask;
+	struct sockaddr_un addr;
+
+	if (!upgrade_addr(&addr, path)) {
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Upgrade socket");
+		return -1;
+	}
+
+	// A stale socket from a previous process (or the one we took over from).
+	unlink(path);
+
+	old_umask = umask(0077);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		umask(old_umask);
+		debug_log(0, "Cannot bind upgrade socket %s", path);
+		perror("Upgrade socket bind");
+		goto err;
+	}
+	umask(old_umask);
+
+	if (listen(fd, 1) < 0) {
+		perror("Upgrade socket listen");
+		goto err;
+	}
+
+	debug_log(1, "Upgrade socket listening on %s", path);
+	return fd;
+
+	err:
+	close(fd);
+	return -1;
+}
+
+/**
+ * Accept an upgrade request, the peer must run as our user (or root).
+ *
+ * @param int listen_fd
+ * @return int	Connected fd or -1.
+ */
+int teavpn_upgrade_accept(int listen_fd)
+{
+	int fd;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0) {
+		perror("Upgrade socket accept");
+		return -1;
+	}
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+		perror("SO_PEERCRED");
+		close(fd);
+		return -1;
+	}
+
+	if ((cred.uid != 0) && (cred.uid != geteuid())) {
+		debug_log(0, "Upgrade request from uid %d (pid %d) refused", cred.uid, cred.pid);
+		close(fd);
+		return -1;
+	}
+
+	debug_log(0, "Upgrade requested by pid %d", cred.pid);
+	return fd;
+}
+
+/**
+ * Send the state and the fds, then wait until the new process
+ * acknowledges that it owns them and confirm that it may start.
+ *
+ * On false the new process has been told to give up (or is gone)
+ * and the socket is shut down, the caller may resume.
+ *
+ * @param int							fd
+ * @param struct teavpn_upgrade_state	*state
+ * @param int							*fds
+ * @param uint16_t						nr_fds
+ * @return bool	true if the caller must exit.
+ */
+bool teavpn_upgrade_send(int fd, struct teavpn_upgrade_state *state, int *fds, uint16_t nr_fds)
+{
+	char ack;
+	int ret;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct pollfd pfd;
+	char cbuf[CMSG_SPACE(sizeof(int) * TEAVPN_UPGRADE_MAX_FDS)];
+
+	if (nr_fds > TEAVPN_UPGRADE_MAX_FDS) {
+		return false;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = state;
+	iov.iov_len = sizeof(*state);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * nr_fds);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nr_fds);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nr_fds);
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(*state)) {
+		perror("Upgrade sendmsg");
+		upgrade_abort(fd);
+		return false;
+	}
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	do {
+		ret = poll(&pfd, 1, UPGRADE_ACK_TIMEOUT_MS);
+	} while ((ret < 0) && (errno == EINTR));
+
+	if (ret <= 0) {
+		debug_log(0, "Upgrade: the new process did not answer");
+		upgrade_abort(fd);
+		return false;
+	}
+
+	if ((recv(fd, &ack, 1, 0) != 1) || (ack != 1)) {
+		debug_log(0, "Upgrade: the new process gave up");
+		upgrade_abort(fd);
+		return false;
+	}
+
+	/**
+	 * The new process only closes its end after our answer,
+	 * a failed send means it is gone and we keep the sockets.
+	 */
+	ack = TEAVPN_UPGRADE_COMMIT;
+	if (send(fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+		perror("Upgrade commit");
+		upgrade_abort(fd);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Connect to a running server and receive its state and fds.
+ *
+ * @param const char					*path
+ * @param struct teavpn_upgrade_state	*state
+ * @param int							*fds		TEAVPN_UPGRADE_MAX_FDS entries.
+ * @param uint16_t						*nr_fds
+ * @return int	fd to ack on or -1 on error.
+ */
+int teavpn_upgrade_recv(const char *path, struct teavpn_upgrade_state *state, int *fds, uint16_t *nr_fds)
+{
+	int fd;
+	ssize_t nread;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct sockaddr_un addr;
+	char cbuf[CMSG_SPACE(sizeof(int) * TEAVPN_UPGRADE_MAX_FDS)];
+
+	*nr_fds = 0;
+
+	if (!upgrade_addr(&addr, path)) {
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("Upgrade socket");
+		return -1;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		debug_log(0, "Cannot connect to upgrade socket %s", path);
+		perror("Upgrade connect");
+		goto err;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = state;
+	iov.iov_len = sizeof(*state);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	do {
+		nread = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while ((nread < 0) && (errno == EINTR));
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) && (cmsg->cmsg_type == SCM_RIGHTS)) {
+			*nr_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * (*nr_fds));
+			break;
+		}
+	}
+
+	if (nread != (ssize_t)sizeof(*state)) {
+		debug_log(0, "Upgrade: short state message (%ld bytes)", nread);
+		goto err;
+	}
+
+	if ((msg.msg_flags & MSG_CTRUNC) ||
+		(state->magic != TEAVPN_UPGRADE_MAGIC) ||
+		(state->version != TEAVPN_UPGRADE_VERSION) ||
+		(state->nr_conns > TEAVPN_UPGRADE_MAX_CONNS) ||
+		(*nr_fds != (2 + state->nr_conns))) {
+		debug_log(0, "Upgrade: incompatible state (version %d, %d fds)", state->version, *nr_fds);
+		goto err;
+	}
+
+	return fd;
+
+	err:
+	for (uint16_t i = 0; i < *nr_fds; i++) {
+		close(fds[i]);
+	}
+	*nr_fds = 0;
+	close(fd);
+	return -1;
+}
+
+/**
+ * Tell the old process that we own its fds now and wait
+ * for its answer.
+ *
+ * The ack may arrive after the old process gave up waiting,
+ * so a sent ack alone does not hand the sockets over. EOF
+ * means the old process exited after reading it.
+ *
+ * @param int fd
+ * @return bool	true if we may use the fds.
+ */
+bool teavpn_upgrade_ack(int fd)
+{
+	char ack = 1;
+	ssize_t ret;
+
+	if (send(fd, &ack, 1, MSG_NOSIGNAL) != 1) {
+		perror("Upgrade ack");
+		close(fd);
+		return false;
+	}
+
+	do {
+		ret = recv(fd, &ack, 1, 0);
+	} while ((ret < 0) && (errno == EINTR));
+
+	close(fd);
+
+	if (ret < 0) {
+		perror("Upgrade commit");
+		return false;
+	}
+
+	return (ret == 0) || (ack == TEAVPN_UPGRADE_COMMIT);
+}
+
+/**
+ * Tell the new process to give up, then shut the socket
+ * down so that a late ack can not be taken for a handover.
+ *
+ * @param int fd
+ * @return void
+ */
+static void upgrade_abort(int fd)
+{
+	char ack = TEAVPN_UPGRADE_ABORT;
+
+	if (send(fd, &ack, 1, MSG_NOSIGNAL | MSG_DONTWAIT) != 1) {
+		debug_log(2, "Upgrade: the new process is gone");
+	}
+
+	shutdown(fd, SHUT_RDWR);
+}
+
+/**
+ * @param struct sockaddr_un	*addr
+ * @param const char			*path
+ * @return bool
+ */
+static bool upgrade_addr(struct sockaddr_un *addr, const char *path)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		debug_log(0, "Upgrade socket path is too long: %s", path);
+		return false;
+	}
+
+	strcpy(addr->sun_path, path);
+	return true;
+}
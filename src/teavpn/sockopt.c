@@ -0,0 +1,324 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+#include <teavpn/teavpn.h>
+#include <teavpn/sockopt.h>
+
+extern uint8_t verbose_level;
+
+static uint32_t sock_buf_clamp(const struct teavpn_sock_tuning *t, uint64_t bytes);
+static void sock_buf_set(int fd, int opt, uint32_t target, uint32_t *cur, bool grow_only);
+
+/**
+ * @param struct teavpn_sock_tuning *t
+ * @return void
+ */
+void teavpn_sock_tuning_default(struct teavpn_sock_tuning *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->nodelay = 1;
+	t->buf_min = 64 * 1024;
+	t->buf_max = 4 * 1024 * 1024;
+}
+
+/**
+ * Set one tuning key (config file or per-user sockopt file).
+ *
+ * @param struct teavpn_sock_tuning	*t
+ * @param const char				*key
+ * @param const char				*value
+ * @return bool	false if key is not a tuning key.
+ */
+bool teavpn_sock_tuning_set(struct teavpn_sock_tuning *t, const char *key, const char *value)
+{
+	if (!strcmp(key, "tcp_nodelay")) {
+		t->nodelay = (uint8_t)atoi(value);
+	} else if (!strcmp(key, "tcp_notsent_lowat")) {
+		t->notsent_lowat = (uint32_t)strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "tcp_congestion")) {
+		snprintf(t->congestion, sizeof(t->congestion), "%s", value);
+	} else if (!strcmp(key, "busy_poll")) {
+		t->busy_poll = (uint32_t)strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "sndbuf")) {
+		t->sndbuf = (uint32_t)strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "rcvbuf")) {
+		t->rcvbuf = (uint32_t)strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "buf_min")) {
+		t->buf_min = (uint32_t)strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "buf_max")) {
+		t->buf_max = (uint32_t)strtoul(value, NULL, 10);
+	} else if (!strcmp(key, "zerocopy_threshold")) {
+		t->zerocopy = (uint32_t)strtoul(value, NULL, 10);
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Apply the "key = value" lines of file on top of t.
+ * A missing file is not an error (no per-user override).
+ *
+ * @param struct teavpn_sock_tuning	*t
+ * @param const char				*file
+ * @return bool
+ */
+bool teavpn_sock_tuning_load(struct teavpn_sock_tuning *t, const char *file)
+{
+	FILE *h;
+	char line[256], key[32], value[64];
+	bool ret = true;
+
+	h = fopen(file, "r");
+	if (h == NULL) {
+		return true;
+	}
+
+	while (fgets(line, sizeof(line), h)) {
+		char *p = line;
+
+		while ((*p == ' ') || (*p == '\t')) p++;
+		if ((*p == '#') || (*p == '\n') || (*p == '\0')) {
+			continue;
+		}
+
+		value[0] = '\0';
+		if ((sscanf(p, "%31[^= \t] = %63[^ \t\r\n#]", key, value) < 1) ||
+			(!teavpn_sock_tuning_set(t, key, value))) {
+			debug_log(0, "Invalid sockopt line in %s: %s", file, line);
+			ret = false;
+		}
+	}
+
+	fclose(h);
+	return ret;
+}
+
+/**
+ * Apply the static options of t to a client socket.
+ *
+ * @param int							fd
+ * @param const struct teavpn_sock_tuning	*t
+ * @param struct teavpn_sock_bufs		*bufs
+ * @return bool	false if one of the options has been refused.
+ */
+bool teavpn_sock_tune(int fd, const struct teavpn_sock_tuning *t, struct teavpn_sock_bufs *bufs)
+{
+	int optval;
+	bool ret = true;
+
+	#define SOCK_SET(LEVEL, OPT, VAL, LEN)								\
+		if (setsockopt(fd, LEVEL, OPT, VAL, LEN) < 0) {					\
+			debug_log(1, "setsockopt(" #OPT ") failed on fd %d", fd);	\
+			ret = false;												\
+		}
+
+	optval = t->nodelay;
+	SOCK_SET(IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+	if (t->notsent_lowat > 0) {
+		optval = (int)t->notsent_lowat;
+		SOCK_SET(IPPROTO_TCP, TCP_NOTSENT_LOWAT, &optval, sizeof(optval));
+	}
+
+	if (t->congestion[0] != '\0') {
+		SOCK_SET(IPPROTO_TCP, TCP_CONGESTION, t->congestion, strlen(t->congestion));
+	}
+
+	if (t->busy_poll > 0) {
+		optval = (int)t->busy_poll;
+		SOCK_SET(SOL_SOCKET, SO_BUSY_POLL, &optval, sizeof(optval));
+	}
+
+	if (t->sndbuf > 0) {
+		optval = (int)t->sndbuf;
+		SOCK_SET(SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval));
+	}
+
+	if (t->rcvbuf > 0) {
+		optval = (int)t->rcvbuf;
+		SOCK_SET(SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
+	}
+
+	#undef SOCK_SET
+
+	/**
+	 * 0 means the kernel still sizes the buffer, until
+	 * teavpn_sock_autotune() has a measurement.
+	 */
+	memset(bufs, 0, sizeof(*bufs));
+	bufs->sndbuf = t->sndbuf;
+	bufs->rcvbuf = t->rcvbuf;
+	return ret;
+}
+
+/**
+ * Size the buffers which are not fixed from the bandwidth-delay
+ * product measured by the kernel.
+ *
+ * Send side: 2 * delivery_rate * srtt (cwnd * mss per srtt on
+ * kernels without tcpi_delivery_rate). An app-limited sample only
+ * shows how fast the path can burst, then the rate actually acked
+ * since the previous call is used instead. Receive side: 2 * rcv_space,
+ * the amount the peer delivers per RTT, it only grows while the
+ * connection is active so the advertised window never shrinks.
+ * Idle connections drop back to buf_min.
+ *
+ * @param int							fd
+ * @param const struct teavpn_sock_tuning	*t
+ * @param struct teavpn_sock_bufs		*bufs
+ * @return bool
+ */
+bool teavpn_sock_autotune(int fd, const struct teavpn_sock_tuning *t, struct teavpn_sock_bufs *bufs)
+{
+	bool idle;
+	uint64_t rate, now_ms, acked_rate = 0;
+	struct timespec ts;
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	if ((t->sndbuf > 0) && (t->rcvbuf > 0)) {
+		return true;
+	}
+
+	memset(&ti, 0, sizeof(ti));
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) {
+		return false;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now_ms = ((uint64_t)ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+
+	// First sample, there is no acked rate yet.
+	if (bufs->acked_at_ms == 0) {
+		bufs->bytes_acked = ti.tcpi_bytes_acked;
+		bufs->acked_at_ms = now_ms;
+		return true;
+	}
+
+	if (now_ms > bufs->acked_at_ms) {
+		acked_rate = ((ti.tcpi_bytes_acked - bufs->bytes_acked) * 1000) / (now_ms - bufs->acked_at_ms);
+	}
+
+	bufs->bytes_acked = ti.tcpi_bytes_acked;
+	bufs->acked_at_ms = now_ms;
+
+	rate = 0;
+	if (len >= (offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(ti.tcpi_delivery_rate))) {
+		rate = ti.tcpi_delivery_rate;
+		if (ti.tcpi_delivery_rate_app_limited && (acked_rate < rate)) {
+			rate = acked_rate;
+		}
+	}
+
+	if ((rate == 0) && (ti.tcpi_rtt > 0)) {
+		rate = ((uint64_t)ti.tcpi_snd_cwnd * ti.tcpi_snd_mss * 1000000) / ti.tcpi_rtt;
+	}
+
+	bufs->rtt_us = ti.tcpi_rtt;
+	bufs->delivery_rate = rate;
+
+	idle = (ti.tcpi_last_data_sent > TEAVPN_SOCK_IDLE_MS) && (ti.tcpi_last_data_recv > TEAVPN_SOCK_IDLE_MS);
+
+	if (t->sndbuf == 0) {
+		sock_buf_set(fd, SO_SNDBUF,
+			idle ? t->buf_min : sock_buf_clamp(t, (2 * rate * ti.tcpi_rtt) / 1000000),
+			&(bufs->sndbuf), false);
+	}
+
+	if (t->rcvbuf == 0) {
+		sock_buf_set(fd, SO_RCVBUF,
+			idle ? t->buf_min : sock_buf_clamp(t, 2 * (uint64_t)ti.tcpi_rcv_space),
+			&(bufs->rcvbuf), !idle);
+	}
+
+	return true;
+}
+
+/**
+ * @param FILE							*fp
+ * @param uint16_t						conn
+ * @param const struct teavpn_sock_bufs	*bufs
+ * @return void
+ */
+void teavpn_sock_bufs_dump(FILE *fp, uint16_t conn, const struct teavpn_sock_bufs *bufs)
+{
+	fprintf(fp, "[sockopt] conn=%d rtt_us=%u rate_kbps=%lu sndbuf=%u rcvbuf=%u\n",
+		conn, bufs->rtt_us, (bufs->delivery_rate * 8) / 1000, bufs->sndbuf, bufs->rcvbuf);
+}
+
+/**
+ * @param const struct teavpn_sock_tuning	*t
+ * @param uint64_t						bytes
+ * @return uint32_t
+ */
+static uint32_t sock_buf_clamp(const struct teavpn_sock_tuning *t, uint64_t bytes)
+{
+	if (bytes < t->buf_min) {
+		return t->buf_min;
+	}
+
+	if (bytes > t->buf_max) {
+		return t->buf_max;
+	}
+
+	return (uint32_t)bytes;
+}
+
+/**
+ * Only touch the socket if target is 25% away from the current
+ * size, every SO_SNDBUF/SO_RCVBUF call takes the socket lock.
+ *
+ * @param int		fd
+ * @param int		opt
+ * @param uint32_t	target
+ * @param uint32_t	*cur		0 = still sized by the kernel.
+ * @param bool		grow_only
+ * @return void
+ */
+static void sock_buf_set(int fd, int opt, uint32_t target, uint32_t *cur, bool grow_only)
+{
+	int optval;
+	uint32_t now = *cur;
+
+	if (now == 0) {
+		socklen_t len = sizeof(optval);
+
+		// The kernel reports twice the usable size.
+		if (getsockopt(fd, SOL_SOCKET, opt, &optval, &len) < 0) {
+			return;
+		}
+		now = (uint32_t)optval / 2;
+	}
+
+	if ((target <= now) && (grow_only || ((now - target) < (now / 4)))) {
+		return;
+	}
+
+	if ((target > now) && ((target - now) < (now / 4))) {
+		return;
+	}
+
+	optval = (int)target;
+	if (setsockopt(fd, SOL_SOCKET, opt, &optval, sizeof(optval)) < 0) {
+		debug_log(1, "Cannot set %s to %u on fd %d", (opt == SO_SNDBUF) ? "sndbuf" : "rcvbuf", target, fd);
+		return;
+	}
+
+	debug_log(3, "fd %d %s %u -> %u", fd, (opt == SO_SNDBUF) ? "sndbuf" : "rcvbuf", now, target);
+	*cur = target;
+}
@@ -0,0 +1,57 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include <teavpn/tsc.h>
+#include <teavpn/spin.h>
+
+/**
+ * @param struct teavpn_spin	*s
+ * @param uint32_t				max_us	0 turns spinning off.
+ * @return void
+ */
+void teavpn_spin_init(struct teavpn_spin *s, uint32_t max_us)
+{
+	uint64_t max = ((uint64_t)max_us * teavpn_tsc_hz()) / 1000000ull;
+
+	__atomic_store_n(&(s->max), max, __ATOMIC_RELAXED);
+	__atomic_store_n(&(s->budget), max, __ATOMIC_RELAXED);
+}
+
+/**
+ * Clear the counters, the budgets stay.
+ *
+ * @param struct teavpn_spin *s
+ * @return void
+ */
+void teavpn_spin_reset(struct teavpn_spin *s)
+{
+	__atomic_store_n(&(s->spin_ticks), 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&(s->block_ticks), 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&(s->hits), 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&(s->misses), 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @param FILE					*fp
+ * @param const char			*name	Of the thread.
+ * @param struct teavpn_spin	*s
+ * @return void
+ */
+void teavpn_spin_dump(FILE *fp, const char *name, struct teavpn_spin *s)
+{
+	uint64_t hits = __atomic_load_n(&(s->hits), __ATOMIC_RELAXED);
+	uint64_t misses = __atomic_load_n(&(s->misses), __ATOMIC_RELAXED);
+
+	fprintf(fp, "[spin] %s budget_us=%.1f spin_ms=%.1f blocked_ms=%.1f hits=%lu misses=%lu hit_rate=%.1f%%\n",
+		name, teavpn_tsc_to_ns(__atomic_load_n(&(s->budget), __ATOMIC_RELAXED)) / 1e3,
+		teavpn_tsc_to_ns(__atomic_load_n(&(s->spin_ticks), __ATOMIC_RELAXED)) / 1e6,
+		teavpn_tsc_to_ns(__atomic_load_n(&(s->block_ticks), __ATOMIC_RELAXED)) / 1e6,
+		hits, misses, ((hits + misses) > 0) ? ((100.0 * hits) / (hits + misses)) : 0.0);
+}
@@ -5,12 +5,10 @@
  * @package TeaVPN
  */
 
-#include <time.h>
 #include <stdio.h>
 #include <fcntl.h>
 #include <string.h>
 #include <unistd.h>
-#include <stdarg.h>
 #include <sys/ioctl.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
@@ -19,27 +17,6 @@
 
 uint8_t verbose_level = 0;
 
-uint8_t __internal_debug_log(const char *msg, ...)
-{
-	va_list argp;
-	time_t rawtime;
-	struct tm *timeinfo;
-
-	time(&rawtime);
-	timeinfo = localtime(&rawtime);
-	char *time = asctime(timeinfo);
-	time[24] = '\0';
-
-	va_start(argp, msg);
-	fprintf(stdout, "[%s]: ", time);
-	vfprintf(stdout, msg, argp);
-	fprintf(stdout, "\n");
-	va_end(argp);
-	fflush(stdout);
-	return 0;
-}
-
-
 /**
  * @param char	*dev
  * @param int	flat
@@ -9,11 +9,43 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include <teavpn/arena.h>
+#include <teavpn/affinity.h>
 #include <teavpn/teavpn_server.h>
 #include <teavpn/teavpn_config_parser.h>
 
-bool teavpn_server_config_parser(char *internal_buf, server_config *config)
+/**
+ * Copy a string value into the internal buffer.
+ *
+ * @param char			**buf		Free part of the internal buffer, advanced past the copy.
+ * @param size_t		*room		Bytes left in it.
+ * @param const char	*value
+ * @return char *	The copy, NULL if it does not fit.
+ */
+static char *config_str(char **buf, size_t *room, const char *value)
+{
+	char *copy = *buf;
+	size_t len = strlen(value) + 1;
+
+	if (len > *room) {
+		return NULL;
+	}
+
+	memcpy(copy, value, len);
+	*buf += len;
+	*room -= len;
+	return copy;
+}
+
+/**
+ * @param char			*internal_buf	Storage of the string values.
+ * @param size_t		size			Size of internal_buf.
+ * @param server_config	*config
+ * @return bool	false on a parse error or if the values do not fit.
+ */
+bool teavpn_server_config_parser(char *internal_buf, size_t size, server_config *config)
 {
+	size_t room = size;
 	uint16_t line = 1;
 	char buffer[4096];
 	bool ret = true, sp;
@@ -92,31 +124,68 @@ bool teavpn_server_config_parser(char *internal_buf, server_config *config)
 
 		// printf("\"%s\" = \"%s\"\n", &(buffer[j]), &(buffer[k]));
 		if (!strcmp(&(buffer[j]), "dev")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->dev = internal_buf;
-			internal_buf += strlen(internal_buf) + 1;
+			if ((config->dev = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "iface_backend")) {
+			if ((config->iface_backend = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
 		} else if (!strcmp(&(buffer[j]), "mtu")) {
 			config->mtu = (uint16_t)atoi(&(buffer[k]));
 		} else if (!strcmp(&(buffer[j]), "inet4")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->inet4 = internal_buf;
-			internal_buf += strlen(internal_buf) + 1;
+			if ((config->inet4 = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
 		} else if (!strcmp(&(buffer[j]), "inet4_bcmask")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->inet4_broadcast = internal_buf;
-			internal_buf += strlen(internal_buf) + 1;
+			if ((config->inet4_broadcast = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
 		} else if (!strcmp(&(buffer[j]), "bind_addr")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->bind_addr = internal_buf;
-			internal_buf += strlen(internal_buf) + 1;
+			if ((config->bind_addr = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
 		} else if (!strcmp(&(buffer[j]), "bind_port")) {
 			config->bind_port = (uint16_t)atoi(&(buffer[k]));
 		} else if (!strcmp(&(buffer[j]), "threads")) {
 			config->threads = (uint8_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "threads_min")) {
+			config->threads_min = (uint8_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "threads_max")) {
+			config->threads_max = (uint8_t)atoi(&(buffer[k]));
 		} else if (!strcmp(&(buffer[j]), "data_dir")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->data_dir = internal_buf;
-			internal_buf += strlen(internal_buf) + 1;
+			if ((config->data_dir = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "stats_file")) {
+			if ((config->stats_file = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "flight_recorder_file")) {
+			if ((config->flight_recorder_file = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "upgrade_socket")) {
+			if ((config->upgrade_socket = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "watchdog_timeout")) {
+			config->watchdog_timeout = (uint16_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "lock_stats")) {
+			config->lock_stats = (uint8_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "hugepages")) {
+			config->hugepages = teavpn_hugepages_mode(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "cpu_affinity")) {
+			config->cpu_affinity = teavpn_affinity_mode(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "cpu_main")) {
+			if ((config->cpu_main = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "cpu_workers")) {
+			if ((config->cpu_workers = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "cpu_housekeeping")) {
+			if ((config->cpu_housekeeping = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "encryption")) {
+			config->encryption = teavpn_encryption_mode(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "tls")) {
+			config->tls = (uint8_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "io_uring")) {
+			config->io_uring = (uint8_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "spin_us")) {
+			config->spin_us = (uint32_t)strtoul(&(buffer[k]), NULL, 10);
+		} else if (!strcmp(&(buffer[j]), "inline_write")) {
+			config->inline_write = (uint8_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "tls_cert_file")) {
+			if ((config->tls_cert_file = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "tls_key_file")) {
+			if ((config->tls_key_file = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "listen_backlog")) {
+			config->listen_backlog = (uint16_t)atoi(&(buffer[k]));
+		} else if (teavpn_sock_tuning_set(&(config->sock_tuning), &(buffer[j]), &(buffer[k]))) {
+			// Client socket tuning key (sockopt.h).
+			if (!strcmp(&(buffer[j]), "busy_poll")) {
+				config->busy_poll_set = 1;
+			}
 		} else {
 			printf("Invalid config key \"%s\" on line %d\n", &(buffer[j]), line);
 		}
@@ -129,11 +198,24 @@ bool teavpn_server_config_parser(char *internal_buf, server_config *config)
 	fclose(h);
 
 	return ret;
+
+	full:
+	printf("Parse error on line %d: the config values do not fit in %zu bytes\n", line, size);
+	fclose(h);
+
+	return false;
 }
 
 
-bool teavpn_client_config_parser(char *internal_buf, client_config *config)
+/**
+ * @param char			*internal_buf	Storage of the string values.
+ * @param size_t		size			Size of internal_buf.
+ * @param client_config	*config
+ * @return bool	false on a parse error or if the values do not fit.
+ */
+bool teavpn_client_config_parser(char *internal_buf, size_t size, client_config *config)
 {
+	size_t room = size;
 	uint16_t line = 1;
 	char buffer[4096];
 	bool ret = true, sp;
@@ -212,27 +294,29 @@ bool teavpn_client_config_parser(char *internal_buf, client_config *config)
 
 		// printf("\"%s\" = \"%s\"\n", &(buffer[j]), &(buffer[k]));
 		if (!strcmp(&(buffer[j]), "dev")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->dev = internal_buf;
-			internal_buf += strlen(internal_buf) + 1;
+			if ((config->dev = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+		} else if (!strcmp(&(buffer[j]), "iface_backend")) {
+			if ((config->iface_backend = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
 		} else if (!strcmp(&(buffer[j]), "mtu")) {
 			config->mtu = (uint16_t)atoi(&(buffer[k]));
 		} else if (!strcmp(&(buffer[j]), "server_ip")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->server_ip = internal_buf;
-			internal_buf += strlen(internal_buf) + 1;
+			if ((config->server_ip = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
 		} else if (!strcmp(&(buffer[j]), "server_port")) {
 			config->server_port = (uint16_t)atoi(&(buffer[k]));
 		} else if (!strcmp(&(buffer[j]), "username")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->username = internal_buf;
-			config->username_len = strlen(internal_buf);
-			internal_buf +=  config->username_len + 1;
+			if ((config->username = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+			config->username_len = strlen(config->username);
 		} else if (!strcmp(&(buffer[j]), "password")) {
-			strcpy(internal_buf, &(buffer[k]));
-			config->password = internal_buf;
-			config->password_len = strlen(internal_buf);
-			internal_buf += config->password_len;
+			if ((config->password = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
+			config->password_len = strlen(config->password);
+		} else if (!strcmp(&(buffer[j]), "encryption")) {
+			config->encryption = teavpn_encryption_mode(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "tls")) {
+			config->tls = (uint8_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "io_uring")) {
+			config->io_uring = (uint8_t)atoi(&(buffer[k]));
+		} else if (!strcmp(&(buffer[j]), "tls_ca_file")) {
+			if ((config->tls_ca_file = config_str(&internal_buf, &room, &(buffer[k]))) == NULL) goto full;
 		}
 
 		line++;
@@ -243,4 +327,10 @@ bool teavpn_client_config_parser(char *internal_buf, client_config *config)
 	fclose(h);
 
 	return ret;
+
+	full:
+	printf("Parse error on line %d: the config values do not fit in %zu bytes\n", line, size);
+	fclose(h);
+
+	return false;
 }
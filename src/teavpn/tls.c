@@ -0,0 +1,227 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/tls.h>
+
+#include <teavpn/teavpn.h>
+#include <teavpn/tls.h>
+
+#ifdef TEAVPN_HAVE_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+extern uint8_t verbose_level;
+
+#ifdef TEAVPN_HAVE_TLS
+static void tls_log_error(const char *what);
+
+/**
+ * Without AES instructions ChaCha20-Poly1305 is the faster one,
+ * the kernel runs all three.
+ */
+#define TLS_SUITES_AES "TLS_AES_256_GCM_SHA384:TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256"
+#define TLS_SUITES_CHACHA "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_256_GCM_SHA384:TLS_AES_128_GCM_SHA256"
+#endif
+
+/**
+ * @param struct teavpn_tls	*tls
+ * @param bool				server
+ * @param const char		*cert_file	Server certificate chain (PEM).
+ * @param const char		*key_file	Server private key (PEM).
+ * @param const char		*ca_file	Client: CA of the server, NULL for the system store.
+ * @return bool
+ */
+bool teavpn_tls_init(struct teavpn_tls *tls, bool server, const char *cert_file, const char *key_file,
+	const char *ca_file)
+{
+#ifdef TEAVPN_HAVE_TLS
+	SSL_CTX *ctx;
+
+	tls->server = server;
+	tls->ctx = ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+	if (ctx == NULL) {
+		tls_log_error("Cannot create the TLS context");
+		return false;
+	}
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION);
+	SSL_CTX_set_max_proto_version(ctx, TLS1_3_VERSION);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	SSL_CTX_set_ciphersuites(ctx,
+		(teavpn_crypto_offer() & TEAVPN_CIPHER_AES_256_GCM) ? TLS_SUITES_AES : TLS_SUITES_CHACHA);
+
+	if (server) {
+		if ((cert_file == NULL) || (key_file == NULL)) {
+			debug_log(0, "tls needs tls_cert_file and tls_key_file");
+			goto err;
+		}
+
+		if ((SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1) ||
+			(SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1) ||
+			(SSL_CTX_check_private_key(ctx) != 1)) {
+			tls_log_error("Cannot load the TLS certificate");
+			goto err;
+		}
+
+		/**
+		 * A ticket would come after the handshake, as a record
+		 * the kTLS socket cannot give back to OpenSSL.
+		 */
+		SSL_CTX_set_num_tickets(ctx, 0);
+		SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_PRIORITIZE_CHACHA);
+	} else {
+		if (((ca_file != NULL) && (SSL_CTX_load_verify_locations(ctx, ca_file, NULL) != 1)) ||
+			((ca_file == NULL) && (SSL_CTX_set_default_verify_paths(ctx) != 1))) {
+			tls_log_error("Cannot load the TLS CA");
+			goto err;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+
+	return true;
+
+	err:
+	SSL_CTX_free(ctx);
+	tls->ctx = NULL;
+	return false;
+#else
+	debug_log(0, "tls is set, but this build has no TLS (libssl)");
+	tls->ctx = NULL;
+	return false;
+#endif
+}
+
+/**
+ * @param struct teavpn_tls *tls
+ * @return void
+ */
+void teavpn_tls_destroy(struct teavpn_tls *tls)
+{
+#ifdef TEAVPN_HAVE_TLS
+	SSL_CTX_free((SSL_CTX *)tls->ctx);
+#endif
+	tls->ctx = NULL;
+}
+
+/**
+ * Run the handshake on a connected blocking socket and move
+ * both directions into the kernel. On success the fd carries
+ * plain read(2) and write(2), on failure it must be closed.
+ *
+ * @param struct teavpn_tls	*tls
+ * @param int				fd
+ * @param const char		*host	Client: name or IP the certificate must match.
+ * @return bool
+ */
+bool teavpn_tls_handshake(struct teavpn_tls *tls, int fd, const char *host)
+{
+#ifdef TEAVPN_HAVE_TLS
+	int ret;
+	SSL *ssl;
+	bool ok = false;
+
+	ssl = SSL_new((SSL_CTX *)tls->ctx);
+	if (ssl == NULL) {
+		tls_log_error("Cannot create the TLS session");
+		return false;
+	}
+
+	if ((SSL_set_fd(ssl, fd) != 1) || ((host != NULL) && (SSL_set1_host(ssl, host) != 1))) {
+		tls_log_error("Cannot set up the TLS session");
+		goto out;
+	}
+
+	ret = tls->server ? SSL_accept(ssl) : SSL_connect(ssl);
+	if (ret != 1) {
+		tls_log_error("TLS handshake failed");
+		if (!tls->server) {
+			debug_log(0, "%s", X509_verify_cert_error_string(SSL_get_verify_result(ssl)));
+		}
+		goto out;
+	}
+
+	if ((!BIO_get_ktls_send(SSL_get_wbio(ssl))) || (!BIO_get_ktls_recv(SSL_get_rbio(ssl)))) {
+		debug_log(0, "The kernel did not take the TLS keys (%s, tx %s, rx %s), is the tls module loaded?",
+			SSL_get_cipher_name(ssl),
+			BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "yes" : "no",
+			BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "yes" : "no");
+		goto out;
+	}
+
+	debug_log(2, "TLS %s in the kernel", SSL_get_cipher_name(ssl));
+	ok = true;
+
+	out:
+	/**
+	 * The keys stay in the socket, freeing the session
+	 * sends nothing and leaves the fd open.
+	 */
+	SSL_free(ssl);
+	return ok;
+#else
+	return false;
+#endif
+}
+
+/**
+ * @param FILE		*fp
+ * @param uint16_t	conn
+ * @param int		fd
+ * @return void
+ */
+void teavpn_tls_dump(FILE *fp, uint16_t conn, int fd)
+{
+	uint8_t info[64];
+	socklen_t len = sizeof(info);
+	const char *cipher;
+
+	/**
+	 * Only the header is used, the rest holds the keys.
+	 */
+	if (getsockopt(fd, SOL_TLS, TLS_TX, info, &len) < 0) {
+		return;
+	}
+
+	switch (((struct tls_crypto_info *)info)->cipher_type) {
+		case TLS_CIPHER_AES_GCM_128: cipher = "aes-128-gcm"; break;
+		case TLS_CIPHER_AES_GCM_256: cipher = "aes-256-gcm"; break;
+		case TLS_CIPHER_CHACHA20_POLY1305: cipher = "chacha20-poly1305"; break;
+		default: cipher = "other"; break;
+	}
+	explicit_bzero(info, sizeof(info));
+
+	fprintf(fp, "[tls] conn=%d ktls=%s\n", conn, cipher);
+}
+
+#ifdef TEAVPN_HAVE_TLS
+/**
+ * @param const char *what
+ * @return void
+ */
+static void tls_log_error(const char *what)
+{
+	char buf[256];
+	unsigned long err = ERR_get_error();
+
+	if (err == 0) {
+		debug_log(0, "%s", what);
+		return;
+	}
+
+	ERR_error_string_n(err, buf, sizeof(buf));
+	debug_log(0, "%s: %s", what, buf);
+	ERR_clear_error();
+}
+#endif
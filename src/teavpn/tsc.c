@@ -0,0 +1,55 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <time.h>
+#include <stdint.h>
+
+#include <teavpn/tsc.h>
+
+static uint64_t tsc_hz = 1000000000ull;
+
+/**
+ * Measure TSC frequency against CLOCK_MONOTONIC.
+ *
+ * Takes ~10ms, must be called once at startup before
+ * any tick to time conversion.
+ */
+void teavpn_tsc_calibrate()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint64_t t0, t1, ns;
+	struct timespec s, e, req = {0, 10000000};
+
+	clock_gettime(CLOCK_MONOTONIC, &s);
+	t0 = teavpn_tsc();
+	nanosleep(&req, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &e);
+	t1 = teavpn_tsc();
+
+	ns = ((uint64_t)(e.tv_sec - s.tv_sec) * 1000000000ull) + e.tv_nsec - s.tv_nsec;
+	if ((ns > 0) && (t1 > t0)) {
+		tsc_hz = (uint64_t)(((double)(t1 - t0) * 1e9) / (double)ns);
+	}
+#endif
+}
+
+/**
+ * @return uint64_t
+ */
+uint64_t teavpn_tsc_hz()
+{
+	return tsc_hz;
+}
+
+/**
+ * @param uint64_t ticks
+ * @return uint64_t
+ */
+uint64_t teavpn_tsc_to_ns(uint64_t ticks)
+{
+	return (uint64_t)(((double)ticks * 1e9) / (double)tsc_hz);
+}
@@ -0,0 +1,426 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <teavpn/teavpn.h>
+#include <teavpn/uring.h>
+
+#ifdef TEAVPN_HAVE_URING
+
+extern uint8_t verbose_level;
+
+static int uring_setup(uint32_t entries, struct io_uring_params *p);
+static int uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args);
+static bool uring_probe(struct teavpn_uring *r);
+
+/**
+ * Ops every loop uses, the multishot receive came with
+ * IORING_OP_SEND_ZC (6.0), which stands for it.
+ */
+static const uint8_t uring_needed_ops[] = {
+	IORING_OP_READ,
+	IORING_OP_WRITE,
+	IORING_OP_READ_FIXED,
+	IORING_OP_WRITE_FIXED,
+	IORING_OP_RECV,
+	IORING_OP_POLL_ADD,
+	IORING_OP_ASYNC_CANCEL,
+	IORING_OP_SEND_ZC
+};
+
+/**
+ * @param struct teavpn_uring	*r
+ * @param uint32_t				entries		SQ size, power of 2.
+ * @param uint32_t				nr_files	Slots of the file table, all empty.
+ * @return bool	false if the kernel lacks anything we need.
+ */
+bool teavpn_uring_init(struct teavpn_uring *r, uint32_t entries, uint32_t nr_files)
+{
+	uint8_t *ring;
+	struct io_uring_params p;
+	struct io_uring_rsrc_register files;
+
+	memset(r, 0, sizeof(*r));
+	r->fd = -1;
+
+	/**
+	 * Only the event loop thread submits and it takes the
+	 * completions itself, the kernel need not interrupt it.
+	 */
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL |
+		IORING_SETUP_CQSIZE;
+	p.cq_entries = entries * 4;
+	r->fd = uring_setup(entries, &p);
+	if ((r->fd < 0) && (errno == EINVAL)) {
+		memset(&p, 0, sizeof(p));
+		p.flags = IORING_SETUP_CQSIZE;
+		p.cq_entries = entries * 4;
+		r->fd = uring_setup(entries, &p);
+	}
+
+	if (r->fd < 0) {
+		debug_log(0, "io_uring_setup(2) failed: %s", strerror(errno));
+		return false;
+	}
+
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG) ||
+		!(p.features & IORING_FEAT_NODROP)) {
+		debug_log(0, "io_uring of this kernel is too old (features 0x%x)", p.features);
+		goto err;
+	}
+
+	r->ring_size = p.sq_off.array + (p.sq_entries * sizeof(uint32_t));
+	if ((p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe))) > r->ring_size) {
+		r->ring_size = p.cq_off.cqes + (p.cq_entries * sizeof(struct io_uring_cqe));
+	}
+
+	r->ring = mmap(NULL, r->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+		IORING_OFF_SQ_RING);
+	if (r->ring == MAP_FAILED) {
+		r->ring = NULL;
+		debug_log(0, "Cannot map the io_uring rings: %s", strerror(errno));
+		goto err;
+	}
+
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+		IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		debug_log(0, "Cannot map the io_uring SQEs: %s", strerror(errno));
+		goto err;
+	}
+
+	ring = (uint8_t *)r->ring;
+	r->sq_head = (uint32_t *)(ring + p.sq_off.head);
+	r->sq_tail = (uint32_t *)(ring + p.sq_off.tail);
+	r->sq_mask = *(uint32_t *)(ring + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	r->sq_local = *(r->sq_tail);
+	r->cq_head = (uint32_t *)(ring + p.cq_off.head);
+	r->cq_tail = (uint32_t *)(ring + p.cq_off.tail);
+	r->cq_mask = *(uint32_t *)(ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+	/**
+	 * SQ slot i always holds SQE i.
+	 */
+	for (register uint32_t i = 0; i < p.sq_entries; i++) {
+		((uint32_t *)(ring + p.sq_off.array))[i] = i;
+	}
+
+	if (!uring_probe(r)) {
+		goto err;
+	}
+
+	memset(&files, 0, sizeof(files));
+	files.nr = nr_files;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+	if (uring_register(r->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+		debug_log(0, "Cannot register the io_uring file table: %s", strerror(errno));
+		goto err;
+	}
+	r->nr_files = nr_files;
+
+	debug_log(2, "io_uring: %d SQEs, %d CQEs, %d files, multishot read %s", p.sq_entries, p.cq_entries,
+		nr_files, r->read_multishot ? "yes" : "no");
+	return true;
+
+	err:
+	teavpn_uring_destroy(r);
+	return false;
+}
+
+/**
+ * @param struct teavpn_uring *r
+ * @return void
+ */
+void teavpn_uring_destroy(struct teavpn_uring *r)
+{
+	if (r->sqes != NULL) {
+		munmap(r->sqes, r->sqes_size);
+		r->sqes = NULL;
+	}
+
+	if (r->ring != NULL) {
+		munmap(r->ring, r->ring_size);
+		r->ring = NULL;
+	}
+
+	if (r->fd != -1) {
+		close(r->fd);
+		r->fd = -1;
+	}
+}
+
+/**
+ * A zeroed SQE, submitted by the next teavpn_uring_enter().
+ * When the queue is full the queued SQEs are submitted first.
+ *
+ * @param struct teavpn_uring *r
+ * @return struct io_uring_sqe *	NULL if the kernel does not take any.
+ */
+struct io_uring_sqe *teavpn_uring_sqe(struct teavpn_uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if ((r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) >= r->sq_entries) {
+		r->sq_full++;
+		if (teavpn_uring_enter(r, 0, 0) < 0) {
+			return NULL;
+		}
+		if ((r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE)) >= r->sq_entries) {
+			return NULL;
+		}
+	}
+
+	sqe = &(r->sqes[r->sq_local & r->sq_mask]);
+	memset(sqe, 0, sizeof(*sqe));
+	r->sq_local++;
+	return sqe;
+}
+
+/**
+ * Submit the queued SQEs and wait for wait_nr completions
+ * (or timeout_ms, 0 = no timeout), in one system call.
+ *
+ * @param struct teavpn_uring	*r
+ * @param uint32_t				wait_nr
+ * @param uint32_t				timeout_ms
+ * @return int	SQEs submitted, -1 on error (errno, ETIME for the timeout).
+ */
+int teavpn_uring_enter(struct teavpn_uring *r, uint32_t wait_nr, uint32_t timeout_ms)
+{
+	int ret;
+	uint32_t to_submit, flags = 0;
+	struct __kernel_timespec ts;
+	struct io_uring_getevents_arg arg;
+
+	to_submit = r->sq_local - *(r->sq_tail);
+	__atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+
+	if ((to_submit == 0) && (wait_nr == 0)) {
+		return 0;
+	}
+
+	if (wait_nr > 0) {
+		flags |= IORING_ENTER_GETEVENTS;
+	}
+
+	memset(&arg, 0, sizeof(arg));
+	if ((wait_nr > 0) && (timeout_ms > 0)) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000;
+		arg.ts = (uint64_t)(uintptr_t)&ts;
+	}
+	flags |= IORING_ENTER_EXT_ARG;
+
+	r->enters++;
+	ret = (int)syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, flags, &arg, sizeof(arg));
+	if (ret > 0) {
+		r->submitted += ret;
+	}
+	return ret;
+}
+
+/**
+ * Put fd into slot of the file table (-1 empties it). The
+ * table holds its own reference, closing fd does not close
+ * the file until the slot is emptied.
+ *
+ * @param struct teavpn_uring	*r
+ * @param uint32_t				slot
+ * @param int					fd
+ * @return bool
+ */
+bool teavpn_uring_file_set(struct teavpn_uring *r, uint32_t slot, int fd)
+{
+	struct io_uring_files_update up;
+
+	memset(&up, 0, sizeof(up));
+	up.offset = slot;
+	up.fds = (uint64_t)(uintptr_t)&fd;
+
+	if (uring_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) < 0) {
+		debug_log(0, "Cannot set io_uring file %d to fd %d: %s", slot, fd, strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Register len bytes from base as fixed buffer 0, READ_FIXED
+ * and WRITE_FIXED within it skip pinning the pages.
+ *
+ * @param struct teavpn_uring	*r
+ * @param void					*base
+ * @param size_t				len
+ * @return bool	false if the pages cannot be locked (RLIMIT_MEMLOCK).
+ */
+bool teavpn_uring_register_bufs(struct teavpn_uring *r, void *base, size_t len)
+{
+	struct iovec iov;
+
+	iov.iov_base = base;
+	iov.iov_len = len;
+	if (uring_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1) < 0) {
+		debug_log(1, "Cannot register %zu bytes of io_uring buffers: %s", len, strerror(errno));
+		return false;
+	}
+
+	r->fixed_bufs = true;
+	return true;
+}
+
+/**
+ * Set up an empty ring of provided buffers as group bgid.
+ *
+ * @param struct teavpn_uring		*r
+ * @param struct teavpn_uring_bufs	*b
+ * @param uint16_t					bgid
+ * @param uint16_t					entries	Power of 2.
+ * @return bool
+ */
+bool teavpn_uring_bufs_init(struct teavpn_uring *r, struct teavpn_uring_bufs *b, uint16_t bgid, uint16_t entries)
+{
+	struct io_uring_buf_reg reg;
+
+	memset(b, 0, sizeof(*b));
+	b->bgid = bgid;
+	b->entries = entries;
+	b->br_size = entries * sizeof(struct io_uring_buf);
+	b->br = mmap(NULL, b->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (b->br == MAP_FAILED) {
+		b->br = NULL;
+		debug_log(0, "Cannot map the provided buffer ring: %s", strerror(errno));
+		return false;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)b->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if (uring_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		debug_log(0, "Cannot register the provided buffer ring %d: %s", bgid, strerror(errno));
+		munmap(b->br, b->br_size);
+		b->br = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * @param struct teavpn_uring		*r
+ * @param struct teavpn_uring_bufs	*b
+ * @return void
+ */
+void teavpn_uring_bufs_destroy(struct teavpn_uring *r, struct teavpn_uring_bufs *b)
+{
+	struct io_uring_buf_reg reg;
+
+	if (b->br == NULL) {
+		return;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = b->bgid;
+	uring_register(r->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(b->br, b->br_size);
+	b->br = NULL;
+}
+
+/**
+ * @param FILE					*fp
+ * @param const char			*name
+ * @param struct teavpn_uring	*r
+ * @return void
+ */
+void teavpn_uring_dump(FILE *fp, const char *name, struct teavpn_uring *r)
+{
+	fprintf(fp, "[io_uring] %s enters=%lu sqes=%lu cqes=%lu sqes/enter=%.1f cqes/enter=%.1f sq_full=%lu "
+		"fixed_bufs=%s read_multishot=%s\n",
+		name, r->enters, r->submitted, r->completed,
+		(r->enters > 0) ? ((double)r->submitted / r->enters) : 0.0,
+		(r->enters > 0) ? ((double)r->completed / r->enters) : 0.0,
+		r->sq_full, r->fixed_bufs ? "yes" : "no", r->read_multishot ? "yes" : "no");
+}
+
+/**
+ * @param uint32_t				entries
+ * @param struct io_uring_params	*p
+ * @return int
+ */
+static int uring_setup(uint32_t entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+/**
+ * @param int			fd
+ * @param uint32_t		opcode
+ * @param const void	*arg
+ * @param uint32_t		nr_args
+ * @return int
+ */
+static int uring_register(int fd, uint32_t opcode, const void *arg, uint32_t nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @param struct teavpn_uring *r
+ * @return bool	false if an op we need is missing.
+ */
+static bool uring_probe(struct teavpn_uring *r)
+{
+	bool ok = true;
+	struct io_uring_probe *probe;
+	const size_t nr_ops = 256;
+
+	probe = calloc(1, sizeof(*probe) + (nr_ops * sizeof(struct io_uring_probe_op)));
+	if (probe == NULL) {
+		return false;
+	}
+
+	if (uring_register(r->fd, IORING_REGISTER_PROBE, probe, nr_ops) < 0) {
+		debug_log(0, "Cannot probe io_uring: %s", strerror(errno));
+		free(probe);
+		return false;
+	}
+
+	#define uring_has_op(OP) \
+		(((OP) <= probe->last_op) && (probe->ops[(OP)].flags & IO_URING_OP_SUPPORTED))
+
+	for (register size_t i = 0; i < sizeof(uring_needed_ops); i++) {
+		if (!uring_has_op(uring_needed_ops[i])) {
+			debug_log(0, "io_uring of this kernel has no op %d (Linux 6.0 is needed)", uring_needed_ops[i]);
+			ok = false;
+		}
+	}
+
+	r->read_multishot = uring_has_op(TEAVPN_URING_OP_READ_MULTISHOT);
+
+	#undef uring_has_op
+
+	free(probe);
+	return ok;
+}
+
+#endif /* #ifdef TEAVPN_HAVE_URING */
@@ -0,0 +1,245 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tls.h>
+#include <linux/errqueue.h>
+
+#include <teavpn/teavpn.h>
+#include <teavpn/zerocopy.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+
+extern uint8_t verbose_level;
+
+/**
+ * @param struct teavpn_zc	*zc
+ * @param int16_t			index	Lock stats index (connection).
+ * @return void
+ */
+void teavpn_zc_init(struct teavpn_zc *zc, int16_t index)
+{
+	memset(zc, 0, sizeof(*zc));
+	teavpn_mutex_init(&(zc->lock), "zerocopy", index);
+}
+
+/**
+ * Turn SO_ZEROCOPY on for a fresh (next = 0) or taken over
+ * socket. Nothing may be pending.
+ *
+ * @param struct teavpn_zc	*zc
+ * @param int				fd
+ * @param uint32_t			threshold	0 = off.
+ * @param uint32_t			next		Sends the socket has already counted.
+ * @return bool	false if the socket stays on the copying path.
+ */
+bool teavpn_zc_enable(struct teavpn_zc *zc, int fd, uint32_t threshold, uint32_t next)
+{
+	int one = 1;
+	uint8_t info[64];
+	socklen_t len = sizeof(info);
+
+	teavpn_mutex_lock(&(zc->lock));
+	zc->threshold = 0;
+	zc->next = next;
+	zc->pending = 0;
+	zc->sent = zc->copied = zc->fallback = 0;
+	memset(zc->items, 0, sizeof(zc->items));
+	teavpn_mutex_unlock(&(zc->lock));
+
+	if (threshold == 0) {
+		return false;
+	}
+
+	/**
+	 * kTLS encrypts into its own pages, it refuses MSG_ZEROCOPY.
+	 */
+	if (getsockopt(fd, SOL_TLS, TLS_TX, info, &len) == 0) {
+		explicit_bzero(info, sizeof(info));
+		debug_log(2, "No zerocopy on fd %d, it is a kTLS socket", fd);
+		return false;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+		debug_log(1, "setsockopt(SO_ZEROCOPY) failed on fd %d", fd);
+		return false;
+	}
+
+	zc->threshold = threshold;
+	return true;
+}
+
+/**
+ * Send iov with MSG_ZEROCOPY. When held is set the item belongs
+ * to zc, it is released by teavpn_zc_reap(), otherwise the caller
+ * keeps it (failed or copied send).
+ *
+ * @param struct teavpn_zc		*zc
+ * @param int					fd
+ * @param const struct iovec	*iov
+ * @param int					iovcnt
+ * @param void					*item	Not NULL.
+ * @param bool					*held
+ * @return ssize_t	As sendmsg(2).
+ */
+ssize_t teavpn_zc_send(struct teavpn_zc *zc, int fd, const struct iovec *iov, int iovcnt, void *item, bool *held)
+{
+	ssize_t ret;
+	uint32_t id;
+	struct msghdr msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+
+	/**
+	 * Registered before the send, the completion may be
+	 * reaped by another thread before sendmsg() returns.
+	 */
+	teavpn_mutex_lock(&(zc->lock));
+	id = zc->next;
+	zc->items[id & TEAVPN_ZC_MASK] = item;
+	zc->pending++;
+	teavpn_mutex_unlock(&(zc->lock));
+
+	ret = sendmsg(fd, &msg, MSG_ZEROCOPY);
+
+	teavpn_mutex_lock(&(zc->lock));
+	if (ret >= 0) {
+		zc->next++;
+		zc->sent++;
+		*held = true;
+	} else {
+		// A failed send is not counted by the socket.
+		zc->items[id & TEAVPN_ZC_MASK] = NULL;
+		zc->pending--;
+		*held = false;
+	}
+	teavpn_mutex_unlock(&(zc->lock));
+
+	/**
+	 * Out of optmem for the notifications, copy this one.
+	 */
+	if ((ret < 0) && (!*held) && (errno == ENOBUFS)) {
+		__atomic_fetch_add(&(zc->fallback), 1, __ATOMIC_RELAXED);
+		ret = sendmsg(fd, &msg, 0);
+	}
+
+	return ret;
+}
+
+/**
+ * Read the completions of fd and release their items.
+ *
+ * @param struct teavpn_zc		*zc
+ * @param int					fd
+ * @param teavpn_zc_release_t	release
+ * @return uint32_t	Number of items released.
+ */
+uint32_t teavpn_zc_reap(struct teavpn_zc *zc, int fd, teavpn_zc_release_t release)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	uint32_t released = 0;
+
+	if (__atomic_load_n(&(zc->pending), __ATOMIC_ACQUIRE) == 0) {
+		return 0;
+	}
+
+	teavpn_mutex_lock(&(zc->lock));
+	while (zc->pending > 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+			break;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(((cm->cmsg_level == SOL_IP) && (cm->cmsg_type == IP_RECVERR)) ||
+				((cm->cmsg_level == SOL_IPV6) && (cm->cmsg_type == IPV6_RECVERR)))) {
+				continue;
+			}
+
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if ((serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || (serr->ee_errno != 0)) {
+				continue;
+			}
+
+			/**
+			 * Ids ee_info to ee_data, both inclusive (may wrap).
+			 */
+			for (uint32_t id = serr->ee_info; ; id++) {
+				void *item = zc->items[id & TEAVPN_ZC_MASK];
+
+				if (item != NULL) {
+					zc->items[id & TEAVPN_ZC_MASK] = NULL;
+					zc->pending--;
+					released++;
+					if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+						zc->copied++;
+					}
+					release(item);
+				}
+
+				if (id == serr->ee_data) {
+					break;
+				}
+			}
+		}
+	}
+	teavpn_mutex_unlock(&(zc->lock));
+
+	return released;
+}
+
+/**
+ * The peer of a closed connection does not take the data which
+ * holds our pages. Reset the connection (connect(2) to AF_UNSPEC),
+ * the kernel drops its send queue and reports the completions of
+ * the dropped frames. The fd stays open for teavpn_zc_reap(),
+ * the items are only released by that.
+ *
+ * @param int fd
+ * @return void
+ */
+void teavpn_zc_abort(int fd)
+{
+	struct sockaddr sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_family = AF_UNSPEC;
+	if (connect(fd, &sa, sizeof(sa)) < 0) {
+		debug_log(2, "Cannot reset fd %d for its zerocopy completions", fd);
+	}
+}
+
+/**
+ * @param FILE				*fp
+ * @param uint16_t			conn
+ * @param struct teavpn_zc	*zc
+ * @return void
+ */
+void teavpn_zc_dump(FILE *fp, uint16_t conn, struct teavpn_zc *zc)
+{
+	if (zc->threshold == 0) {
+		return;
+	}
+
+	fprintf(fp, "[zerocopy] conn=%d threshold=%u sent=%lu copied=%lu fallback=%lu pending=%u\n",
+		conn, zc->threshold, zc->sent, zc->copied, zc->fallback,
+		__atomic_load_n(&(zc->pending), __ATOMIC_RELAXED));
+}
@@ -0,0 +1,342 @@
+#!/usr/bin/env python3
+#
+# @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+# @license MIT
+# @package TeaVPN
+#
+# Traffic generator and result comparator for tools/bench/run.sh.
+#
+#   bench.py sink <addr>
+#       Run in the server namespace, bound to the server tunnel address.
+#
+#   bench.py client <addr> --duration S --pids PID,PID [--meta KEY=VALUE]...
+#       Run in the client namespace, prints the results as JSON.
+#
+#   bench.py compare <baseline.json> <current.json> [--threshold PCT]
+#       Exit 1 if a metric regressed by more than PCT percent.
+#
+
+import os
+import sys
+import json
+import time
+import socket
+import argparse
+import threading
+import socketserver
+
+BULK_PORT = 9000
+FLOOD_PORT = 9001
+CTRL_PORT = 9002
+ECHO_PORT = 9003
+
+BULK_CHUNK = 65536
+FLOOD_PAYLOAD = 64
+RR_PAYLOAD = 64
+
+# Metric name -> True if higher is better.
+METRICS = {
+	"gbit_s": True,
+	"kpps": True,
+	"cpu_s_per_gbit": False,
+	"loss_pct": False,
+	"p50_us": False,
+	"p90_us": False,
+	"p99_us": False,
+	"p999_us": False,
+}
+
+
+# ---------------------------------------------------------------- sink side
+
+flood_lock = threading.Lock()
+flood_pkts = 0
+flood_bytes = 0
+
+
+class BulkHandler(socketserver.BaseRequestHandler):
+	def handle(self):
+		while self.request.recv(BULK_CHUNK):
+			pass
+
+
+class CtrlHandler(socketserver.BaseRequestHandler):
+	"""Reply with the flood counters and reset them."""
+
+	def handle(self):
+		global flood_pkts, flood_bytes
+		with flood_lock:
+			data = {"pkts": flood_pkts, "bytes": flood_bytes}
+			flood_pkts = 0
+			flood_bytes = 0
+		self.request.sendall(json.dumps(data).encode())
+
+
+class ThreadedTCPServer(socketserver.ThreadingMixIn, socketserver.TCPServer):
+	allow_reuse_address = True
+	daemon_threads = True
+
+
+def flood_counter(addr):
+	global flood_pkts, flood_bytes
+	s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 8 << 20)
+	s.bind((addr, FLOOD_PORT))
+	while True:
+		n = len(s.recv(2048))
+		with flood_lock:
+			flood_pkts += 1
+			flood_bytes += n
+
+
+def echo_server(addr):
+	s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	s.bind((addr, ECHO_PORT))
+	while True:
+		data, peer = s.recvfrom(2048)
+		s.sendto(data, peer)
+
+
+def cmd_sink(args):
+	for fn in (flood_counter, echo_server):
+		threading.Thread(target=fn, args=(args.addr,), daemon=True).start()
+
+	ctrl = ThreadedTCPServer((args.addr, CTRL_PORT), CtrlHandler)
+	threading.Thread(target=ctrl.serve_forever, daemon=True).start()
+
+	bulk = ThreadedTCPServer((args.addr, BULK_PORT), BulkHandler)
+	print("sink ready", flush=True)
+	bulk.serve_forever()
+
+
+# -------------------------------------------------------------- client side
+
+def cpu_seconds(pids):
+	"""utime + stime of the given processes (all threads)."""
+	total = 0
+	for pid in pids:
+		with open("/proc/%d/stat" % pid) as f:
+			fields = f.read().rsplit(")", 1)[1].split()
+		total += int(fields[11]) + int(fields[12])
+	return total / os.sysconf("SC_CLK_TCK")
+
+
+def percentile(sorted_values, p):
+	if not sorted_values:
+		return 0.0
+	k = min(len(sorted_values) - 1, int(round((p / 100.0) * (len(sorted_values) - 1))))
+	return sorted_values[k]
+
+
+def cpu_per_gbit(cpu, nbytes):
+	gbit = (nbytes * 8) / 1e9
+	return round(cpu / gbit, 4) if gbit > 0 else 0.0
+
+
+def profile_bulk_tcp(args, pids):
+	payload = b"\x00" * BULK_CHUNK
+	sent = 0
+
+	s = socket.create_connection((args.addr, BULK_PORT), timeout=10)
+	cpu0 = cpu_seconds(pids)
+	t0 = time.monotonic()
+	deadline = t0 + args.duration
+	while time.monotonic() < deadline:
+		s.sendall(payload)
+		sent += len(payload)
+
+	# Wait until the sink has consumed everything.
+	s.shutdown(socket.SHUT_WR)
+	while s.recv(1):
+		pass
+	elapsed = time.monotonic() - t0
+	cpu = cpu_seconds(pids) - cpu0
+	s.close()
+
+	return {
+		"bytes": sent,
+		"seconds": round(elapsed, 3),
+		"gbit_s": round((sent * 8) / elapsed / 1e9, 4),
+		"cpu_s": round(cpu, 3),
+		"cpu_s_per_gbit": cpu_per_gbit(cpu, sent),
+	}
+
+
+def flood_counters(args):
+	s = socket.create_connection((args.addr, CTRL_PORT), timeout=10)
+	data = b""
+	while True:
+		chunk = s.recv(4096)
+		if not chunk:
+			break
+		data += chunk
+	s.close()
+	return json.loads(data)
+
+
+def profile_udp_flood(args, pids):
+	payload = b"\x00" * FLOOD_PAYLOAD
+	sent = 0
+
+	flood_counters(args)
+	s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	s.connect((args.addr, FLOOD_PORT))
+
+	cpu0 = cpu_seconds(pids)
+	t0 = time.monotonic()
+	deadline = t0 + args.duration
+	while time.monotonic() < deadline:
+		for _ in range(64):
+			try:
+				s.send(payload)
+				sent += 1
+			except (BlockingIOError, ConnectionRefusedError):
+				pass
+	elapsed = time.monotonic() - t0
+
+	# Let the tunnel drain before reading the counters.
+	time.sleep(1)
+	cpu = cpu_seconds(pids) - cpu0
+	recv = flood_counters(args)
+	s.close()
+
+	return {
+		"sent_pkts": sent,
+		"recv_pkts": recv["pkts"],
+		"seconds": round(elapsed, 3),
+		"kpps": round(recv["pkts"] / elapsed / 1e3, 3),
+		"sent_kpps": round(sent / elapsed / 1e3, 3),
+		"loss_pct": round((100.0 * (sent - recv["pkts"]) / sent) if sent else 0.0, 3),
+		"gbit_s": round((recv["bytes"] * 8) / elapsed / 1e9, 4),
+		"cpu_s": round(cpu, 3),
+		"cpu_s_per_gbit": cpu_per_gbit(cpu, recv["bytes"]),
+	}
+
+
+def profile_rr(args, pids):
+	payload = b"\x00" * RR_PAYLOAD
+	rtts = []
+	lost = 0
+
+	s = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+	s.connect((args.addr, ECHO_PORT))
+	s.settimeout(1)
+
+	t0 = time.monotonic()
+	deadline = t0 + args.duration
+	while (time.monotonic() < deadline) and (len(rtts) + lost < args.rr_count):
+		start = time.perf_counter_ns()
+		s.send(payload)
+		try:
+			s.recv(2048)
+		except socket.timeout:
+			lost += 1
+			continue
+		rtts.append((time.perf_counter_ns() - start) / 1e3)
+	elapsed = time.monotonic() - t0
+	s.close()
+
+	rtts.sort()
+	return {
+		"transactions": len(rtts),
+		"lost": lost,
+		"seconds": round(elapsed, 3),
+		"kpps": round(len(rtts) / elapsed / 1e3, 3),
+		"p50_us": round(percentile(rtts, 50), 1),
+		"p90_us": round(percentile(rtts, 90), 1),
+		"p99_us": round(percentile(rtts, 99), 1),
+		"p999_us": round(percentile(rtts, 99.9), 1),
+		"max_us": round(rtts[-1], 1) if rtts else 0.0,
+	}
+
+
+PROFILES = {
+	"bulk_tcp": profile_bulk_tcp,
+	"udp_flood": profile_udp_flood,
+	"rr": profile_rr,
+}
+
+
+def cmd_client(args):
+	pids = [int(p) for p in args.pids.split(",") if p]
+	result = {"meta": {}, "profiles": {}}
+
+	for kv in args.meta:
+		k, _, v = kv.partition("=")
+		result["meta"][k] = v
+	result["meta"]["duration"] = args.duration
+
+	for name in args.profiles.split(","):
+		result["profiles"][name] = PROFILES[name](args, pids)
+		print("%s: %s" % (name, json.dumps(result["profiles"][name])), file=sys.stderr)
+
+	print(json.dumps(result, indent=2))
+
+
+# ------------------------------------------------------------------ compare
+
+def cmd_compare(args):
+	with open(args.baseline) as f:
+		base = json.load(f)
+	with open(args.current) as f:
+		cur = json.load(f)
+
+	regressions = 0
+	print("%-10s %-16s %14s %14s %9s" % ("profile", "metric", "baseline", "current", "change"))
+
+	for prof, metrics in sorted(base.get("profiles", {}).items()):
+		for metric, higher_better in METRICS.items():
+			if (metric not in metrics) or (metric not in cur.get("profiles", {}).get(prof, {})):
+				continue
+
+			b = float(metrics[metric])
+			c = float(cur["profiles"][prof][metric])
+			change = ((c - b) * 100.0 / b) if b else 0.0
+			worse = (-change) if higher_better else change
+
+			flag = ""
+			if worse > args.threshold:
+				flag = "  REGRESSION"
+				regressions += 1
+
+			print("%-10s %-16s %14.4f %14.4f %+8.2f%%%s" % (prof, metric, b, c, change, flag))
+
+	if regressions:
+		print("\n%d metric(s) regressed by more than %.1f%%" % (regressions, args.threshold))
+		return 1
+
+	print("\nNo regression above %.1f%%" % args.threshold)
+	return 0
+
+
+def main():
+	ap = argparse.ArgumentParser()
+	sub = ap.add_subparsers(dest="cmd", required=True)
+
+	p = sub.add_parser("sink")
+	p.add_argument("addr")
+
+	p = sub.add_parser("client")
+	p.add_argument("addr")
+	p.add_argument("--duration", type=float, default=10)
+	p.add_argument("--pids", default="")
+	p.add_argument("--profiles", default="bulk_tcp,udp_flood,rr")
+	p.add_argument("--rr-count", type=int, default=100000)
+	p.add_argument("--meta", action="append", default=[], metavar="KEY=VALUE")
+
+	p = sub.add_parser("compare")
+	p.add_argument("baseline")
+	p.add_argument("current")
+	p.add_argument("--threshold", type=float, default=5.0)
+
+	args = ap.parse_args()
+	if args.cmd == "sink":
+		cmd_sink(args)
+	elif args.cmd == "client":
+		cmd_client(args)
+	else:
+		sys.exit(cmd_compare(args))
+
+
+if __name__ == "__main__":
+	main()
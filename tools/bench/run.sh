@@ -0,0 +1,196 @@
+#!/bin/bash
+#
+# @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+# @license MIT
+# @package TeaVPN
+#
+# Loopback benchmark: teavpn server and client in two network
+# namespaces joined by a veth pair. Does not need root, the
+# whole run lives in an unprivileged user namespace.
+#
+# Usage: tools/bench/run.sh [options]
+#   -o FILE     write JSON results to FILE (default: stdout)
+#   -d SECONDS  duration of each traffic profile (default: 10)
+#   -t THREADS  server worker threads (default: 4)
+#   -p LIST     profiles, comma separated (default: bulk_tcp,udp_flood,rr)
+#   -b FILE     compare the results with baseline FILE
+#   -T PCT      regression threshold in percent (default: 5)
+#   -k          keep the work directory (configs and logs)
+#
+
+set -e
+
+ROOT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")/../.." && pwd)"
+BENCH_PY="${ROOT_DIR}/tools/bench/bench.py"
+BIN="${ROOT_DIR}/teavpn"
+
+OUT=""
+DURATION=10
+THREADS=4
+PROFILES="bulk_tcp,udp_flood,rr"
+BASELINE=""
+THRESHOLD=5
+KEEP=0
+
+while getopts "o:d:t:p:b:T:k" opt; do
+	case "${opt}" in
+		o) OUT="${OPTARG}" ;;
+		d) DURATION="${OPTARG}" ;;
+		t) THREADS="${OPTARG}" ;;
+		p) PROFILES="${OPTARG}" ;;
+		b) BASELINE="${OPTARG}" ;;
+		T) THRESHOLD="${OPTARG}" ;;
+		k) KEEP=1 ;;
+		*) sed -n '/^# Usage/,/^$/p' "$0"; exit 1 ;;
+	esac
+done
+
+if [ ! -x "${BIN}" ]; then
+	echo "${BIN} does not exist, run make first" >&2
+	exit 1
+fi
+
+#
+# Re-exec inside a fresh user + network namespace. Inside it
+# we are root for the namespaced network stack only.
+#
+if [ -z "${TEAVPN_BENCH_INNER}" ]; then
+	RESULT="$(mktemp)"
+	TEAVPN_BENCH_INNER="${RESULT}" unshare --user --map-root-user --net -- "$0" "$@"
+
+	if [ -n "${OUT}" ]; then
+		cp "${RESULT}" "${OUT}"
+		echo "Results written to ${OUT}" >&2
+	else
+		cat "${RESULT}"
+	fi
+
+	STATUS=0
+	if [ -n "${BASELINE}" ]; then
+		python3 "${BENCH_PY}" compare "${BASELINE}" "${RESULT}" --threshold "${THRESHOLD}" || STATUS=$?
+	fi
+
+	rm -f "${RESULT}"
+	exit ${STATUS}
+fi
+
+WORK="$(mktemp -d)"
+PIDS=()
+
+cleanup()
+{
+	for pid in "${PIDS[@]}"; do
+		kill "${pid}" 2> /dev/null || true
+	done
+	wait 2> /dev/null || true
+
+	if [ "${KEEP}" = "1" ]; then
+		echo "Work directory: ${WORK}" >&2
+	else
+		rm -rf "${WORK}"
+	fi
+}
+trap cleanup EXIT
+
+# wait_for <seconds> <command...>
+wait_for()
+{
+	local n=$(( $1 * 10 ))
+	shift
+	while ! "$@" > /dev/null 2>&1; do
+		n=$(( n - 1 ))
+		if [ ${n} -le 0 ]; then
+			return 1
+		fi
+		sleep 0.1
+	done
+}
+
+in_client()
+{
+	nsenter -t "${CLIENT_NS}" -n --preserve-credentials -- "$@"
+}
+
+client_ns_ready()
+{
+	[ "$(readlink /proc/${CLIENT_NS}/ns/net)" != "$(readlink /proc/self/ns/net)" ]
+}
+
+client_ready()
+{
+	in_client ip -o -4 addr show dev tvbc0 | grep -q "5.5.0.2"
+}
+
+#
+# Server side lives in our namespace, the client side in a
+# child namespace held open by a sleeping process.
+#
+ip link set lo up
+unshare --net -- sleep infinity &
+CLIENT_NS=$!
+PIDS+=(${CLIENT_NS})
+wait_for 5 client_ns_ready
+
+ip link add vs type veth peer name vc netns "${CLIENT_NS}"
+ip addr add 10.99.0.1/24 dev vs
+ip link set vs up
+in_client ip link set lo up
+in_client ip addr add 10.99.0.2/24 dev vc
+in_client ip link set vc up
+
+mkdir -p "${WORK}/data/users/bench"
+printf "pass123" > "${WORK}/data/users/bench/password"
+printf "5.5.0.2/16 5.5.255.255" > "${WORK}/data/users/bench/ip"
+
+cat > "${WORK}/server.conf" << EOF
+dev = tvbs0
+mtu = 1400
+inet4 = 5.5.0.1/16
+inet4_bcmask = 5.5.255.255
+bind_addr = 10.99.0.1
+bind_port = 55555
+threads = ${THREADS}
+data_dir = ${WORK}/data
+EOF
+
+cat > "${WORK}/client.conf" << EOF
+dev = tvbc0
+mtu = 1400
+server_ip = 10.99.0.1
+server_port = 55555
+username = bench
+password = pass123
+EOF
+
+"${BIN}" server -c "${WORK}/server.conf" > "${WORK}/server.log" 2>&1 &
+SERVER_PID=$!
+PIDS+=(${SERVER_PID})
+if ! wait_for 10 grep -q "Listening on" "${WORK}/server.log"; then
+	echo "teavpn server did not start:" >&2
+	cat "${WORK}/server.log" >&2
+	exit 1
+fi
+
+python3 "${BENCH_PY}" sink 5.5.0.1 > "${WORK}/sink.log" 2>&1 &
+PIDS+=($!)
+
+in_client "${BIN}" connect -c "${WORK}/client.conf" > "${WORK}/client.log" 2>&1 &
+CLIENT_PID=$!
+PIDS+=(${CLIENT_PID})
+if ! wait_for 10 client_ready; then
+	echo "teavpn client did not connect:" >&2
+	cat "${WORK}/client.log" >&2
+	exit 1
+fi
+wait_for 5 grep -q "sink ready" "${WORK}/sink.log"
+
+in_client python3 "${BENCH_PY}" client 5.5.0.1 \
+	--duration "${DURATION}" \
+	--profiles "${PROFILES}" \
+	--pids "${SERVER_PID},${CLIENT_PID}" \
+	--meta "commit=$(git -C "${ROOT_DIR}" rev-parse --short HEAD 2> /dev/null || echo unknown)" \
+	--meta "date=$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+	--meta "kernel=$(uname -r)" \
+	--meta "cpus=$(nproc)" \
+	--meta "threads=${THREADS}" \
+	> "${TEAVPN_BENCH_INNER}"
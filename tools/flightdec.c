@@ -0,0 +1,204 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ *
+ * Flight recorder decoder.
+ *
+ * Usage: teavpn-flightdec <dump_file> [last_n_events]
+ *
+ * Merges the per-thread rings of a flight recorder dump
+ * and prints them as a single timeline, relative to the
+ * moment of the dump.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <teavpn/flight.h>
+
+struct timeline_entry {
+	struct teavpn_fr_event ev;
+	uint32_t ring;
+};
+
+static const char *type_names[TEAVPN_FR_TYPE_NUM] = {
+	"?",
+	"ENQUEUE",
+	"DEQUEUE",
+	"BUF_ALLOC",
+	"BUF_FREE",
+	"BUF_EXHAUSTED",
+	"QUEUE_FULL",
+	"CONN_OPEN",
+	"CONN_CLOSE",
+	"ERROR",
+	"WATCHDOG"
+};
+
+static const char *err_sites[] = {
+	"?", "tap_read", "tap_write", "sock_read", "sock_write", "accept", "select", "decrypt"
+};
+
+static const char *reasons[] = {
+	"?", "signal", "fatal signal", "watchdog"
+};
+
+/**
+ * @param const void *a
+ * @param const void *b
+ * @return int
+ */
+static int timeline_cmp(const void *a, const void *b)
+{
+	const struct timeline_entry *x = a, *y = b;
+
+	if (x->ev.tsc < y->ev.tsc) return -1;
+	if (x->ev.tsc > y->ev.tsc) return 1;
+	return 0;
+}
+
+/**
+ * @param const struct teavpn_fr_event *ev
+ * @return void
+ */
+static void print_args(const struct teavpn_fr_event *ev)
+{
+	switch (ev->type) {
+		case TEAVPN_FR_ENQUEUE:
+			printf("conn=%u bufchan=%u queue=%u", ev->a, ev->b, ev->c);
+			break;
+		case TEAVPN_FR_DEQUEUE:
+			printf("worker=%u queue=%u conn=%u", ev->a, ev->b, ev->c);
+			break;
+		case TEAVPN_FR_BUF_ALLOC:
+			printf("bufchan=%u", ev->a);
+			break;
+		case TEAVPN_FR_BUF_FREE:
+			printf("bufchan=%u ref_count=%u", ev->a, ev->b);
+			break;
+		case TEAVPN_FR_BUF_EXHAUSTED:
+			printf("wait=%u sleep_state=%u", ev->a, ev->b);
+			break;
+		case TEAVPN_FR_QUEUE_FULL:
+			printf("conn=%u bufchan=%u", ev->a, ev->b);
+			break;
+		case TEAVPN_FR_CONN_OPEN:
+			printf("conn=%u fd=%u", ev->a, ev->b);
+			break;
+		case TEAVPN_FR_CONN_CLOSE:
+			printf("conn=%u fd=%u reason=%u", ev->a, ev->b, ev->c);
+			break;
+		case TEAVPN_FR_ERROR:
+			printf("site=%s errno=%u (%s) conn=%u",
+				(ev->a < (sizeof(err_sites) / sizeof(err_sites[0]))) ? err_sites[ev->a] : "?",
+				ev->b, strerror(ev->b), ev->c);
+			break;
+		case TEAVPN_FR_WATCHDOG:
+			printf("stalled=%us", ev->a);
+			break;
+		default:
+			printf("a=%u b=%u c=%u", ev->a, ev->b, ev->c);
+			break;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *h;
+	time_t dump_sec;
+	size_t n = 0, start = 0, last = 0;
+	struct teavpn_fr_file_hdr hdr;
+	struct teavpn_fr_ring *rings;
+	struct timeline_entry *timeline;
+
+	if (argc < 2) {
+		printf("Usage: %s <dump_file> [last_n_events]\n", argv[0]);
+		return 1;
+	}
+
+	if (argc > 2) {
+		last = (size_t)atol(argv[2]);
+	}
+
+	h = fopen(argv[1], "rb");
+	if (h == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	if ((fread(&hdr, sizeof(hdr), 1, h) != 1) || (hdr.magic != TEAVPN_FR_MAGIC)) {
+		printf("%s is not a flight recorder dump\n", argv[1]);
+		fclose(h);
+		return 1;
+	}
+
+	if ((hdr.version != TEAVPN_FR_VERSION) || (hdr.ring_size != TEAVPN_FR_RING_SIZE)) {
+		printf("Unsupported dump version %u (ring size %u)\n", hdr.version, hdr.ring_size);
+		fclose(h);
+		return 1;
+	}
+
+	rings = calloc(hdr.nr_rings, sizeof(*rings));
+	timeline = calloc((size_t)hdr.nr_rings * TEAVPN_FR_RING_SIZE, sizeof(*timeline));
+	if ((hdr.nr_rings > 0) && ((rings == NULL) || (timeline == NULL))) {
+		printf("Cannot allocate memory\n");
+		fclose(h);
+		return 1;
+	}
+
+	if (fread(rings, sizeof(*rings), hdr.nr_rings, h) != hdr.nr_rings) {
+		printf("Truncated dump file\n");
+		fclose(h);
+		return 1;
+	}
+	fclose(h);
+
+	dump_sec = (time_t)(hdr.dump_unix_ns / 1000000000ll);
+	printf("pid %u, reason: %s", hdr.pid,
+		(hdr.reason < (sizeof(reasons) / sizeof(reasons[0]))) ? reasons[hdr.reason] : "?");
+	if (hdr.signo) {
+		printf(" (signal %d)", hdr.signo);
+	}
+	printf(", dumped at %s", ctime(&dump_sec));
+	printf("tsc_hz %lu, %u thread(s)\n\n", hdr.tsc_hz, hdr.nr_rings);
+
+	for (uint32_t r = 0; r < hdr.nr_rings; r++) {
+		uint32_t head = rings[r].hdr.head;
+		uint32_t count = (head > TEAVPN_FR_RING_SIZE) ? TEAVPN_FR_RING_SIZE : head;
+
+		printf("thread %-16s tid %-8u %u event(s)%s\n", rings[r].hdr.name, rings[r].hdr.tid,
+			head, (head > TEAVPN_FR_RING_SIZE) ? " (ring wrapped)" : "");
+
+		for (uint32_t i = head - count; i != head; i++) {
+			timeline[n].ev = rings[r].events[i & (TEAVPN_FR_RING_SIZE - 1)];
+			timeline[n].ring = r;
+			n++;
+		}
+	}
+	printf("\n");
+
+	qsort(timeline, n, sizeof(*timeline), timeline_cmp);
+
+	if ((last > 0) && (last < n)) {
+		start = n - last;
+	}
+
+	for (size_t i = start; i < n; i++) {
+		struct teavpn_fr_event *ev = &(timeline[i].ev);
+		double rel_us = ((double)((int64_t)(ev->tsc - hdr.dump_tsc)) * 1e6) / (double)hdr.tsc_hz;
+
+		printf("%16.3f us  %-16s %-14s ", rel_us, rings[timeline[i].ring].hdr.name,
+			(ev->type < TEAVPN_FR_TYPE_NUM) ? type_names[ev->type] : "?");
+		print_args(ev);
+		printf("\n");
+	}
+
+	free(rings);
+	free(timeline);
+	return 0;
+}
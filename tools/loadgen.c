@@ -0,0 +1,850 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ *
+ * Synthetic multi-session load generator.
+ *
+ * Opens many authenticated sessions against a TeaVPN TCP
+ * server, speaking the wire protocol of teavpn.h directly
+ * (no TUN device), and drives per-session IPv4/UDP traffic.
+ *
+ * Usage: teavpn-loadgen [options]
+ *   -H addr       server address (default 127.0.0.1)
+ *   -P port       server port (default 55555)
+ *   -c file       credentials, one "username password" per line
+ *   -n sessions   total sessions (default 16)
+ *   -r step       sessions added per interval (default: all at once)
+ *   -i seconds    report / ramp interval (default 1)
+ *   -T seconds    duration after the ramp is complete (default 10)
+ *   -p pps        packets per second per session (default 100)
+ *   -s bytes      IP packet size (default 512)
+ *   -d addr       destination IP of the generated packets (default 5.5.0.1)
+ *   -u port       destination UDP port (default 9)
+ *   -t threads    worker threads (default 1)
+ *   -j            print a JSON summary at the end
+ */
+
+#define _GNU_SOURCE
+
+#include <time.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+
+#include <teavpn/teavpn.h>
+
+#define MAX_EVENTS 256
+#define MAX_BURST 32
+#define FRAME_HDR_LEN TEAVPN_PACK(0)
+
+enum session_state {
+	SESS_IDLE = 0,
+	SESS_CONNECTING,
+	SESS_WAIT_AUTH,
+	SESS_WAIT_CONF,
+	SESS_ESTABLISHED,
+	SESS_CLOSED
+};
+
+struct credential {
+	char username[64];
+	char password[64];
+};
+
+struct session {
+	int fd;
+	uint8_t state;
+	uint32_t id;
+	uint64_t seq;
+	uint32_t src_ip;
+	uint64_t t_start;
+	uint64_t next_send;
+
+	/**
+	 * Cumulative counters, read by the reporter.
+	 */
+	uint64_t tx_pkts;
+	uint64_t tx_bytes;
+	uint64_t rx_pkts;
+	uint64_t rx_bytes;
+
+	/**
+	 * Reporter snapshots (interval deltas).
+	 */
+	uint64_t last_tx_bytes;
+	uint64_t last_rx_bytes;
+
+	uint32_t rx_len;
+	uint32_t tx_off;
+	uint32_t tx_len;
+	char rx_buf[sizeof(teavpn_packet)];
+	char tx_buf[sizeof(teavpn_packet)];
+};
+
+struct worker {
+	uint32_t num;
+	int epfd;
+	pthread_t thread;
+};
+
+static struct {
+	struct sockaddr_in server;
+	struct credential *creds;
+	uint32_t nr_creds;
+	uint32_t sessions;
+	uint32_t ramp_step;
+	uint32_t interval;
+	uint32_t duration;
+	uint32_t pps;
+	uint32_t pkt_size;
+	uint32_t dst_ip;
+	uint16_t dst_port;
+	uint32_t threads;
+	bool json;
+} opt;
+
+static struct session *sessions;
+static volatile bool stop = false;
+static uint32_t target_sessions = 0;
+
+/**
+ * Global counters.
+ */
+static uint64_t hs_done = 0;
+static uint64_t hs_failed = 0;
+static uint64_t hs_ns_sum = 0;
+static uint64_t hs_ns_max = 0;
+static uint64_t closed_by_server = 0;
+static uint64_t send_blocked = 0;
+
+
+/**
+ * @return uint64_t
+ */
+static inline uint64_t now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+
+/**
+ * @param void		*data
+ * @param size_t	len
+ * @return uint16_t
+ */
+static uint16_t ip_checksum(const void *data, size_t len)
+{
+	uint32_t sum = 0;
+	const uint16_t *p = data;
+
+	while (len > 1) {
+		sum += *p++;
+		len -= 2;
+	}
+
+	if (len) {
+		sum += *(const uint8_t *)p;
+	}
+
+	while (sum >> 16) {
+		sum = (sum & 0xffff) + (sum >> 16);
+	}
+
+	return (uint16_t)~sum;
+}
+
+
+/**
+ * @param const char *file
+ * @return bool
+ */
+static bool load_credentials(const char *file)
+{
+	FILE *h;
+	char line[256];
+	uint32_t alloc = 0;
+
+	h = fopen(file, "r");
+	if (h == NULL) {
+		perror("Cannot open credentials file");
+		return false;
+	}
+
+	while (fgets(line, sizeof(line), h) != NULL) {
+		struct credential *c;
+
+		if ((line[0] == '#') || (line[0] == '\n')) {
+			continue;
+		}
+
+		if (opt.nr_creds == alloc) {
+			alloc = alloc ? (alloc * 2) : 64;
+			opt.creds = realloc(opt.creds, alloc * sizeof(*(opt.creds)));
+			if (opt.creds == NULL) {
+				fclose(h);
+				return false;
+			}
+		}
+
+		c = &(opt.creds[opt.nr_creds]);
+		if (sscanf(line, "%63s %63s", c->username, c->password) == 2) {
+			opt.nr_creds++;
+		}
+	}
+
+	fclose(h);
+	return opt.nr_creds > 0;
+}
+
+
+/**
+ * @param struct session	*s
+ * @param int				epfd
+ * @param bool				failed	Count as failed handshake if not established.
+ * @return void
+ */
+static void session_close(struct session *s, int epfd, bool failed)
+{
+	if (s->state == SESS_ESTABLISHED) {
+		__atomic_fetch_add(&closed_by_server, 1, __ATOMIC_RELAXED);
+	} else if (failed) {
+		__atomic_fetch_add(&hs_failed, 1, __ATOMIC_RELAXED);
+	}
+
+	epoll_ctl(epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	close(s->fd);
+	s->fd = -1;
+	s->state = SESS_CLOSED;
+}
+
+
+/**
+ * Write tx_buf (or the rest of it).
+ *
+ * @param struct session *s
+ * @return int	1 done, 0 would block, -1 error.
+ */
+static int session_flush(struct session *s)
+{
+	ssize_t ret;
+
+	while (s->tx_off < s->tx_len) {
+		ret = send(s->fd, &(s->tx_buf[s->tx_off]), s->tx_len - s->tx_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			return ((errno == EAGAIN) || (errno == EWOULDBLOCK)) ? 0 : -1;
+		}
+		s->tx_off += ret;
+	}
+
+	s->tx_off = s->tx_len = 0;
+	return 1;
+}
+
+
+/**
+ * Queue one control frame (handshake) and send it.
+ *
+ * @param struct session	*s
+ * @param teavpn_packet		*pkt
+ * @param size_t			len
+ * @return int
+ */
+static int session_send_frame(struct session *s, teavpn_packet *pkt, size_t len)
+{
+	pkt->info.len = len;
+	pkt->info.seq = ++(s->seq);
+	memcpy(s->tx_buf, pkt, len);
+	s->tx_off = 0;
+	s->tx_len = len;
+	return session_flush(s);
+}
+
+
+/**
+ * @param struct session	*s
+ * @param int				epfd
+ * @return void
+ */
+static void session_connect(struct session *s, int epfd)
+{
+	struct epoll_event ev;
+	int one = 1;
+
+	s->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (s->fd < 0) {
+		perror("socket()");
+		s->state = SESS_CLOSED;
+		__atomic_fetch_add(&hs_failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	s->seq = 0;
+	s->rx_len = 0;
+	s->tx_off = s->tx_len = 0;
+	s->t_start = now_ns();
+	s->state = SESS_CONNECTING;
+
+	if ((connect(s->fd, (struct sockaddr *)&(opt.server), sizeof(opt.server)) < 0) && (errno != EINPROGRESS)) {
+		close(s->fd);
+		s->fd = -1;
+		s->state = SESS_CLOSED;
+		__atomic_fetch_add(&hs_failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+	ev.data.ptr = s;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, s->fd, &ev);
+}
+
+
+/**
+ * Connected, send the auth packet.
+ *
+ * @param struct session	*s
+ * @param int				epfd
+ * @return void
+ */
+static void session_on_connected(struct session *s, int epfd)
+{
+	int err = 0;
+	teavpn_packet pkt;
+	socklen_t len = sizeof(err);
+	struct credential *c = &(opt.creds[s->id % opt.nr_creds]);
+
+	getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err != 0) {
+		session_close(s, epfd, true);
+		return;
+	}
+
+	memset(&pkt, 0, TEAVPN_PACK(sizeof(pkt.data.auth)));
+	pkt.info.type = TEAVPN_PACKET_AUTH;
+	pkt.data.auth.username_len = strlen(c->username);
+	pkt.data.auth.password_len = strlen(c->password);
+	strcpy(pkt.data.auth.username, c->username);
+	strcpy(pkt.data.auth.password, c->password);
+
+	s->state = SESS_WAIT_AUTH;
+	if (session_send_frame(s, &pkt, TEAVPN_PACK(sizeof(pkt.data.auth))) < 0) {
+		session_close(s, epfd, true);
+	}
+}
+
+
+/**
+ * Handle one complete frame from the server.
+ *
+ * @param struct session	*s
+ * @param int				epfd
+ * @param teavpn_packet		*pkt
+ * @return bool	false if the session has been closed.
+ */
+static bool session_on_frame(struct session *s, int epfd, teavpn_packet *pkt)
+{
+	char *slash;
+	uint64_t hs_ns;
+	teavpn_packet reply;
+	struct in_addr addr;
+
+	switch (s->state) {
+		case SESS_WAIT_AUTH:
+			s->seq++;
+			if ((pkt->info.type != TEAVPN_PACKET_SIG) || (pkt->data.sig.sig != TEAVPN_SIG_AUTH_OK)) {
+				session_close(s, epfd, true);
+				return false;
+			}
+
+			reply.info.type = TEAVPN_PACKET_SIG;
+			reply.data.sig.sig = TEAVPN_SIG_ACK;
+			s->state = SESS_WAIT_CONF;
+			if (session_send_frame(s, &reply, TEAVPN_PACK(sizeof(reply.data.sig))) < 0) {
+				session_close(s, epfd, true);
+				return false;
+			}
+			return true;
+
+		case SESS_WAIT_CONF:
+			s->seq++;
+			if (pkt->info.type != TEAVPN_PACKET_CONF) {
+				session_close(s, epfd, true);
+				return false;
+			}
+
+			pkt->data.conf.inet4[sizeof(pkt->data.conf.inet4) - 1] = '\0';
+			slash = strchr(pkt->data.conf.inet4, '/');
+			if (slash != NULL) {
+				*slash = '\0';
+			}
+			if (!inet_aton(pkt->data.conf.inet4, &addr)) {
+				session_close(s, epfd, true);
+				return false;
+			}
+
+			s->src_ip = addr.s_addr;
+			s->state = SESS_ESTABLISHED;
+			s->next_send = now_ns();
+
+			hs_ns = s->next_send - s->t_start;
+			__atomic_fetch_add(&hs_done, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&hs_ns_sum, hs_ns, __ATOMIC_RELAXED);
+			if (hs_ns > __atomic_load_n(&hs_ns_max, __ATOMIC_RELAXED)) {
+				__atomic_store_n(&hs_ns_max, hs_ns, __ATOMIC_RELAXED);
+			}
+			return true;
+
+		case SESS_ESTABLISHED:
+			if (pkt->info.type == TEAVPN_PACKET_DATA) {
+				__atomic_fetch_add(&(s->rx_pkts), 1, __ATOMIC_RELAXED);
+				__atomic_fetch_add(&(s->rx_bytes), pkt->info.len - FRAME_HDR_LEN, __ATOMIC_RELAXED);
+			}
+			return true;
+
+		default:
+			return true;
+	}
+}
+
+
+/**
+ * Read and split the byte stream into frames.
+ *
+ * @param struct session	*s
+ * @param int				epfd
+ * @return void
+ */
+static void session_on_readable(struct session *s, int epfd)
+{
+	ssize_t ret;
+	uint32_t off;
+	teavpn_packet *pkt;
+
+	while (true) {
+		ret = recv(s->fd, &(s->rx_buf[s->rx_len]), sizeof(s->rx_buf) - s->rx_len, MSG_DONTWAIT);
+		if (ret == 0) {
+			session_close(s, epfd, true);
+			return;
+		}
+
+		if (ret < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				session_close(s, epfd, true);
+			}
+			return;
+		}
+
+		s->rx_len += ret;
+		off = 0;
+
+		while ((s->rx_len - off) >= FRAME_HDR_LEN) {
+			pkt = (teavpn_packet *)&(s->rx_buf[off]);
+
+			if ((pkt->info.len < FRAME_HDR_LEN) || (pkt->info.len > sizeof(s->rx_buf))) {
+				fprintf(stderr, "session %u: invalid frame length %u\n", s->id, pkt->info.len);
+				session_close(s, epfd, true);
+				return;
+			}
+
+			if ((s->rx_len - off) < pkt->info.len) {
+				break;
+			}
+
+			if (!session_on_frame(s, epfd, pkt)) {
+				return;
+			}
+			off += pkt->info.len;
+		}
+
+		if (off > 0) {
+			memmove(s->rx_buf, &(s->rx_buf[off]), s->rx_len - off);
+			s->rx_len -= off;
+		}
+	}
+}
+
+
+/**
+ * Build one IPv4/UDP data frame in tx_buf.
+ *
+ * @param struct session *s
+ * @return void
+ */
+static void session_build_data(struct session *s)
+{
+	teavpn_packet *pkt = (teavpn_packet *)s->tx_buf;
+	struct iphdr *ip = (struct iphdr *)pkt->data.data;
+	struct udphdr *udp = (struct udphdr *)&(pkt->data.data[sizeof(*ip)]);
+
+	memset(ip, 0, sizeof(*ip) + sizeof(*udp));
+	ip->version = 4;
+	ip->ihl = 5;
+	ip->ttl = 64;
+	ip->protocol = IPPROTO_UDP;
+	ip->tot_len = htons(opt.pkt_size);
+	ip->id = htons((uint16_t)s->seq);
+	ip->saddr = s->src_ip;
+	ip->daddr = opt.dst_ip;
+	ip->check = ip_checksum(ip, sizeof(*ip));
+
+	udp->source = htons(40000 + (s->id % 20000));
+	udp->dest = htons(opt.dst_port);
+	udp->len = htons(opt.pkt_size - sizeof(*ip));
+
+	pkt->info.type = TEAVPN_PACKET_DATA;
+	pkt->info.len = TEAVPN_PACK(opt.pkt_size);
+	pkt->info.seq = ++(s->seq);
+
+	s->tx_off = 0;
+	s->tx_len = pkt->info.len;
+}
+
+
+/**
+ * Send whatever is due for an established session.
+ *
+ * @param struct session	*s
+ * @param int				epfd
+ * @param uint64_t			now
+ * @return void
+ */
+static void session_pace(struct session *s, int epfd, uint64_t now)
+{
+	int ret;
+	uint32_t burst = 0;
+	uint64_t gap = 1000000000ull / opt.pps;
+
+	/**
+	 * Do not try to catch up for more than 100ms.
+	 */
+	if ((now > s->next_send) && ((now - s->next_send) > 100000000ull)) {
+		s->next_send = now - 100000000ull;
+	}
+
+	while ((s->next_send <= now) && (burst++ < MAX_BURST)) {
+		if (s->tx_len == 0) {
+			session_build_data(s);
+		}
+
+		ret = session_flush(s);
+		if (ret < 0) {
+			session_close(s, epfd, true);
+			return;
+		}
+
+		if (ret == 0) {
+			__atomic_fetch_add(&send_blocked, 1, __ATOMIC_RELAXED);
+			return;
+		}
+
+		__atomic_fetch_add(&(s->tx_pkts), 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&(s->tx_bytes), opt.pkt_size, __ATOMIC_RELAXED);
+		s->next_send += gap;
+	}
+}
+
+
+/**
+ * Worker thread, owns sessions where id % threads == num.
+ */
+static void *worker_thread(struct worker *w)
+{
+	int n;
+	uint64_t now;
+	struct session *s;
+	struct epoll_event events[MAX_EVENTS];
+
+	while (!stop) {
+		uint32_t target = __atomic_load_n(&target_sessions, __ATOMIC_ACQUIRE);
+
+		n = epoll_wait(w->epfd, events, MAX_EVENTS, 1);
+
+		for (register int i = 0; i < n; i++) {
+			s = (struct session *)events[i].data.ptr;
+
+			if (s->state == SESS_CLOSED) {
+				continue;
+			}
+
+			if ((s->state == SESS_CONNECTING) && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+				session_on_connected(s, w->epfd);
+				if (s->state == SESS_CLOSED) {
+					continue;
+				}
+			}
+
+			if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+				session_on_readable(s, w->epfd);
+				if (s->state == SESS_CLOSED) {
+					continue;
+				}
+			}
+
+			if ((events[i].events & EPOLLOUT) && (s->tx_len > 0) && (session_flush(s) < 0)) {
+				session_close(s, w->epfd, true);
+			}
+		}
+
+		now = now_ns();
+		for (register uint32_t i = w->num; i < opt.sessions; i += opt.threads) {
+			s = &(sessions[i]);
+
+			if ((s->state == SESS_IDLE) && (i < target)) {
+				session_connect(s, w->epfd);
+			} else if (s->state == SESS_ESTABLISHED) {
+				session_pace(s, w->epfd, now);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Jain's fairness index of the per-session deltas,
+ * 1.0 means every established session got the same.
+ *
+ * @param uint64_t	*deltas
+ * @param uint32_t	n
+ * @return double
+ */
+static double jain_index(uint64_t *deltas, uint32_t n)
+{
+	double sum = 0, sq = 0;
+
+	for (register uint32_t i = 0; i < n; i++) {
+		sum += (double)deltas[i];
+		sq += (double)deltas[i] * (double)deltas[i];
+	}
+
+	return (sq > 0) ? ((sum * sum) / ((double)n * sq)) : 0.0;
+}
+
+
+/**
+ * @param const char *appname
+ * @return void
+ */
+static void usage(const char *appname)
+{
+	printf("Usage: %s -c <credentials_file> [-H addr] [-P port] [-n sessions] [-r ramp_step]\n"
+		"\t[-i interval] [-T duration] [-p pps] [-s size] [-d dst_ip] [-u dst_port] [-t threads] [-j]\n",
+		appname);
+}
+
+
+int main(int argc, char **argv)
+{
+	int c;
+	char *cred_file = NULL;
+	uint64_t *tx_deltas, *rx_deltas;
+	uint64_t t0, elapsed_ns, last_hs = 0, last_rx_pkts = 0;
+	uint64_t total_tx = 0, total_rx = 0;
+	uint32_t tick = 0, ramp_ticks, total_ticks;
+	double jain_tx = 0, jain_rx = 0;
+	struct worker *workers;
+
+	memset(&opt, 0, sizeof(opt));
+	opt.server.sin_family = AF_INET;
+	opt.server.sin_port = htons(55555);
+	opt.server.sin_addr.s_addr = inet_addr("127.0.0.1");
+	opt.sessions = 16;
+	opt.interval = 1;
+	opt.duration = 10;
+	opt.pps = 100;
+	opt.pkt_size = 512;
+	opt.dst_ip = inet_addr("5.5.0.1");
+	opt.dst_port = 9;
+	opt.threads = 1;
+
+	while ((c = getopt(argc, argv, "H:P:c:n:r:i:T:p:s:d:u:t:jh")) != -1) {
+		switch (c) {
+			case 'H': opt.server.sin_addr.s_addr = inet_addr(optarg); break;
+			case 'P': opt.server.sin_port = htons((uint16_t)atoi(optarg)); break;
+			case 'c': cred_file = optarg; break;
+			case 'n': opt.sessions = (uint32_t)atoi(optarg); break;
+			case 'r': opt.ramp_step = (uint32_t)atoi(optarg); break;
+			case 'i': opt.interval = (uint32_t)atoi(optarg); break;
+			case 'T': opt.duration = (uint32_t)atoi(optarg); break;
+			case 'p': opt.pps = (uint32_t)atoi(optarg); break;
+			case 's': opt.pkt_size = (uint32_t)atoi(optarg); break;
+			case 'd': opt.dst_ip = inet_addr(optarg); break;
+			case 'u': opt.dst_port = (uint16_t)atoi(optarg); break;
+			case 't': opt.threads = (uint32_t)atoi(optarg); break;
+			case 'j': opt.json = true; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	if ((cred_file == NULL) || (!load_credentials(cred_file))) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if ((opt.pkt_size < (sizeof(struct iphdr) + sizeof(struct udphdr))) || (opt.pkt_size > TEAVPN_TAP_READ_SIZE)) {
+		printf("Packet size must be between %zu and %d\n", sizeof(struct iphdr) + sizeof(struct udphdr),
+			TEAVPN_TAP_READ_SIZE);
+		return 1;
+	}
+
+	if ((opt.sessions == 0) || (opt.threads == 0) || (opt.pps == 0) || (opt.interval == 0)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if ((opt.ramp_step == 0) || (opt.ramp_step > opt.sessions)) {
+		opt.ramp_step = opt.sessions;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	sessions = calloc(opt.sessions, sizeof(*sessions));
+	tx_deltas = calloc(opt.sessions, sizeof(*tx_deltas));
+	rx_deltas = calloc(opt.sessions, sizeof(*rx_deltas));
+	workers = calloc(opt.threads, sizeof(*workers));
+	if ((sessions == NULL) || (tx_deltas == NULL) || (rx_deltas == NULL) || (workers == NULL)) {
+		printf("Cannot allocate memory\n");
+		return 1;
+	}
+
+	for (register uint32_t i = 0; i < opt.sessions; i++) {
+		sessions[i].id = i;
+		sessions[i].fd = -1;
+	}
+
+	for (register uint32_t i = 0; i < opt.threads; i++) {
+		workers[i].num = i;
+		workers[i].epfd = epoll_create1(0);
+		pthread_create(&(workers[i].thread), NULL, (void * (*)(void *))worker_thread, &(workers[i]));
+	}
+
+	ramp_ticks = (opt.sessions + opt.ramp_step - 1) / opt.ramp_step;
+	total_ticks = ramp_ticks + (opt.duration / opt.interval);
+
+	printf("%6s %8s %8s %8s %8s %10s %10s %10s %10s %8s %8s\n",
+		"time", "target", "estab", "hs/s", "hs_fail", "hs_avg_us", "tx_mbps", "rx_mbps", "rx_kpps", "jain_tx", "jain_rx");
+
+	t0 = now_ns();
+	while (tick < total_ticks) {
+		uint32_t estab = 0, target;
+		uint64_t tx = 0, rx = 0, rx_pkts = 0, hs, hs_sum;
+
+		target = (tick + 1) * opt.ramp_step;
+		if (target > opt.sessions) {
+			target = opt.sessions;
+		}
+		__atomic_store_n(&target_sessions, target, __ATOMIC_RELEASE);
+
+		tick++;
+		while (now_ns() < (t0 + ((uint64_t)tick * opt.interval * 1000000000ull))) {
+			usleep(1000);
+		}
+
+		for (register uint32_t i = 0; i < opt.sessions; i++) {
+			struct session *s = &(sessions[i]);
+			uint64_t stx = __atomic_load_n(&(s->tx_bytes), __ATOMIC_RELAXED);
+			uint64_t srx = __atomic_load_n(&(s->rx_bytes), __ATOMIC_RELAXED);
+
+			rx_pkts += __atomic_load_n(&(s->rx_pkts), __ATOMIC_RELAXED);
+
+			if (__atomic_load_n(&(s->state), __ATOMIC_RELAXED) == SESS_ESTABLISHED) {
+				tx_deltas[estab] = stx - s->last_tx_bytes;
+				rx_deltas[estab] = srx - s->last_rx_bytes;
+				estab++;
+			}
+
+			tx += stx - s->last_tx_bytes;
+			rx += srx - s->last_rx_bytes;
+			s->last_tx_bytes = stx;
+			s->last_rx_bytes = srx;
+		}
+
+		total_tx += tx;
+		total_rx += rx;
+		jain_tx = jain_index(tx_deltas, estab);
+		jain_rx = jain_index(rx_deltas, estab);
+
+		hs = __atomic_load_n(&hs_done, __ATOMIC_RELAXED);
+		hs_sum = __atomic_load_n(&hs_ns_sum, __ATOMIC_RELAXED);
+
+		printf("%6u %8u %8u %8.1f %8lu %10.1f %10.3f %10.3f %10.3f %8.3f %8.3f\n",
+			tick * opt.interval,
+			target,
+			estab,
+			(double)(hs - last_hs) / opt.interval,
+			__atomic_load_n(&hs_failed, __ATOMIC_RELAXED),
+			hs ? ((double)hs_sum / hs / 1e3) : 0.0,
+			(tx * 8.0) / opt.interval / 1e6,
+			(rx * 8.0) / opt.interval / 1e6,
+			(double)(rx_pkts - last_rx_pkts) / opt.interval / 1e3,
+			jain_tx,
+			jain_rx
+		);
+		fflush(stdout);
+
+		last_hs = hs;
+		last_rx_pkts = rx_pkts;
+	}
+
+	stop = true;
+	for (register uint32_t i = 0; i < opt.threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	elapsed_ns = now_ns() - t0;
+
+	if (opt.json) {
+		uint32_t estab = 0;
+
+		for (register uint32_t i = 0; i < opt.sessions; i++) {
+			estab += (sessions[i].state == SESS_ESTABLISHED);
+		}
+
+		printf("{\"sessions\": %u, \"established\": %u, \"handshakes\": %lu, \"handshake_failed\": %lu, "
+			"\"handshake_avg_us\": %.1f, \"handshake_max_us\": %.1f, \"closed_by_server\": %lu, "
+			"\"tx_mbps\": %.3f, \"rx_mbps\": %.3f, \"send_blocked\": %lu, "
+			"\"jain_tx_last\": %.4f, \"jain_rx_last\": %.4f}\n",
+			opt.sessions, estab, hs_done, hs_failed,
+			hs_done ? ((double)hs_ns_sum / hs_done / 1e3) : 0.0,
+			(double)hs_ns_max / 1e3,
+			closed_by_server,
+			(total_tx * 8.0) / ((double)elapsed_ns / 1e9) / 1e6,
+			(total_rx * 8.0) / ((double)elapsed_ns / 1e9) / 1e6,
+			send_blocked,
+			jain_tx, jain_rx
+		);
+	}
+
+	for (register uint32_t i = 0; i < opt.sessions; i++) {
+		if (sessions[i].fd >= 0) {
+			close(sessions[i].fd);
+		}
+	}
+
+	free(sessions);
+	free(tx_deltas);
+	free(rx_deltas);
+	free(workers);
+	free(opt.creds);
+	return 0;
+}
@@ -0,0 +1,737 @@
+
+/**
+ * @author Ammar Faizi <ammarfaizi2@gmail.com> https://www.facebook.com/ammarfaizi2
+ * @license MIT
+ * @package TeaVPN
+ *
+ * Microbenchmarks for the hot internal primitives of the server.
+ *
+ * Usage: teavpn-microbench [options]
+ *   -t list       thread counts (default 1,2,4)
+ *   -w list       queue consumer work per packet in ns (default 0,2000)
+ *   -d ms         duration of every run (default 300)
+ *   -f name       only run primitives whose name starts with name
+ *   -c file       config file for the config parser (default server.conf)
+ *
+ * The server translation unit is compiled into this program, so the
+ * static functions of server/tcp.c are measured as they are, on
+ * the same data structures.
+ *
+ * ns/op is the average time one thread spends per operation
+ * (wall time * threads / ops), ops/s is the aggregate throughput.
+ */
+
+#include "../src/teavpn/server/tcp.c"
+
+#include <time.h>
+#include <sched.h>
+
+#define MB_MAX_LIST 16
+
+struct mb_run;
+typedef void (*mb_fn)(struct mb_run *run, uint32_t tnum);
+
+struct mb_run {
+	mb_fn fn;
+	void *arg;
+	uint32_t threads;
+	volatile bool stop;
+	pthread_barrier_t barrier;
+	uint64_t ops[64];
+};
+
+struct mb_thread_arg {
+	struct mb_run *run;
+	uint32_t tnum;
+};
+
+static struct {
+	uint32_t threads[MB_MAX_LIST];
+	uint32_t nr_threads;
+	uint32_t work[MB_MAX_LIST];
+	uint32_t nr_work;
+	uint32_t duration_ms;
+	const char *filter;
+	const char *config_file;
+} mb;
+
+static struct teavpn_tcp_queue mb_queue_tab[QUEUE_AMOUNT];
+static struct buffer_channel mb_bufchan_tab[BUFCHAN_ALLOC];
+static uint8_t mb_bufchan_room[BUFCHAN_ROOM] __attribute__((aligned(64)));
+static struct connection_entry mb_connection_tab[CONNECTION_ALLOC];
+
+/**
+ * Queue slots not yet released by a consumer.
+ */
+static uint32_t mb_inflight = 0;
+
+
+/**
+ * @return uint64_t
+ */
+static inline uint64_t mb_now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ull) + ts.tv_nsec;
+}
+
+
+/**
+ * Busy wait, stands for the time a worker spends in write(2).
+ *
+ * @param uint32_t ns
+ * @return void
+ */
+static inline void mb_spin(uint32_t ns)
+{
+	uint64_t until;
+
+	if (ns == 0) {
+		return;
+	}
+
+	until = mb_now_ns() + ns;
+	while (mb_now_ns() < until) {
+		teavpn_spin_relax();
+	}
+}
+
+
+/**
+ * @param struct mb_thread_arg *targ
+ */
+static void *mb_thread(struct mb_thread_arg *targ)
+{
+	pthread_barrier_wait(&(targ->run->barrier));
+	targ->run->fn(targ->run, targ->tnum);
+	return NULL;
+}
+
+
+/**
+ * Run fn on the given number of threads for the configured
+ * duration and print one result line.
+ *
+ * @param const char	*name
+ * @param const char	*variant
+ * @param mb_fn			fn
+ * @param void			*arg
+ * @param uint32_t		threads		Threads running fn.
+ * @param uint32_t		shown		Thread count printed.
+ * @return void
+ */
+static void mb_run(const char *name, const char *variant, mb_fn fn, void *arg, uint32_t threads, uint32_t shown)
+{
+	uint64_t start, elapsed, ops = 0;
+	struct mb_run run;
+	pthread_t tids[64];
+	struct mb_thread_arg targs[64];
+
+	memset(&run, 0, sizeof(run));
+	run.fn = fn;
+	run.arg = arg;
+	run.threads = threads;
+	pthread_barrier_init(&(run.barrier), NULL, threads + 1);
+
+	for (register uint32_t i = 0; i < threads; i++) {
+		targs[i].run = &run;
+		targs[i].tnum = i;
+		pthread_create(&(tids[i]), NULL, (void * (*)(void *))mb_thread, &(targs[i]));
+	}
+
+	pthread_barrier_wait(&(run.barrier));
+	start = mb_now_ns();
+	usleep(mb.duration_ms * 1000);
+	run.stop = true;
+
+	for (register uint32_t i = 0; i < threads; i++) {
+		pthread_join(tids[i], NULL);
+		ops += run.ops[i];
+	}
+	elapsed = mb_now_ns() - start;
+	pthread_barrier_destroy(&(run.barrier));
+
+	printf("%-14s %-18s %7u %12.1f %14.0f\n",
+		name,
+		variant,
+		shown,
+		ops ? (((double)elapsed * shown) / ops) : 0.0,
+		((double)ops * 1e9) / elapsed
+	);
+	fflush(stdout);
+}
+
+
+/**
+ * Packet queue: thread 0 is the event loop calling enqueue_packet(),
+ * the others are workers doing worker_job_pull() and the release
+ * of teavpn_tcp_worker_thread().
+ */
+static void mb_queue_fn(struct mb_run *run, uint32_t tnum)
+{
+	uint8_t n;
+	int16_t jobs[WORKER_BURST];
+	uint64_t ops = 0;
+	uint32_t work = *(uint32_t *)run->arg;
+
+	if (tnum == 0) {
+		while (!run->stop) {
+			/**
+			 * Never let enqueue_packet() hit a full queue,
+			 * it logs on every retry.
+			 */
+			if (__atomic_load_n(&mb_inflight, __ATOMIC_ACQUIRE) >= QUEUE_AMOUNT) {
+				sched_yield();
+				continue;
+			}
+
+			__atomic_fetch_add(&mb_inflight, 1, __ATOMIC_ACQ_REL);
+			enqueue_packet(ops % CONNECTION_ALLOC, ops % BUFCHAN_ALLOC);
+			ops++;
+		}
+		return;
+	}
+
+	while (!run->stop) {
+		n = worker_job_pull(jobs, WORKER_BURST);
+		if (n == 0) {
+			sched_yield();
+			continue;
+		}
+
+		for (register uint8_t k = 0; k < n; k++) {
+			mb_spin(work);
+
+			teavpn_mutex_lock(&worker_job_pull_mutex);
+			queues[jobs[k]].used = false;
+			queues[jobs[k]].taken = false;
+			teavpn_mutex_unlock(&worker_job_pull_mutex);
+		}
+		__atomic_fetch_sub(&mb_inflight, n, __ATOMIC_ACQ_REL);
+		ops += n;
+	}
+
+	run->ops[tnum] = ops;
+}
+
+
+/**
+ * @return void
+ */
+static void mb_queue()
+{
+	char variant[32];
+
+	for (register uint32_t w = 0; w < mb.nr_work; w++) {
+		for (register uint32_t t = 0; t < mb.nr_threads; t++) {
+			for (register uint16_t i = 0; i < QUEUE_AMOUNT; i++) {
+				queue_zero(i);
+				queues[i].taken = false;
+			}
+			mb_inflight = 0;
+
+			snprintf(variant, sizeof(variant), "work=%uns", mb.work[w]);
+			mb_run("queue", variant, mb_queue_fn, &(mb.work[w]), mb.threads[t] + 1, mb.threads[t]);
+		}
+	}
+}
+
+
+/**
+ * Buffer channel allocator, only ever called by the event loop.
+ */
+static void mb_bufchan_fn(struct mb_run *run, uint32_t tnum)
+{
+	uint64_t ops = 0;
+	volatile int16_t idx;
+
+	while (!run->stop) {
+		for (register int j = 0; j < 64; j++) {
+			idx = get_bufchan_index(TEAVPN_PB_SMALL);
+		}
+		ops += 64;
+	}
+
+	(void)idx;
+	run->ops[tnum] = ops;
+}
+
+
+/**
+ * Contention here is how many channels are still referenced
+ * by queued packets when the event loop looks for a free one.
+ *
+ * @return void
+ */
+static void mb_bufchan()
+{
+	char variant[32];
+	uint16_t busy[] = {0, BUFCHAN_ALLOC / 2, BUFCHAN_ALLOC - 1};
+
+	for (register uint32_t b = 0; b < (sizeof(busy) / sizeof(busy[0])); b++) {
+		for (register uint16_t i = 0; i < BUFCHAN_ALLOC; i++) {
+			bufchan[i].ref_count = (i < busy[b]) ? 1 : 0;
+		}
+
+		snprintf(variant, sizeof(variant), "busy=%u/%u", busy[b], BUFCHAN_ALLOC);
+		mb_run("bufchan", variant, mb_bufchan_fn, NULL, 1, 1);
+	}
+
+	for (register uint16_t i = 0; i < BUFCHAN_ALLOC; i++) {
+		bufchan[i].ref_count = 0;
+	}
+}
+
+
+struct mb_frame_arg {
+	uint16_t size;
+	bool split;
+};
+
+/**
+ * Frame parser, every thread owns one connection backed by a
+ * SOCK_SEQPACKET socketpair so a read(2) returns exactly what
+ * was written. A split frame makes conn_read_frame_rest() loop.
+ */
+static void mb_frame_fn(struct mb_run *run, uint32_t tnum)
+{
+	int sv[2];
+	ssize_t nread;
+	uint64_t ops = 0;
+	uint32_t len, first;
+	struct mb_frame_arg *arg = (struct mb_frame_arg *)run->arg;
+	teavpn_packet *out, *in;
+
+	out = calloc(1, sizeof(teavpn_packet));
+	in = calloc(1, sizeof(teavpn_packet));
+	if ((out == NULL) || (in == NULL) || (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0)) {
+		perror("frame bench setup");
+		free(out);
+		free(in);
+		return;
+	}
+
+	len = TEAVPN_PACK(arg->size);
+	first = arg->split ? (TEAVPN_PACK(0) + (arg->size / 2)) : len;
+	out->info.type = TEAVPN_PACKET_DATA;
+	out->info.len = len;
+	connections[tnum].fd = sv[0];
+
+	while (!run->stop) {
+		if ((write(sv[1], out, first) < 0) || ((first < len) && (write(sv[1], &(((char *)out)[first]), len - first) < 0))) {
+			perror("write()");
+			break;
+		}
+
+		nread = read(connections[tnum].fd, in, TEAVPN_PACKET_BUFFER);
+		if ((nread <= 0) || (in->info.type != TEAVPN_PACKET_DATA)) {
+			break;
+		}
+
+		if (conn_read_frame_rest(tnum, in, nread) < 0) {
+			break;
+		}
+		ops++;
+	}
+
+	connections[tnum].fd = -1;
+	close(sv[0]);
+	close(sv[1]);
+	free(out);
+	free(in);
+	run->ops[tnum] = ops;
+}
+
+
+/**
+ * @return void
+ */
+static void mb_frame()
+{
+	char variant[32];
+	struct mb_frame_arg args[] = {
+		{64, false},
+		{1400, false},
+		{1400, true}
+	};
+
+	for (register uint32_t a = 0; a < (sizeof(args) / sizeof(args[0])); a++) {
+		for (register uint32_t t = 0; t < mb.nr_threads; t++) {
+			if (mb.threads[t] > CONNECTION_ALLOC) {
+				continue;
+			}
+
+			snprintf(variant, sizeof(variant), "size=%u%s", args[a].size, args[a].split ? ",split" : "");
+			mb_run("frame_parse", variant, mb_frame_fn, &(args[a]), mb.threads[t], mb.threads[t]);
+		}
+	}
+}
+
+
+/**
+ * Route lookup stage of tun_burst(): lookups are for the
+ * IPv4 destination of real packets, spread over all
+ * connected clients.
+ */
+static void mb_dst_fn(struct mb_run *run, uint32_t tnum)
+{
+	uint64_t ops = 0;
+	uint32_t conns = *(uint32_t *)run->arg;
+	volatile int16_t found;
+	struct iphdr pkts[CONNECTION_ALLOC];
+
+	memset(pkts, 0, sizeof(pkts));
+	for (register uint32_t i = 0; i < conns; i++) {
+		pkts[i].daddr = connections[i].priv_ip;
+	}
+
+	while (!run->stop) {
+		for (register uint32_t i = 0; i < 64; i++) {
+			found = conn_lookup_priv_ip(pkts[(ops + i) % conns].daddr);
+		}
+		ops += 64;
+	}
+
+	(void)found;
+	run->ops[tnum] = ops;
+}
+
+
+/**
+ * @return void
+ */
+static void mb_dst()
+{
+	char variant[32], addr[sizeof("xxx.xxx.xxx.xxx/xx")];
+	uint32_t conns[] = {1, CONNECTION_ALLOC / 2, CONNECTION_ALLOC};
+
+	for (register uint32_t c = 0; c < (sizeof(conns) / sizeof(conns[0])); c++) {
+		for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+			connection_zero(i);
+			if (i < conns[c]) {
+				snprintf(addr, sizeof(addr), "5.5.0.%u/16", i + 2);
+				connections[i].connected = true;
+				connections[i].priv_ip = ip_read_conv(addr);
+			}
+		}
+
+		for (register uint32_t t = 0; t < mb.nr_threads; t++) {
+			snprintf(variant, sizeof(variant), "conns=%u", conns[c]);
+			mb_run("dst_lookup", variant, mb_dst_fn, &(conns[c]), mb.threads[t], mb.threads[t]);
+		}
+	}
+
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		connection_zero(i);
+	}
+}
+
+
+/**
+ * The addresses handed out from the user ip files.
+ */
+static void mb_ip_conv_fn(struct mb_run *run, uint32_t tnum)
+{
+	uint64_t ops = 0;
+	volatile uint32_t ip;
+	static const char *addrs[] = {
+		"5.5.0.2/16",
+		"10.8.0.123/24",
+		"192.168.100.254/24",
+		"1.2.3.4"
+	};
+
+	while (!run->stop) {
+		for (register uint32_t i = 0; i < 64; i++) {
+			ip = ip_read_conv(addrs[i & 3]);
+		}
+		ops += 64;
+	}
+
+	(void)ip;
+	run->ops[tnum] = ops;
+}
+
+
+/**
+ * @return void
+ */
+static void mb_ip_conv()
+{
+	for (register uint32_t t = 0; t < mb.nr_threads; t++) {
+		mb_run("ip_read_conv", "-", mb_ip_conv_fn, NULL, mb.threads[t], mb.threads[t]);
+	}
+}
+
+
+/**
+ * Full parse of a server config file, as done at start up.
+ */
+static void mb_config_fn(struct mb_run *run, uint32_t tnum)
+{
+	uint64_t ops = 0;
+	server_config config;
+	char buffer[4096];
+
+	while (!run->stop) {
+		memset(&config, 0, sizeof(config));
+		config.config_file = (char *)mb.config_file;
+		if (!teavpn_server_config_parser(buffer, sizeof(buffer), &config)) {
+			break;
+		}
+		ops++;
+	}
+
+	run->ops[tnum] = ops;
+}
+
+
+/**
+ * @return void
+ */
+static void mb_config()
+{
+	if (access(mb.config_file, R_OK) < 0) {
+		printf("%-14s skipped, cannot read %s\n", "config_parser", mb.config_file);
+		return;
+	}
+
+	for (register uint32_t t = 0; t < mb.nr_threads; t++) {
+		mb_run("config_parser", mb.config_file, mb_config_fn, NULL, mb.threads[t], mb.threads[t]);
+	}
+}
+
+
+struct mb_aead_arg {
+	uint8_t cipher;		// TEAVPN_CIPHER_NONE = memcpy of the frame.
+	uint16_t size;
+};
+
+/**
+ * Data channel cost per DATA frame: what a worker pays to seal
+ * one frame into the buffer of its job against
+ * a plain copy of it. Opening costs the same.
+ */
+static void mb_aead_fn(struct mb_run *run, uint32_t tnum)
+{
+	uint64_t ops = 0;
+	struct teavpn_crypto c;
+	struct teavpn_crypto_state st;
+	struct mb_aead_arg *arg = (struct mb_aead_arg *)run->arg;
+	teavpn_packet *in, *out;
+
+	in = calloc(1, sizeof(teavpn_packet));
+	out = calloc(1, sizeof(teavpn_packet));
+	memset(&c, 0, sizeof(c));
+	memset(&st, 0x5a, sizeof(st));
+	st.cipher = arg->cipher;
+	st.tx_seq = st.rx_seq = 0;
+
+	if ((in == NULL) || (out == NULL) || ((arg->cipher != TEAVPN_CIPHER_NONE) &&
+		((!teavpn_crypto_alloc(&c)) || (!teavpn_crypto_set(&c, &st))))) {
+		printf("aead bench setup failed\n");
+		goto out;
+	}
+
+	in->info.type = TEAVPN_PACKET_DATA;
+	in->info.len = TEAVPN_PACK(arg->size);
+
+	while (!run->stop) {
+		if (arg->cipher == TEAVPN_CIPHER_NONE) {
+			memcpy(out, in, in->info.len);
+			__asm__ volatile("" : : "r"(out) : "memory");
+		} else if (teavpn_crypto_seal(&c, out, in, ops + 1) == 0) {
+			break;
+		}
+		ops++;
+	}
+
+	out:
+	teavpn_crypto_free(&c);
+	free(in);
+	free(out);
+	run->ops[tnum] = ops;
+}
+
+
+/**
+ * @return void
+ */
+static void mb_aead()
+{
+	char variant[32];
+	uint8_t ciphers[] = {TEAVPN_CIPHER_NONE, TEAVPN_CIPHER_AES_256_GCM, TEAVPN_CIPHER_CHACHA20_POLY1305};
+	uint16_t sizes[] = {64, 1400};
+
+	if (teavpn_crypto_offer() == TEAVPN_CIPHER_NONE) {
+		printf("%-14s skipped, built without libcrypto\n", "aead");
+		return;
+	}
+
+	for (register uint32_t s = 0; s < (sizeof(sizes) / sizeof(sizes[0])); s++) {
+		for (register uint32_t a = 0; a < (sizeof(ciphers) / sizeof(ciphers[0])); a++) {
+			struct mb_aead_arg arg = {ciphers[a], sizes[s]};
+
+			snprintf(variant, sizeof(variant), "%s,size=%u",
+				(ciphers[a] == TEAVPN_CIPHER_NONE) ? "memcpy" : teavpn_cipher_name(ciphers[a]), sizes[s]);
+			for (register uint32_t t = 0; t < mb.nr_threads; t++) {
+				mb_run("aead", variant, mb_aead_fn, &arg, mb.threads[t], mb.threads[t]);
+			}
+		}
+	}
+}
+
+
+static struct teavpn_reorder mb_ro;
+static uint64_t mb_ro_last = 0;
+static uint64_t mb_ro_bad = 0;
+
+/**
+ * Runs on one thread at a time, counts what left out of order.
+ */
+static void mb_reorder_emit(uint64_t seq, void *item)
+{
+	if (seq != (mb_ro_last + 1)) {
+		mb_ro_bad++;
+	}
+	mb_ro_last = seq;
+}
+
+
+/**
+ * Every thread is a worker: take the next ticket, do the stage
+ * work (jittered so jobs finish out of order) and hand the job
+ * to the reorder buffer, as the workers do for a connection.
+ */
+static void mb_reorder_fn(struct mb_run *run, uint32_t tnum)
+{
+	uint64_t ops = 0, seq;
+	uint32_t work = *(uint32_t *)run->arg;
+
+	while (!run->stop) {
+		seq = teavpn_reorder_ticket(&mb_ro);
+		mb_spin((work * (1 + ((seq * 7) % 4))) / 2);
+		teavpn_reorder_done(&mb_ro, seq, &mb_ro, mb_reorder_emit);
+		ops++;
+	}
+
+	run->ops[tnum] = ops;
+}
+
+
+/**
+ * @return void
+ */
+static void mb_reorder()
+{
+	char variant[32];
+
+	for (register uint32_t w = 0; w < mb.nr_work; w++) {
+		for (register uint32_t t = 0; t < mb.nr_threads; t++) {
+			teavpn_reorder_init(&mb_ro, -1);
+			mb_ro_last = 0;
+			mb_ro_bad = 0;
+
+			snprintf(variant, sizeof(variant), "work=%uns", mb.work[w]);
+			mb_run("reorder", variant, mb_reorder_fn, &(mb.work[w]), mb.threads[t], mb.threads[t]);
+			if (mb_ro_bad > 0) {
+				printf("reorder: %lu frames left out of order\n", mb_ro_bad);
+			}
+		}
+	}
+}
+
+
+/**
+ * @param const char	*str	"1,2,4"
+ * @param uint32_t		*list
+ * @param uint32_t		max_val
+ * @return uint32_t
+ */
+static uint32_t mb_parse_list(const char *str, uint32_t *list, uint32_t max_val)
+{
+	char *end;
+	uint32_t n = 0;
+
+	while ((*str != '\0') && (n < MB_MAX_LIST)) {
+		list[n] = (uint32_t)strtoul(str, &end, 10);
+		if ((end == str) || (list[n] > max_val)) {
+			return 0;
+		}
+		n++;
+		str = (*end == ',') ? (end + 1) : end;
+	}
+
+	return n;
+}
+
+
+/**
+ * @param const char *name
+ * @return bool
+ */
+static inline bool mb_selected(const char *name)
+{
+	return (mb.filter == NULL) || (!strncmp(name, mb.filter, strlen(mb.filter)));
+}
+
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	memset(&mb, 0, sizeof(mb));
+	mb.duration_ms = 300;
+	mb.config_file = "server.conf";
+	mb.nr_threads = mb_parse_list("1,2,4", mb.threads, 63);
+	mb.nr_work = mb_parse_list("0,2000", mb.work, 1000000);
+
+	while ((c = getopt(argc, argv, "t:w:d:f:c:h")) != -1) {
+		switch (c) {
+			case 't': mb.nr_threads = mb_parse_list(optarg, mb.threads, 63); break;
+			case 'w': mb.nr_work = mb_parse_list(optarg, mb.work, 1000000); break;
+			case 'd': mb.duration_ms = (uint32_t)atoi(optarg); break;
+			case 'f': mb.filter = optarg; break;
+			case 'c': mb.config_file = optarg; break;
+			default:
+				printf("Usage: %s [-t threads_list] [-w work_ns_list] [-d ms] [-f name] [-c config_file]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if ((mb.nr_threads == 0) || (mb.nr_work == 0) || (mb.duration_ms == 0)) {
+		printf("Invalid thread or work list\n");
+		return 1;
+	}
+
+	teavpn_log_init();
+	teavpn_lat_init();
+
+	/**
+	 * Point the server globals at our tables.
+	 */
+	queues = mb_queue_tab;
+	bufchan = mb_bufchan_tab;
+	bufchan_setup(mb_bufchan_room);
+	connections = mb_connection_tab;
+	teavpn_mutex_init(&worker_job_pull_mutex, "worker_job_pull_mutex", -1);
+	for (register uint16_t i = 0; i < CONNECTION_ALLOC; i++) {
+		connection_zero(i);
+	}
+
+	printf("%-14s %-18s %7s %12s %14s\n", "primitive", "variant", "threads", "ns/op", "ops/s");
+
+	if (mb_selected("queue")) mb_queue();
+	if (mb_selected("bufchan")) mb_bufchan();
+	if (mb_selected("frame_parse")) mb_frame();
+	if (mb_selected("dst_lookup")) mb_dst();
+	if (mb_selected("ip_read_conv")) mb_ip_conv();
+	if (mb_selected("config_parser")) mb_config();
+	if (mb_selected("aead")) mb_aead();
+	if (mb_selected("reorder")) mb_reorder();
+
+	teavpn_log_flush();
+	return 0;
+}